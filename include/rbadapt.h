@@ -0,0 +1,256 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SYS_RBADAPT_H_
+#define	_SYS_RBADAPT_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include "tree.h"
+
+/*
+ * A set of elements that starts as a sorted array of up to RB_ADAPT_SIZE
+ * pointers kept in the head and becomes a tree from tree.h when it grows
+ * past that. Sets that stay small are searched with a linear scan of one
+ * or two cache lines of pointers instead of a descent through the nodes,
+ * and inserts and removals only move pointers. The elements still need an
+ * RB_ENTRY, used once the set is a tree.
+ *
+ * The insert that overflows the array links its elements into a balanced
+ * tree with RB_DESERIALIZE, in O(n) and without comparisons. A tree that
+ * shrinks to RB_ADAPT_SIZE / 2 elements is moved back into the array with
+ * RB_SERIALIZE; the gap between the two sizes keeps a set that grows and
+ * shrinks around one size from switching on every update. The array and
+ * the tree head share their memory, as only one of them is in use at a
+ * time.
+ *
+ * The calls take the same arguments and return the same as their tree.h
+ * counterparts, including RB_ADAPT_REMOVE, which in the large layout has
+ * to be given an element of the set, and RB_ADAPT_NEXT, which takes one in
+ * every layout. The small layout without RB_THREADED has no RB_NEXT, there
+ * RB_ADAPT_NEXT descends from the root. The head is set up with
+ * RB_ADAPT_INIT.
+ */
+#ifndef RB_ADAPT_SIZE
+#define RB_ADAPT_SIZE		16
+#endif
+
+#define RB_ADAPT_HEAD(name, type)			\
+RB_HEAD(name##_tree, type);				\
+struct name {						\
+	size_t			 count;			\
+	int			 istree;		\
+	union {						\
+		struct name##_tree	 tree;		\
+		struct type		*elm[RB_ADAPT_SIZE];	\
+	};						\
+}
+
+#define RB_ADAPT_INIT(head)		do {		\
+RB_INIT(&(head)->tree);					\
+(head)->count = 0;					\
+(head)->istree = 0;					\
+} while (0)
+
+/* the small layout has no parent links to follow */
+#if defined(RB_SMALL) && !defined(RB_THREADED)
+#define _RB_ADAPT_TREE_NEXT(name, head, elm, cmp, field, res) do {	\
+__typeof(elm) tmp_nx = RB_ROOT(&(head)->tree);			\
+(res) = NULL;							\
+while (tmp_nx != NULL) {					\
+	if (cmp(elm, tmp_nx) < 0) {				\
+		(res) = tmp_nx;					\
+		tmp_nx = RB_LEFT(tmp_nx, field);		\
+	} else							\
+		tmp_nx = RB_RIGHT(tmp_nx, field);		\
+}								\
+} while (0)
+#else
+#define _RB_ADAPT_TREE_NEXT(name, head, elm, cmp, field, res) do {	\
+(res) = RB_NEXT(name##_tree, &(head)->tree, elm);		\
+} while (0)
+#endif
+
+#define RB_ADAPT_PROTOTYPE(name, type)					\
+struct type	*name##_RB_ADAPT_FIND(struct name *, struct type *);	\
+struct type	*name##_RB_ADAPT_NFIND(struct name *, struct type *);	\
+struct type	*name##_RB_ADAPT_NEXT(struct name *, struct type *);	\
+struct type	*name##_RB_ADAPT_MIN(struct name *);			\
+struct type	*name##_RB_ADAPT_INSERT(struct name *, struct type *);	\
+struct type	*name##_RB_ADAPT_REMOVE(struct name *, struct type *);
+
+#define RB_ADAPT_GENERATE(name, type, field, cmp)			\
+	_RB_ADAPT_GENERATE_INTERNAL(name, type, field, cmp, )
+
+#define RB_ADAPT_GENERATE_STATIC(name, type, field, cmp)		\
+	_RB_ADAPT_GENERATE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static)
+
+#define _RB_ADAPT_GENERATE_INTERNAL(name, type, field, cmp, attr)	\
+RB_GENERATE_STATIC(name##_tree, type, field, cmp)			\
+									\
+/* the position of the first element of the array not below elm */	\
+static inline size_t							\
+name##_RB_ADAPT_POS(struct name *head, struct type *elm, int *comp)	\
+{									\
+	size_t i;							\
+									\
+	*comp = 1;							\
+	for (i = 0; i < head->count; i++)				\
+		if ((*comp = cmp(elm, head->elm[i])) <= 0)		\
+			break;						\
+	return (i);							\
+}									\
+									\
+/* both go through a copy of the array, which the tree head overlays */	\
+static int								\
+name##_RB_ADAPT_SAVE(struct type *elm, void *arg)			\
+{									\
+	struct type ***next = arg;					\
+									\
+	*(*next)++ = elm;						\
+	return (0);							\
+}									\
+									\
+static struct type *							\
+name##_RB_ADAPT_LOAD(void *arg)						\
+{									\
+	struct type ***next = arg;					\
+									\
+	return (*(*next)++);						\
+}									\
+									\
+attr struct type *							\
+name##_RB_ADAPT_FIND(struct name *head, struct type *elm)		\
+{									\
+	size_t i;							\
+	int comp;							\
+									\
+	if (head->istree)						\
+		return (RB_FIND(name##_tree, &head->tree, elm));	\
+	i = name##_RB_ADAPT_POS(head, elm, &comp);			\
+	return (comp == 0 ? head->elm[i] : NULL);			\
+}									\
+									\
+attr struct type *							\
+name##_RB_ADAPT_NFIND(struct name *head, struct type *elm)		\
+{									\
+	size_t i;							\
+	int comp;							\
+									\
+	if (head->istree)						\
+		return (RB_NFIND(name##_tree, &head->tree, elm));	\
+	i = name##_RB_ADAPT_POS(head, elm, &comp);			\
+	return (i < head->count ? head->elm[i] : NULL);			\
+}									\
+									\
+attr struct type *							\
+name##_RB_ADAPT_NEXT(struct name *head, struct type *elm)		\
+{									\
+	struct type *res;						\
+	size_t i;							\
+	int comp;							\
+									\
+	if (head->istree) {						\
+		_RB_ADAPT_TREE_NEXT(name, head, elm, cmp, field, res);	\
+		return (res);						\
+	}								\
+	i = name##_RB_ADAPT_POS(head, elm, &comp);			\
+	i += (comp == 0);						\
+	return (i < head->count ? head->elm[i] : NULL);			\
+}									\
+									\
+attr struct type *							\
+name##_RB_ADAPT_MIN(struct name *head)					\
+{									\
+	if (head->istree)						\
+		return (RB_MIN(name##_tree, &head->tree));		\
+	return (head->count > 0 ? head->elm[0] : NULL);			\
+}									\
+									\
+attr struct type *							\
+name##_RB_ADAPT_INSERT(struct name *head, struct type *elm)		\
+{									\
+	struct type *res, *arr[RB_ADAPT_SIZE], **next = arr;		\
+	size_t i;							\
+	int comp;							\
+									\
+	if (head->istree) {						\
+		if ((res = RB_INSERT(name##_tree, &head->tree, elm)) == NULL)	\
+			head->count++;					\
+		return (res);						\
+	}								\
+	i = name##_RB_ADAPT_POS(head, elm, &comp);			\
+	if (comp == 0)							\
+		return (head->elm[i]);					\
+	if (head->count == RB_ADAPT_SIZE) {				\
+		/* the array is full, its elements become a tree */	\
+		memcpy(arr, head->elm, sizeof(arr));			\
+		RB_INIT(&head->tree);					\
+		RB_DESERIALIZE(name##_tree, &head->tree, RB_ADAPT_SIZE,	\
+		    name##_RB_ADAPT_LOAD, &next);			\
+		RB_INSERT(name##_tree, &head->tree, elm);		\
+		head->count = RB_ADAPT_SIZE + 1;			\
+		head->istree = 1;					\
+		return (NULL);						\
+	}								\
+	memmove(&head->elm[i + 1], &head->elm[i], (head->count - i) * sizeof(elm));	\
+	head->elm[i] = elm;						\
+	head->count++;							\
+	return (NULL);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_ADAPT_REMOVE(struct name *head, struct type *elm)		\
+{									\
+	struct type *res, *arr[RB_ADAPT_SIZE], **next = arr;		\
+	size_t i;							\
+	int comp;							\
+									\
+	if (head->istree) {						\
+		if ((res = RB_REMOVE(name##_tree, &head->tree, elm)) == NULL)	\
+			return (NULL);					\
+		if (--head->count == RB_ADAPT_SIZE / 2) {		\
+			/* small enough to go back into the array */	\
+			RB_SERIALIZE(name##_tree, &head->tree,		\
+			    name##_RB_ADAPT_SAVE, &next);		\
+			memcpy(head->elm, arr, head->count * sizeof(arr[0]));	\
+			head->istree = 0;				\
+		}							\
+		return (res);						\
+	}								\
+	i = name##_RB_ADAPT_POS(head, elm, &comp);			\
+	if (comp != 0)							\
+		return (NULL);						\
+	res = head->elm[i];						\
+	head->count--;							\
+	memmove(&head->elm[i], &head->elm[i + 1], (head->count - i) * sizeof(elm));	\
+	return (res);							\
+}
+
+#define RB_ADAPT_FIND(name, head, elm)		name##_RB_ADAPT_FIND(head, elm)
+#define RB_ADAPT_NFIND(name, head, elm)		name##_RB_ADAPT_NFIND(head, elm)
+#define RB_ADAPT_NEXT(name, head, elm)		name##_RB_ADAPT_NEXT(head, elm)
+#define RB_ADAPT_MIN(name, head)		name##_RB_ADAPT_MIN(head)
+#define RB_ADAPT_INSERT(name, head, elm)	name##_RB_ADAPT_INSERT(head, elm)
+#define RB_ADAPT_REMOVE(name, head, elm)	name##_RB_ADAPT_REMOVE(head, elm)
+#define RB_ADAPT_COUNT(head)			(head)->count
+#define RB_ADAPT_ISTREE(head)			((head)->istree)
+
+#define RB_ADAPT_FOREACH(x, name, head)					\
+	for ((x) = RB_ADAPT_MIN(name, head);				\
+	     (x) != NULL;						\
+	     (x) = RB_ADAPT_NEXT(name, head, x))
+
+#endif	/* _SYS_RBADAPT_H_ */
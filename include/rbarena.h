@@ -0,0 +1,199 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SYS_RBARENA_H_
+#define	_SYS_RBARENA_H_
+
+#include <sys/mman.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS		MAP_ANON
+#endif
+
+/*
+ * A fixed size node allocator for one tree. Memory comes from slabs
+ * mapped with mmap, aligned to RB_ARENA_SLAB so that they can be backed by
+ * huge pages, and split into pages of RB_ARENA_PAGE bytes. Every page
+ * starts with a small header and hands out its slots by bumping, then
+ * from a free list of the slots given back.
+ *
+ * rb_arena_alloc takes a hint, a node already in the tree, and returns a
+ * slot on the page of the hint while there is one, so that parents and
+ * children share pages. RB_INSERT_ALLOC hands its allocfn the parent of
+ * the new leaf, found by the descent of the insert itself, which is the
+ * hint to pass. Without a hint, or on a full page, slots come from the
+ * page that was filled last, then from pages with freed slots, then from
+ * a new page.
+ *
+ * With RB_ARENA_HUGE the slabs are mapped with MAP_HUGETLB where it
+ * exists, falling back to a normal mapping with MADV_HUGEPAGE.
+ */
+#ifndef RB_ARENA_SLAB
+#define RB_ARENA_SLAB		(2UL * 1024 * 1024)
+#endif
+#ifndef RB_ARENA_PAGE
+#define RB_ARENA_PAGE		4096UL
+#endif
+
+#define RB_ARENA_HUGE		0x1
+
+struct rb_arena_page {
+	struct rb_arena_page	*next;		/* on the list of pages with free slots */
+	struct rb_arena_page	*slab;		/* next slab, only in the first page */
+	void			*free;
+	uint32_t		 used;
+	uint32_t		 listed;
+};
+
+struct rb_arena {
+	size_t			 size;		/* slot size */
+	size_t			 nslots;	/* slots per page */
+	int			 flags;
+	struct rb_arena_page	*slabs;
+	struct rb_arena_page	*cur;		/* page that is being filled */
+	struct rb_arena_page	*partial;	/* pages with freed slots */
+	char			*next;		/* next unused page of the last slab */
+	char			*end;
+};
+
+#define _RB_ARENA_HDR		((sizeof(struct rb_arena_page) + 15) & ~(size_t)15)
+#define _RB_ARENA_PAGEOF(p)	((struct rb_arena_page *)((uintptr_t)(p) & ~(RB_ARENA_PAGE - 1)))
+#define _RB_ARENA_ROOM(a, pg)	((pg)->free != NULL || (pg)->used < (a)->nslots)
+
+static inline int
+rb_arena_init(struct rb_arena *a, size_t size, int flags)
+{
+	a->size = (size + 15) & ~(size_t)15;
+	if (a->size + _RB_ARENA_HDR > RB_ARENA_PAGE)
+		return (-1);
+	a->nslots = (RB_ARENA_PAGE - _RB_ARENA_HDR) / a->size;
+	a->flags = flags;
+	a->slabs = a->cur = a->partial = NULL;
+	a->next = a->end = NULL;
+	return (0);
+}
+
+/* maps twice the slab size and trims it to an aligned slab */
+static inline char *
+_rb_arena_map(struct rb_arena *a)
+{
+	char *p, *q;
+
+#ifdef MAP_HUGETLB
+	if (a->flags & RB_ARENA_HUGE) {
+		p = mmap(NULL, RB_ARENA_SLAB, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return (p);
+	}
+#endif
+	p = mmap(NULL, 2 * RB_ARENA_SLAB, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	q = (char *)(((uintptr_t)p + RB_ARENA_SLAB - 1) & ~(RB_ARENA_SLAB - 1));
+	if (q != p)
+		munmap(p, q - p);
+	munmap(q + RB_ARENA_SLAB, p + RB_ARENA_SLAB - q);
+#ifdef MADV_HUGEPAGE
+	if (a->flags & RB_ARENA_HUGE)
+		(void)madvise(q, RB_ARENA_SLAB, MADV_HUGEPAGE);
+#endif
+	return (q);
+}
+
+static inline struct rb_arena_page *
+_rb_arena_page(struct rb_arena *a)
+{
+	struct rb_arena_page *pg;
+	char *slab;
+
+	if (a->next == a->end) {
+		if ((slab = _rb_arena_map(a)) == NULL)
+			return (NULL);
+		a->next = slab;
+		a->end = slab + RB_ARENA_SLAB;
+		pg = (struct rb_arena_page *)slab;
+		pg->slab = a->slabs;
+		a->slabs = pg;
+	}
+	pg = (struct rb_arena_page *)a->next;
+	a->next += RB_ARENA_PAGE;
+	pg->next = NULL;
+	pg->free = NULL;
+	pg->used = 0;
+	pg->listed = 0;
+	return (pg);
+}
+
+static inline void *
+rb_arena_alloc(struct rb_arena *a, const void *hint)
+{
+	struct rb_arena_page *pg = NULL;
+	void *elm;
+
+	if (hint != NULL)
+		pg = _RB_ARENA_PAGEOF(hint);
+	if (pg == NULL || !_RB_ARENA_ROOM(a, pg)) {
+		pg = a->cur;
+		if (pg == NULL || !_RB_ARENA_ROOM(a, pg)) {
+			while ((pg = a->partial) != NULL) {
+				a->partial = pg->next;
+				pg->listed = 0;
+				if (_RB_ARENA_ROOM(a, pg))
+					break;
+			}
+			if (pg == NULL && (pg = _rb_arena_page(a)) == NULL)
+				return (NULL);
+			a->cur = pg;
+		}
+	}
+	if ((elm = pg->free) != NULL)
+		pg->free = *(void **)elm;
+	else
+		elm = (char *)pg + _RB_ARENA_HDR + pg->used++ * a->size;
+	return (elm);
+}
+
+static inline void
+rb_arena_free(struct rb_arena *a, void *elm)
+{
+	struct rb_arena_page *pg = _RB_ARENA_PAGEOF(elm);
+
+	*(void **)elm = pg->free;
+	pg->free = elm;
+	if (!pg->listed && pg != a->cur) {
+		pg->listed = 1;
+		pg->next = a->partial;
+		a->partial = pg;
+	}
+}
+
+/* unmaps every slab, all nodes of the arena are gone after this */
+static inline void
+rb_arena_destroy(struct rb_arena *a)
+{
+	struct rb_arena_page *slab;
+
+	while ((slab = a->slabs) != NULL) {
+		a->slabs = slab->slab;
+		munmap(slab, RB_ARENA_SLAB);
+	}
+	a->cur = a->partial = NULL;
+	a->next = a->end = NULL;
+}
+
+#endif	/* _SYS_RBARENA_H_ */
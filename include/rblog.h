@@ -0,0 +1,285 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SYS_RBLOG_H_
+#define	_SYS_RBLOG_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * A write-ahead log of tree operations, meant as the log of an RB_LOG tree
+ * from tree.h together with a checkpoint written with RB_SERIALIZE.
+ *
+ * Records are appended to a buffer and written out when it fills. Every
+ * batch records the log is written and synced at once, so a group of
+ * operations shares one fsync; rb_log_commit does the same on demand.
+ * Each record carries its length and a checksum, so a record torn by a
+ * crash ends the replay instead of being applied.
+ *
+ * rb_log_checkpoint saves the tree next to the log and then empties the
+ * log. rb_log_recover loads the last checkpoint and replays the log on
+ * top of it. Replaying an insert of a present key, a remove of a missing
+ * one or a clear of an empty tree changes nothing, so a log that outlived
+ * its checkpoint still recovers the right tree.
+ */
+struct rb_log {
+	int		 fd;
+	unsigned char	*buf;
+	size_t		 len;
+	size_t		 size;
+	unsigned int	 pending;	/* records appended since the last sync */
+	unsigned int	 batch;		/* records per sync, 0 to only sync on commit */
+};
+
+struct rb_log_rec {
+	uint32_t	 len;
+	uint32_t	 op;
+	uint32_t	 sum;
+};
+
+/* fnv-1a over the op and the payload */
+static inline uint32_t
+_rb_log_sum(uint32_t op, const void *rec, size_t len)
+{
+	const unsigned char *p = rec;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(op); i++, op >>= 8)
+		h = (h ^ (op & 0xff)) * 16777619U;
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619U;
+	return (h);
+}
+
+static inline int
+rb_log_open(struct rb_log *lg, const char *path, size_t size,
+    unsigned int batch)
+{
+	lg->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (lg->fd == -1)
+		return (-1);
+	if ((lg->buf = malloc(size)) == NULL) {
+		close(lg->fd);
+		return (-1);
+	}
+	lg->len = 0;
+	lg->size = size;
+	lg->pending = 0;
+	lg->batch = batch;
+	return (0);
+}
+
+static inline int
+_rb_log_write(struct rb_log *lg)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < lg->len) {
+		n = write(lg->fd, lg->buf + off, lg->len - off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		off += n;
+	}
+	lg->len = 0;
+	return (0);
+}
+
+/* makes every appended record durable */
+static inline int
+rb_log_commit(struct rb_log *lg)
+{
+	if (_rb_log_write(lg) == -1)
+		return (-1);
+	if (lg->pending == 0)
+		return (0);
+	if (fsync(lg->fd) == -1)
+		return (-1);
+	lg->pending = 0;
+	return (0);
+}
+
+static inline int
+rb_log_append(struct rb_log *lg, int op, const void *rec, size_t len)
+{
+	struct rb_log_rec hdr;
+	unsigned char *nbuf;
+
+	if (lg->len + sizeof(hdr) + len > lg->size) {
+		if (_rb_log_write(lg) == -1)
+			return (-1);
+		if (sizeof(hdr) + len > lg->size) {
+			if ((nbuf = realloc(lg->buf, sizeof(hdr) + len)) == NULL)
+				return (-1);
+			lg->buf = nbuf;
+			lg->size = sizeof(hdr) + len;
+		}
+	}
+	hdr.len = len;
+	hdr.op = op;
+	hdr.sum = _rb_log_sum(op, rec, len);
+	memcpy(lg->buf + lg->len, &hdr, sizeof(hdr));
+	memcpy(lg->buf + lg->len + sizeof(hdr), rec, len);
+	lg->len += sizeof(hdr) + len;
+	if (++lg->pending == lg->batch)
+		return (rb_log_commit(lg));
+	return (0);
+}
+
+static inline int
+rb_log_truncate(struct rb_log *lg)
+{
+	lg->len = 0;
+	lg->pending = 0;
+	if (ftruncate(lg->fd, 0) == -1)
+		return (-1);
+	return (fsync(lg->fd));
+}
+
+static inline int
+rb_log_close(struct rb_log *lg)
+{
+	int error;
+
+	error = rb_log_commit(lg);
+	if (close(lg->fd) == -1)
+		error = -1;
+	free(lg->buf);
+	return (error);
+}
+
+/*
+ * calls fn on every complete record of the log at path, in order, and
+ * returns the number of records or -1 if fn failed. a missing log is empty,
+ * a torn record at the end is cut off so that new records follow the last
+ * good one. a length past the end of the file marks a torn header, it is
+ * never allocated.
+ */
+static inline long
+rb_log_replay(const char *path, int (*fn)(void *, int, const void *, size_t),
+    void *arg)
+{
+	struct rb_log_rec hdr;
+	unsigned char *rec = NULL, *nrec;
+	size_t size = 0;
+	long n = 0, good = 0, end;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (errno == ENOENT ? 0 : -1);
+	if (fseek(fp, 0, SEEK_END) == -1 || (end = ftell(fp)) == -1 ||
+	    fseek(fp, 0, SEEK_SET) == -1) {
+		fclose(fp);
+		return (-1);
+	}
+	while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+		if (hdr.len > (unsigned long)(end - ftell(fp)))
+			break;
+		if (hdr.len > size) {
+			if ((nrec = realloc(rec, hdr.len)) == NULL) {
+				n = -1;
+				break;
+			}
+			rec = nrec;
+			size = hdr.len;
+		}
+		if (hdr.len > 0 && fread(rec, hdr.len, 1, fp) != 1)
+			break;
+		if (_rb_log_sum(hdr.op, rec, hdr.len) != hdr.sum)
+			break;
+		if (fn(arg, hdr.op, rec, hdr.len) != 0) {
+			n = -1;
+			break;
+		}
+		n++;
+		good = ftell(fp);
+	}
+	if (n != -1 && end > good && truncate(path, good) == -1)
+		n = -1;
+	free(rec);
+	fclose(fp);
+	return (n);
+}
+
+/* the new checkpoint replaces the old one by rename before the log is emptied */
+static inline int
+rb_log_checkpoint(struct rb_log *lg, const char *path,
+    int (*save)(void *, FILE *), void *arg)
+{
+	char tmp[1024], dir[1024];
+	const char *slash;
+	FILE *fp;
+	int dfd, error;
+
+	if (rb_log_commit(lg) == -1)
+		return (-1);
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return (-1);
+	error = save(arg, fp);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+		error = -1;
+	if (fclose(fp) != 0)
+		error = -1;
+	if (error != 0 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return (-1);
+	}
+	if ((slash = strrchr(path, '/')) == NULL)
+		snprintf(dir, sizeof(dir), ".");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path);
+	if ((dfd = open(dir, O_RDONLY)) != -1) {
+		(void)fsync(dfd);
+		close(dfd);
+	}
+	return (rb_log_truncate(lg));
+}
+
+/*
+ * load reads the checkpoint at path, if there is one, and fn applies the
+ * records of the log at logpath. returns the number of records replayed.
+ */
+static inline long
+rb_log_recover(const char *path, const char *logpath,
+    int (*load)(void *, FILE *), int (*fn)(void *, int, const void *, size_t),
+    void *arg)
+{
+	FILE *fp;
+	int error;
+
+	if ((fp = fopen(path, "r")) != NULL) {
+		error = load(arg, fp);
+		fclose(fp);
+		if (error != 0)
+			return (-1);
+	} else if (errno != ENOENT)
+		return (-1);
+	return (rb_log_replay(logpath, fn, arg));
+}
+
+#endif	/* _SYS_RBLOG_H_ */
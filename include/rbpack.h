@@ -0,0 +1,296 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SYS_RBPACK_H_
+#define	_SYS_RBPACK_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A static, compressed set of sorted 64 bit keys, meant as a read-only
+ * copy of the keys of a tree from tree.h that is built with RB_SERIALIZE
+ * and an encoder calling rb_pack_add, in O(n).
+ *
+ * The keys are split into blocks of RB_PACK_BLOCK. The first key of
+ * every block is kept in a top-level index that is searched by bisection,
+ * the others as LEB128 varints of the difference to the key before, so
+ * dense keys take little more than a byte. A lookup decodes at most one
+ * block. Keys are identified by their index in the sorted order, which
+ * the caller can use to find the data that goes with them.
+ */
+#ifndef RB_PACK_BLOCK
+#define RB_PACK_BLOCK		64
+#endif
+
+struct rb_pack {
+	uint64_t	*first;		/* first key of every block */
+	size_t		*off;		/* offset of the rest of every block in data */
+	unsigned char	*data;
+	size_t		 n;		/* keys */
+	size_t		 nblocks;
+	size_t		 bsize;		/* room in first and off */
+	size_t		 len;
+	size_t		 size;		/* room in data */
+	uint64_t	 last;
+};
+
+struct rb_pack_iter {
+	size_t		 idx;
+	size_t		 pos;
+	uint64_t	 key;
+};
+
+static inline void
+rb_pack_init(struct rb_pack *p)
+{
+	p->first = NULL;
+	p->off = NULL;
+	p->data = NULL;
+	p->n = p->nblocks = p->bsize = 0;
+	p->len = p->size = 0;
+	p->last = 0;
+}
+
+static inline void
+rb_pack_free(struct rb_pack *p)
+{
+	free(p->first);
+	free(p->off);
+	free(p->data);
+	rb_pack_init(p);
+}
+
+static inline uint64_t
+_rb_pack_varint(const unsigned char *data, size_t *pos)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	unsigned char c;
+
+	do {
+		c = data[(*pos)++];
+		v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return (v);
+}
+
+/* appends key, which has to be larger than every key added before */
+static inline int
+rb_pack_add(struct rb_pack *p, uint64_t key)
+{
+	uint64_t *nfirst, delta;
+	unsigned char *ndata;
+	size_t *noff, nsize;
+
+	if (p->n > 0 && key <= p->last) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (p->n % RB_PACK_BLOCK == 0) {
+		if (p->nblocks == p->bsize) {
+			nsize = p->bsize ? 2 * p->bsize : 16;
+			if ((nfirst = realloc(p->first, nsize * sizeof(*nfirst))) == NULL)
+				return (-1);
+			p->first = nfirst;
+			if ((noff = realloc(p->off, nsize * sizeof(*noff))) == NULL)
+				return (-1);
+			p->off = noff;
+			p->bsize = nsize;
+		}
+		p->first[p->nblocks] = key;
+		p->off[p->nblocks] = p->len;
+		p->nblocks++;
+	} else {
+		/* a varint of 64 bits takes at most 10 bytes */
+		if (p->len + 10 > p->size) {
+			nsize = p->size ? 2 * p->size : 1024;
+			if ((ndata = realloc(p->data, nsize)) == NULL)
+				return (-1);
+			p->data = ndata;
+			p->size = nsize;
+		}
+		delta = key - p->last;
+		while (delta >= 0x80) {
+			p->data[p->len++] = (unsigned char)(delta | 0x80);
+			delta >>= 7;
+		}
+		p->data[p->len++] = (unsigned char)delta;
+	}
+	p->last = key;
+	p->n++;
+	return (0);
+}
+
+/* gives back the room reserved for more keys once all are added */
+static inline void
+rb_pack_trim(struct rb_pack *p)
+{
+	void *np;
+
+	if (p->n == 0) {
+		rb_pack_free(p);
+		return;
+	}
+	if (p->len > 0 && (np = realloc(p->data, p->len)) != NULL) {
+		p->data = np;
+		p->size = p->len;
+	}
+	if ((np = realloc(p->first, p->nblocks * sizeof(*p->first))) != NULL)
+		p->first = np;
+	if ((np = realloc(p->off, p->nblocks * sizeof(*p->off))) != NULL) {
+		p->off = np;
+		p->bsize = p->nblocks;
+	}
+}
+
+/* the memory held by the pack, for comparing with the tree it came from */
+static inline size_t
+rb_pack_bytes(const struct rb_pack *p)
+{
+	return (sizeof(*p) + p->size +
+	    p->bsize * (sizeof(*p->first) + sizeof(*p->off)));
+}
+
+#define _RB_PACK_PRED		0x1
+#define _RB_PACK_SUCC		0x2
+
+/*
+ * finds the last key not above key and the first one above it, returns
+ * which of the two exist
+ */
+static inline int
+_rb_pack_around(const struct rb_pack *p, uint64_t key, uint64_t *pred,
+    size_t *pidx, uint64_t *succ, size_t *sidx)
+{
+	size_t lo = 0, hi = p->nblocks, mid, i, pos, end;
+	uint64_t k, d, next;
+
+	if (p->n == 0)
+		return (0);
+	if (key < p->first[0]) {
+		*succ = p->first[0];
+		*sidx = 0;
+		return (_RB_PACK_SUCC);
+	}
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (p->first[mid] <= key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	k = p->first[lo];
+	i = lo * RB_PACK_BLOCK;
+	pos = p->off[lo];
+	end = (lo + 1 < p->nblocks) ? p->off[lo + 1] : p->len;
+	/* the first key of the next block, or one that is not above key */
+	next = p->first[lo + 1 < p->nblocks ? lo + 1 : lo];
+	while (pos < end) {
+		d = k + _rb_pack_varint(p->data, &pos);
+		if (d > key) {
+			next = d;
+			break;
+		}
+		k = d;
+		i++;
+	}
+	*pred = k;
+	*pidx = i;
+	if (next <= key)
+		return (_RB_PACK_PRED);
+	*succ = next;
+	*sidx = i + 1;
+	return (_RB_PACK_PRED | _RB_PACK_SUCC);
+}
+
+/* these return -1 if there is no such key, idx may be NULL */
+static inline int
+rb_pack_find(const struct rb_pack *p, uint64_t key, size_t *idx)
+{
+	uint64_t pred, succ;
+	size_t pidx, sidx;
+
+	if (!(_rb_pack_around(p, key, &pred, &pidx, &succ, &sidx) &
+	    _RB_PACK_PRED) || pred != key)
+		return (-1);
+	if (idx != NULL)
+		*idx = pidx;
+	return (0);
+}
+
+static inline int
+rb_pack_nfind(const struct rb_pack *p, uint64_t key, uint64_t *res,
+    size_t *idx)
+{
+	uint64_t pred, succ;
+	size_t pidx, sidx;
+	int found;
+
+	found = _rb_pack_around(p, key, &pred, &pidx, &succ, &sidx);
+	if ((found & _RB_PACK_PRED) && pred == key) {
+		succ = pred;
+		sidx = pidx;
+	} else if (!(found & _RB_PACK_SUCC))
+		return (-1);
+	*res = succ;
+	if (idx != NULL)
+		*idx = sidx;
+	return (0);
+}
+
+static inline int
+rb_pack_pfind(const struct rb_pack *p, uint64_t key, uint64_t *res,
+    size_t *idx)
+{
+	uint64_t pred, succ;
+	size_t pidx, sidx;
+
+	if (!(_rb_pack_around(p, key, &pred, &pidx, &succ, &sidx) &
+	    _RB_PACK_PRED))
+		return (-1);
+	*res = pred;
+	if (idx != NULL)
+		*idx = pidx;
+	return (0);
+}
+
+/* in-order iteration, the current key is it->key and its index it->idx */
+static inline void
+rb_pack_first(const struct rb_pack *p, struct rb_pack_iter *it)
+{
+	it->idx = 0;
+	it->pos = 0;
+	it->key = (p->n > 0) ? p->first[0] : 0;
+}
+
+static inline void
+rb_pack_next(const struct rb_pack *p, struct rb_pack_iter *it)
+{
+	if (++it->idx >= p->n)
+		return;
+	if (it->idx % RB_PACK_BLOCK == 0) {
+		it->key = p->first[it->idx / RB_PACK_BLOCK];
+		it->pos = p->off[it->idx / RB_PACK_BLOCK];
+	} else
+		it->key += _rb_pack_varint(p->data, &it->pos);
+}
+
+#define RB_PACK_FOREACH(it, p)						\
+	for (rb_pack_first(p, it); (it)->idx < (p)->n; rb_pack_next(p, it))
+
+#endif	/* _SYS_RBPACK_H_ */
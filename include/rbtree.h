@@ -26,51 +26,114 @@
 struct rb_tree;
 struct rb_entry;
 
+/*
+ * With RBT_PREFIX every entry also keeps a normalized prefix of its key,
+ * given by t_prefix, which must order keys the same way as t_compare
+ * whenever their prefixes differ. t_compare is then only called on ties.
+ *
+ * With RBT_MINMAX every tree also caches its leftmost and rightmost entries,
+ * so that rb_min and rb_max do not descend and rb_insert appends keys beyond
+ * them without a descent. It adds two pointers to every struct rb_tree.
+ *
+ * With RBT_BLOOM every tree can also be given a counting Bloom filter of its
+ * keys with rb_bloom_init, which rb_find checks before it descends, and the
+ * t_hash of its type is used to fill it. It adds the cell pointer, the cell
+ * count and the probe count to every struct rb_tree.
+ *
+ * With RBT_RELATIVE the links, the root and the min/max cache are stored as
+ * offsets from their own address, so a tree kept in a shared or mapped
+ * segment together with its nodes can be used at any address. The options
+ * and bloom pointers are absolute and have to be set by every user.
+ *
+ * t_rule picks the rank rule the updates of the trees of the type keep,
+ * as the RB_WAVL, RB_AVL and RB_REDBLACK features of tree.h do, and
+ * rb_rank checks it. It is set with the other fields of the struct rb_type,
+ * an initializer that leaves it out keeps RBT_RULE_WAVL.
+ */
+#define RBT_RULE_WAVL		0
+#define RBT_RULE_AVL		1
+#define RBT_RULE_RB		2
+
 struct rb_type {
 	int		(*t_compare)(const void *, const void *);
 	int		(*t_augment)(struct rb_tree *, void *);
 	unsigned int	  t_offset;	/* offset of rb_entry in type */
+	unsigned long	(*t_hash)(const void *);	/* only needed with RBT_BLOOM */
+	uint64_t	(*t_prefix)(const void *);	/* only needed with RBT_PREFIX */
+	int		  t_rule;	/* rank rule, RBT_RULE_WAVL if 0 */
 };
 
+#ifndef RB_MAX_HEIGHT
+#define RB_MAX_HEIGHT		127
+#endif
+
 /*
  * Allow choosing an implementation without the parent pointer.
  * The advantage is a much smaller tree representation, faster lookup
  * times but at the cost of a slight increase in insert/removal times.
  */
+#ifdef RBT_MINMAX
+#define _RBT_MINMAX_INITIALIZER	{ NULL, NULL },
+#else
+#define _RBT_MINMAX_INITIALIZER
+#endif
+#ifdef RBT_BLOOM
+#define _RBT_BLOOM_INITIALIZER	NULL, 0, 0,
+#else
+#define _RBT_BLOOM_INITIALIZER
+#endif
+
 #ifdef RBT_SMALL
 
 struct rb_entry {
 	/* left, right */
 	struct rb_entry		*child[2];
-};
-
-
-#ifndef RB_MAX_HEIGHT
-#define RB_MAX_HEIGHT		127
+#ifdef RBT_PREFIX
+	uint64_t		 prefix;
 #endif
+};
 
 struct rb_tree {
 	struct rb_entry		*root;
 	struct rb_type		*options;
+#ifdef RBT_MINMAX
+	struct rb_entry		*minmax[2];
+#endif
+#ifdef RBT_BLOOM
+	uint8_t			*bloom;
+	size_t			 bloom_size;
+	unsigned int		 bloom_k;
+#endif
 	struct rb_entry		*stack[RB_MAX_HEIGHT];
 	size_t			 top;
 };
 
-#define RBT_INITIALIZER(_head)	{ NULL, NULL, { NULL }, 0 }
+#define RBT_INITIALIZER(_head)	{ NULL, NULL, _RBT_MINMAX_INITIALIZER _RBT_BLOOM_INITIALIZER { NULL }, 0 }
 
 #else
 
 struct rb_entry {
 	/* left, right, parent */
 	struct rb_entry		*child[3];
+#ifdef RBT_PREFIX
+	uint64_t		 prefix;
+#endif
 };
 
 struct rb_tree {
 	struct rb_entry		*root;
 	struct rb_type		*options;
+#ifdef RBT_MINMAX
+	struct rb_entry		*minmax[2];
+#endif
+#ifdef RBT_BLOOM
+	uint8_t			*bloom;
+	size_t			 bloom_size;
+	unsigned int		 bloom_k;
+#endif
 };
 
-#define RBT_INITIALIZER(_head)	{ NULL, NULL }
+#define RBT_INITIALIZER(_head)	{ NULL, NULL, _RBT_MINMAX_INITIALIZER _RBT_BLOOM_INITIALIZER }
 
 #endif
 
@@ -106,6 +169,17 @@ void	 rb_set_right(struct rb_tree *, void *, void *);
 void	 rb_set_parent(struct rb_tree *, void *, void *);
 void	 rb_poison(struct rb_tree *, void *, unsigned long);
 int	 rb_check(const struct rb_tree *, void *, unsigned long);
+#ifdef RBT_BLOOM
+void	 rb_bloom_init(struct rb_tree *, uint8_t *, size_t, unsigned int);
+#endif
+void	 rb_rebuild_perfect(struct rb_tree *);
+void	 rb_destroy(struct rb_tree *, void (*)(void *, void *), void *);
+int	 rb_clone(struct rb_tree *, struct rb_tree *, void *(*)(void *, void *), void *);
+
+#ifdef RBT_BLOOM
+/* bytes of cells needed by rb_bloom_init */
+#define RBT_BLOOM_SIZE(_nkeys, _bits_per_key)	((size_t)(_nkeys) * (_bits_per_key))
+#endif
 
 /*
 #define RBT_PROTOTYPE(_name, _type, _field, _cmp)			\
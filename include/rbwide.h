@@ -0,0 +1,313 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef	_SYS_RBWIDE_H_
+#define	_SYS_RBWIDE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+
+/*
+ * A set of elements ordered by a 64 bit key, given by the keyfn passed to
+ * RB_WIDE_GENERATE, which has to be unique like the keys of a tree. The
+ * elements are kept in buckets of up to RB_WIDE_SIZE sorted keys, each
+ * with a pointer to its element, and the buckets are the nodes of a tree
+ * from tree.h ordered by their first key. A lookup descends the tree of
+ * buckets and then counts the keys below the search key in one bucket,
+ * a loop without branches over a fixed number of keys that the compiler
+ * turns into vector compares. The elements themselves are only touched
+ * when they are returned and need no entry.
+ *
+ * A full bucket is split in two halves, an empty one is freed and one
+ * that falls below a quarter takes in the next bucket if the two fit in
+ * three quarters. Buckets come from malloc; RB_WIDE_INSERT returns the
+ * element itself if that fails. The head is set up with RB_WIDE_INIT or
+ * RB_WIDE_INITIALIZER and its buckets are freed with RB_WIDE_FREE.
+ *
+ * The buckets always use the large layout, so that the next bucket is one
+ * RB_NEXT away. RB_WIDE_FOREACH keeps its place as a bucket and an index
+ * and steps without a lookup, RB_WIDE_NEXT from an element first has to
+ * find it.
+ */
+#ifndef RB_WIDE_SIZE
+#define RB_WIDE_SIZE		16
+#endif
+
+#define RB_WIDE_HEAD(name, type)			\
+struct name##_bucket {					\
+	RB_ENTRY_LARGE(name##_bucket)	 link;		\
+	unsigned int		 n;			\
+	uint64_t		 key[RB_WIDE_SIZE];	\
+	struct type		*elm[RB_WIDE_SIZE];	\
+};							\
+RB_HEAD_LARGE(name##_buckets, name##_bucket);		\
+struct name {						\
+	struct name##_buckets	 buckets;		\
+	size_t			 count;			\
+};							\
+struct name##_cursor {					\
+	struct name##_bucket	*b;			\
+	unsigned int		 pos;			\
+}
+
+#define RB_WIDE_INITIALIZER(head)			\
+{ RB_INITIALIZER(&(head)->buckets), 0 }
+
+#define RB_WIDE_INIT(head)		do {		\
+RB_INIT(&(head)->buckets);				\
+(head)->count = 0;					\
+} while (0)
+
+#define RB_WIDE_PROTOTYPE(name, type)					\
+struct type	*name##_RB_WIDE_FIND(struct name *, struct type *);	\
+struct type	*name##_RB_WIDE_NFIND(struct name *, struct type *);	\
+struct type	*name##_RB_WIDE_NEXT(struct name *, struct type *);	\
+struct type	*name##_RB_WIDE_MIN(struct name *);			\
+struct type	*name##_RB_WIDE_INSERT(struct name *, struct type *);	\
+struct type	*name##_RB_WIDE_REMOVE(struct name *, struct type *);	\
+void		 name##_RB_WIDE_FREE(struct name *);
+
+#define RB_WIDE_GENERATE(name, type, keyfn)				\
+	_RB_WIDE_GENERATE_INTERNAL(name, type, keyfn, )
+
+#define RB_WIDE_GENERATE_STATIC(name, type, keyfn)			\
+	_RB_WIDE_GENERATE_INTERNAL(name, type, keyfn, __attribute__((__unused__)) static)
+
+#define _RB_WIDE_GENERATE_INTERNAL(name, type, keyfn, attr)		\
+static inline int							\
+name##_RB_WIDE_CMP(const struct name##_bucket *a, const struct name##_bucket *b)	\
+{									\
+	return ((a->key[0] > b->key[0]) - (a->key[0] < b->key[0]));	\
+}									\
+									\
+RB_GENERATE_LARGE_STATIC(name##_buckets, name##_bucket, link, name##_RB_WIDE_CMP)	\
+									\
+/* the slots past n hold the largest key, so they never count */	\
+static inline unsigned int						\
+name##_RB_WIDE_RANK(const struct name##_bucket *b, uint64_t wkey)	\
+{									\
+	unsigned int i, pos = 0;					\
+									\
+	for (i = 0; i < RB_WIDE_SIZE; i++)				\
+		pos += (b->key[i] < wkey);				\
+	return (pos);							\
+}									\
+									\
+static inline void							\
+name##_RB_WIDE_PAD(struct name##_bucket *b, unsigned int from)		\
+{									\
+	for (; from < RB_WIDE_SIZE; from++) {				\
+		b->key[from] = UINT64_MAX;				\
+		b->elm[from] = NULL;					\
+	}								\
+}									\
+									\
+/* the bucket whose range holds the key, or the first one */		\
+static inline struct name##_bucket *					\
+name##_RB_WIDE_BUCKET(struct name *head, uint64_t wkey)			\
+{									\
+	struct name##_bucket probe, *b;					\
+									\
+	probe.key[0] = wkey;						\
+	b = RB_PFIND(name##_buckets, &head->buckets, &probe);		\
+	if (b == NULL)							\
+		b = RB_MIN(name##_buckets, &head->buckets);		\
+	return (b);							\
+}									\
+									\
+static inline struct type *						\
+name##_RB_WIDE_AT(const struct name##_cursor *c)			\
+{									\
+	return (c->b == NULL ? NULL : c->b->elm[c->pos]);		\
+}									\
+									\
+static inline void							\
+name##_RB_WIDE_STEP(struct name##_cursor *c)				\
+{									\
+	if (++c->pos == c->b->n) {					\
+		c->b = RB_NEXT(name##_buckets, NULL, c->b);		\
+		c->pos = 0;						\
+	}								\
+}									\
+									\
+attr struct type *							\
+name##_RB_WIDE_FIND(struct name *head, struct type *elm)		\
+{									\
+	struct name##_bucket *b;					\
+	uint64_t wkey = keyfn(elm);					\
+	unsigned int pos;						\
+									\
+	if ((b = name##_RB_WIDE_BUCKET(head, wkey)) == NULL)		\
+		return (NULL);						\
+	pos = name##_RB_WIDE_RANK(b, wkey);				\
+	if (pos < b->n && b->key[pos] == wkey)				\
+		return (b->elm[pos]);					\
+	return (NULL);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_WIDE_NFIND(struct name *head, struct type *elm)		\
+{									\
+	struct name##_bucket *b;					\
+	uint64_t wkey = keyfn(elm);					\
+	unsigned int pos;						\
+									\
+	if ((b = name##_RB_WIDE_BUCKET(head, wkey)) == NULL)		\
+		return (NULL);						\
+	pos = name##_RB_WIDE_RANK(b, wkey);				\
+	if (pos < b->n)							\
+		return (b->elm[pos]);					\
+	if ((b = RB_NEXT(name##_buckets, &head->buckets, b)) == NULL)	\
+		return (NULL);						\
+	return (b->elm[0]);						\
+}									\
+									\
+attr struct type *							\
+name##_RB_WIDE_NEXT(struct name *head, struct type *elm)		\
+{									\
+	struct name##_bucket *b;					\
+	uint64_t wkey = keyfn(elm);					\
+	unsigned int pos;						\
+									\
+	if ((b = name##_RB_WIDE_BUCKET(head, wkey)) == NULL)		\
+		return (NULL);						\
+	pos = name##_RB_WIDE_RANK(b, wkey) + 1;				\
+	if (pos < b->n)							\
+		return (b->elm[pos]);					\
+	if ((b = RB_NEXT(name##_buckets, &head->buckets, b)) == NULL)	\
+		return (NULL);						\
+	return (b->elm[0]);						\
+}									\
+									\
+attr struct type *							\
+name##_RB_WIDE_MIN(struct name *head)					\
+{									\
+	struct name##_bucket *b;					\
+									\
+	b = RB_MIN(name##_buckets, &head->buckets);			\
+	return (b == NULL ? NULL : b->elm[0]);				\
+}									\
+									\
+/* returns elm itself if a new bucket could not be allocated */		\
+attr struct type *							\
+name##_RB_WIDE_INSERT(struct name *head, struct type *elm)		\
+{									\
+	struct name##_bucket *b, *nb;					\
+	uint64_t wkey = keyfn(elm);					\
+	unsigned int pos, half = RB_WIDE_SIZE / 2;			\
+									\
+	if ((b = name##_RB_WIDE_BUCKET(head, wkey)) == NULL) {		\
+		if ((b = malloc(sizeof(*b))) == NULL)			\
+			return (elm);					\
+		b->n = 0;						\
+		name##_RB_WIDE_PAD(b, 0);				\
+		b->key[0] = wkey;					\
+		RB_INSERT(name##_buckets, &head->buckets, b);		\
+	}								\
+	pos = name##_RB_WIDE_RANK(b, wkey);				\
+	if (pos < b->n && b->key[pos] == wkey)				\
+		return (b->elm[pos]);					\
+	if (b->n == RB_WIDE_SIZE) {					\
+		/* the upper half moves to a new bucket that follows b */	\
+		if ((nb = malloc(sizeof(*nb))) == NULL)			\
+			return (elm);					\
+		nb->n = RB_WIDE_SIZE - half;				\
+		memcpy(nb->key, &b->key[half], nb->n * sizeof(b->key[0]));	\
+		memcpy(nb->elm, &b->elm[half], nb->n * sizeof(b->elm[0]));	\
+		name##_RB_WIDE_PAD(nb, nb->n);				\
+		b->n = half;						\
+		name##_RB_WIDE_PAD(b, half);				\
+		RB_INSERT(name##_buckets, &head->buckets, nb);		\
+		if (pos > half) {					\
+			b = nb;						\
+			pos -= half;					\
+		}							\
+	}								\
+	memmove(&b->key[pos + 1], &b->key[pos], (b->n - pos) * sizeof(b->key[0]));	\
+	memmove(&b->elm[pos + 1], &b->elm[pos], (b->n - pos) * sizeof(b->elm[0]));	\
+	b->key[pos] = wkey;						\
+	b->elm[pos] = elm;						\
+	b->n++;								\
+	head->count++;							\
+	return (NULL);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_WIDE_REMOVE(struct name *head, struct type *elm)		\
+{									\
+	struct name##_bucket *b, *nb;					\
+	uint64_t wkey = keyfn(elm);					\
+	unsigned int pos;						\
+									\
+	if ((b = name##_RB_WIDE_BUCKET(head, wkey)) == NULL)		\
+		return (NULL);						\
+	pos = name##_RB_WIDE_RANK(b, wkey);				\
+	if (pos == b->n || b->key[pos] != wkey)				\
+		return (NULL);						\
+	elm = b->elm[pos];						\
+	head->count--;							\
+	if (b->n == 1) {						\
+		RB_REMOVE(name##_buckets, &head->buckets, b);		\
+		free(b);						\
+		return (elm);						\
+	}								\
+	b->n--;								\
+	memmove(&b->key[pos], &b->key[pos + 1], (b->n - pos) * sizeof(b->key[0]));	\
+	memmove(&b->elm[pos], &b->elm[pos + 1], (b->n - pos) * sizeof(b->elm[0]));	\
+	name##_RB_WIDE_PAD(b, b->n);					\
+	if (b->n < RB_WIDE_SIZE / 4 &&					\
+		(nb = RB_NEXT(name##_buckets, &head->buckets, b)) != NULL &&	\
+		b->n + nb->n <= RB_WIDE_SIZE * 3 / 4) {			\
+		/* a small bucket takes in the next one if there is room to spare */	\
+		memcpy(&b->key[b->n], nb->key, nb->n * sizeof(b->key[0]));	\
+		memcpy(&b->elm[b->n], nb->elm, nb->n * sizeof(b->elm[0]));	\
+		b->n += nb->n;						\
+		RB_REMOVE(name##_buckets, &head->buckets, nb);		\
+		free(nb);						\
+	}								\
+	return (elm);							\
+}									\
+									\
+/* frees every bucket, the elements are left alone */			\
+attr void								\
+name##_RB_WIDE_FREE(struct name *head)					\
+{									\
+	struct name##_bucket *b;					\
+									\
+	while ((b = RB_MIN(name##_buckets, &head->buckets)) != NULL) {	\
+		RB_REMOVE(name##_buckets, &head->buckets, b);		\
+		free(b);						\
+	}								\
+	head->count = 0;						\
+}
+
+#define RB_WIDE_FIND(name, head, elm)		name##_RB_WIDE_FIND(head, elm)
+#define RB_WIDE_NFIND(name, head, elm)		name##_RB_WIDE_NFIND(head, elm)
+#define RB_WIDE_NEXT(name, head, elm)		name##_RB_WIDE_NEXT(head, elm)
+#define RB_WIDE_MIN(name, head)			name##_RB_WIDE_MIN(head)
+#define RB_WIDE_INSERT(name, head, elm)		name##_RB_WIDE_INSERT(head, elm)
+#define RB_WIDE_REMOVE(name, head, elm)		name##_RB_WIDE_REMOVE(head, elm)
+#define RB_WIDE_FREE(name, head)		name##_RB_WIDE_FREE(head)
+#define RB_WIDE_COUNT(head)			(head)->count
+
+#define RB_WIDE_FOREACH(x, name, head)					\
+	for (struct name##_cursor name##_cur =				\
+	    { RB_MIN(name##_buckets, &(head)->buckets), 0 };		\
+	     ((x) = name##_RB_WIDE_AT(&name##_cur)) != NULL;		\
+	     name##_RB_WIDE_STEP(&name##_cur))
+
+#endif	/* _SYS_RBWIDE_H_ */
@@ -52,14 +52,39 @@
  *   max rotations after insert     2              O(Log(N))        2
  *   max rotations after delete     2              2                3
  * 
- * For each node we store the left and right pointers (and parent pointer depending on RB_SMALL).
+ * For each node we store the left and right pointers (and the parent pointer in the large layout).
  * We assume that a pointer to a struct is aligned to multiple of 4 bytes, which leaves
  * the last two bits free for our use.
  * The last bit of each child is used to store the rank difference between the node and its child.
  * The convention used here is the rank difference = 1 + last bit.
  */
 
-#include <stdint.h>
+/*
+ * A tree keeps one of three rank rules, picked by listing the feature
+ * RB_WAVL, RB_AVL or RB_REDBLACK, so that trees of different rules can
+ * share a translation unit. Trees that list none keep RB_RULE, which is
+ * RB_RULE_WAVL unless defined otherwise. All of the rules use the rank
+ * differences of 1 and 2 above, so only the updates change:
+ *
+ * RB_RULE_WAVL	the default, leaves are 1,1.
+ * RB_RULE_AVL	no node is 2,2, which keeps the height within 1.44Log(N)
+ *		after removals too. A removal can demote all the way up.
+ * RB_RULE_RB	nodes of even rank are 1,1. This is a red-black tree: even
+ *		ranks are red, and a rank is twice the number of black nodes
+ *		on a path down from the node, less one if it is black. Black
+ *		leaves are 2,2.
+ *
+ * RB_RANK checks the rule of the tree. With the AVL and red-black rules
+ * RB_INSERT_TOPDOWN and RB_REMOVE_TOPDOWN are RB_INSERT and RB_REMOVE.
+ * The rule is name##_RB_RULE in the file that generates the tree.
+ */
+#define RB_RULE_WAVL					0
+#define RB_RULE_AVL					1
+#define RB_RULE_RB					2
+
+#ifndef RB_RULE
+#define RB_RULE						RB_RULE_WAVL
+#endif
 
 /*
  * debug macros
@@ -75,7 +100,13 @@
  * internal use macros
  */
 #define _RB_LOWMASK					((uintptr_t)3U)
+#ifndef RB_THREADED
 #define _RB_PTR(elm)					(__typeof(elm))((uintptr_t)(elm) & ~_RB_LOWMASK)
+#else
+/* a link with the second bit set is a thread and not a child */
+#define _RB_PTR(elm)					\
+(__typeof(elm))((uintptr_t)(elm) & ~_RB_LOWMASK & ((((uintptr_t)(elm)) >> 1 & 1U) - 1))
+#endif
 
 #define _RB_LDIR					((uintptr_t)0U)
 #define _RB_RDIR					((uintptr_t)1U)
@@ -85,137 +116,1020 @@
 #define RB_MAX_HEIGHT					127
 #endif
 
-#ifdef RB_SMALL
+/* number of slots in the lookup cache of RB_HOT trees, must be a power of 2 */
+#ifndef RB_HOT_SIZE
+#define RB_HOT_SIZE					64
+#endif
+
+/* number of inserts an RB_RELAXED tree can leave unbalanced at a time */
+#ifndef RB_RELAXED_SIZE
+#define RB_RELAXED_SIZE					64
+#endif
 
-#define RB_ENTRY(type)					\
+/*
+ * Two node layouts are available and can be mixed freely within one
+ * translation unit, each tree picking the one that suits its access pattern:
+ *
+ * RB_ENTRY_SMALL/RB_HEAD_SMALL/RB_GENERATE_SMALL
+ *	only the left and right pointers are kept in the node, the path from
+ *	the root is remembered in a stack in the head during updates.
+ *	Gives the smallest nodes and the fastest lookups, but there is no
+ *	RB_NEXT/RB_PREV and updates are slightly slower.
+ *
+ * RB_ENTRY_LARGE/RB_HEAD_LARGE/RB_GENERATE_LARGE
+ *	the node also keeps a pointer to its parent, which allows iteration
+ *	and removal by pointer without any comparisons.
+ *
+ * The unsuffixed RB_ENTRY/RB_HEAD/RB_GENERATE macros select the small
+ * layout when RB_SMALL is defined and the large layout otherwise.
+ *
+ * With RB_THREADED defined the small layout keeps no stack. A null left or
+ * right link instead holds the in-order predecessor or successor, tagged
+ * with the second low bit, so RB_NEXT/RB_PREV follow it in O(1) amortized.
+ * The parent of a node is the node that threads to the leftmost or the
+ * rightmost node of its subtree, which is how updates walk back up, and
+ * RB_REMOVEC and RB_INSERT_NEXT/RB_INSERT_PREV work on the node itself as
+ * in the large layout. Finding a parent costs the height of the subtree,
+ * so augmented trees update in O(log^2 n). RB_REMOVE still searches by key.
+ * Like RB_RELATIVE it applies to every tree in the translation unit.
+ */
+#define RB_ENTRY_SMALL(type)				\
 struct {						\
 	/* left, right */				\
 	struct type	*child[2];			\
 }
 
-#define RB_HEAD(name, type)				\
+/* the stack goes in front of the root, RB_INIT only clears from the root on */
+#ifndef RB_THREADED
+#define _RB_HEAD_STACK(type)				\
+	struct type	*stack[RB_MAX_HEIGHT];
+#define _RB_HEAD_TOP					\
+	size_t		 top;
+#else
+#define _RB_HEAD_STACK(type)
+#define _RB_HEAD_TOP
+#endif
+
+#define RB_HEAD_SMALL(name, type)			\
 struct name {						\
+	_RB_HEAD_STACK(type)				\
 	struct type	*root;				\
-	struct type	*stack[RB_MAX_HEIGHT];		\
-	size_t		 top;				\
+	_RB_HEAD_TOP					\
 }
 
-#define RB_INITIALIZER(root)				\
-{ NULL, { NULL }, 0 }
+#ifndef RB_THREADED
+#define _RB_GET_PARENT_SMALL(elm, oelm, field)		do {} while (0)
+#define _RB_SET_PARENT_SMALL(elm, pelm, field)		do {} while (0)
 
-#define _RB_GET_PARENT(elm, oelm, field)		do {} while (0)
-#define _RB_SET_PARENT(elm, pelm, field)		do {} while (0)
-
-#define _RB_STACK_SIZE(head, sz)	do {	\
+#define _RB_STACK_SIZE_SMALL(head, sz)	do {	\
 *sz = (head)->top;				\
 } while (0)
 
-#define _RB_STACK_PUSH(head, elm)	do {	\
+#define _RB_STACK_PUSH_SMALL(head, elm)	do {	\
 (head)->stack[(head)->top++] = elm;		\
 } while (0)
 
-#define _RB_STACK_DROP(head)		do {	\
+#define _RB_STACK_DROP_SMALL(head)	do {	\
 (head)->top -= 1;				\
 } while (0)
 
-#define _RB_STACK_POP(head, oelm)	do {	\
+#define _RB_STACK_POP_SMALL(head, oelm)	do {	\
 if ((head)->top > 0)				\
 	oelm = (head)->stack[--(head)->top];	\
 } while (0)
 
-#define _RB_STACK_TOP(head, oelm)	do {	\
+#define _RB_STACK_TOP_SMALL(head, oelm)	do {	\
 if ((head)->top > 0)				\
 	oelm = (head)->stack[(head)->top - 1];	\
 } while (0)
 
-#define _RB_STACK_CLEAR(head)		do {	\
+#define _RB_STACK_CLEAR_SMALL(head)	do {	\
 (head)->top = 0;				\
-_RB_STACK_PUSH(head, NULL);			\
+_RB_STACK_PUSH_SMALL(head, NULL);		\
 } while (0)
 
-#define _RB_STACK_SET(head, i, elm)	do {	\
+#define _RB_STACK_SET_SMALL(head, i, elm)	do {	\
 (head)->stack[i] = elm;				\
 } while (0)
 
+/* removal needs the path to the node, so it has to be searched for */
+#define _RB_REMOVE_FIND_SMALL(name, head, elm)		name##_RB_FINDC(head, elm)
+
+/* the path to an extreme node is along the spine, no comparisons needed */
+#define _RB_SPINE_PATH_SMALL(head, elm, dir, field)	do {		\
+__typeof(elm) tmp_pp = RB_ROOT(head);					\
+_RB_STACK_CLEAR_SMALL(head);						\
+while (tmp_pp != (elm)) {						\
+	_RB_STACK_PUSH_SMALL(head, tmp_pp);				\
+	tmp_pp = _RB_PTR(_RB_GET_CHILD(tmp_pp, dir, field));		\
+}									\
+} while (0)
+
+#define _RB_THREAD_SMALL(elm, dir, field)		NULL
+#define _RB_SET_THREAD_SMALL(elm, dir, telm, field)	do {} while (0)
+#define _RB_REMOVE_THREADS_SMALL(elm, opar, rmin, parent, child, field)	do {} while (0)
+#define _RB_RETHREAD_SMALL(name, head, field)		do {} while (0)
 #else
+/* the node a null link threads to, the rank difference bit is kept on update */
+#define _RB_THREAD_SMALL(elm, dir, field)				\
+((__typeof(elm))((uintptr_t)_RB_GET_CHILD(elm, dir, field) & ~_RB_LOWMASK))
+#define _RB_SET_THREAD_SMALL(elm, dir, telm, field)	do {		\
+_RB_SET_CHILD(elm, dir, (__typeof(elm))((uintptr_t)(telm) | 2U |	\
+    _RB_GET_RDIFF(elm, dir, field)), field);				\
+} while (0)
+
+/*
+ * a right child is threaded to from the leftmost node of its subtree and a
+ * left child from the rightmost one, the root from neither
+ */
+#define _RB_GET_PARENT_SMALL(elm, pelm, field)	do {			\
+__typeof(elm) tmp_pe = (elm), tmp_pt = tmp_pe;				\
+while (RB_LEFT(tmp_pt, field) != NULL)					\
+	tmp_pt = RB_LEFT(tmp_pt, field);				\
+tmp_pt = _RB_THREAD_SMALL(tmp_pt, _RB_LDIR, field);			\
+if (tmp_pt == NULL || RB_RIGHT(tmp_pt, field) != tmp_pe) {		\
+	tmp_pt = tmp_pe;						\
+	while (RB_RIGHT(tmp_pt, field) != NULL)				\
+		tmp_pt = RB_RIGHT(tmp_pt, field);			\
+	tmp_pt = _RB_THREAD_SMALL(tmp_pt, _RB_RDIR, field);		\
+}									\
+(pelm) = tmp_pt;							\
+} while (0)
+#define _RB_SET_PARENT_SMALL(elm, pelm, field)		do {} while (0)
+
+#define _RB_STACK_SIZE_SMALL(head, sz)		do {} while (0)
+#define _RB_STACK_PUSH_SMALL(head, elm)		do {} while (0)
+#define _RB_STACK_DROP_SMALL(head)		do {} while (0)
+#define _RB_STACK_POP_SMALL(head, elm)		do {} while (0)
+#define _RB_STACK_TOP_SMALL(head, elm)		do {} while (0)
+#define _RB_STACK_CLEAR_SMALL(head)		do {} while (0)
+#define _RB_STACK_SET_SMALL(head, i, elm)	do {} while (0)
+
+/* RB_REMOVE keeps taking a key, RB_REMOVEC takes the node */
+#define _RB_REMOVE_FIND_SMALL(name, head, elm)		name##_RB_FIND(head, elm)
+#define _RB_SPINE_PATH_SMALL(head, elm, dir, field)	do {} while (0)
+
+/*
+ * called once elm is unlinked, with rmin the node that took its place:
+ * the threads that led to elm are moved to its neighbours, and a link that
+ * became null gets a thread. child is cleared if it was a thread.
+ */
+#define _RB_REMOVE_THREADS_SMALL(elm, opar, rmin, parent, child, field) do {	\
+__typeof(elm) tmp_rt;							\
+if (RB_LEFT(elm, field) != NULL && RB_RIGHT(elm, field) != NULL) {	\
+	tmp_rt = RB_LEFT(rmin, field);					\
+	while (RB_RIGHT(tmp_rt, field) != NULL)				\
+		tmp_rt = RB_RIGHT(tmp_rt, field);			\
+	_RB_SET_THREAD_SMALL(tmp_rt, _RB_RDIR, rmin, field);		\
+	if ((parent) != (rmin) && RB_LEFT(parent, field) == NULL)	\
+		_RB_SET_THREAD_SMALL(parent, _RB_LDIR, rmin, field);	\
+	(child) = _RB_PTR(child);					\
+} else if ((rmin) != NULL) {						\
+	tmp_rt = (rmin);						\
+	if ((rmin) == RB_LEFT(elm, field)) {				\
+		while (RB_RIGHT(tmp_rt, field) != NULL)			\
+			tmp_rt = RB_RIGHT(tmp_rt, field);		\
+		_RB_SET_THREAD_SMALL(tmp_rt, _RB_RDIR,			\
+		    _RB_THREAD_SMALL(elm, _RB_RDIR, field), field);	\
+	} else {							\
+		while (RB_LEFT(tmp_rt, field) != NULL)			\
+			tmp_rt = RB_LEFT(tmp_rt, field);		\
+		_RB_SET_THREAD_SMALL(tmp_rt, _RB_LDIR,			\
+		    _RB_THREAD_SMALL(elm, _RB_LDIR, field), field);	\
+	}								\
+} else if ((opar) != NULL) {						\
+	if (_RB_THREAD_SMALL(elm, _RB_RDIR, field) == (opar))		\
+		_RB_SET_THREAD_SMALL(opar, _RB_LDIR,			\
+		    _RB_THREAD_SMALL(elm, _RB_LDIR, field), field);	\
+	else								\
+		_RB_SET_THREAD_SMALL(opar, _RB_RDIR,			\
+		    _RB_THREAD_SMALL(elm, _RB_RDIR, field), field);	\
+}									\
+} while (0)
+
+/* for trees linked without going through insert, see _RB_GENERATE_THREAD_SMALL */
+#define _RB_RETHREAD_SMALL(name, head, field)	do {			\
+__typeof(RB_ROOT(head)) tmp_prev = NULL;				\
+name##_RB_THREAD(RB_ROOT(head), &tmp_prev);				\
+if (tmp_prev != NULL)							\
+	_RB_SET_THREAD_SMALL(tmp_prev, _RB_RDIR, NULL, field);		\
+} while (0)
+#endif
+
 
-#define RB_ENTRY(type)					\
+#define RB_ENTRY_LARGE(type)				\
 struct {						\
 	/* left, right, parent */			\
 	struct type *child[3];				\
 }
 
-#define RB_HEAD(name, type)				\
+#define RB_HEAD_LARGE(name, type)			\
 struct name {						\
 	struct type *root;				\
 }
 
-#define RB_INITIALIZER(root)				\
-{ NULL }
-
 #define _RB_PDIR					2
 
-#define _RB_GET_PARENT(elm, pelm, field)	do {	\
-pelm = _RB_GET_CHILD(elm, _RB_PDIR, field);			\
+#define _RB_GET_PARENT_LARGE(elm, pelm, field)	do {	\
+pelm = _RB_GET_CHILD(elm, _RB_PDIR, field);		\
 } while (0)
 
-#define _RB_SET_PARENT(elm, pelm, field) do {		\
+#define _RB_SET_PARENT_LARGE(elm, pelm, field) do {	\
 _RB_SET_CHILD(elm, _RB_PDIR, pelm, field);		\
 } while (0)
 
-#define _RB_STACK_SIZE(head, sz)		do {} while (0)
-#define _RB_STACK_PUSH(head, elm)		do {} while (0)
-#define _RB_STACK_DROP(head)			do {} while (0)
-#define _RB_STACK_POP(head, elm)		do {} while (0)
-#define _RB_STACK_TOP(head, elm)		do {} while (0)
-#define _RB_STACK_CLEAR(head)			do {} while (0)
-#define _RB_STACK_SET(head, i, elm)		do {} while (0)
+#define _RB_STACK_SIZE_LARGE(head, sz)		do {} while (0)
+#define _RB_STACK_PUSH_LARGE(head, elm)		do {} while (0)
+#define _RB_STACK_DROP_LARGE(head)		do {} while (0)
+#define _RB_STACK_POP_LARGE(head, elm)		do {} while (0)
+#define _RB_STACK_TOP_LARGE(head, elm)		do {} while (0)
+#define _RB_STACK_CLEAR_LARGE(head)		do {} while (0)
+#define _RB_STACK_SET_LARGE(head, i, elm)	do {} while (0)
+
+#define _RB_REMOVE_FIND_LARGE(name, head, elm)		(elm)
+#define _RB_SPINE_PATH_LARGE(head, elm, dir, field)	do {} while (0)
+
+#define _RB_THREAD_LARGE(elm, dir, field)		NULL
+#define _RB_SET_THREAD_LARGE(elm, dir, telm, field)	do {} while (0)
+#define _RB_REMOVE_THREADS_LARGE(elm, opar, rmin, parent, child, field)	do {} while (0)
+#define _RB_RETHREAD_LARGE(name, head, field)		do {} while (0)
+
+
+/*
+ * Trees can be given any combination of the features below, listed after
+ * the usual arguments of RB_ENTRY_EXT, RB_HEAD_EXT, RB_PROTOTYPE_EXT and
+ * RB_GENERATE_EXT or their _SMALL, _LARGE, _STATIC and _AUGMENT variants:
+ *
+ *	RB_HEAD_EXT(tree, node, RB_MINMAX, RB_BLOOM(hash));
+ *	RB_GENERATE_EXT(tree, node, link, cmp, RB_MINMAX, RB_BLOOM(hash))
+ *
+ * The prototypes and generators of a tree take the same list, of up to 8
+ * features, and call the hooks of each feature in list order. The entry
+ * and head macros only add the fields of the features that need them, so
+ * RB_ENTRY and RB_HEAD still do for features that add none.
+ */
+#define _RB_CAT(a, b)					_RB_CAT_(a, b)
+#define _RB_CAT_(a, b)					a##b
+#define _RB_LIST(...)					__VA_ARGS__
+#define _RB_APPLY(m, ...)				m(__VA_ARGS__)
+#define _RB_NARG(...)					_RB_NARG_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define _RB_NARG_(a, b, c, d, e, f, g, h, n, ...)	n
+
+/* m(x, f) for every f of the list */
+#define _RB_EACH(m, x, ...)				_RB_CAT(_RB_EACH_, _RB_NARG(__VA_ARGS__))(m, x, __VA_ARGS__)
+#define _RB_EACH_1(m, x, f)				m(x, f)
+#define _RB_EACH_2(m, x, f, ...)			m(x, f) _RB_EACH_1(m, x, __VA_ARGS__)
+#define _RB_EACH_3(m, x, f, ...)			m(x, f) _RB_EACH_2(m, x, __VA_ARGS__)
+#define _RB_EACH_4(m, x, f, ...)			m(x, f) _RB_EACH_3(m, x, __VA_ARGS__)
+#define _RB_EACH_5(m, x, f, ...)			m(x, f) _RB_EACH_4(m, x, __VA_ARGS__)
+#define _RB_EACH_6(m, x, f, ...)			m(x, f) _RB_EACH_5(m, x, __VA_ARGS__)
+#define _RB_EACH_7(m, x, f, ...)			m(x, f) _RB_EACH_6(m, x, __VA_ARGS__)
+#define _RB_EACH_8(m, x, f, ...)			m(x, f) _RB_EACH_7(m, x, __VA_ARGS__)
+
+/* the list of m(f) for every f of the list */
+#define _RB_MAP(m, ...)					_RB_CAT(_RB_MAP_, _RB_NARG(__VA_ARGS__))(m, __VA_ARGS__)
+#define _RB_MAP_1(m, f)					m(f)
+#define _RB_MAP_2(m, f, ...)				m(f), _RB_MAP_1(m, __VA_ARGS__)
+#define _RB_MAP_3(m, f, ...)				m(f), _RB_MAP_2(m, __VA_ARGS__)
+#define _RB_MAP_4(m, f, ...)				m(f), _RB_MAP_3(m, __VA_ARGS__)
+#define _RB_MAP_5(m, f, ...)				m(f), _RB_MAP_4(m, __VA_ARGS__)
+#define _RB_MAP_6(m, f, ...)				m(f), _RB_MAP_5(m, __VA_ARGS__)
+#define _RB_MAP_7(m, f, ...)				m(f), _RB_MAP_6(m, __VA_ARGS__)
+#define _RB_MAP_8(m, f, ...)				m(f), _RB_MAP_7(m, __VA_ARGS__)
+
+/*
+ * a feature stands for the suffix of its hooks, the function it takes, the
+ * suffix of the compare it puts in front of cmp and the suffix of the rank
+ * rule it picks, if any. The rules have no hooks of their own.
+ */
+#define _RB_FEATURE(f)					_RB_FEATURE_##f
+#define _RB_FEATURE_					(_NONE, , , )
+#define _RB_FEATURE_RB_MINMAX				(_MINMAX, , , )
+#define _RB_FEATURE_RB_HOT(hashfn)			(_HOT, hashfn, , )
+#define _RB_FEATURE_RB_BLOOM(hashfn)			(_BLOOM, hashfn, , )
+#define _RB_FEATURE_RB_LOG(logfn)			(_LOG, logfn, , )
+#define _RB_FEATURE_RB_RELAXED				(_RELAXED, , , )
+#define _RB_FEATURE_RB_PREFIX(prefixfn)			(_PREFIX, prefixfn, _PREFIX, )
+#define _RB_FEATURE_RB_BIASED				(_BIASED, , , )
+#define _RB_FEATURE_RB_INDEX				(_INDEX, , , )
+#define _RB_FEATURE_RB_WAVL				(_NONE, , , _WAVL)
+#define _RB_FEATURE_RB_AVL				(_NONE, , , _AVL)
+#define _RB_FEATURE_RB_REDBLACK				(_NONE, , , _REDBLACK)
+
+#define _RB_SUFFIX(t)					_RB_SUFFIX_ t
+#define _RB_SUFFIX_(suffix, fn, cmpsuffix, rulesuffix)	suffix
+#define _RB_CMPSUFFIX(x, t)				_RB_CMPSUFFIX_ t
+#define _RB_CMPSUFFIX_(suffix, fn, cmpsuffix, rulesuffix)	cmpsuffix
+#define _RB_RULESUFFIX(x, t)				_RB_RULESUFFIX_ t
+#define _RB_RULESUFFIX_(suffix, fn, cmpsuffix, rulesuffix)	rulesuffix
+
+/* two rules in one list leave no macro to expand to */
+#define _RB_RULE()					RB_RULE
+#define _RB_RULE_WAVL()					RB_RULE_WAVL
+#define _RB_RULE_AVL()					RB_RULE_AVL
+#define _RB_RULE_REDBLACK()				RB_RULE_RB
+
+#define _RB_HEAD_FEATURE(type, f)			_RB_CAT(_RB_HEAD_FIELDS, _RB_SUFFIX(_RB_FEATURE(f)))(type)
+#define _RB_ENTRY_FEATURE(type, f)			_RB_CAT(_RB_ENTRY_FIELDS, _RB_SUFFIX(_RB_FEATURE(f)))(type)
+
+#define _RB_HEAD_FIELDS_NONE(type)
+#define _RB_ENTRY_FIELDS_NONE(type)
+
+/*
+ * RB_MINMAX caches the leftmost and rightmost nodes in the head, so that
+ * RB_MIN/RB_MAX are O(1) and RB_POP_MIN/RB_POP_MAX can remove them without
+ * doing any comparisons.
+ */
+#define _RB_HEAD_FIELDS_MINMAX(type)			\
+	struct type	*minmax[2];
+#define _RB_ENTRY_FIELDS_MINMAX(type)
+
+/*
+ * RB_HOT(hashfn) puts a small direct-mapped cache in front of RB_FIND.
+ * Slots are indexed by hashfn of the key, and hold the node last found
+ * with that hash. Removing a node clears its slot, and the hit and miss
+ * counts are kept in the head. RB_FIND writes to the slots and the counts,
+ * so unlike on other trees concurrent lookups race with each other, and
+ * RB_FIND on an RB_HOT tree has to be serialized like an update.
+ */
+#define _RB_HEAD_FIELDS_HOT(type)			\
+	struct type	*hot[RB_HOT_SIZE];		\
+	unsigned long	 hot_hits;			\
+	unsigned long	 hot_misses;
+#define _RB_ENTRY_FIELDS_HOT(type)
+
+#define RB_HOT_HITS(head)				(head)->hot_hits
+#define RB_HOT_MISSES(head)				(head)->hot_misses
+
+/*
+ * RB_BLOOM(hashfn) keeps a counting Bloom filter of the keys in the tree,
+ * so that RB_FIND can return misses without descending. The cells are
+ * 8 bit counters provided by the caller with RB_BLOOM_INIT, which takes
+ * the expected number of keys and the number of cells per key; more
+ * cells per key give fewer false positives. A counter that overflows
+ * stays saturated. Until RB_BLOOM_INIT is called the filter is unused.
+ */
+#define _RB_HEAD_FIELDS_BLOOM(type)			\
+	uint8_t		*bloom;				\
+	size_t		 bloom_size;			\
+	unsigned int	 bloom_k;
+#define _RB_ENTRY_FIELDS_BLOOM(type)
+
+/* bytes of cells needed by RB_BLOOM_INIT */
+#define RB_BLOOM_SIZE(nkeys, bits_per_key)		((size_t)(nkeys) * (bits_per_key))
+
+/*
+ * RB_LOG(logfn) passes every insert and remove to logfn, as
+ * logfn(log, RB_LOG_INSERT or RB_LOG_REMOVE, elm), and RB_DESTROY as
+ * logfn(log, RB_LOG_CLEAR, NULL), while a log is set with RB_SET_LOG. logfn
+ * runs before the tree changes and returns 0, anything else leaves the tree
+ * as it was: the insert returns elm, the remove NULL and RB_DESTROY -1. The
+ * log is opaque to the tree, rblog.h has a write-ahead log with group
+ * commit that fits. RB_REPLAY applies a logged insert or remove without
+ * logging it again, and inserts the next node right after the last one it
+ * inserted when the keys allow; a clear is replayed by RB_DESTROY while no
+ * log is set. RB_DESERIALIZE and RB_CLONE do not log the nodes they link.
+ */
+#define _RB_HEAD_FIELDS_LOG(type)			\
+	void		*log;				\
+	struct type	*hint;
+#define _RB_ENTRY_FIELDS_LOG(type)
+
+/*
+ * RB_RELAXED defers the rebalancing of inserts. A node linked as a leaf
+ * where the insert would have to rebalance is marked with a pattern of
+ * rank bits no leaf has under any rule and queued in the head, and the
+ * insert returns. Such a node counts as a null link to the rank rule, so
+ * the rest of the tree stays balanced, and lookups and iteration see it as
+ * usual. RB_REBALANCE(name, head, budget) finishes up to budget of these
+ * inserts and returns how many are left, RB_PENDING(head) is their number.
+ * Once RB_RELAXED_SIZE are queued inserts rebalance right away again, and
+ * RB_INSERT_TOPDOWN and RB_REMOVE_TOPDOWN finish them all first. A removal
+ * that unlinks a queued node, or moves one up, needs no rebalancing at all,
+ * the other removals rebalance right away. RB_RANK fails while inserts are
+ * queued. Like the other updates RB_REBALANCE needs the caller to serialize
+ * it with every other use of the tree.
+ *
+ * This moves work, it does not save any. The descent costs an insert about
+ * as much as the rotations it defers, and RB_REBALANCE repeats the path up
+ * from the parent, from the root in the small layout. It only pays where
+ * the rotations and augment updates have to be kept out of a burst of
+ * inserts, for a budget of RB_REBALANCE later. The queue is a fixed array
+ * of RB_RELAXED_SIZE in the head, which does not grow: inserts below a
+ * queued node and removals of one search it, so a larger one costs more,
+ * and once it is full inserts are eager. Removals are never deferred.
+ */
+#define _RB_HEAD_FIELDS_RELAXED(type)			\
+	struct type	*pending[RB_RELAXED_SIZE];	\
+	size_t		 npending;
+#define _RB_ENTRY_FIELDS_RELAXED(type)
+
+#define RB_PENDING(head)				(head)->npending
+
+#define RB_ENTRY_SMALL_EXT(type, ...)			\
+struct {						\
+	/* left, right */				\
+	struct type	*child[2];			\
+	_RB_EACH(_RB_ENTRY_FEATURE, type, __VA_ARGS__)	\
+}
+
+#define RB_ENTRY_LARGE_EXT(type, ...)			\
+struct {						\
+	/* left, right, parent */			\
+	struct type	*child[3];			\
+	_RB_EACH(_RB_ENTRY_FEATURE, type, __VA_ARGS__)	\
+}
+
+#define RB_HEAD_SMALL_EXT(name, type, ...)		\
+struct name {						\
+	_RB_HEAD_STACK(type)				\
+	struct type	*root;				\
+	_RB_HEAD_TOP					\
+	_RB_EACH(_RB_HEAD_FEATURE, type, __VA_ARGS__)	\
+}
+
+#define RB_HEAD_LARGE_EXT(name, type, ...)		\
+struct name {						\
+	struct type	*root;				\
+	_RB_EACH(_RB_HEAD_FEATURE, type, __VA_ARGS__)	\
+}
+
+#define RB_LOG_INSERT					1
+#define RB_LOG_REMOVE					2
+#define RB_LOG_CLEAR					3
+
+#define RB_SET_LOG(head, lg)		do {		\
+(head)->log = (lg);					\
+} while (0)
+
+/*
+ * Hooks called by the generators for each feature of a tree, in the order
+ * the features are listed:
+ * INIT when the first node is inserted, INSERT when a node is linked below
+ * parent, REMOVE before a node is unlinked, EDGE gives the cached extreme
+ * node if any, LOOKUP runs before the RB_FIND descent and FOUND when the
+ * descent finds the node. KEY runs on the key before every descent.
+ * MOVED runs after RB_COMPACT has moved every node to a new address.
+ * FREEZE runs for every node stored by RB_FREEZE at position k and
+ * FROZEN_STEP may move a snapshot search from position k to a child itself
+ * and then returns true.
+ * DEFER may link a new leaf itself and then returns true, DEFERRED tells a
+ * leaf waiting for it, SETTLED takes such a leaf off the queue as a leaf of
+ * rank black and FLUSH finishes every deferred insert. REJECT is true for a
+ * node the tree cannot link, which is then handed back by the insert. VETO
+ * runs right before an update links or unlinks a node, with op
+ * RB_LOG_INSERT or RB_LOG_REMOVE, or before RB_DESTROY with RB_LOG_CLEAR and
+ * no node, and stops the update when it is true.
+ * Of all features EDGE gives the first node found, and DEFER, DEFERRED,
+ * REJECT, VETO and FROZEN_STEP stop at the first that returns true.
+ */
+#define _RB_EXT(hook, ext, ...)		do {					\
+	_RB_EXT_EACH(_RB_EXT_STMT, _RB_EXT_##hook, (__VA_ARGS__), _RB_LIST ext)	\
+} while (0)
+#define _RB_EXT_STMT(h, args, e)			h##e args;
+
+#define _RB_EXT_FIRST(hook, ext, ...)					\
+	(_RB_EXT_EACH(_RB_EXT_ELSE, _RB_EXT_##hook, (__VA_ARGS__), _RB_LIST ext) NULL)
+#define _RB_EXT_ELSE(h, args, e)			(h##e args) != NULL ? (h##e args) :
+
+#define _RB_EXT_ANY(hook, ext, ...)					\
+	(_RB_EXT_EACH(_RB_EXT_OR, _RB_EXT_##hook, (__VA_ARGS__), _RB_LIST ext) 0)
+#define _RB_EXT_OR(h, args, e)				(h##e args) ||
+
+/* true when an insert has to hand elm back instead of linking it */
+#define _RB_EXT_REFUSED(name, head, elm, ext)				\
+	(_RB_EXT_ANY(REJECT, ext, head, elm) ||				\
+	    _RB_EXT_ANY(VETO, ext, name, head, RB_LOG_INSERT, elm))
+
+/* the hooks are called from the generators, which _RB_EACH may be expanding */
+#define _RB_EXT_EACH(m, h, a, ...)			_RB_CAT(_RB_EXT_EACH_, _RB_NARG(__VA_ARGS__))(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_1(m, h, a, e)			m(h, a, e)
+#define _RB_EXT_EACH_2(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_1(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_3(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_2(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_4(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_3(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_5(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_4(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_6(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_5(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_7(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_6(m, h, a, __VA_ARGS__)
+#define _RB_EXT_EACH_8(m, h, a, e, ...)			m(h, a, e) _RB_EXT_EACH_7(m, h, a, __VA_ARGS__)
+#define _RB_EXT_INIT_NONE(name, head, elm)		do {} while (0)
+#define _RB_EXT_INSERT_NONE(name, head, parent, dir, elm)	do {} while (0)
+#define _RB_EXT_REMOVE_NONE(name, head, elm, opar, field)	do {} while (0)
+#define _RB_EXT_EDGE_NONE(head, dir)			NULL
+#define _RB_EXT_LOOKUP_NONE(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_NONE(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_NONE(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_NONE(fz, k, elm, field)		do {} while (0)
+#define _RB_EXT_FROZEN_STEP_NONE(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_MOVED_NONE(name, head, field)		do {} while (0)
+#define _RB_EXT_DEFER_NONE(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_NONE(head, elm)		0
+#define _RB_EXT_VETO_NONE(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_NONE(elm, field)		0
+#define _RB_EXT_SETTLED_NONE(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_NONE(name, head)			do {} while (0)
+
+/* the cache is only read while the tree is non-empty, so RB_INIT need not clear it */
+#define _RB_EXT_INIT_MINMAX(name, head, elm)		do {	\
+_RB_STORE_SLOT((head)->minmax[_RB_LDIR], elm);		\
+_RB_STORE_SLOT((head)->minmax[_RB_RDIR], elm);		\
+} while (0)
+
+/* rotations keep the order, only a new child of an extreme node can replace it */
+#define _RB_EXT_INSERT_MINMAX(name, head, parent, dir, elm)	do {	\
+if (_RB_LOAD_SLOT((head)->minmax[dir]) == (parent))		\
+	_RB_STORE_SLOT((head)->minmax[dir], elm);		\
+} while (0)
+
+/* the neighbour of an extreme node is in its inner subtree, or it is the parent */
+#define _RB_EXT_REMOVE_EXTREME(head, elm, opar, dir, field) do {		\
+__typeof(elm) tmp_ex = _RB_PTR(_RB_GET_CHILD(elm, _RB_ODIR(dir), field));	\
+if (tmp_ex == NULL)								\
+	tmp_ex = (opar);							\
+else										\
+	while (_RB_PTR(_RB_GET_CHILD(tmp_ex, dir, field)) != NULL)		\
+		tmp_ex = _RB_PTR(_RB_GET_CHILD(tmp_ex, dir, field));		\
+_RB_STORE_SLOT((head)->minmax[dir], tmp_ex);						\
+} while (0)
+
+#define _RB_EXT_EDGE_MINMAX(head, dir)			_RB_LOAD_SLOT((head)->minmax[dir])
+
+#define _RB_EXT_REMOVE_MINMAX(name, head, elm, opar, field)	do {	\
+if (_RB_LOAD_SLOT((head)->minmax[_RB_LDIR]) == (elm))			\
+	_RB_EXT_REMOVE_EXTREME(head, elm, opar, _RB_LDIR, field);	\
+if (_RB_LOAD_SLOT((head)->minmax[_RB_RDIR]) == (elm))			\
+	_RB_EXT_REMOVE_EXTREME(head, elm, opar, _RB_RDIR, field);	\
+} while (0)
+
+#define _RB_EXT_LOOKUP_MINMAX(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_MINMAX(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_MINMAX(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_MINMAX(fz, k, elm, field)		do {} while (0)
+#define _RB_EXT_FROZEN_STEP_MINMAX(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_DEFER_MINMAX(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_MINMAX(head, elm)	0
+#define _RB_EXT_VETO_MINMAX(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_MINMAX(elm, field)		0
+#define _RB_EXT_SETTLED_MINMAX(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_MINMAX(name, head)			do {} while (0)
+
+/* RB_COMPACT only calls this on a non-empty tree */
+#define _RB_EXT_MOVED_MINMAX(name, head, field)	do {		\
+__typeof(RB_ROOT(head)) tmp_mv;					\
+uintptr_t tmp_dir;						\
+for (tmp_dir = _RB_LDIR; tmp_dir <= _RB_RDIR; tmp_dir++) {	\
+	tmp_mv = RB_ROOT(head);					\
+	while (_RB_PTR(_RB_GET_CHILD(tmp_mv, tmp_dir, field)) != NULL)	\
+		tmp_mv = _RB_PTR(_RB_GET_CHILD(tmp_mv, tmp_dir, field));	\
+	_RB_STORE_SLOT((head)->minmax[tmp_dir], tmp_mv);	\
+}								\
+} while (0)
+
+#define _RB_HOT_SLOT(name, elm)				(name##_RB_HOTHASH(elm) & (RB_HOT_SIZE - 1))
+
+#define _RB_EXT_INIT_HOT(name, head, elm)		do {} while (0)
+#define _RB_EXT_INSERT_HOT(name, head, parent, dir, elm)	do {} while (0)
+#define _RB_EXT_EDGE_HOT(head, dir)			NULL
+
+/* the low bit of a slot marks a node that was hit since it was cached */
+#define _RB_EXT_REMOVE_HOT(name, head, elm, opar, field)	do {	\
+__typeof(elm) *tmp_slot = &(head)->hot[_RB_HOT_SLOT(name, elm)];	\
+if (_RB_PTR(_RB_LOAD_SLOT(*tmp_slot)) == (elm))				\
+	_RB_STORE_SLOT(*tmp_slot, NULL);				\
+} while (0)
+
+/* cached nodes are always in the tree, so one comparison confirms a hit */
+#define _RB_EXT_LOOKUP_HOT(name, head, elm, cmp)	do {		\
+__typeof(elm) *tmp_slot = &(head)->hot[_RB_HOT_SLOT(name, elm)];	\
+__typeof(elm) tmp_hot = _RB_PTR(_RB_LOAD_SLOT(*tmp_slot));		\
+if (tmp_hot != NULL && cmp(elm, tmp_hot) == 0) {			\
+	_RB_STORE_SLOT(*tmp_slot, (__typeof(elm))((uintptr_t)tmp_hot | 1U));	\
+	(head)->hot_hits++;						\
+	return (tmp_hot);						\
+}									\
+(head)->hot_misses++;							\
+} while (0)
+
+/* a node that was hit gets a second chance before it is replaced */
+#define _RB_EXT_FOUND_HOT(name, head, elm)		do {		\
+__typeof(elm) *tmp_slot = &(head)->hot[_RB_HOT_SLOT(name, elm)];	\
+if ((uintptr_t)_RB_LOAD_SLOT(*tmp_slot) & 1U)				\
+	_RB_STORE_SLOT(*tmp_slot, _RB_PTR(_RB_LOAD_SLOT(*tmp_slot)));	\
+else									\
+	_RB_STORE_SLOT(*tmp_slot, elm);					\
+} while (0)
+#define _RB_EXT_KEY_HOT(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_HOT(fz, k, elm, field)		do {} while (0)
+#define _RB_EXT_FROZEN_STEP_HOT(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_DEFER_HOT(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_HOT(head, elm)		0
+#define _RB_EXT_VETO_HOT(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_HOT(elm, field)		0
+#define _RB_EXT_SETTLED_HOT(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_HOT(name, head)			do {} while (0)
+
+/* the slots point at the old addresses */
+#define _RB_EXT_MOVED_HOT(name, head, field)	do {		\
+int tmp_i;							\
+for (tmp_i = 0; tmp_i < RB_HOT_SIZE; tmp_i++)			\
+	_RB_STORE_SLOT((head)->hot[tmp_i], NULL);		\
+} while (0)
+
+#define _RB_EXT_INIT_BLOOM(name, head, elm)		do {	\
+name##_RB_BLOOM_UPDATE(head, elm, 1);			\
+} while (0)
+
+#define _RB_EXT_INSERT_BLOOM(name, head, parent, dir, elm)	do {	\
+name##_RB_BLOOM_UPDATE(head, elm, 1);				\
+} while (0)
+
+#define _RB_EXT_REMOVE_BLOOM(name, head, elm, opar, field)	do {	\
+name##_RB_BLOOM_UPDATE(head, elm, -1);				\
+} while (0)
+
+#define _RB_EXT_EDGE_BLOOM(head, dir)			NULL
+
+#define _RB_EXT_LOOKUP_BLOOM(name, head, elm, cmp)	do {	\
+if (!name##_RB_BLOOM_MAYBE(head, elm))			\
+	return (NULL);					\
+} while (0)
+
+#define _RB_EXT_FOUND_BLOOM(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_BLOOM(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_BLOOM(fz, k, elm, field)		do {} while (0)
+#define _RB_EXT_FROZEN_STEP_BLOOM(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_MOVED_BLOOM(name, head, field)		do {} while (0)
+#define _RB_EXT_DEFER_BLOOM(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_BLOOM(head, elm)		0
+#define _RB_EXT_VETO_BLOOM(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_BLOOM(elm, field)		0
+#define _RB_EXT_SETTLED_BLOOM(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_BLOOM(name, head)			do {} while (0)
+
+/*
+ * RB_PREFIX(prefixfn) keeps a normalized prefix of the key in every entry,
+ * given by prefixfn, which must order keys the same way as cmp does
+ * whenever their prefixes differ. The descent then compares the prefixes
+ * stored in the nodes and only calls cmp, and so only touches the key
+ * memory of a node, when they are equal. The prefix of the search key is
+ * written to its own entry before every descent.
+ */
+#define _RB_HEAD_FIELDS_PREFIX(type)
+#define _RB_ENTRY_FIELDS_PREFIX(type)			\
+	uint64_t	 prefix;
+
+#define _RB_EXT_INIT_PREFIX(name, head, elm)		do {} while (0)
+#define _RB_EXT_INSERT_PREFIX(name, head, parent, dir, elm)	do {} while (0)
+#define _RB_EXT_REMOVE_PREFIX(name, head, elm, opar, field)	do {} while (0)
+#define _RB_EXT_EDGE_PREFIX(head, dir)			NULL
+#define _RB_EXT_LOOKUP_PREFIX(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_PREFIX(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_PREFIX(name, elm)			name##_RB_PREFIX_KEY(elm)
+#define _RB_EXT_MOVED_PREFIX(name, head, field)		do {} while (0)
+#define _RB_EXT_DEFER_PREFIX(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_PREFIX(head, elm)	0
+#define _RB_EXT_VETO_PREFIX(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_PREFIX(elm, field)		0
+#define _RB_EXT_SETTLED_PREFIX(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_PREFIX(name, head)			do {} while (0)
+
+#define _RB_EXT_FREEZE_PREFIX(fz, k, elm, field)	do {		\
+if ((fz)->prefix != NULL)					\
+	(fz)->prefix[(k) - 1] = (elm)->field.prefix;		\
+} while (0)
+
+/* while the prefixes differ the step only reads the arrays, so it need not branch */
+#define _RB_EXT_FROZEN_STEP_PREFIX(fz, k, elm, cmp, field, dir)		\
+((fz)->prefix != NULL &&						\
+    ((k) = 2 * (k) + (((elm)->field.prefix == (fz)->prefix[(k) - 1] ?	\
+    cmp(elm, (__typeof(elm))(fz)->node[(k) - 1]) :			\
+    (elm)->field.prefix < (fz)->prefix[(k) - 1] ? -1 : 1) >= (dir)), 1))
+
+/*
+ * RB_BIASED keeps a weight in every entry, an access count bumped with
+ * RB_TOUCH or any value set with RB_SET_WEIGHT, and RB_REBIAS(name, head)
+ * relinks the tree so that heavy nodes sit near the root. Every subtree is
+ * split at the node that holds the middle of its weight, as far as the rank
+ * rule allows, so a node of weight w out of W ends up about log(W/w) deep
+ * while the height keeps the bound of the rule. The rule can still hold a
+ * heavy node near the ends of the key range down to about half the height
+ * of the tree, where a short path leaves no room. Each node weighs one more
+ * than its weight, so nodes never touched still count, and the weights must
+ * not add up past UINT64_MAX. The rank bits are set to fit, so updates carry
+ * on as usual but place new nodes by key alone: call RB_REBIAS again once
+ * the tree or the weights have drifted. It takes O(n log n) and allocates
+ * nothing, and an RB_RELAXED tree finishes its queued inserts first.
+ * Lookups leave the weights alone.
+ */
+#define _RB_HEAD_FIELDS_BIASED(type)
+#define _RB_ENTRY_FIELDS_BIASED(type)			\
+	uint64_t	 weight;
+
+#define RB_WEIGHT(elm, field)				(elm)->field.weight
+
+#define RB_TOUCH(elm, field)		do {		\
+(elm)->field.weight++;					\
+} while (0)
+
+#define RB_SET_WEIGHT(elm, field, w)	do {		\
+(elm)->field.weight = (w);				\
+} while (0)
+
+#define _RB_EXT_INIT_BIASED(name, head, elm)		do {} while (0)
+#define _RB_EXT_INSERT_BIASED(name, head, parent, dir, elm)	do {} while (0)
+#define _RB_EXT_REMOVE_BIASED(name, head, elm, opar, field)	do {} while (0)
+#define _RB_EXT_EDGE_BIASED(head, dir)			NULL
+#define _RB_EXT_LOOKUP_BIASED(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_BIASED(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_BIASED(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_BIASED(fz, k, elm, field)	do {} while (0)
+#define _RB_EXT_FROZEN_STEP_BIASED(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_MOVED_BIASED(name, head, field)		do {} while (0)
+#define _RB_EXT_DEFER_BIASED(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_BIASED(head, elm)	0
+#define _RB_EXT_VETO_BIASED(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_BIASED(elm, field)		0
+#define _RB_EXT_SETTLED_BIASED(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_BIASED(name, head)			do {} while (0)
+
+/*
+ * RB_INDEX is the feature of the index trees of RB_HEAD_INDEX, whose head
+ * holds the base of the node array. It keeps no fields of its own and only
+ * refuses to link a node that is not within RB_INDEX_MAX nodes of the base.
+ */
+#define _RB_HEAD_FIELDS_INDEX(type)
+#define _RB_ENTRY_FIELDS_INDEX(type)
+
+#define _RB_EXT_INIT_INDEX(name, head, elm)		do {} while (0)
+#define _RB_EXT_INSERT_INDEX(name, head, parent, dir, elm)	do {} while (0)
+#define _RB_EXT_REMOVE_INDEX(name, head, elm, opar, field)	do {} while (0)
+#define _RB_EXT_EDGE_INDEX(head, dir)			NULL
+#define _RB_EXT_LOOKUP_INDEX(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_INDEX(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_INDEX(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_INDEX(fz, k, elm, field)		do {} while (0)
+#define _RB_EXT_FROZEN_STEP_INDEX(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_MOVED_INDEX(name, head, field)		do {} while (0)
+#define _RB_EXT_DEFER_INDEX(name, head, parent, dir, elm)	0
+#define _RB_EXT_DEFERRED_INDEX(elm, field)		0
+#define _RB_EXT_VETO_INDEX(name, head, op, elm)	0
+#define _RB_EXT_SETTLED_INDEX(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_INDEX(name, head)			do {} while (0)
+
+/* positions below the base wrap around to large ones */
+#define _RB_EXT_REJECT_INDEX(head, elm)				\
+(((uintptr_t)(elm) - (uintptr_t)_RB_LOAD_SLOT((head)->base)) / sizeof(*(elm)) >= RB_INDEX_MAX)
+
+#define _RB_EXT_INIT_LOG(name, head, elm)		do {} while (0)
+#define _RB_EXT_INSERT_LOG(name, head, parent, dir, elm)	do {} while (0)
+
+#define _RB_EXT_REMOVE_LOG(name, head, elm, opar, field) do {	\
+if (_RB_LOAD_SLOT((head)->hint) == (elm))			\
+	_RB_STORE_SLOT((head)->hint, NULL);			\
+} while (0)
+
+/* the record is written ahead of the change, which it can still stop */
+#define _RB_EXT_VETO_LOG(name, head, op, elm)		(name##_RB_LOG(head, op, elm) != 0)
+
+#define _RB_EXT_EDGE_LOG(head, dir)			NULL
+#define _RB_EXT_LOOKUP_LOG(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_LOG(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_LOG(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_LOG(fz, k, elm, field)		do {} while (0)
+#define _RB_EXT_FROZEN_STEP_LOG(fz, k, elm, cmp, field, dir)	0
+#define _RB_EXT_DEFER_LOG(name, head, parent, dir, elm)	0
+#define _RB_EXT_REJECT_LOG(head, elm)		0
+#define _RB_EXT_DEFERRED_LOG(elm, field)		0
+#define _RB_EXT_SETTLED_LOG(name, head, elm, black, field)	do {} while (0)
+#define _RB_EXT_FLUSH_LOG(name, head)			do {} while (0)
+#define _RB_EXT_MOVED_LOG(name, head, field)	do {		\
+_RB_STORE_SLOT((head)->hint, NULL);				\
+} while (0)
+
+/* a leaf with a 2 on the left and a 1 on the right, which no rule allows */
+#define _RB_DEFERRED(elm, field)				\
+((elm) != NULL && RB_LEFT(elm, field) == NULL && RB_RIGHT(elm, field) == NULL &&	\
+    _RB_GET_RDIFF(elm, _RB_LDIR, field) && !_RB_GET_RDIFF(elm, _RB_RDIR, field))
+
+#define _RB_EXT_INIT_RELAXED(name, head, elm)	do {		\
+(head)->npending = 0;						\
+} while (0)
+
+#define _RB_EXT_INSERT_RELAXED(name, head, parent, dir, elm)	do {} while (0)
+
+#define _RB_EXT_REMOVE_RELAXED(name, head, elm, opar, field)	do {	\
+if (_RB_DEFERRED(elm, field))					\
+	name##_RB_UNQUEUE(head, elm);				\
+} while (0)
+
+#define _RB_EXT_EDGE_RELAXED(head, dir)			NULL
+#define _RB_EXT_LOOKUP_RELAXED(name, head, elm, cmp)	do {} while (0)
+#define _RB_EXT_FOUND_RELAXED(name, head, elm)		do {} while (0)
+#define _RB_EXT_KEY_RELAXED(name, elm)			do {} while (0)
+#define _RB_EXT_FREEZE_RELAXED(fz, k, elm, field)	do {} while (0)
+#define _RB_EXT_FROZEN_STEP_RELAXED(fz, k, elm, cmp, field, dir)	0
+
+/* the queue points at the old addresses */
+#define _RB_EXT_MOVED_RELAXED(name, head, field)	do {	\
+(head)->npending = 0;						\
+name##_RB_REQUEUE(head, RB_ROOT(head));				\
+} while (0)
+
+#define _RB_EXT_DEFER_RELAXED(name, head, parent, dir, elm)	name##_RB_DEFER(head, parent, dir, elm)
+#define _RB_EXT_REJECT_RELAXED(head, elm)	0
+#define _RB_EXT_VETO_RELAXED(name, head, op, elm)	0
+#define _RB_EXT_DEFERRED_RELAXED(elm, field)		_RB_DEFERRED(elm, field)
+
+#define _RB_EXT_SETTLED_RELAXED(name, head, elm, black, field)	do {	\
+name##_RB_UNQUEUE(head, elm);					\
+if (black)							\
+	_RB_SET_RDIFF1(elm, _RB_RDIR, field);			\
+else								\
+	_RB_SET_RDIFF0(elm, _RB_LDIR, field);			\
+} while (0)
+
+#define _RB_EXT_FLUSH_RELAXED(name, head)	do {		\
+(void)name##_RB_RESUME(head, (head)->npending);			\
+} while (0)
+
+/* only the large and threaded layouts can start the descent at the hint */
+#ifndef RB_THREADED
+#define _RB_LOG_INSERT_SMALL(name, head, elm, cmp, res) do {	\
+(res) = name##_RB_INSERT(head, elm);				\
+} while (0)
+#else
+#define _RB_LOG_INSERT_SMALL(name, head, elm, cmp, res)		\
+	_RB_LOG_INSERT_LARGE(name, head, elm, cmp, res)
+#endif
+
+#define _RB_LOG_INSERT_LARGE(name, head, elm, cmp, res) do {	\
+__typeof(elm) tmp_hint = _RB_LOAD_SLOT((head)->hint), tmp_next;	\
+if (tmp_hint != NULL && cmp(tmp_hint, elm) < 0 &&		\
+	((tmp_next = name##_RB_NEXT(tmp_hint)) == NULL || cmp(elm, tmp_next) < 0))	\
+	(res) = name##_RB_INSERT_NEXT(head, tmp_hint, elm);	\
+else								\
+	(res) = name##_RB_INSERT(head, elm);			\
+} while (0)
 
+#ifdef RB_SMALL
+#define RB_ENTRY(type)					RB_ENTRY_SMALL(type)
+#define RB_ENTRY_EXT(type, ...)				RB_ENTRY_SMALL_EXT(type, __VA_ARGS__)
+#define RB_HEAD(name, type)				RB_HEAD_SMALL(name, type)
+#define RB_HEAD_EXT(name, type, ...)			RB_HEAD_SMALL_EXT(name, type, __VA_ARGS__)
+#else
+#define RB_ENTRY(type)					RB_ENTRY_LARGE(type)
+#define RB_ENTRY_EXT(type, ...)				RB_ENTRY_LARGE_EXT(type, __VA_ARGS__)
+#define RB_HEAD(name, type)				RB_HEAD_LARGE(name, type)
+#define RB_HEAD_EXT(name, type, ...)			RB_HEAD_LARGE_EXT(name, type, __VA_ARGS__)
 #endif
 
-#define RB_INIT(head)			do {	\
-(head)->root = NULL;				\
-_RB_STACK_CLEAR(head);				\
+/* a snapshot taken with RB_FREEZE, see there */
+struct rb_frozen {
+	void		**node;
+	uint64_t	 *prefix;	/* only filled by RB_PREFIX trees, may be NULL */
+	size_t		 n;
+	size_t		 size;
+};
+
+/*
+ * the key is behind a node pointer, so a real branch lets the cpu run ahead
+ * into the likely child. the empty asm keeps it from becoming a cmov.
+ */
+#define _RB_FROZEN_STEP(fz, k, elm, cmp, dir)		do {	\
+if (cmp(elm, (__typeof(elm))(fz)->node[(k) - 1]) >= (dir)) {	\
+	(k) = 2 * (k) + 1;					\
+	__asm__ __volatile__("");				\
+} else								\
+	(k) = 2 * (k);						\
+} while (0)
+
+#define RB_FROZEN_INIT(fz, nodes, prefixes, sz)	do {	\
+(fz)->node = (void **)(nodes);				\
+(fz)->prefix = (prefixes);				\
+(fz)->n = 0;						\
+(fz)->size = (sz);					\
+} while (0)
+
+/*
+ * these clear the head from the root on, so they work for every layout and
+ * feature. the path stack of the small layout is written before it is read
+ * and is left alone, which saves RB_INIT clearing RB_MAX_HEIGHT pointers.
+ */
+#define RB_INITIALIZER(head)				\
+{ .root = NULL }
+
+#define RB_INIT(head)			do {				\
+__builtin_memset(&(head)->root, 0,					\
+    sizeof(*(head)) - offsetof(__typeof(*(head)), root));		\
 } while (0)
 
 /*
  * element macros
+ *
+ * With RB_RELATIVE defined every link is stored as the byte offset of the
+ * target node from the entry holding the link, and the root as the offset
+ * from the root field of the head. The rank difference bits stay in the low
+ * bits of the offset and an offset of zero is NULL. A tree that has its head
+ * and nodes in one mapping can then be used at any address without fix-ups.
+ * The pointers the features keep in the head, to nodes or to the cells of
+ * RB_BLOOM, are stored the same way, from their own field. Only the log of
+ * RB_LOG stays absolute, as it is outside the tree. The relative base of an
+ * index tree cannot be set by RB_INDEX_INITIALIZER, use RB_INDEX_INIT.
+ *
+ * The entries of index trees, see RB_ENTRY_INDEX, hold 32 bit links in
+ * either case: the distance in nodes from the entry to the target, shifted
+ * past the tag bits. The accessors pick the encoding by the type of the link.
  */
-#define _RB_GET_CHILD(elm, dir, field)			(elm)->field.child[dir]
+#define RB_INDEX_MAX					((size_t)1 << 29)
+
+#define _RB_IDX(elm, field)					\
+__builtin_types_compatible_p(__typeof((elm)->field.child[0]), uint32_t)
+#define _RB_IDX_DIST(link)				((int32_t)(uint32_t)(uintptr_t)(link) >> 2)
+#define _RB_IDX_DECODE(elm, link)				\
+(_RB_IDX_DIST(link) == 0 ? (uintptr_t)(link) & _RB_LOWMASK :		\
+    (uintptr_t)((elm) + _RB_IDX_DIST(link)) | ((uintptr_t)(link) & _RB_LOWMASK))
+#define _RB_IDX_ENCODE(elm, ptr)				\
+(((uintptr_t)(ptr) & ~_RB_LOWMASK) == 0 ? (uintptr_t)(ptr) :		\
+    (uintptr_t)(uint32_t)((__typeof(elm))((uintptr_t)(ptr) & ~_RB_LOWMASK) - (elm)) << 2 |	\
+    ((uintptr_t)(ptr) & _RB_LOWMASK))
+
+#ifndef RB_RELATIVE
+#define _RB_GET_CHILD(elm, dir, field)				\
+((__typeof(elm))(_RB_IDX(elm, field) ?				\
+    _RB_IDX_DECODE(elm, (elm)->field.child[dir]) : (uintptr_t)(elm)->field.child[dir]))
 #define _RB_SET_CHILD(elm, dir, celm, field)		do {	\
-_RB_GET_CHILD(elm, dir, field) = (celm);			\
+(elm)->field.child[dir] = (__typeof((elm)->field.child[dir]))(_RB_IDX(elm, field) ?	\
+    _RB_IDX_ENCODE(elm, celm) : (uintptr_t)(celm));		\
 } while (0)
+
+#define _RB_LOAD_SLOT(slot)				(slot)
+#define _RB_STORE_SLOT(slot, elm)			do {	\
+(slot) = (elm);							\
+} while (0)
+#else
+/* offsets are taken modulo the pointer size, the tag bits pass through */
+#define _RB_REL_DECODE(base, link)				\
+(((uintptr_t)(link) & ~_RB_LOWMASK) == 0 ? (uintptr_t)(link) :		\
+    (uintptr_t)(link) + (uintptr_t)(base))
+#define _RB_REL_ENCODE(base, ptr)				\
+(((uintptr_t)(ptr) & ~_RB_LOWMASK) == 0 ? (uintptr_t)(ptr) :		\
+    (uintptr_t)(ptr) - (uintptr_t)(base))
+
+#define _RB_GET_CHILD(elm, dir, field)				\
+((__typeof(elm))(_RB_IDX(elm, field) ?				\
+    _RB_IDX_DECODE(elm, (elm)->field.child[dir]) :		\
+    _RB_REL_DECODE(&(elm)->field, (elm)->field.child[dir])))
+#define _RB_SET_CHILD(elm, dir, celm, field)		do {	\
+(elm)->field.child[dir] = (__typeof((elm)->field.child[dir]))(_RB_IDX(elm, field) ?	\
+    _RB_IDX_ENCODE(elm, celm) : _RB_REL_ENCODE(&(elm)->field, celm));	\
+} while (0)
+
+/* the root and the pointers of the features are relative to their own field */
+#define _RB_LOAD_SLOT(slot)					\
+((__typeof(slot))_RB_REL_DECODE(&(slot), slot))
+#define _RB_STORE_SLOT(slot, elm)			do {	\
+(slot) = (__typeof(slot))_RB_REL_ENCODE(&(slot), elm);	\
+} while (0)
+#endif
+
+#define RB_ROOT(head)					_RB_LOAD_SLOT((head)->root)
+#define _RB_SET_ROOT(head, elm)				_RB_STORE_SLOT((head)->root, elm)
+
 #define _RB_REPLACE_CHILD(elm, dir, oelm, nelm, field)	do {	\
-_RB_GET_CHILD(elm, dir, field) = (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm, dir, field)) ^ ((uintptr_t)oelm) ^ ((uintptr_t)nelm));	\
+_RB_SET_CHILD(elm, dir, (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm, dir, field)) ^ ((uintptr_t)oelm) ^ ((uintptr_t)nelm)), field);	\
 } while (0)
 #define _RB_SWAP_CHILD_OR_ROOT(head, elm, oelm, nelm, field)	do {	\
 if (elm == NULL)							\
-	RB_ROOT(head) = nelm;						\
+	_RB_SET_ROOT(head, nelm);					\
 else									\
 	_RB_REPLACE_CHILD(elm, (RB_LEFT(elm, field) == (oelm) ? _RB_LDIR : _RB_RDIR), oelm, nelm, field);	\
 } while (0)
 
-#define _RB_GET_RDIFF(elm, dir, field)			(((uintptr_t)_RB_GET_CHILD(elm, dir, field)) & 1U)
+/* every encoding stores the tag bits as they are, so these work on the raw link */
+#define _RB_GET_RDIFF(elm, dir, field)			(((uintptr_t)(elm)->field.child[dir]) & 1U)
 #define _RB_FLIP_RDIFF(elm, dir, field)			do {	\
-_RB_GET_CHILD(elm, dir, field) = (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm, dir, field)) ^ 1U);	\
+(elm)->field.child[dir] = (__typeof((elm)->field.child[dir]))(((uintptr_t)(elm)->field.child[dir]) ^ 1U);	\
 } while (0)
 #define _RB_SET_RDIFF0(elm, dir, field)			do {	\
-_RB_GET_CHILD(elm, dir, field) = (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm, dir, field)) & ~_RB_LOWMASK);	\
+(elm)->field.child[dir] = (__typeof((elm)->field.child[dir]))(((uintptr_t)(elm)->field.child[dir]) & ~(uintptr_t)1U);	\
 } while (0)
 #define _RB_SET_RDIFF1(elm, dir, field)			do {	\
-_RB_GET_CHILD(elm, dir, field) = (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm, dir, field)) | 1U);		\
+(elm)->field.child[dir] = (__typeof((elm)->field.child[dir]))(((uintptr_t)(elm)->field.child[dir]) | 1U);	\
 } while (0)
 
 
-#define RB_ROOT(head)					(head)->root
 #define RB_EMPTY(head)					(RB_ROOT(head) == NULL)
 #define RB_LEFT(elm, field)				_RB_PTR(_RB_GET_CHILD(elm, _RB_LDIR, field))
 #define RB_RIGHT(elm, field)				_RB_PTR(_RB_GET_CHILD(elm, _RB_RDIR, field))
 
 
 /*
- * RB_AUGMENT should only return true when the update changes the node data,
+ * The augment function of a tree is called on every node whose subtree changed,
+ * bottom up. It should only return true when the update changes the node data,
  * so that updating can be stopped short of the root when it returns false.
+ *
+ * Each tree can be given its own function with RB_GENERATE_AUGMENT, trees
+ * generated with RB_GENERATE use RB_AUGMENT if it is defined, and are not
+ * augmented at all otherwise.
  */
 #ifndef RB_AUGMENT
 #define _RB_AUGMENT(x)	(0)
@@ -223,11 +1137,14 @@ _RB_GET_CHILD(elm, dir, field) = (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm,
 #define _RB_AUGMENT(x)	(RB_AUGMENT(x))
 #endif
 
-#define _RB_AUGMENT_WALK(head, elm, field) do {				\
+/* aug is a constant for trees that are not augmented */
+#define _RB_AUGMENTED(aug, elm)		(!__builtin_constant_p(aug(elm)))
+
+#define _RB_AUGMENT_WALK(head, elm, field, lay, aug) do {				\
 	__typeof(elm) tmp_up = (elm);					\
-	while (tmp_up != NULL && _RB_AUGMENT(tmp_up)) {			\
-		_RB_GET_PARENT(tmp_up, tmp_up, field);			\
-		_RB_STACK_POP(head, tmp_up);				\
+	while (tmp_up != NULL && aug(tmp_up)) {			\
+		_RB_GET_PARENT##lay(tmp_up, tmp_up, field);			\
+		_RB_STACK_POP##lay(head, tmp_up);				\
 	}								\
 } while (0)
 
@@ -239,40 +1156,652 @@ _RB_GET_CHILD(elm, dir, field) = (__typeof(elm))(((uintptr_t)_RB_GET_CHILD(elm,
  *         / \        / \
  *      gc1   gc2    c1 gc1
  */
-#define _RB_ROTATE(elm, celm, dir, field) do {					\
+#define _RB_ROTATE(elm, celm, dir, field, lay) do {					\
 _RB_SET_CHILD(elm, _RB_ODIR(dir), _RB_GET_CHILD(celm, dir, field), field);	\
 if (_RB_PTR(_RB_GET_CHILD(elm, _RB_ODIR(dir), field)) != NULL)			\
-	_RB_SET_PARENT(_RB_PTR(_RB_GET_CHILD(elm, _RB_ODIR(dir), field)), elm, field);	\
+	_RB_SET_PARENT##lay(_RB_PTR(_RB_GET_CHILD(elm, _RB_ODIR(dir), field)), elm, field);	\
+else										\
+	_RB_SET_THREAD##lay(elm, _RB_ODIR(dir), celm, field);			\
 _RB_SET_CHILD(celm, dir, elm, field);						\
-_RB_SET_PARENT(elm, celm, field);						\
+_RB_SET_PARENT##lay(elm, celm, field);						\
 } while (0)
 
 
-/* returns -2 if the subtree is not rank balanced else returns the rank of the node */
-#define _RB_GENERATE_RANK(name, type, field, cmp, attr)				\
-attr int									\
-name##_RB_RANK(const struct type *elm)						\
-{										\
-	int lrank, rrank;							\
-	if (elm == NULL)							\
-		return (-1);							\
-	lrank =  name##_RB_RANK(RB_LEFT(elm, field));				\
-	if (lrank == -2)							\
-		return (-2);							\
-	rrank =  name##_RB_RANK(RB_RIGHT(elm, field));				\
-	if (rrank == -2)							\
-		return (-2);							\
-	lrank += (_RB_GET_RDIFF(elm, _RB_LDIR, field) == 1) ? 2 : 1;		\
-	rrank += (_RB_GET_RDIFF(elm, _RB_RDIR, field) == 1) ? 2 : 1;		\
-	if (lrank != rrank)							\
-		return (-2);							\
-	return (lrank);								\
+/*
+ * RB_SERIALIZE calls enc on every node in order and stops at the first
+ * non-zero return, which it passes back. RB_DESERIALIZE takes the n nodes
+ * of such a dump back from dec, in the same order, and links them into an
+ * empty tree in O(n), without comparisons or rebalancing. The rank of
+ * each node is its height, the left subtree is never deeper than the right
+ * one. Under the red-black rule a node is red when its subtree is perfect
+ * and one level deeper than its black height asks for, and black otherwise.
+ * n has to be kept by the caller, for example in a header of the
+ * dump. It returns -1 and leaves the tree empty if dec returns NULL or a
+ * node the tree cannot link, or if the tree was not empty. The features
+ * only see the nodes once all of them are linked, in order, so a failed
+ * load leaves nothing behind in their fields or logs either.
+ */
+#define _RB_GENERATE_SERIALIZE(name, type, field, cmp, attr, lay, aug, ext)	\
+static int								\
+name##_RB_SAVE(struct type *elm, int (*enc)(struct type *, void *), void *arg)	\
+{									\
+	int error;							\
+									\
+	while (elm != NULL) {						\
+		error = name##_RB_SAVE(RB_LEFT(elm, field), enc, arg);	\
+		if (error != 0)						\
+			return (error);					\
+		error = enc(elm, arg);					\
+		if (error != 0)						\
+			return (error);					\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+	return (0);							\
+}									\
+									\
+attr int								\
+name##_RB_SERIALIZE(struct name *head, int (*enc)(struct type *, void *),	\
+	void *arg)							\
+{									\
+	return (name##_RB_SAVE(RB_ROOT(head), enc, arg));		\
+}									\
+									\
+/*									\
+ * links the next n nodes of the stream, *rank is -2 when dec failed. bh is	\
+ * the black height the red-black rule needs the subtree to have	\
+ */									\
+static struct type *							\
+name##_RB_LOAD(struct name *head, size_t n, struct type *(*dec)(void *),	\
+	void *arg, int bh, int *rank)					\
+{									\
+	struct type *elm, *left, *right;				\
+	int lrank, rrank, red;						\
+									\
+	*rank = -1;							\
+	if (n == 0)							\
+		return (NULL);						\
+	*rank = -2;							\
+	red = name##_RB_RULE == RB_RULE_RB && n == ((size_t)2 << bh) - 1;	\
+	left = name##_RB_LOAD(head, (n - 1) / 2, dec, arg,		\
+	    red ? bh : bh - 1, &lrank);					\
+	if (lrank == -2)						\
+		return (NULL);						\
+	elm = dec(arg);							\
+	if (elm == NULL || _RB_EXT_ANY(REJECT, ext, head, elm))		\
+		return (NULL);						\
+	_RB_EXT(KEY, ext, name, elm);					\
+	right = name##_RB_LOAD(head, n - 1 - (n - 1) / 2, dec, arg,	\
+	    red ? bh : bh - 1, &rrank);					\
+	if (rrank == -2)						\
+		return (NULL);						\
+	_RB_SET_CHILD(elm, _RB_LDIR, left, field);			\
+	_RB_SET_CHILD(elm, _RB_RDIR, right, field);			\
+	if (left != NULL)						\
+		_RB_SET_PARENT##lay(left, elm, field);			\
+	if (right != NULL)						\
+		_RB_SET_PARENT##lay(right, elm, field);			\
+	if (name##_RB_RULE == RB_RULE_RB)				\
+		*rank = red ? 2 * bh : 2 * bh - 1;			\
+	else								\
+		*rank = rrank + 1;					\
+	if (*rank - lrank == 2)						\
+		_RB_SET_RDIFF1(elm, _RB_LDIR, field);			\
+	if (*rank - rrank == 2)						\
+		_RB_SET_RDIFF1(elm, _RB_RDIR, field);			\
+	(void)aug(elm);							\
+	return (elm);							\
+}									\
+									\
+/* hands the loaded nodes to the features in order */			\
+static void								\
+name##_RB_LOADED(struct name *head, struct type *elm, struct type **prev)	\
+{									\
+	while (elm != NULL) {						\
+		name##_RB_LOADED(head, RB_LEFT(elm, field), prev);	\
+		if (*prev == NULL)					\
+			_RB_EXT(INIT, ext, name, head, elm);		\
+		else							\
+			_RB_EXT(INSERT, ext, name, head, *prev, _RB_RDIR, elm);	\
+		*prev = elm;						\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+}									\
+									\
+attr int								\
+name##_RB_DESERIALIZE(struct name *head, size_t n,			\
+	struct type *(*dec)(void *), void *arg)				\
+{									\
+	struct type *elm, *prev = NULL;					\
+	int bh, rank;							\
+									\
+	if (!RB_EMPTY(head))						\
+		return (-1);						\
+	/* the largest black height n nodes have room for */		\
+	for (bh = 0; ((size_t)2 << bh) - 1 <= n; bh++)			\
+		;							\
+	elm = name##_RB_LOAD(head, n, dec, arg, bh, &rank);		\
+	if (rank == -2)							\
+		return (-1);						\
+	if (elm != NULL)						\
+		_RB_SET_PARENT##lay(elm, NULL, field);			\
+	_RB_SET_ROOT(head, elm);					\
+	_RB_RETHREAD##lay(name, head, field);				\
+	name##_RB_LOADED(head, elm, &prev);				\
+	return (0);							\
 }
 
+/*
+ * RB_COMPACT moves every node of the tree into the array dst of n nodes,
+ * in breadth first order, so that the top levels of the tree share cache
+ * lines and pages and a descent walks forward through memory. Nodes are
+ * copied whole and the links of the copies are rewritten. reloc, if not
+ * NULL, is called with the old and the new address of every node right
+ * after it is copied, to update outside references or free the old node.
+ * Returns -1 without touching the tree if it has more than n nodes, and
+ * always for index trees, whose links cannot reach from one array into
+ * another: copy their array whole and use RB_INDEX_RELOCATE instead.
+ */
+#define _RB_GENERATE_COMPACT(name, type, field, cmp, attr, lay, aug, ext)	\
+static size_t								\
+name##_RB_COUNT(struct type *elm)					\
+{									\
+	size_t n = 0;							\
+									\
+	while (elm != NULL) {						\
+		n += 1 + name##_RB_COUNT(RB_LEFT(elm, field));		\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+	return (n);							\
+}									\
+									\
+/* copies elm to dst, with its links still pointing at the old children */	\
+static inline void							\
+name##_RB_COPY(struct type *dst, struct type *elm,			\
+	void (*reloc)(struct type *, struct type *, void *), void *arg)	\
+{									\
+	*dst = *elm;							\
+	_RB_SET_CHILD(dst, _RB_LDIR, _RB_GET_CHILD(elm, _RB_LDIR, field), field);	\
+	_RB_SET_CHILD(dst, _RB_RDIR, _RB_GET_CHILD(elm, _RB_RDIR, field), field);	\
+	if (reloc != NULL)						\
+		reloc(elm, dst, arg);					\
+}									\
+									\
+attr int								\
+name##_RB_COMPACT(struct name *head, struct type *dst, size_t n,	\
+	void (*reloc)(struct type *, struct type *, void *), void *arg)	\
+{									\
+	struct type *elm, *child;					\
+	size_t i, next;							\
+	uintptr_t dir;							\
+									\
+	if (_RB_IDX(dst, field) || name##_RB_COUNT(RB_ROOT(head)) > n)	\
+		return (-1);						\
+	if (RB_EMPTY(head))						\
+		return (0);						\
+	name##_RB_COPY(&dst[0], RB_ROOT(head), reloc, arg);		\
+	_RB_SET_PARENT##lay(&dst[0], NULL, field);			\
+	_RB_SET_ROOT(head, &dst[0]);					\
+	for (i = 0, next = 1; i < next; i++) {				\
+		elm = &dst[i];						\
+		for (dir = _RB_LDIR; dir <= _RB_RDIR; dir++) {		\
+			child = _RB_PTR(_RB_GET_CHILD(elm, dir, field));	\
+			if (child == NULL)				\
+				continue;				\
+			name##_RB_COPY(&dst[next], child, reloc, arg);	\
+			_RB_REPLACE_CHILD(elm, dir, child, &dst[next], field);	\
+			_RB_SET_PARENT##lay(&dst[next], elm, field);	\
+			next++;						\
+		}							\
+	}								\
+	_RB_RETHREAD##lay(name, head, field);				\
+	_RB_EXT(MOVED, ext, name, head, field);				\
+	return (0);							\
+}
 
-/* When doing a balancing of the tree, lets check when we are looking at the edge
- * 'elm' to its 'parent'. We assume that 'elm' has already been promoted.
- * Now there are two possibilities:
+/*
+ * RB_REBUILD_PERFECT relinks the tree into the least height its nodes fit
+ * in, every level full but the last, in O(n) and without moving a node.
+ * The tree is rotated into a list through the right links and folded back
+ * by the compressions of Day, Stout and Warren, then one pass down the new
+ * tree, as deep as it is high, sets the ranks for the rule and augments.
+ */
+#define _RB_GENERATE_REBUILD(name, type, field, cmp, attr, lay, aug, ext)	\
+/* rotates the subtree into a list through the right links, counting it */	\
+static struct type *							\
+name##_RB_VINE(struct type *elm, size_t *n)				\
+{									\
+	struct type *left, *list = NULL, *tail = NULL;			\
+									\
+	*n = 0;								\
+	while (elm != NULL) {						\
+		left = RB_LEFT(elm, field);				\
+		if (left != NULL) {					\
+			_RB_SET_CHILD(elm, _RB_LDIR, RB_RIGHT(left, field), field);	\
+			_RB_SET_CHILD(left, _RB_RDIR, elm, field);	\
+			elm = left;					\
+			continue;					\
+		}							\
+		if (tail == NULL)					\
+			list = elm;					\
+		else							\
+			_RB_SET_CHILD(tail, _RB_RDIR, elm, field);	\
+		tail = elm;						\
+		(*n)++;							\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+	return (list);							\
+}									\
+									\
+/* rotates every other node of the first 2 * count down the list left */	\
+static struct type *							\
+name##_RB_COMPRESS(struct type *list, size_t count)			\
+{									\
+	struct type *scan = NULL, *child, *grand;			\
+									\
+	for (; count > 0; count--) {					\
+		child = scan == NULL ? list : RB_RIGHT(scan, field);	\
+		grand = RB_RIGHT(child, field);				\
+		_RB_SET_CHILD(child, _RB_RDIR, RB_LEFT(grand, field), field);	\
+		_RB_SET_CHILD(grand, _RB_LDIR, child, field);		\
+		if (scan == NULL)					\
+			list = grand;					\
+		else							\
+			_RB_SET_CHILD(scan, _RB_RDIR, grand, field);	\
+		scan = grand;						\
+	}								\
+	return (list);							\
+}									\
+									\
+/*									\
+ * sets the links below elm, depth levels down a tree whose last level is	\
+ * h, and returns its rank. under the red-black rule only the nodes of a	\
+ * last level that is not full are red					\
+ */									\
+static int								\
+name##_RB_PERFECT(struct type *elm, int depth, int h, int full)		\
+{									\
+	struct type *left, *right;					\
+	int lrank, rrank, rank;						\
+									\
+	if (elm == NULL)						\
+		return (-1);						\
+	left = RB_LEFT(elm, field);					\
+	right = RB_RIGHT(elm, field);					\
+	lrank = name##_RB_PERFECT(left, depth + 1, h, full);		\
+	rrank = name##_RB_PERFECT(right, depth + 1, h, full);		\
+	_RB_SET_CHILD(elm, _RB_LDIR, left, field);			\
+	_RB_SET_CHILD(elm, _RB_RDIR, right, field);			\
+	if (left != NULL)						\
+		_RB_SET_PARENT##lay(left, elm, field);			\
+	if (right != NULL)						\
+		_RB_SET_PARENT##lay(right, elm, field);			\
+	if (name##_RB_RULE != RB_RULE_RB)				\
+		rank = (lrank > rrank ? lrank : rrank) + 1;		\
+	else if (full)							\
+		rank = 2 * (h - depth) + 1;				\
+	else								\
+		rank = depth == h ? 0 : 2 * (h - depth) - 1;		\
+	if (rank - lrank == 2)						\
+		_RB_SET_RDIFF1(elm, _RB_LDIR, field);			\
+	if (rank - rrank == 2)						\
+		_RB_SET_RDIFF1(elm, _RB_RDIR, field);			\
+	(void)aug(elm);							\
+	return (rank);							\
+}									\
+									\
+attr void								\
+name##_RB_REBUILD_PERFECT(struct name *head)				\
+{									\
+	struct type *list;						\
+	size_t n, m;							\
+	int h;								\
+									\
+	_RB_EXT(FLUSH, ext, name, head);				\
+	list = name##_RB_VINE(RB_ROOT(head), &n);			\
+	if (n == 0)							\
+		return;							\
+	/* m is the largest 2^k - 1 not above n, the full levels */	\
+	for (m = 1, h = 0; m <= (n - 1) / 2; m = 2 * m + 1, h++)	\
+		;							\
+	list = name##_RB_COMPRESS(list, n - m);				\
+	for (; m > 1; m /= 2)						\
+		list = name##_RB_COMPRESS(list, m / 2);			\
+	(void)name##_RB_PERFECT(list, 0, n == m ? h : h + 1, n == m);	\
+	_RB_SET_PARENT##lay(list, NULL, field);				\
+	_RB_SET_ROOT(head, list);					\
+	_RB_RETHREAD##lay(name, head, field);				\
+}
+
+/*
+ * RB_DESTROY hands every node to freefn(elm, arg) once, in post-order, and
+ * leaves the head as RB_INIT does, so an RB_BLOOM tree needs RB_BLOOM_INIT
+ * and an RB_LOG tree RB_SET_LOG again. An RB_LOG tree logs RB_LOG_CLEAR
+ * first and is left as it is, with -1 returned, when that fails; otherwise
+ * it returns 0. Nothing is compared or rebalanced and the walk needs no
+ * stack nor parent pointers: on the way down the link taken is turned to
+ * point back up and the first rank bit of the right link tells which one
+ * it was. freefn is only called on a node once it has no children left and
+ * its links are not read after.
+ */
+#define _RB_GENERATE_DESTROY(name, type, field, cmp, attr, lay, aug, ext)	\
+attr int								\
+name##_RB_DESTROY(struct name *head, void (*freefn)(struct type *, void *),	\
+	void *arg)							\
+{									\
+	struct type *elm, *parent = NULL, *child;			\
+									\
+	if (_RB_EXT_ANY(VETO, ext, name, head, RB_LOG_CLEAR, NULL))	\
+		return (-1);						\
+	elm = RB_ROOT(head);						\
+	while (elm != NULL) {						\
+		child = RB_LEFT(elm, field);				\
+		if (child != NULL) {					\
+			_RB_SET_RDIFF0(elm, _RB_RDIR, field);		\
+			_RB_SET_CHILD(elm, _RB_LDIR, parent, field);	\
+			parent = elm;					\
+			elm = child;					\
+			continue;					\
+		}							\
+		child = RB_RIGHT(elm, field);				\
+		if (child != NULL) {					\
+			_RB_SET_CHILD(elm, _RB_RDIR, parent, field);	\
+			_RB_SET_RDIFF1(elm, _RB_RDIR, field);		\
+			parent = elm;					\
+			elm = child;					\
+			continue;					\
+		}							\
+		freefn(elm, arg);					\
+		/* back up, cutting the link that was followed */	\
+		elm = parent;						\
+		if (elm == NULL)					\
+			break;						\
+		if (_RB_GET_RDIFF(elm, _RB_RDIR, field)) {		\
+			parent = RB_RIGHT(elm, field);			\
+			_RB_SET_CHILD(elm, _RB_RDIR, NULL, field);	\
+		} else {						\
+			parent = RB_LEFT(elm, field);			\
+			_RB_SET_CHILD(elm, _RB_LDIR, NULL, field);	\
+		}							\
+	}								\
+	RB_INIT(head);							\
+	return (0);							\
+}
+
+/*
+ * RB_CLONE copies the tree of src into the empty head dst in one walk and
+ * in the same shape, with the same rank bits, so nothing is compared or
+ * rebalanced. allocfn(elm, arg) returns a copy of elm, with its key, data
+ * and augment fields, and RB_CLONE sets the links of the copy. The
+ * features of dst see the copies in order, as with RB_DESERIALIZE, and
+ * RB_RELAXED trees finish the inserts pending in src first. Returns -1 if
+ * dst is not empty, or when allocfn returns NULL or a copy dst cannot link,
+ * which leaves the copies made so far in dst only to be freed with
+ * RB_DESTROY.
+ */
+#define _RB_GENERATE_CLONE(name, type, field, cmp, attr, lay, aug, ext)	\
+attr int								\
+name##_RB_CLONE(struct name *src, struct name *dst,			\
+	struct type *(*allocfn)(struct type *, void *), void *arg)	\
+{									\
+	struct type *stack[RB_MAX_HEIGHT], *copies[RB_MAX_HEIGHT];	\
+	struct type *elm, *copy, *parent = NULL, *prev = NULL;		\
+	size_t top = 0;							\
+	uintptr_t dir = _RB_LDIR;					\
+									\
+	if (!RB_EMPTY(dst))						\
+		return (-1);						\
+	_RB_EXT(FLUSH, ext, name, src);					\
+	elm = RB_ROOT(src);						\
+	for (;;) {							\
+		/* copies elm and the left spine below it */		\
+		for (; elm != NULL; elm = RB_LEFT(elm, field), dir = _RB_LDIR) {	\
+			copy = allocfn(elm, arg);			\
+			if (copy == NULL ||				\
+			    _RB_EXT_ANY(REJECT, ext, dst, copy))	\
+				return (-1);				\
+			_RB_SET_CHILD(copy, _RB_LDIR, NULL, field);	\
+			_RB_SET_CHILD(copy, _RB_RDIR, NULL, field);	\
+			if (_RB_GET_RDIFF(elm, _RB_LDIR, field))	\
+				_RB_SET_RDIFF1(copy, _RB_LDIR, field);	\
+			if (_RB_GET_RDIFF(elm, _RB_RDIR, field))	\
+				_RB_SET_RDIFF1(copy, _RB_RDIR, field);	\
+			if (parent == NULL)				\
+				_RB_SET_ROOT(dst, copy);		\
+			else						\
+				_RB_REPLACE_CHILD(parent, dir, NULL, copy, field);	\
+			_RB_SET_PARENT##lay(copy, parent, field);	\
+			_RB_ASSERT(top < RB_MAX_HEIGHT);		\
+			stack[top] = elm;				\
+			copies[top++] = copy;				\
+			parent = copy;					\
+		}							\
+		if (top == 0)						\
+			break;						\
+		elm = stack[--top];					\
+		copy = copies[top];					\
+		_RB_EXT(KEY, ext, name, copy);				\
+		if (prev == NULL)					\
+			_RB_EXT(INIT, ext, name, dst, copy);		\
+		else							\
+			_RB_EXT(INSERT, ext, name, dst, prev, _RB_RDIR, copy);	\
+		prev = copy;						\
+		parent = copy;						\
+		dir = _RB_RDIR;						\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+	_RB_RETHREAD##lay(name, dst, field);				\
+	return (0);							\
+}
+
+/*
+ * RB_FREEZE takes a read-only snapshot of the tree into a struct rb_frozen
+ * set up with RB_FROZEN_INIT: the node pointers in Eytzinger order, the
+ * root first and the children of position k at 2k and 2k + 1, so that the
+ * first levels of every search share cache lines and the levels below can
+ * be prefetched. RB_PREFIX trees also store the key prefixes, when given an
+ * array for them, and then search without touching a node or branching on
+ * a comparison until two prefixes are equal. The snapshot is not updated
+ * by later changes to the tree, call RB_FREEZE again to refresh it.
+ * Returns -1 if the tree has more nodes than the arrays hold.
+ */
+#define _RB_GENERATE_FREEZE(name, type, field, cmp, attr, lay, aug, ext)	\
+/* stores the subtree in order at the eytzinger positions from *k on */	\
+static void								\
+name##_RB_EXPORT(struct type *elm, struct rb_frozen *fz, size_t *k)	\
+{									\
+	while (elm != NULL) {						\
+		name##_RB_EXPORT(RB_LEFT(elm, field), fz, k);		\
+		fz->node[*k - 1] = elm;					\
+		_RB_EXT(FREEZE, ext, fz, *k, elm, field);		\
+		if (2 * *k + 1 <= fz->n) {				\
+			*k = 2 * *k + 1;				\
+			while (2 * *k <= fz->n)				\
+				*k *= 2;				\
+		} else							\
+			*k >>= __builtin_ffsll(~(unsigned long long)*k);	\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+}									\
+									\
+attr int								\
+name##_RB_FREEZE(struct name *head, struct rb_frozen *fz)		\
+{									\
+	size_t k = 1, n;						\
+									\
+	n = name##_RB_COUNT(RB_ROOT(head));				\
+	if (n > fz->size)						\
+		return (-1);						\
+	fz->n = n;							\
+	while (2 * k <= n)						\
+		k *= 2;							\
+	name##_RB_EXPORT(RB_ROOT(head), fz, &k);			\
+	return (0);							\
+}									\
+									\
+/* goes right while cmp is at least dir, the path taken is in the bits of k */	\
+static inline size_t							\
+name##_RB_FROZEN_DESCEND(const struct rb_frozen *fz, struct type *elm, int dir)	\
+{									\
+	size_t k = 1;							\
+									\
+	_RB_EXT(KEY, ext, name, elm);					\
+	while (k <= fz->n) {						\
+		__builtin_prefetch(fz->node + 16 * k - 1);		\
+		if (!_RB_EXT_ANY(FROZEN_STEP, ext, fz, k, elm, cmp, field, dir))	\
+			_RB_FROZEN_STEP(fz, k, elm, cmp, dir);		\
+	}								\
+	return (k);							\
+}									\
+									\
+/* the last left turn is the successor */				\
+attr struct type *							\
+name##_RB_FROZEN_NFIND(const struct rb_frozen *fz, struct type *elm)	\
+{									\
+	size_t k;							\
+									\
+	k = name##_RB_FROZEN_DESCEND(fz, elm, 1);			\
+	k >>= __builtin_ffsll(~(unsigned long long)k);			\
+	return (k == 0 ? NULL : (struct type *)fz->node[k - 1]);	\
+}									\
+									\
+/* the last right turn is the predecessor */				\
+attr struct type *							\
+name##_RB_FROZEN_PFIND(const struct rb_frozen *fz, struct type *elm)	\
+{									\
+	size_t k;							\
+									\
+	k = name##_RB_FROZEN_DESCEND(fz, elm, 0);			\
+	k >>= __builtin_ffsll((unsigned long long)k);			\
+	return (k == 0 ? NULL : (struct type *)fz->node[k - 1]);	\
+}									\
+									\
+attr struct type *							\
+name##_RB_FROZEN_FIND(const struct rb_frozen *fz, struct type *elm)	\
+{									\
+	size_t k;							\
+									\
+	k = name##_RB_FROZEN_DESCEND(fz, elm, 1);			\
+	k >>= __builtin_ffsll(~(unsigned long long)k);			\
+	if (k == 0 || cmp(elm, (struct type *)fz->node[k - 1]) != 0)	\
+		return (NULL);						\
+	return ((struct type *)fz->node[k - 1]);			\
+}
+
+/* returns -2 if the subtree is not rank balanced else returns the rank of the node */
+#define _RB_GENERATE_RANK(name, type, field, cmp, attr, lay, aug, ext)				\
+attr int									\
+name##_RB_RANK(const struct type *elm)						\
+{										\
+	int lrank, rrank;							\
+	if (elm == NULL)							\
+		return (-1);							\
+	lrank =  name##_RB_RANK(RB_LEFT(elm, field));				\
+	if (lrank == -2)							\
+		return (-2);							\
+	rrank =  name##_RB_RANK(RB_RIGHT(elm, field));				\
+	if (rrank == -2)							\
+		return (-2);							\
+	lrank += (_RB_GET_RDIFF(elm, _RB_LDIR, field) == 1) ? 2 : 1;		\
+	rrank += (_RB_GET_RDIFF(elm, _RB_RDIR, field) == 1) ? 2 : 1;		\
+	if (lrank != rrank)							\
+		return (-2);							\
+	/* no AVL node is 2,2, a WAVL node only when it is no leaf */		\
+	if (_RB_GET_RDIFF(elm, _RB_LDIR, field) &&				\
+	    _RB_GET_RDIFF(elm, _RB_RDIR, field) &&				\
+	    (name##_RB_RULE == RB_RULE_AVL ||					\
+	    (name##_RB_RULE == RB_RULE_WAVL && lrank == 1)))			\
+		return (-2);							\
+	/* red nodes are 1,1 */							\
+	if (name##_RB_RULE == RB_RULE_RB && lrank % 2 == 0 &&			\
+	    (_RB_GET_RDIFF(elm, _RB_LDIR, field) ||				\
+	    _RB_GET_RDIFF(elm, _RB_RDIR, field)))				\
+		return (-2);							\
+	return (lrank);								\
+}
+
+/*
+ * RB_INSERT_ALLOC inserts without a node at hand. It descends with elm as
+ * the key and, when no node is equal, calls allocfn(elm, parent, arg) for
+ * the node to link, with its key set, where parent is the node the new
+ * leaf will hang from or NULL in an empty tree, so that an allocator can
+ * place it next to its parent, see rbarena.h. It returns what RB_INSERT
+ * returns for that node, or elm when allocfn returns NULL.
+ *
+ * Both share this descent. new(name, head, parent, elm, field, ext) runs
+ * once the parent of the new leaf is known and may put another node into
+ * elm.
+ */
+#define _RB_INSERT_DESCEND(name, field, cmp, lay, ext, new)			\
+	_RB_EXT(KEY, ext, name, elm);						\
+	_RB_STACK_CLEAR##lay(head);							\
+	_RB_SET_CHILD(elm, _RB_LDIR, NULL, field);				\
+	_RB_SET_CHILD(elm, _RB_RDIR, NULL, field);				\
+	tmp = RB_ROOT(head);							\
+	if (tmp == NULL) {							\
+		new(name, head, NULL, elm, field, ext);				\
+		if (_RB_EXT_REFUSED(name, head, elm, ext))			\
+			return (elm);						\
+		_RB_SET_ROOT(head, elm);					\
+		_RB_SET_PARENT##lay(elm, NULL, field);				\
+		_RB_EXT(INIT, ext, name, head, elm);					\
+		return (NULL);							\
+	}									\
+	parent = tmp;								\
+	comp = cmp(elm, tmp);							\
+	if (comp == 0)								\
+		return (parent);						\
+	insdir = (comp < 0) ? _RB_LDIR : _RB_RDIR;				\
+	/*									\
+	 * keys beyond the cached min or max on the same side of the root	\
+	 * are appended there directly, this costs one comparison otherwise	\
+	 */									\
+	edge = _RB_EXT_FIRST(EDGE, ext, head, insdir);				\
+	if (edge != NULL && edge != parent) {					\
+		comp = cmp(elm, edge);						\
+		if (comp == 0)							\
+			return (edge);						\
+		if ((comp < 0) == (insdir == _RB_LDIR)) {			\
+			_RB_SPINE_PATH##lay(head, edge, insdir, field);		\
+			new(name, head, edge, elm, field, ext);			\
+			return (name##_RB_INSERT_FINISH(head, edge, insdir, elm));	\
+		}								\
+	}									\
+	tmp = _RB_PTR(_RB_GET_CHILD(parent, insdir, field));			\
+	_RB_STACK_PUSH##lay(head, parent);					\
+	while (tmp) {								\
+		parent = tmp;							\
+		comp = cmp(elm, tmp);						\
+		if (comp < 0) {							\
+			tmp = RB_LEFT(tmp, field);				\
+			insdir = _RB_LDIR;					\
+		}								\
+		else if (comp > 0) {						\
+			tmp = RB_RIGHT(tmp, field);				\
+			insdir = _RB_RDIR;					\
+		}								\
+		else								\
+			return (parent);					\
+		_RB_STACK_PUSH##lay(head, parent);					\
+	}									\
+	/* the stack contains all the nodes upto and including parent */	\
+	_RB_STACK_POP##lay(head, parent);						\
+	new(name, head, parent, elm, field, ext);					\
+	return (name##_RB_INSERT_FINISH(head, parent, insdir, elm));
+
+#define _RB_INSERT_NEW_ELM(name, head, parent, elm, field, ext)	do {} while (0)
+
+#define _RB_INSERT_NEW_ALLOC(name, head, parent, elm, field, ext) do {	\
+if ((tmp = allocfn(elm, parent, arg)) == NULL)				\
+	return (elm);							\
+(elm) = tmp;								\
+_RB_EXT(KEY, ext, name, elm);						\
+_RB_SET_CHILD(elm, _RB_LDIR, NULL, field);				\
+_RB_SET_CHILD(elm, _RB_RDIR, NULL, field);				\
+} while (0)
+
+/* When doing a balancing of the tree, lets check when we are looking at the edge
+ * 'elm' to its 'parent'. We assume that 'elm' has already been promoted.
+ * Now there are two possibilities:
  * 1) if 'elm' has rank difference 1 with 'parent', or it is the root node, we are done
  * 2) if 'elm' has rank difference 0 with 'parent', we have a few cases
  *
@@ -330,7 +1859,7 @@ name##_RB_RANK(const struct type *elm)						\
  *      /\      / \          /\              /\    /\  /\    /\
  *      --     c1 c2         --              --    --  --    --
  */
-#define _RB_GENERATE_INSERT(name, type, field, cmp, attr)			\
+#define _RB_GENERATE_INSERT(name, type, field, cmp, attr, lay, aug, ext)			\
 										\
 attr struct type *								\
 name##_RB_INSERT_BALANCE(struct name *head, struct type *parent,		\
@@ -338,9 +1867,12 @@ name##_RB_INSERT_BALANCE(struct name *head, struct type *parent,		\
 {										\
 	struct type *child, *gpar;						\
 	uintptr_t elmdir, sibdir;						\
+	int rank;								\
 										\
 	child = NULL;								\
 	gpar = NULL;								\
+	/* the rank elm is promoted to, only the red-black rule needs it */	\
+	rank = 0;								\
 	do {									\
 		/* elm has not been promoted yet */				\
 		_RB_ASSERT(parent != NULL);					\
@@ -349,17 +1881,24 @@ name##_RB_INSERT_BALANCE(struct name *head, struct type *parent,		\
 		if (_RB_GET_RDIFF(parent, elmdir, field)) {			\
 			/* case (1) */						\
 			_RB_FLIP_RDIFF(parent, elmdir, field);			\
-			_RB_STACK_PUSH(head, parent);				\
+			_RB_STACK_PUSH##lay(head, parent);				\
 			return (elm);						\
 		}								\
-		_RB_STACK_POP(head, gpar);					\
-		_RB_GET_PARENT(parent, gpar, field);				\
+		_RB_STACK_POP##lay(head, gpar);					\
+		_RB_GET_PARENT##lay(parent, gpar, field);				\
 		/* case (2) */							\
 		sibdir = _RB_ODIR(elmdir);					\
 		_RB_FLIP_RDIFF(parent, sibdir, field);				\
 		if (_RB_GET_RDIFF(parent, sibdir, field)) {			\
 			/* case (2.1) */					\
-			(void)_RB_AUGMENT(elm);					\
+			if (++rank % 2 == 0 && name##_RB_RULE == RB_RULE_RB) {	\
+				/* parent turns red, its sibling black */	\
+				_RB_FLIP_RDIFF(parent, sibdir, field);		\
+				child = _RB_PTR(_RB_GET_CHILD(parent, sibdir, field));	\
+				_RB_SET_RDIFF1(child, _RB_LDIR, field);		\
+				_RB_SET_RDIFF1(child, _RB_RDIR, field);		\
+			}							\
+			(void)aug(elm);						\
 			child = elm;						\
 			elm = parent;						\
 			continue;						\
@@ -368,22 +1907,22 @@ name##_RB_INSERT_BALANCE(struct name *head, struct type *parent,		\
 		/* case (2.2) */						\
 		if (_RB_GET_RDIFF(elm, sibdir, field) == 0) {			\
 			/* case (2.2b) */					\
-			_RB_ROTATE(elm, child, elmdir, field);			\
+			_RB_ROTATE(elm, child, elmdir, field, lay);			\
 		} else {							\
 			/* case (2.2a) */					\
 			child = elm;						\
 			_RB_FLIP_RDIFF(elm, sibdir, field);			\
 		}								\
-		_RB_ROTATE(parent, child, sibdir, field);			\
-		_RB_SET_PARENT(child, gpar, field);				\
+		_RB_ROTATE(parent, child, sibdir, field, lay);			\
+		_RB_SET_PARENT##lay(child, gpar, field);				\
 		_RB_SWAP_CHILD_OR_ROOT(head, gpar, parent, child, field);	\
-		(void)_RB_AUGMENT(parent);					\
+		(void)aug(parent);					\
 		if (elm != child)						\
-			(void)_RB_AUGMENT(elm);					\
-		_RB_STACK_PUSH(head, gpar);					\
+			(void)aug(elm);					\
+		_RB_STACK_PUSH##lay(head, gpar);					\
 		return (child);							\
 	} while ((parent = gpar) != NULL);					\
-	_RB_STACK_PUSH(head, NULL);						\
+	_RB_STACK_PUSH##lay(head, NULL);						\
 	return (elm);								\
 }										\
 										\
@@ -393,17 +1932,24 @@ name##_RB_INSERT_FINISH(struct name *head, struct type *parent,			\
     uintptr_t insdir, struct type *elm)					\
 {										\
 	struct type *tmp = elm;							\
-	_RB_SET_PARENT(elm, parent, field);					\
-	if (_RB_GET_CHILD(parent, insdir, field))				\
+	if (_RB_EXT_REFUSED(name, head, elm, ext))				\
+		return (elm);							\
+	_RB_SET_PARENT##lay(elm, parent, field);					\
+	_RB_EXT(INSERT, ext, name, head, parent, insdir, elm);				\
+	_RB_SET_THREAD##lay(elm, insdir, _RB_THREAD##lay(parent, insdir, field), field);	\
+	_RB_SET_THREAD##lay(elm, _RB_ODIR(insdir), parent, field);		\
+	if (_RB_EXT_ANY(DEFER, ext, name, head, parent, insdir, elm))		\
+		return (NULL);							\
+	if (_RB_GET_RDIFF(parent, insdir, field))				\
 		_RB_SET_CHILD(parent, insdir, elm, field);			\
 	else {									\
 		_RB_SET_CHILD(parent, insdir, elm, field);			\
 		tmp = name##_RB_INSERT_BALANCE(head, parent, elm);		\
-		_RB_STACK_POP(head, parent);					\
-		_RB_GET_PARENT(tmp, parent, field);				\
+		_RB_STACK_POP##lay(head, parent);					\
+		_RB_GET_PARENT##lay(tmp, parent, field);				\
 	}									\
-	(void)_RB_AUGMENT(tmp);							\
-	_RB_AUGMENT_WALK(head, parent, field);					\
+	(void)aug(tmp);							\
+	_RB_AUGMENT_WALK(head, parent, field, lay, aug);					\
 	return (NULL);								\
 }										\
 										\
@@ -411,49 +1957,40 @@ name##_RB_INSERT_FINISH(struct name *head, struct type *parent,			\
 attr struct type *								\
 name##_RB_INSERT(struct name *head, struct type *elm)				\
 {										\
-	struct type *parent, *tmp;						\
+	struct type *parent, *tmp, *edge;					\
 	__typeof(cmp(NULL, NULL)) comp;						\
 	uintptr_t insdir;							\
 										\
-	_RB_STACK_CLEAR(head);							\
-	_RB_SET_CHILD(elm, _RB_LDIR, NULL, field);				\
-	_RB_SET_CHILD(elm, _RB_RDIR, NULL, field);				\
-	tmp = RB_ROOT(head);							\
-	if (tmp == NULL) {							\
-		RB_ROOT(head) = elm;						\
-		_RB_SET_PARENT(elm, NULL, field);				\
-		return (NULL);							\
-	}									\
-	while (tmp) {								\
-		parent = tmp;							\
-		comp = cmp(elm, tmp);						\
-		if (comp < 0) {							\
-			tmp = RB_LEFT(tmp, field);				\
-			insdir = _RB_LDIR;					\
-		}								\
-		else if (comp > 0) {						\
-			tmp = RB_RIGHT(tmp, field);				\
-			insdir = _RB_RDIR;					\
-		}								\
-		else								\
-			return (parent);					\
-		_RB_STACK_PUSH(head, parent);					\
-	}									\
-	/* the stack contains all the nodes upto and including parent */	\
-	_RB_STACK_POP(head, parent);						\
-	return (name##_RB_INSERT_FINISH(head, parent, insdir, elm));		\
+	_RB_INSERT_DESCEND(name, field, cmp, lay, ext, _RB_INSERT_NEW_ELM);	\
+}										\
+										\
+/* Inserts a node made by allocfn once its parent is known */			\
+attr struct type *								\
+name##_RB_INSERT_ALLOC(struct name *head, struct type *elm,			\
+    struct type *(*allocfn)(struct type *, struct type *, void *), void *arg)	\
+{										\
+	struct type *parent, *tmp, *edge;					\
+	__typeof(cmp(NULL, NULL)) comp;						\
+	uintptr_t insdir;							\
+										\
+	_RB_INSERT_DESCEND(name, field, cmp, lay, ext, _RB_INSERT_NEW_ALLOC);	\
 }
 
-#ifdef RB_SMALL
-#define _RB_GENERATE_INSERT_ITERATE(name, type, field, cmp, attr)
+#ifndef RB_THREADED
+#define _RB_GENERATE_INSERT_ITERATE_SMALL(name, type, field, cmp, attr, lay, aug, ext)
 #else
-#define _RB_GENERATE_INSERT_ITERATE(name, type, field, cmp, attr)		\
+#define _RB_GENERATE_INSERT_ITERATE_SMALL(name, type, field, cmp, attr, lay, aug, ext)	\
+	_RB_GENERATE_INSERT_ITERATE_LARGE(name, type, field, cmp, attr, lay, aug, ext)
+#endif
+
+#define _RB_GENERATE_INSERT_ITERATE_LARGE(name, type, field, cmp, attr, lay, aug, ext)	\
 										\
 attr struct type *								\
 name##_RB_INSERT_NEXT(struct name *head, struct type *elm, struct type *next)	\
 {										\
 	struct type *tmp;							\
 	uintptr_t insdir = _RB_RDIR;						\
+	_RB_EXT(KEY, ext, name, next);						\
 	_RB_SET_CHILD(next, _RB_LDIR, NULL, field);				\
 	_RB_SET_CHILD(next, _RB_RDIR, NULL, field);				\
 	_RB_ASSERT((cmp)(elm, next) < 0);					\
@@ -474,6 +2011,7 @@ name##_RB_INSERT_PREV(struct name *head, struct type *elm, struct type *prev)	\
 {										\
 	struct type *tmp;							\
 	uintptr_t insdir = _RB_LDIR;						\
+	_RB_EXT(KEY, ext, name, prev);						\
 	_RB_SET_CHILD(prev, _RB_LDIR, NULL, field);				\
 	_RB_SET_CHILD(prev, _RB_RDIR, NULL, field);				\
 	_RB_ASSERT((cmp)(elm, prev) > 0);					\
@@ -488,19 +2026,19 @@ name##_RB_INSERT_PREV(struct name *head, struct type *elm, struct type *prev)	\
 	}									\
 	return name##_RB_INSERT_FINISH(head, elm, insdir, prev);		\
 }
-#endif
 
-#ifdef RB_SMALL
-#define _RB_GENERATE_FINDC(name, type, field, cmp, attr)			\
+#ifndef RB_THREADED
+#define _RB_GENERATE_FINDC_SMALL(name, type, field, cmp, attr, lay, aug, ext)		\
 										\
 attr struct type *								\
 name##_RB_FINDC(struct name *head, struct type *elm)				\
 {										\
 	struct type *tmp = RB_ROOT(head);					\
 	__typeof(cmp(NULL, NULL)) comp;						\
-	_RB_STACK_CLEAR(head);							\
+	_RB_EXT(KEY, ext, name, elm);						\
+	_RB_STACK_CLEAR##lay(head);							\
 	while (tmp) {								\
-		_RB_STACK_PUSH(head, tmp);					\
+		_RB_STACK_PUSH##lay(head, tmp);					\
 		comp = cmp(elm, tmp);						\
 		if (comp < 0)							\
 			tmp = RB_LEFT(tmp, field);				\
@@ -518,9 +2056,10 @@ name##_RB_NFINDC(struct name *head, struct type *elm)				\
 	struct type *tmp = RB_ROOT(head);					\
 	struct type *res = NULL;						\
 	__typeof(cmp(NULL, NULL)) comp;						\
-	_RB_STACK_CLEAR(head);							\
+	_RB_EXT(KEY, ext, name, elm);						\
+	_RB_STACK_CLEAR##lay(head);							\
 	while (tmp) {								\
-		_RB_STACK_PUSH(head, tmp);					\
+		_RB_STACK_PUSH##lay(head, tmp);					\
 		comp = cmp(elm, tmp);						\
 		if (comp < 0) {							\
 			res = tmp;						\
@@ -540,9 +2079,10 @@ name##_RB_PFINDC(struct name *head, struct type *elm)				\
 	struct type *tmp = RB_ROOT(head);					\
 	struct type *res = NULL;						\
 	__typeof(cmp(NULL, NULL)) comp;						\
-	_RB_STACK_CLEAR(head);							\
+	_RB_EXT(KEY, ext, name, elm);						\
+	_RB_STACK_CLEAR##lay(head);							\
 	while (tmp) {								\
-		_RB_STACK_PUSH(head, tmp);					\
+		_RB_STACK_PUSH##lay(head, tmp);					\
 		comp = cmp(elm, tmp);						\
 		if (comp > 0) {							\
 			res = tmp;						\
@@ -556,42 +2096,50 @@ name##_RB_PFINDC(struct name *head, struct type *elm)				\
 	return (res);								\
 }
 #else
-#define _RB_GENERATE_FINDC(name, type, field, cmp, attr)			\
+#define _RB_GENERATE_FINDC_SMALL(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_FINDC_LARGE(name, type, field, cmp, attr, lay, aug, ext)
+#endif
+
+/* with parent pointers or threads there is nothing to cache, these are plain lookups */
+#define _RB_GENERATE_FINDC_LARGE(name, type, field, cmp, attr, lay, aug, ext)		\
 										\
 attr struct type *								\
 name##_RB_FINDC(struct name *head, struct type *elm)				\
 {										\
-	return (elm);								\
+	return (name##_RB_FIND(head, elm));					\
 }										\
 										\
 attr struct type *								\
 name##_RB_NFINDC(struct name *head, struct type *elm)				\
 {										\
-	return (elm);								\
+	return (name##_RB_NFIND(head, elm));					\
 }										\
 										\
 attr struct type *								\
 name##_RB_PFINDC(struct name *head, struct type *elm)				\
 {										\
-	return (elm);								\
+	return (name##_RB_PFIND(head, elm));					\
 }
-#endif
 
-#define _RB_GENERATE_FIND(name, type, field, cmp, attr)				\
+#define _RB_GENERATE_FIND(name, type, field, cmp, attr, lay, aug, ext)				\
 										\
 attr struct type *								\
 name##_RB_FIND(struct name *head, struct type *elm)				\
 {										\
 	struct type *tmp = RB_ROOT(head);					\
 	__typeof(cmp(NULL, NULL)) comp;						\
+	_RB_EXT(KEY, ext, name, elm);						\
+	_RB_EXT(LOOKUP, ext, name, head, elm, cmp);				\
 	while (tmp) {								\
 		comp = cmp(elm, tmp);						\
 		if (comp < 0)							\
 			tmp = RB_LEFT(tmp, field);				\
 		else if (comp > 0)						\
 			tmp = RB_RIGHT(tmp, field);				\
-		else								\
+		else {								\
+			_RB_EXT(FOUND, ext, name, head, tmp);			\
 			return (tmp);						\
+		}								\
 	}									\
 	return (NULL);								\
 }										\
@@ -602,6 +2150,7 @@ name##_RB_NFIND(struct name *head, struct type *elm)				\
 	struct type *tmp = RB_ROOT(head);					\
 	struct type *res = NULL;						\
 	__typeof(cmp(NULL, NULL)) comp;						\
+	_RB_EXT(KEY, ext, name, elm);						\
 	while (tmp) {								\
 		comp = cmp(elm, tmp);						\
 		if (comp < 0) {							\
@@ -622,6 +2171,7 @@ name##_RB_PFIND(struct name *head, struct type *elm)				\
 	struct type *tmp = RB_ROOT(head);					\
 	struct type *res = NULL;						\
 	__typeof(cmp(NULL, NULL)) comp;						\
+	_RB_EXT(KEY, ext, name, elm);						\
 	while (tmp) {								\
 		comp = cmp(elm, tmp);						\
 		if (comp > 0) {							\
@@ -636,13 +2186,16 @@ name##_RB_PFIND(struct name *head, struct type *elm)				\
 	return (res);								\
 }
 
-#define _RB_GENERATE_MINMAX(name, type, field, cmp, attr)			\
+/* the extreme cached by a feature, or else the end of the spine */
+#define _RB_GENERATE_MINMAX(name, type, field, cmp, attr, lay, aug, ext)	\
 										\
 attr struct type *								\
 name##_RB_MINMAX(struct name *head, int dir)					\
 {										\
 	struct type *tmp = RB_ROOT(head);					\
 	struct type *parent = NULL;						\
+	if (tmp != NULL && (parent = _RB_EXT_FIRST(EDGE, ext, head, dir)) != NULL)	\
+		return (parent);						\
 	while (tmp) {								\
 		parent = tmp;							\
 		tmp = _RB_PTR(_RB_GET_CHILD(tmp, dir, field));			\
@@ -726,7 +2279,7 @@ name##_RB_MINMAX(struct name *head, int dir)					\
  *                c1  c2
  *
  */
-#define _RB_GENERATE_REMOVE(name, type, field, cmp, attr)			\
+#define _RB_GENERATE_REMOVE(name, type, field, cmp, attr, lay, aug, ext)			\
 										\
 attr struct type *								\
 name##_RB_REMOVE_BALANCE(struct name *head, struct type *parent,		\
@@ -739,34 +2292,46 @@ name##_RB_REMOVE_BALANCE(struct name *head, struct type *parent,		\
 	_RB_ASSERT(parent != NULL);						\
 	gpar = NULL;								\
 	sibling = NULL;								\
-	if (RB_RIGHT(parent, field) == NULL && RB_LEFT(parent, field) == NULL) {\
-		_RB_SET_CHILD(parent, _RB_LDIR, NULL, field);			\
-		_RB_SET_CHILD(parent, _RB_RDIR, NULL, field);			\
+	/* a deferred leaf is a null link to the ranks */			\
+	if ((RB_RIGHT(parent, field) == NULL ||					\
+	    _RB_EXT_ANY(DEFERRED, ext, RB_RIGHT(parent, field), field)) &&	\
+	    (RB_LEFT(parent, field) == NULL ||					\
+	    _RB_EXT_ANY(DEFERRED, ext, RB_LEFT(parent, field), field))) {	\
+		_RB_SET_RDIFF0(parent, _RB_LDIR, field);			\
+		_RB_SET_RDIFF0(parent, _RB_RDIR, field);			\
 		elm = parent;							\
-		(void)_RB_AUGMENT(elm);						\
-		_RB_STACK_POP(head, parent);					\
-		_RB_GET_PARENT(parent, parent, field);				\
+		(void)aug(elm);						\
+		_RB_STACK_POP##lay(head, parent);					\
+		_RB_GET_PARENT##lay(parent, parent, field);				\
 		if (parent == NULL) {						\
 			return (NULL);						\
 		}								\
 	}									\
 	do {									\
 		_RB_ASSERT(parent != NULL);					\
-		_RB_STACK_POP(head, gpar);					\
-		_RB_GET_PARENT(parent, gpar, field);				\
+		_RB_STACK_POP##lay(head, gpar);					\
+		_RB_GET_PARENT##lay(parent, gpar, field);				\
 		elmdir = RB_LEFT(parent, field) == elm ? _RB_LDIR : _RB_RDIR;	\
 		if (_RB_GET_RDIFF(parent, elmdir, field) == 0) {		\
 			/* case (1) */						\
 			_RB_FLIP_RDIFF(parent, elmdir, field);			\
-			_RB_STACK_PUSH(head, gpar);				\
-			return (parent);					\
+			if (name##_RB_RULE != RB_RULE_AVL ||			\
+			    !_RB_GET_RDIFF(parent, _RB_ODIR(elmdir), field)) {	\
+				_RB_STACK_PUSH##lay(head, gpar);		\
+				return (parent);				\
+			}							\
+			/* an AVL parent left 2,2 is demoted */			\
+			_RB_SET_RDIFF0(parent, _RB_LDIR, field);		\
+			_RB_SET_RDIFF0(parent, _RB_RDIR, field);		\
+			(void)aug(parent);					\
+			continue;						\
 		}								\
 		/* case 2 */							\
 		sibdir = _RB_ODIR(elmdir);					\
 		if (_RB_GET_RDIFF(parent, sibdir, field)) {			\
 			/* case 2.1 */						\
 			_RB_FLIP_RDIFF(parent, sibdir, field);			\
-			(void)_RB_AUGMENT(parent);				\
+			(void)aug(parent);				\
 			continue;						\
 		}								\
 		/* case 2.2 */							\
@@ -778,7 +2343,7 @@ name##_RB_REMOVE_BALANCE(struct name *head, struct type *parent,		\
 			/* case 2.2a */						\
 			_RB_FLIP_RDIFF(sibling, elmdir, field);			\
 			_RB_FLIP_RDIFF(sibling, sibdir, field);			\
-			(void)_RB_AUGMENT(parent);				\
+			(void)aug(parent);				\
 			continue;						\
 		}								\
 		extend = 0;							\
@@ -787,7 +2352,7 @@ name##_RB_REMOVE_BALANCE(struct name *head, struct type *parent,		\
 			_RB_FLIP_RDIFF(sibling, sibdir, field);			\
 			_RB_FLIP_RDIFF(parent, elmdir, field);			\
 			elm = _RB_PTR(_RB_GET_CHILD(sibling, elmdir, field));	\
-			_RB_ROTATE(sibling, elm, sibdir, field);		\
+			_RB_ROTATE(sibling, elm, sibdir, field, lay);		\
 			_RB_SET_RDIFF1(elm, sibdir, field);			\
 			extend = 1;						\
 		} else {							\
@@ -801,32 +2366,148 @@ name##_RB_REMOVE_BALANCE(struct name *head, struct type *parent,		\
 			_RB_FLIP_RDIFF(parent, sibdir, field);			\
 			elm = sibling;						\
 		}								\
-		_RB_ROTATE(parent, elm, elmdir, field);				\
-		_RB_SET_PARENT(elm, gpar, field);				\
+		_RB_ROTATE(parent, elm, elmdir, field, lay);				\
+		_RB_SET_PARENT##lay(elm, gpar, field);				\
 		_RB_SWAP_CHILD_OR_ROOT(head, gpar, parent, elm, field);		\
 		if (extend) {							\
 			_RB_SET_RDIFF1(elm, elmdir, field);			\
 		}								\
-		(void)_RB_AUGMENT(parent);					\
+		(void)aug(parent);						\
 		if (elm != sibling)						\
-			(void)_RB_AUGMENT(sibling);				\
-		_RB_STACK_PUSH(head, gpar);					\
+			(void)aug(sibling);					\
+		/* an AVL top left 2,2 is demoted */				\
+		if (name##_RB_RULE == RB_RULE_AVL &&				\
+		    _RB_GET_RDIFF(elm, _RB_LDIR, field) &&			\
+		    _RB_GET_RDIFF(elm, _RB_RDIR, field)) {			\
+			_RB_SET_RDIFF0(elm, _RB_LDIR, field);			\
+			_RB_SET_RDIFF0(elm, _RB_RDIR, field);			\
+			(void)aug(elm);						\
+			parent = elm;						\
+			continue;						\
+		}								\
+		_RB_STACK_PUSH##lay(head, gpar);				\
 		return (elm);							\
 	} while ((elm = parent, (parent = gpar) != NULL));			\
-	_RB_STACK_PUSH(head, NULL);						\
+	_RB_STACK_PUSH##lay(head, NULL);						\
 	return (elm);								\
 }										\
 										\
+/*										\
+ * the red-black removal, rank is that of the unlinked node. once it is		\
+ * black and had no red child to take its colour, elm is a black too short	\
+ * and its rank stays that of the node it should be				\
+ */										\
+attr struct type *								\
+name##_RB_REMOVE_BLACK(struct name *head, struct type *parent,			\
+    struct type *elm, int rank)							\
+{										\
+	struct type *gpar, *sibling, *tmp;					\
+	uintptr_t elmdir, sibdir;						\
+	int prank;								\
+										\
+	_RB_ASSERT(parent != NULL);						\
+	gpar = NULL;								\
+	if (elm != NULL) {							\
+		/* a red leaf takes the place of its black parent */		\
+		_RB_SET_RDIFF1(elm, _RB_LDIR, field);				\
+		_RB_SET_RDIFF1(elm, _RB_RDIR, field);				\
+		return (parent);						\
+	}									\
+	if (rank == 0) {							\
+		/* a red leaf is gone, the parent is black */			\
+		if (RB_LEFT(parent, field) == NULL)				\
+			_RB_SET_RDIFF1(parent, _RB_LDIR, field);		\
+		if (RB_RIGHT(parent, field) == NULL)				\
+			_RB_SET_RDIFF1(parent, _RB_RDIR, field);		\
+		return (parent);						\
+	}									\
+	for (;;) {								\
+		_RB_STACK_POP##lay(head, gpar);					\
+		_RB_GET_PARENT##lay(parent, gpar, field);			\
+		elmdir = RB_LEFT(parent, field) == elm ? _RB_LDIR : _RB_RDIR;	\
+		sibdir = _RB_ODIR(elmdir);					\
+		prank = rank + 1 + (int)_RB_GET_RDIFF(parent, elmdir, field);	\
+		sibling = _RB_PTR(_RB_GET_CHILD(parent, sibdir, field));	\
+		_RB_ASSERT(sibling != NULL);					\
+		if (prank % 2 == 1 && !_RB_GET_RDIFF(parent, sibdir, field)) {	\
+			/* case (1), the sibling is red */			\
+			_RB_ROTATE(parent, sibling, elmdir, field, lay);	\
+			_RB_SET_PARENT##lay(sibling, gpar, field);		\
+			_RB_SWAP_CHILD_OR_ROOT(head, gpar, parent, sibling, field);	\
+			_RB_SET_RDIFF1(sibling, sibdir, field);			\
+			_RB_SET_RDIFF0(parent, elmdir, field);			\
+			_RB_STACK_PUSH##lay(head, gpar);			\
+			_RB_STACK_PUSH##lay(head, sibling);			\
+			continue;						\
+		}								\
+		if (_RB_GET_RDIFF(sibling, _RB_LDIR, field) &&			\
+		    _RB_GET_RDIFF(sibling, _RB_RDIR, field)) {			\
+			/* case (2), the sibling turns red */			\
+			_RB_SET_RDIFF0(sibling, _RB_LDIR, field);		\
+			_RB_SET_RDIFF0(sibling, _RB_RDIR, field);		\
+			if (prank % 2 == 0) {					\
+				/* and the red parent black */			\
+				_RB_SET_RDIFF1(parent, elmdir, field);		\
+				if (gpar != NULL)				\
+					_RB_SET_RDIFF1(gpar,			\
+					    RB_LEFT(gpar, field) == parent ?	\
+					    _RB_LDIR : _RB_RDIR, field);	\
+				_RB_STACK_PUSH##lay(head, gpar);		\
+				return (parent);				\
+			}							\
+			_RB_SET_RDIFF0(parent, sibdir, field);			\
+			(void)aug(parent);					\
+			rank = prank;						\
+			elm = parent;						\
+			if ((parent = gpar) == NULL) {				\
+				_RB_STACK_PUSH##lay(head, NULL);		\
+				return (elm);					\
+			}							\
+			continue;						\
+		}								\
+		if (_RB_GET_RDIFF(sibling, sibdir, field)) {			\
+			/* case (3), the near child of the sibling is red */	\
+			tmp = _RB_PTR(_RB_GET_CHILD(sibling, elmdir, field));	\
+			_RB_ROTATE(sibling, tmp, sibdir, field, lay);		\
+			_RB_SET_PARENT##lay(tmp, parent, field);		\
+			_RB_REPLACE_CHILD(parent, sibdir, sibling, tmp, field);	\
+			_RB_SET_RDIFF0(sibling, sibdir, field);			\
+			_RB_SET_RDIFF1(tmp, elmdir, field);			\
+			(void)aug(sibling);					\
+			sibling = tmp;						\
+		}								\
+		/* case (4), the far child of the sibling is red */		\
+		tmp = _RB_PTR(_RB_GET_CHILD(sibling, sibdir, field));		\
+		_RB_ROTATE(parent, sibling, elmdir, field, lay);		\
+		_RB_SET_PARENT##lay(sibling, gpar, field);			\
+		_RB_SWAP_CHILD_OR_ROOT(head, gpar, parent, sibling, field);	\
+		_RB_SET_RDIFF1(parent, elmdir, field);				\
+		_RB_SET_RDIFF1(tmp, _RB_LDIR, field);				\
+		_RB_SET_RDIFF1(tmp, _RB_RDIR, field);				\
+		if (prank % 2 == 1) {						\
+			_RB_SET_RDIFF1(sibling, _RB_LDIR, field);		\
+			_RB_SET_RDIFF1(sibling, _RB_RDIR, field);		\
+		}								\
+		(void)aug(parent);						\
+		_RB_STACK_PUSH##lay(head, gpar);				\
+		return (sibling);						\
+	}									\
+}										\
+										\
 attr struct type *								\
 name##_RB_REMOVE_START(struct name *head, struct type *elm)			\
 {										\
-	struct type *parent, *opar, *child, *rmin, *cptr;			\
+	struct type *parent, *opar, *child, *rmin, *rpar, *cptr;		\
 	size_t sz;								\
+	int black, settled;							\
 										\
 	parent = NULL;								\
 	opar = NULL;								\
-	_RB_STACK_TOP(head, opar);						\
-	_RB_GET_PARENT(elm, opar, field);					\
+	_RB_STACK_TOP##lay(head, opar);						\
+	_RB_GET_PARENT##lay(elm, opar, field);					\
+	if (_RB_EXT_ANY(VETO, ext, name, head, RB_LOG_REMOVE, elm))		\
+		return (NULL);							\
+	_RB_EXT(REMOVE, ext, name, head, elm, opar, field);				\
 										\
 	/* first find the element to swap with oelm */				\
 	child = _RB_GET_CHILD(elm, _RB_LDIR, field);				\
@@ -834,42 +2515,65 @@ name##_RB_REMOVE_START(struct name *head, struct type *elm)			\
 	rmin = RB_RIGHT(elm, field);						\
 	if (rmin == NULL || cptr == NULL) {					\
 		rmin = child = (rmin == NULL ? cptr : rmin);			\
+		/* the rank of a node with a null link, one for a black one */	\
+		black = (int)_RB_GET_RDIFF(elm, RB_LEFT(elm, field) == NULL ?	\
+		    _RB_LDIR : _RB_RDIR, field);				\
+		/* a deferred leaf is unlinked without rebalancing */		\
+		settled = _RB_EXT_ANY(DEFERRED, ext, elm, field);		\
 		parent = opar;							\
-		_RB_STACK_DROP(head);						\
+		_RB_STACK_DROP##lay(head);						\
 	}									\
 	else {									\
-		_RB_STACK_PUSH(head, elm);					\
-		_RB_STACK_SIZE(head, &sz);					\
-		parent = rmin;							\
+		_RB_STACK_PUSH##lay(head, elm);					\
+		_RB_STACK_SIZE##lay(head, &sz);					\
+		parent = rpar = rmin;						\
 		while (RB_LEFT(rmin, field)) {					\
-			_RB_STACK_PUSH(head, rmin);				\
+			_RB_STACK_PUSH##lay(head, rmin);				\
+			rpar = rmin;						\
 			rmin = RB_LEFT(rmin, field);				\
 		}								\
+		black = (int)_RB_GET_RDIFF(rmin, _RB_LDIR, field);		\
+		/* and a deferred successor takes the place and rank of elm */	\
+		settled = _RB_EXT_ANY(DEFERRED, ext, rmin, field);		\
+		if (settled)							\
+			_RB_EXT(SETTLED, ext, name, head, rmin, 0, field);	\
 		_RB_SET_CHILD(rmin, _RB_LDIR, child, field);			\
-		_RB_SET_PARENT(cptr, rmin, field);				\
+		_RB_SET_PARENT##lay(cptr, rmin, field);				\
+		/* the right link of a black leaf has the bit set too */	\
+		if (name##_RB_RULE == RB_RULE_RB)				\
+			_RB_SET_RDIFF0(rmin, _RB_RDIR, field);			\
 		child = _RB_GET_CHILD(rmin, _RB_RDIR, field);			\
 		if (parent != rmin) {						\
-			_RB_SET_PARENT(parent, rmin, field);			\
+			_RB_SET_PARENT##lay(parent, rmin, field);			\
 			_RB_SET_CHILD(rmin, _RB_RDIR, _RB_GET_CHILD(elm, _RB_RDIR, field), field);	\
-			_RB_GET_PARENT(rmin, parent, field);			\
-			_RB_STACK_POP(head, parent);				\
+			parent = rpar;						\
+			_RB_STACK_POP##lay(head, parent);				\
 			_RB_REPLACE_CHILD(parent, _RB_LDIR, child, rmin, field);\
-			_RB_STACK_SET(head, sz - 1, rmin);			\
+			_RB_STACK_SET##lay(head, sz - 1, rmin);			\
 		} else {							\
-			_RB_STACK_SET(head, sz - 1, NULL);			\
-			_RB_STACK_DROP(head);					\
+			_RB_STACK_SET##lay(head, sz - 1, NULL);			\
+			_RB_STACK_DROP##lay(head);					\
 			if (_RB_GET_RDIFF(elm, _RB_RDIR, field))		\
 				_RB_SET_RDIFF1(rmin, _RB_RDIR, field);		\
 		}								\
-		_RB_SET_PARENT(rmin, opar, field);				\
+		_RB_SET_PARENT##lay(rmin, opar, field);				\
+	}									\
+	/* as does a deferred child, in place of the leaf above it */		\
+	if (_RB_EXT_ANY(DEFERRED, ext, _RB_PTR(child), field)) {		\
+		_RB_EXT(SETTLED, ext, name, head, _RB_PTR(child), black, field);	\
+		settled = 1;							\
 	}									\
 	_RB_SWAP_CHILD_OR_ROOT(head, opar, elm, rmin, field);			\
+	_RB_REMOVE_THREADS##lay(elm, opar, rmin, parent, child, field);		\
 	if (child != NULL) {							\
-		_RB_SET_PARENT(child, parent, field);				\
+		_RB_SET_PARENT##lay(child, parent, field);				\
 	}									\
 	if (parent != NULL) {							\
-		parent = name##_RB_REMOVE_BALANCE(head, parent, child);		\
-		_RB_AUGMENT_WALK(head, parent, field);				\
+		if (!settled)							\
+			parent = name##_RB_RULE == RB_RULE_RB ?			\
+			    name##_RB_REMOVE_BLACK(head, parent, child, black) :	\
+			    name##_RB_REMOVE_BALANCE(head, parent, child);	\
+		_RB_AUGMENT_WALK(head, parent, field, lay, aug);				\
 	}									\
 	return (elm);								\
 }										\
@@ -879,111 +2583,1060 @@ name##_RB_REMOVE(struct name *head, struct type *elm)				\
 {										\
 	struct type *telm = elm;						\
 										\
-	telm = name##_RB_FINDC(head, elm);					\
+	telm = _RB_REMOVE_FIND##lay(name, head, elm);				\
 	if (telm == NULL)							\
 		return (NULL);							\
-	_RB_STACK_POP(head, telm);						\
+	_RB_STACK_POP##lay(head, telm);						\
 	_RB_ASSERT((cmp(telm, elm)) == 0);					\
 	return (name##_RB_REMOVE_START(head, telm));				\
 }
 
-#ifdef RB_SMALL
-#define _RB_GENERATE_REMOVEC(name, type, field, cmp, attr)			\
+#ifndef RB_THREADED
+#define _RB_GENERATE_REMOVEC_SMALL(name, type, field, cmp, attr, lay, aug, ext)		\
 										\
 attr struct type *								\
 name##_RB_REMOVEC(struct name *head, struct type *elm)				\
 {										\
 	struct type *telm = elm;						\
 										\
-	_RB_STACK_POP(head, telm);						\
+	_RB_STACK_POP##lay(head, telm);						\
 	_RB_ASSERT((cmp(telm, elm)) == 0);					\
 	return (name##_RB_REMOVE_START(head, telm));				\
 }
 #else
-#define _RB_GENERATE_REMOVEC(name, type, field, cmp, attr)			\
+#define _RB_GENERATE_REMOVEC_SMALL(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_REMOVEC_LARGE(name, type, field, cmp, attr, lay, aug, ext)
+#endif
+
+#define _RB_GENERATE_REMOVEC_LARGE(name, type, field, cmp, attr, lay, aug, ext)		\
 										\
 attr struct type *								\
 name##_RB_REMOVEC(struct name *head, struct type *elm)				\
 {										\
-	return (NULL);								\
-}
-#endif
-
-#ifndef RB_SMALL
-#define _RB_GENERATE_ITERATE(name, type, field, cmp, attr)		\
-									\
-attr struct type *							\
-name##_RB_NEXT(struct type *elm)					\
-{									\
-	struct type *parent = NULL;					\
-									\
-	if (RB_RIGHT(elm, field)) {					\
-		elm = RB_RIGHT(elm, field);				\
-		while (RB_LEFT(elm, field))				\
-			elm = RB_LEFT(elm, field);			\
-	} else {							\
-		_RB_GET_PARENT(elm, parent, field);			\
-		while (parent && elm == RB_RIGHT(parent, field)) {	\
-			elm = parent;					\
-			_RB_GET_PARENT(parent, parent, field);		\
-		}							\
-		elm = parent;						\
-	}								\
-	return (elm);							\
-}									\
-									\
-attr struct type *							\
-name##_RB_PREV(struct type *elm)					\
-{									\
-	struct type *parent = NULL;					\
-									\
-	if (RB_LEFT(elm, field)) {					\
-		elm = RB_LEFT(elm, field);				\
-		while (RB_RIGHT(elm, field))				\
-			elm = RB_RIGHT(elm, field);			\
-	} else {							\
-		_RB_GET_PARENT(elm, parent, field);			\
-		while (parent && elm == RB_LEFT(parent, field)) {	\
-			elm = parent;					\
-			_RB_GET_PARENT(parent, parent, field);		\
-		}							\
-		elm = parent;						\
-	}								\
-	return (elm);							\
+	return (name##_RB_REMOVE_START(head, elm));				\
 }
-#else
-#define _RB_GENERATE_ITERATE(name, type, field, cmp, attr)
-#endif
-
 
-#define RB_GENERATE(name, type, field, cmp)					\
-	_RB_GENERATE_INTERNAL(name, type, field, cmp,)
+/*
+ * RB_INSERT_TOPDOWN and RB_REMOVE_TOPDOWN do what RB_INSERT and RB_REMOVE
+ * do in one pass down the tree, without the stack in the head. The descent
+ * remembers the lowest node at which the promotions or demotions would stop
+ * going up, and once the node is linked or unlinked they are made on a walk
+ * down from there, with the rotation, if any, at that node. That walk is
+ * O(1) nodes amortized and repeats their comparisons. Augmented trees are
+ * then updated by a recursive walk down from the root.
+ *
+ * In the large and threaded layouts, and under the AVL and red-black rules,
+ * these are RB_INSERT and RB_REMOVE.
+ */
+#ifndef RB_THREADED
+/*
+ * a demotion below elm in dir goes on above it when that child is 2 below
+ * already and the other one is too, or is a 2,2 node
+ */
+#define _RB_DEMOTE_UP(elm, dir, field)						\
+(_RB_GET_RDIFF(elm, dir, field) && (_RB_GET_RDIFF(elm, _RB_ODIR(dir), field) ||	\
+    (_RB_GET_RDIFF(_RB_PTR(_RB_GET_CHILD(elm, _RB_ODIR(dir), field)), _RB_LDIR, field) &&	\
+    _RB_GET_RDIFF(_RB_PTR(_RB_GET_CHILD(elm, _RB_ODIR(dir), field)), _RB_RDIR, field))))
+
+#define _RB_GENERATE_TOPDOWN_SMALL(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+/* updates the nodes on the path of key from elm down to stop, bottom up */	\
+attr void									\
+name##_RB_AUGMENT_PATH(struct type *elm, struct type *key,			\
+    struct type *pivot, struct type *stop)					\
+{										\
+	if (elm != stop)							\
+		name##_RB_AUGMENT_PATH((elm == pivot || cmp(key, elm) > 0) ?	\
+		    RB_RIGHT(elm, field) : RB_LEFT(elm, field), key, pivot, stop);	\
+	(void)aug(elm);								\
+}										\
+										\
+attr struct type *								\
+name##_RB_INSERT_TOPDOWN(struct name *head, struct type *elm)			\
+{										\
+	struct type *parent, *tmp, *top, *tpar, *child, *edge;			\
+	__typeof(cmp(NULL, NULL)) comp;						\
+	uintptr_t insdir, dir, tdir, sibdir;					\
+	int spine;								\
+										\
+	if (name##_RB_RULE != RB_RULE_WAVL)					\
+		return (name##_RB_INSERT(head, elm));				\
+	_RB_EXT(FLUSH, ext, name, head);					\
+	_RB_EXT(KEY, ext, name, elm);						\
+	_RB_SET_CHILD(elm, _RB_LDIR, NULL, field);				\
+	_RB_SET_CHILD(elm, _RB_RDIR, NULL, field);				\
+	tmp = RB_ROOT(head);							\
+	if (tmp == NULL) {							\
+		if (_RB_EXT_REFUSED(name, head, elm, ext))			\
+			return (elm);						\
+		_RB_SET_ROOT(head, elm);					\
+		_RB_EXT(INIT, ext, name, head, elm);				\
+		return (NULL);							\
+	}									\
+	comp = cmp(elm, tmp);							\
+	if (comp == 0)								\
+		return (tmp);							\
+	insdir = (comp < 0) ? _RB_LDIR : _RB_RDIR;				\
+	/* beyond the cached min or max the path is the spine */		\
+	spine = 0;								\
+	edge = _RB_EXT_FIRST(EDGE, ext, head, insdir);				\
+	if (edge != NULL && edge != tmp) {					\
+		comp = cmp(elm, edge);						\
+		if (comp == 0)							\
+			return (edge);						\
+		spine = ((comp < 0) == (insdir == _RB_LDIR));			\
+	}									\
+	/* the promotions stop at the lowest node that is not 1,1 */		\
+	top = tpar = parent = NULL;						\
+	for (;;) {								\
+		if (_RB_GET_RDIFF(tmp, _RB_LDIR, field) |			\
+		    _RB_GET_RDIFF(tmp, _RB_RDIR, field)) {			\
+			top = tmp;						\
+			tpar = parent;						\
+		}								\
+		parent = tmp;							\
+		tmp = _RB_PTR(_RB_GET_CHILD(tmp, insdir, field));		\
+		if (tmp == NULL)						\
+			break;							\
+		if (!spine) {							\
+			comp = cmp(elm, tmp);					\
+			if (comp == 0)						\
+				return (tmp);					\
+			insdir = (comp < 0) ? _RB_LDIR : _RB_RDIR;		\
+		}								\
+	}									\
+	if (_RB_EXT_REFUSED(name, head, elm, ext))				\
+		return (elm);							\
+	_RB_EXT(INSERT, ext, name, head, parent, insdir, elm);			\
+	/* a leaf parent is 1,1, so a parent at the top takes elm as its 2 child */	\
+	_RB_SET_CHILD(parent, insdir, elm, field);				\
+	if (top != parent) {							\
+		tdir = insdir;							\
+		if (top != NULL) {						\
+			if (!spine)						\
+				tdir = cmp(elm, top) < 0 ? _RB_LDIR : _RB_RDIR;	\
+			child = _RB_PTR(_RB_GET_CHILD(top, tdir, field));	\
+		} else								\
+			child = RB_ROOT(head);					\
+		/* every node below top is promoted */				\
+		for (tmp = child; tmp != elm;					\
+		    tmp = _RB_PTR(_RB_GET_CHILD(tmp, dir, field))) {		\
+			dir = insdir;						\
+			if (!spine)						\
+				dir = cmp(elm, tmp) < 0 ? _RB_LDIR : _RB_RDIR;	\
+			_RB_SET_RDIFF1(tmp, _RB_ODIR(dir), field);		\
+		}								\
+		if (top != NULL && _RB_GET_RDIFF(top, tdir, field))		\
+			_RB_FLIP_RDIFF(top, tdir, field);			\
+		else if (top != NULL) {						\
+			/* case (2.2) of the bottom up insert, with parent top */	\
+			sibdir = _RB_ODIR(tdir);				\
+			_RB_FLIP_RDIFF(top, sibdir, field);			\
+			_RB_SET_RDIFF0(child, tdir, field);			\
+			if (_RB_GET_RDIFF(child, sibdir, field) == 0) {		\
+				tmp = _RB_PTR(_RB_GET_CHILD(child, sibdir, field));	\
+				_RB_ROTATE(child, tmp, tdir, field, lay);	\
+			} else {						\
+				tmp = child;					\
+				_RB_FLIP_RDIFF(child, sibdir, field);		\
+			}							\
+			_RB_ROTATE(top, tmp, sibdir, field, lay);		\
+			_RB_SWAP_CHILD_OR_ROOT(head, tpar, top, tmp, field);	\
+			(void)aug(top);						\
+			if (tmp != child)					\
+				(void)aug(child);				\
+		}								\
+	}									\
+	if (_RB_AUGMENTED(aug, elm))						\
+		name##_RB_AUGMENT_PATH(RB_ROOT(head), elm, NULL, elm);		\
+	return (NULL);								\
+}										\
+										\
+attr struct type *								\
+name##_RB_REMOVE_TOPDOWN(struct name *head, struct type *elm)			\
+{										\
+	struct type *parent, *opar, *telm, *tmp, *top, *tpar, *otop, *otpar;	\
+	struct type *rmin, *child, *cptr, *sibling, *pivot;			\
+	__typeof(cmp(NULL, NULL)) comp;						\
+	uintptr_t dir, tdir, sibdir, ssdiff, sodiff;				\
+	int leaf, extend;							\
+										\
+	if (name##_RB_RULE != RB_RULE_WAVL)					\
+		return (name##_RB_REMOVE(head, elm));				\
+	_RB_EXT(FLUSH, ext, name, head);					\
+	_RB_EXT(KEY, ext, name, elm);						\
+	/* the demotions stop at the lowest node where _RB_DEMOTE_UP fails */	\
+	top = tpar = otop = otpar = parent = NULL;				\
+	telm = RB_ROOT(head);							\
+	while (telm != NULL && (comp = cmp(elm, telm)) != 0) {			\
+		dir = (comp < 0) ? _RB_LDIR : _RB_RDIR;				\
+		if (!_RB_DEMOTE_UP(telm, dir, field)) {				\
+			otop = top;						\
+			otpar = tpar;						\
+			top = telm;						\
+			tpar = parent;						\
+		}								\
+		parent = telm;							\
+		telm = _RB_PTR(_RB_GET_CHILD(telm, dir, field));		\
+	}									\
+	if (telm == NULL)							\
+		return (NULL);							\
+	opar = parent;								\
+	pivot = NULL;								\
+	rmin = RB_RIGHT(telm, field);						\
+	if (rmin != NULL && RB_LEFT(telm, field) != NULL) {			\
+		/* the successor takes the place and the rank of telm */	\
+		for (dir = _RB_RDIR, tmp = telm; tmp != rmin;			\
+		    dir = _RB_LDIR, tmp = rmin, rmin = RB_LEFT(rmin, field)) {	\
+			if (!_RB_DEMOTE_UP(tmp, dir, field)) {			\
+				otop = top;					\
+				otpar = tpar;					\
+				top = tmp;					\
+				tpar = parent;					\
+			}							\
+			parent = tmp;						\
+			if (RB_LEFT(rmin, field) == NULL)			\
+				break;						\
+		}								\
+		pivot = rmin;							\
+	}									\
+	if (_RB_EXT_ANY(VETO, ext, name, head, RB_LOG_REMOVE, telm))		\
+		return (NULL);							\
+	_RB_EXT(REMOVE, ext, name, head, telm, opar, field);			\
+										\
+	child = _RB_GET_CHILD(telm, _RB_LDIR, field);				\
+	cptr = _RB_PTR(child);							\
+	if (pivot == NULL) {							\
+		rmin = child = (rmin == NULL ? cptr : rmin);			\
+		parent = opar;							\
+	} else {								\
+		_RB_SET_CHILD(rmin, _RB_LDIR, child, field);			\
+		child = _RB_GET_CHILD(rmin, _RB_RDIR, field);			\
+		if (parent != telm) {						\
+			_RB_SET_CHILD(rmin, _RB_RDIR, _RB_GET_CHILD(telm, _RB_RDIR, field), field);	\
+			_RB_REPLACE_CHILD(parent, _RB_LDIR, child, rmin, field);	\
+		} else {							\
+			parent = rmin;						\
+			if (_RB_GET_RDIFF(telm, _RB_RDIR, field))		\
+				_RB_SET_RDIFF1(rmin, _RB_RDIR, field);		\
+		}								\
+	}									\
+	_RB_SWAP_CHILD_OR_ROOT(head, opar, telm, rmin, field);			\
+	if (parent == NULL)							\
+		return (telm);							\
+										\
+	/* a parent left without children is demoted to a 1,1 leaf */		\
+	leaf = (RB_LEFT(parent, field) == NULL && RB_RIGHT(parent, field) == NULL);	\
+	if (leaf) {								\
+		_RB_SET_RDIFF0(parent, _RB_LDIR, field);			\
+		_RB_SET_RDIFF0(parent, _RB_RDIR, field);			\
+		if (top == parent) {						\
+			top = otop;						\
+			tpar = otpar;						\
+		}								\
+	}									\
+	if (top == telm)							\
+		top = rmin;							\
+	if (tpar == telm)							\
+		tpar = rmin;							\
+	tdir = _RB_LDIR;							\
+	for (tmp = (top == NULL ? RB_ROOT(head) : top);				\
+	    tmp != parent || !leaf;						\
+	    tmp = _RB_PTR(_RB_GET_CHILD(tmp, dir, field))) {			\
+		dir = (tmp == pivot || cmp(elm, tmp) > 0) ? _RB_RDIR : _RB_LDIR;	\
+		sibdir = _RB_ODIR(dir);						\
+		if (tmp == top)							\
+			tdir = dir;						\
+		else if (_RB_GET_RDIFF(tmp, sibdir, field)) {			\
+			/* case 2.1 of the bottom up remove */			\
+			_RB_FLIP_RDIFF(tmp, sibdir, field);			\
+		} else {							\
+			/* case 2.2a */						\
+			sibling = _RB_PTR(_RB_GET_CHILD(tmp, sibdir, field));	\
+			_RB_FLIP_RDIFF(sibling, _RB_LDIR, field);		\
+			_RB_FLIP_RDIFF(sibling, _RB_RDIR, field);		\
+		}								\
+		if (tmp == parent)						\
+			break;							\
+	}									\
+	if (top != NULL && _RB_GET_RDIFF(top, tdir, field) == 0)		\
+		_RB_FLIP_RDIFF(top, tdir, field);				\
+	else if (top != NULL) {							\
+		/* cases 2.2b and 2.2c, with parent top */			\
+		sibdir = _RB_ODIR(tdir);					\
+		sibling = _RB_PTR(_RB_GET_CHILD(top, sibdir, field));		\
+		ssdiff = _RB_GET_RDIFF(sibling, tdir, field);			\
+		sodiff = _RB_GET_RDIFF(sibling, sibdir, field);			\
+		extend = 0;							\
+		if (sodiff) {							\
+			_RB_FLIP_RDIFF(sibling, sibdir, field);			\
+			_RB_FLIP_RDIFF(top, tdir, field);			\
+			tmp = _RB_PTR(_RB_GET_CHILD(sibling, tdir, field));	\
+			_RB_ROTATE(sibling, tmp, sibdir, field, lay);		\
+			_RB_SET_RDIFF1(tmp, sibdir, field);			\
+			extend = 1;						\
+		} else {							\
+			_RB_FLIP_RDIFF(sibling, sibdir, field);			\
+			if (ssdiff) {						\
+				_RB_FLIP_RDIFF(sibling, tdir, field);		\
+				_RB_FLIP_RDIFF(top, tdir, field);		\
+				extend = 1;					\
+			}							\
+			_RB_FLIP_RDIFF(top, sibdir, field);			\
+			tmp = sibling;						\
+		}								\
+		_RB_ROTATE(top, tmp, tdir, field, lay);				\
+		_RB_SWAP_CHILD_OR_ROOT(head, tpar, top, tmp, field);		\
+		if (extend)							\
+			_RB_SET_RDIFF1(tmp, tdir, field);			\
+		(void)aug(top);							\
+		if (tmp != sibling)						\
+			(void)aug(sibling);					\
+	}									\
+	if (_RB_AUGMENTED(aug, elm))						\
+		name##_RB_AUGMENT_PATH(RB_ROOT(head), elm, pivot, parent);	\
+	return (telm);								\
+}
+#else
+#define _RB_GENERATE_TOPDOWN_SMALL(name, type, field, cmp, attr, lay, aug, ext)	\
+	_RB_GENERATE_TOPDOWN_LARGE(name, type, field, cmp, attr, lay, aug, ext)
+#endif
+
+#define _RB_GENERATE_TOPDOWN_LARGE(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+attr struct type *								\
+name##_RB_INSERT_TOPDOWN(struct name *head, struct type *elm)			\
+{										\
+	return (name##_RB_INSERT(head, elm));					\
+}										\
+										\
+attr struct type *								\
+name##_RB_REMOVE_TOPDOWN(struct name *head, struct type *elm)			\
+{										\
+	return (name##_RB_REMOVE(head, elm));					\
+}
+
+#define _RB_GENERATE_ITERATE_LARGE(name, type, field, cmp, attr, lay, aug, ext)		\
+									\
+attr struct type *							\
+name##_RB_NEXT(struct type *elm)					\
+{									\
+	struct type *parent = NULL;					\
+									\
+	if (RB_RIGHT(elm, field)) {					\
+		elm = RB_RIGHT(elm, field);				\
+		while (RB_LEFT(elm, field))				\
+			elm = RB_LEFT(elm, field);			\
+	} else {							\
+		_RB_GET_PARENT##lay(elm, parent, field);			\
+		while (parent && elm == RB_RIGHT(parent, field)) {	\
+			elm = parent;					\
+			_RB_GET_PARENT##lay(parent, parent, field);		\
+		}							\
+		elm = parent;						\
+	}								\
+	return (elm);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_PREV(struct type *elm)					\
+{									\
+	struct type *parent = NULL;					\
+									\
+	if (RB_LEFT(elm, field)) {					\
+		elm = RB_LEFT(elm, field);				\
+		while (RB_RIGHT(elm, field))				\
+			elm = RB_RIGHT(elm, field);			\
+	} else {							\
+		_RB_GET_PARENT##lay(elm, parent, field);			\
+		while (parent && elm == RB_LEFT(parent, field)) {	\
+			elm = parent;					\
+			_RB_GET_PARENT##lay(parent, parent, field);		\
+		}							\
+		elm = parent;						\
+	}								\
+	return (elm);							\
+}
+
+#ifndef RB_THREADED
+#define _RB_GENERATE_ITERATE_SMALL(name, type, field, cmp, attr, lay, aug, ext)
+#define _RB_GENERATE_THREAD_SMALL(name, type, field, cmp, attr, lay, aug, ext)
+#else
+/* a null link leads straight to the neighbour */
+#define _RB_GENERATE_ITERATE_SMALL(name, type, field, cmp, attr, lay, aug, ext)	\
+									\
+attr struct type *							\
+name##_RB_NEXT(struct type *elm)					\
+{									\
+	struct type *tmp = RB_RIGHT(elm, field);			\
+									\
+	if (tmp == NULL)						\
+		return (_RB_THREAD##lay(elm, _RB_RDIR, field));		\
+	while (RB_LEFT(tmp, field))					\
+		tmp = RB_LEFT(tmp, field);				\
+	return (tmp);							\
+}									\
+									\
+attr struct type *							\
+name##_RB_PREV(struct type *elm)					\
+{									\
+	struct type *tmp = RB_LEFT(elm, field);				\
+									\
+	if (tmp == NULL)						\
+		return (_RB_THREAD##lay(elm, _RB_LDIR, field));		\
+	while (RB_RIGHT(tmp, field))					\
+		tmp = RB_RIGHT(tmp, field);				\
+	return (tmp);							\
+}
+
+/* sets every thread of the subtree, *prev is the node before it */
+#define _RB_GENERATE_THREAD_SMALL(name, type, field, cmp, attr, lay, aug, ext)	\
+static void								\
+name##_RB_THREAD(struct type *elm, struct type **prev)			\
+{									\
+	while (elm != NULL) {						\
+		if (RB_LEFT(elm, field) != NULL)			\
+			name##_RB_THREAD(RB_LEFT(elm, field), prev);	\
+		else							\
+			_RB_SET_THREAD##lay(elm, _RB_LDIR, *prev, field);	\
+		if (*prev != NULL && RB_RIGHT(*prev, field) == NULL)	\
+			_RB_SET_THREAD##lay(*prev, _RB_RDIR, elm, field);	\
+		*prev = elm;						\
+		elm = RB_RIGHT(elm, field);				\
+	}								\
+}
+#endif
+#define _RB_GENERATE_THREAD_LARGE(name, type, field, cmp, attr, lay, aug, ext)
+
+
+
+/*
+ * The rank rule of the tree, the functions each feature needs ahead of the
+ * generated ones, and the tree, with the compare put in front of cmp by
+ * RB_PREFIX if it is listed.
+ */
+#define _RB_GENERATE_FEATURES(name, type, field, cmp, attr, lay, aug, ...)	\
+	_RB_GENERATE_FEATURES_(name, type, field, cmp, attr, lay, aug,		\
+	    _RB_MAP(_RB_FEATURE, __VA_ARGS__))
+
+#define _RB_GENERATE_FEATURES_(name, type, field, cmp, attr, lay, aug, ...)	\
+	enum { name##_RB_RULE =							\
+	    _RB_CAT(_RB_RULE, _RB_EACH(_RB_RULESUFFIX, , __VA_ARGS__))() };	\
+	_RB_EACH(_RB_GENERATE_PRE, (name, type, field, cmp), __VA_ARGS__)	\
+	_RB_GENERATE_INTERNAL(name, type, field,				\
+	    _RB_CAT(_RB_CMP, _RB_EACH(_RB_CMPSUFFIX, , __VA_ARGS__))(name, cmp),	\
+	    attr, lay, aug, (_RB_MAP(_RB_SUFFIX, __VA_ARGS__)))
+
+#define _RB_CMP(name, cmp)					cmp
+#define _RB_CMP_PREFIX(name, cmp)				name##_RB_PREFIX_CMP
+
+#define _RB_GENERATE_PRE(x, t)					_RB_GENERATE_PRE_(_RB_LIST x, _RB_LIST t)
+#define _RB_GENERATE_PRE_(...)					_RB_GENERATE_PRE__(__VA_ARGS__)
+#define _RB_GENERATE_PRE__(name, type, field, cmp, suffix, fn, cmpsuffix, rulesuffix)	\
+	_RB_GENERATE_PRE##suffix(name, type, field, cmp, fn)
+
+#define _RB_GENERATE_PRE_NONE(name, type, field, cmp, fn)
+#define _RB_GENERATE_PRE_MINMAX(name, type, field, cmp, fn)
+#define _RB_GENERATE_PRE_BIASED(name, type, field, cmp, fn)
+#define _RB_GENERATE_PRE_INDEX(name, type, field, cmp, fn)
+#define _RB_GENERATE_PRE_HOT(name, type, field, cmp, fn)	_RB_GENERATE_HOTHASH(name, type, fn)
+#define _RB_GENERATE_PRE_BLOOM(name, type, field, cmp, fn)	_RB_GENERATE_BLOOMHASH(name, type, fn)
+#define _RB_GENERATE_PRE_PREFIX(name, type, field, cmp, fn)	_RB_GENERATE_PREFIXCMP(name, type, field, cmp, fn)
+#define _RB_GENERATE_PRE_LOG(name, type, field, cmp, fn)	_RB_GENERATE_LOGFN(name, type, fn)
+#define _RB_GENERATE_PRE_RELAXED(name, type, field, cmp, fn)	_RB_GENERATE_RELAXEDFN(name, type)
+
+#define RB_GENERATE_SMALL(name, type, field, cmp)				\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _SMALL, _RB_AUGMENT, )
+
+#define RB_GENERATE_SMALL_STATIC(name, type, field, cmp)			\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _SMALL, _RB_AUGMENT, )
+
+#define RB_GENERATE_SMALL_AUGMENT(name, type, field, cmp, augfn)		\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _SMALL, augfn, )
+
+#define RB_GENERATE_SMALL_AUGMENT_STATIC(name, type, field, cmp, augfn)		\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _SMALL, augfn, )
+
+#define RB_GENERATE_SMALL_EXT(name, type, field, cmp, ...)			\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _SMALL, _RB_AUGMENT, __VA_ARGS__)
+
+#define RB_GENERATE_SMALL_EXT_STATIC(name, type, field, cmp, ...)		\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _SMALL, _RB_AUGMENT, __VA_ARGS__)
+
+#define RB_GENERATE_SMALL_EXT_AUGMENT(name, type, field, cmp, augfn, ...)	\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _SMALL, augfn, __VA_ARGS__)
+
+#define RB_GENERATE_SMALL_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, ...)	\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _SMALL, augfn, __VA_ARGS__)
+
+#define RB_GENERATE_LARGE(name, type, field, cmp)				\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _LARGE, _RB_AUGMENT, )
+
+#define RB_GENERATE_LARGE_STATIC(name, type, field, cmp)			\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _LARGE, _RB_AUGMENT, )
+
+#define RB_GENERATE_LARGE_AUGMENT(name, type, field, cmp, augfn)		\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _LARGE, augfn, )
+
+#define RB_GENERATE_LARGE_AUGMENT_STATIC(name, type, field, cmp, augfn)		\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _LARGE, augfn, )
+
+#define RB_GENERATE_LARGE_EXT(name, type, field, cmp, ...)			\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _LARGE, _RB_AUGMENT, __VA_ARGS__)
+
+#define RB_GENERATE_LARGE_EXT_STATIC(name, type, field, cmp, ...)		\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _LARGE, _RB_AUGMENT, __VA_ARGS__)
+
+#define RB_GENERATE_LARGE_EXT_AUGMENT(name, type, field, cmp, augfn, ...)	\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, , _LARGE, augfn, __VA_ARGS__)
+
+#define RB_GENERATE_LARGE_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, ...)	\
+	_RB_GENERATE_FEATURES(name, type, field, cmp, __attribute__((__unused__)) static, _LARGE, augfn, __VA_ARGS__)
+
+#ifdef RB_SMALL
+#define RB_GENERATE(name, type, field, cmp)					\
+	RB_GENERATE_SMALL(name, type, field, cmp)
 
 #define RB_GENERATE_STATIC(name, type, field, cmp)				\
-	_RB_GENERATE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static)
+	RB_GENERATE_SMALL_STATIC(name, type, field, cmp)
 
-#define _RB_GENERATE_INTERNAL(name, type, field, cmp, attr)			\
-	_RB_GENERATE_RANK(name, type, field, cmp, attr)				\
-	_RB_GENERATE_FIND(name, type, field, cmp, attr)				\
-	_RB_GENERATE_FINDC(name, type, field, cmp, attr)			\
-	_RB_GENERATE_INSERT(name, type, field, cmp, attr)			\
-	_RB_GENERATE_INSERT_ITERATE(name, type, field, cmp, attr)		\
-	_RB_GENERATE_REMOVE(name, type, field, cmp, attr)			\
-	_RB_GENERATE_REMOVEC(name, type, field, cmp, attr)			\
-	_RB_GENERATE_ITERATE(name, type, field, cmp, attr)			\
-	_RB_GENERATE_MINMAX(name, type, field, cmp, attr)
+#define RB_GENERATE_AUGMENT(name, type, field, cmp, augfn)			\
+	RB_GENERATE_SMALL_AUGMENT(name, type, field, cmp, augfn)
 
+#define RB_GENERATE_AUGMENT_STATIC(name, type, field, cmp, augfn)		\
+	RB_GENERATE_SMALL_AUGMENT_STATIC(name, type, field, cmp, augfn)
+
+#define RB_GENERATE_EXT(name, type, field, cmp, ...)				\
+	RB_GENERATE_SMALL_EXT(name, type, field, cmp, __VA_ARGS__)
+
+#define RB_GENERATE_EXT_STATIC(name, type, field, cmp, ...)			\
+	RB_GENERATE_SMALL_EXT_STATIC(name, type, field, cmp, __VA_ARGS__)
+
+#define RB_GENERATE_EXT_AUGMENT(name, type, field, cmp, augfn, ...)		\
+	RB_GENERATE_SMALL_EXT_AUGMENT(name, type, field, cmp, augfn, __VA_ARGS__)
+
+#define RB_GENERATE_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, ...)	\
+	RB_GENERATE_SMALL_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, __VA_ARGS__)
+#else
+#define RB_GENERATE(name, type, field, cmp)					\
+	RB_GENERATE_LARGE(name, type, field, cmp)
 
+#define RB_GENERATE_STATIC(name, type, field, cmp)				\
+	RB_GENERATE_LARGE_STATIC(name, type, field, cmp)
+
+#define RB_GENERATE_AUGMENT(name, type, field, cmp, augfn)			\
+	RB_GENERATE_LARGE_AUGMENT(name, type, field, cmp, augfn)
+
+#define RB_GENERATE_AUGMENT_STATIC(name, type, field, cmp, augfn)		\
+	RB_GENERATE_LARGE_AUGMENT_STATIC(name, type, field, cmp, augfn)
+
+#define RB_GENERATE_EXT(name, type, field, cmp, ...)				\
+	RB_GENERATE_LARGE_EXT(name, type, field, cmp, __VA_ARGS__)
+
+#define RB_GENERATE_EXT_STATIC(name, type, field, cmp, ...)			\
+	RB_GENERATE_LARGE_EXT_STATIC(name, type, field, cmp, __VA_ARGS__)
+
+#define RB_GENERATE_EXT_AUGMENT(name, type, field, cmp, augfn, ...)		\
+	RB_GENERATE_LARGE_EXT_AUGMENT(name, type, field, cmp, augfn, __VA_ARGS__)
+
+#define RB_GENERATE_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, ...)	\
+	RB_GENERATE_LARGE_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, __VA_ARGS__)
+#endif
+
+/*
+ * 'lay' is the layout suffix, either _SMALL or _LARGE.
+ * 'aug' is the augment function, or _RB_AUGMENT for the global RB_AUGMENT.
+ * 'ext' is the list of the suffixes of the features in parentheses, out of
+ * _MINMAX, _HOT, _BLOOM, _PREFIX, _LOG, _RELAXED, _BIASED and _INDEX, or
+ * (_NONE).
+ */
+#define _RB_GENERATE_INTERNAL(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_THREAD##lay(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_RANK(name, type, field, cmp, attr, lay, aug, ext)			\
+	_RB_GENERATE_SERIALIZE(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_COMPACT(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_REBUILD(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_DESTROY(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_CLONE(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_FREEZE(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_FIND(name, type, field, cmp, attr, lay, aug, ext)			\
+	_RB_GENERATE_FINDC##lay(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_GENERATE_ITERATE##lay(name, type, field, cmp, attr, lay, aug, ext)	\
+	_RB_GENERATE_INSERT(name, type, field, cmp, attr, lay, aug, ext)			\
+	_RB_GENERATE_INSERT_ITERATE##lay(name, type, field, cmp, attr, lay, aug, ext)	\
+	_RB_GENERATE_REMOVE(name, type, field, cmp, attr, lay, aug, ext)			\
+	_RB_GENERATE_REMOVEC##lay(name, type, field, cmp, attr, lay, aug, ext)	\
+	_RB_GENERATE_TOPDOWN##lay(name, type, field, cmp, attr, lay, aug, ext)	\
+	_RB_GENERATE_MINMAX(name, type, field, cmp, attr, lay, aug, ext)		\
+	_RB_EACH(_RB_GENERATE_FEATURE, (name, type, field, cmp, attr, lay, aug, ext), _RB_LIST ext)
+
+/* the functions specific to each feature */
+#define _RB_GENERATE_FEATURE(x, suffix)					_RB_GENERATE_EXT##suffix x
+
+#define _RB_GENERATE_EXT_NONE(name, type, field, cmp, attr, lay, aug, ext)
+#define _RB_GENERATE_EXT_HOT(name, type, field, cmp, attr, lay, aug, ext)
+#define _RB_GENERATE_EXT_PREFIX(name, type, field, cmp, attr, lay, aug, ext)
+
+#define _RB_GENERATE_EXT_INDEX(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+/* the links are relative, only the root and the caches follow the array */	\
+attr void									\
+name##_RB_RELOCATE(struct name *head, struct type *base)			\
+{										\
+	struct type *root = RB_ROOT(head);					\
+										\
+	if (root != NULL)							\
+		_RB_SET_ROOT(head, base + (root - _RB_LOAD_SLOT(head->base)));	\
+	_RB_STORE_SLOT(head->base, base);					\
+	if (root != NULL)							\
+		_RB_EXT(MOVED, ext, name, head, field);				\
+}
+
+#define _RB_GENERATE_EXT_MINMAX(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+/* removes the cached extreme, no comparisons are needed to find it */	\
+attr struct type *								\
+name##_RB_POP(struct name *head, int dir)					\
+{										\
+	struct type *elm;							\
+										\
+	if (RB_EMPTY(head))							\
+		return (NULL);							\
+	elm = _RB_LOAD_SLOT((head)->minmax[dir]);				\
+	_RB_SPINE_PATH##lay(head, elm, dir, field);				\
+	return (name##_RB_REMOVE_START(head, elm));				\
+}
+
+#define _RB_GENERATE_EXT_BLOOM(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+static void									\
+name##_RB_BLOOM_FILL(struct name *head, struct type *elm)			\
+{										\
+	if (elm == NULL)							\
+		return;								\
+	name##_RB_BLOOM_UPDATE(head, elm, 1);					\
+	name##_RB_BLOOM_FILL(head, RB_LEFT(elm, field));			\
+	name##_RB_BLOOM_FILL(head, RB_RIGHT(elm, field));			\
+}										\
+										\
+/* k = bits_per_key * ln(2) hash functions minimize the false positives */	\
+attr void									\
+name##_RB_BLOOM_INIT(struct name *head, uint8_t *cells, size_t nkeys,		\
+    unsigned int bits_per_key)							\
+{										\
+	size_t i;								\
+										\
+	_RB_STORE_SLOT(head->bloom, cells);					\
+	head->bloom_size = RB_BLOOM_SIZE(nkeys, bits_per_key);			\
+	head->bloom_k = (bits_per_key * 7 + 5) / 10;				\
+	if (head->bloom_k < 1)							\
+		head->bloom_k = 1;						\
+	for (i = 0; i < head->bloom_size; i++)					\
+		cells[i] = 0;							\
+	name##_RB_BLOOM_FILL(head, RB_ROOT(head));				\
+}
+
+#define _RB_GENERATE_EXT_LOG(name, type, field, cmp, attr, lay, aug, ext)	\
+									\
+attr struct type *							\
+name##_RB_REPLAY(struct name *head, int op, struct type *elm)		\
+{									\
+	struct type *res;						\
+	void *log = head->log;						\
+									\
+	head->log = NULL;						\
+	if (op == RB_LOG_INSERT) {					\
+		_RB_LOG_INSERT##lay(name, head, elm, cmp, res);		\
+		if (res == NULL)					\
+			_RB_STORE_SLOT(head->hint, elm);		\
+	} else if (op == RB_LOG_REMOVE) {				\
+		res = name##_RB_FIND(head, elm);			\
+		if (res != NULL)					\
+			name##_RB_REMOVE(head, res);			\
+	} else								\
+		res = NULL;						\
+	head->log = log;						\
+	return (res);							\
+}
+
+/* RB_REBALANCE and the functions behind the hooks of RB_RELAXED */
+#define _RB_GENERATE_EXT_RELAXED(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+/* the path from the root to parent is on the stack, without parent */		\
+static void									\
+name##_RB_SETTLE(struct name *head, struct type *parent, struct type *elm)	\
+{										\
+	uintptr_t elmdir;							\
+										\
+	_RB_SET_RDIFF0(elm, _RB_LDIR, field);					\
+	elmdir = RB_LEFT(parent, field) == elm ? _RB_LDIR : _RB_RDIR;		\
+	if (_RB_GET_RDIFF(parent, elmdir, field))				\
+		_RB_FLIP_RDIFF(parent, elmdir, field);				\
+	else {									\
+		elm = name##_RB_INSERT_BALANCE(head, parent, elm);		\
+		_RB_STACK_POP##lay(head, parent);				\
+		_RB_GET_PARENT##lay(elm, parent, field);			\
+	}									\
+	(void)aug(elm);								\
+	_RB_AUGMENT_WALK(head, parent, field, lay, aug);			\
+}										\
+										\
+/* below a deferred parent elm takes its place, and it is balanced as a leaf */	\
+static int									\
+name##_RB_DEFER(struct name *head, struct type *parent, uintptr_t insdir,	\
+    struct type *elm)								\
+{										\
+	struct type *gpar = NULL;						\
+	size_t i;								\
+										\
+	if (!_RB_DEFERRED(parent, field)) {					\
+		/* only inserts that would rebalance are deferred */		\
+		if (_RB_GET_RDIFF(parent, insdir, field) ||			\
+		    head->npending == RB_RELAXED_SIZE)				\
+			return (0);						\
+		_RB_SET_CHILD(parent, insdir, elm, field);			\
+		_RB_SET_RDIFF1(elm, _RB_LDIR, field);				\
+		_RB_STORE_SLOT(head->pending[head->npending], elm);		\
+		head->npending++;						\
+		(void)aug(elm);							\
+		_RB_AUGMENT_WALK(head, parent, field, lay, aug);		\
+		return (1);							\
+	}									\
+	_RB_SET_CHILD(parent, insdir, elm, field);				\
+	_RB_SET_RDIFF0(parent, _RB_LDIR, field);				\
+	_RB_SET_RDIFF1(elm, _RB_LDIR, field);					\
+	for (i = 0; _RB_LOAD_SLOT(head->pending[i]) != parent; i++)		\
+		;								\
+	_RB_STORE_SLOT(head->pending[i], elm);					\
+	(void)aug(elm);								\
+	_RB_STACK_POP##lay(head, gpar);						\
+	_RB_GET_PARENT##lay(parent, gpar, field);				\
+	name##_RB_SETTLE(head, gpar, parent);					\
+	return (1);								\
+}										\
+										\
+static void									\
+name##_RB_UNQUEUE(struct name *head, struct type *elm)				\
+{										\
+	size_t i;								\
+										\
+	for (i = 0; _RB_LOAD_SLOT(head->pending[i]) != elm; i++)		\
+		;								\
+	--head->npending;							\
+	_RB_STORE_SLOT(head->pending[i], _RB_LOAD_SLOT(head->pending[head->npending]));	\
+}										\
+										\
+static void									\
+name##_RB_REQUEUE(struct name *head, struct type *elm)				\
+{										\
+	while (elm != NULL) {							\
+		if (_RB_DEFERRED(elm, field)) {					\
+			_RB_STORE_SLOT(head->pending[head->npending], elm);	\
+			head->npending++;					\
+		}								\
+		name##_RB_REQUEUE(head, RB_LEFT(elm, field));			\
+		elm = RB_RIGHT(elm, field);					\
+	}									\
+}										\
+										\
+/* the last insert deferred is the first one finished */			\
+static size_t									\
+name##_RB_RESUME(struct name *head, size_t budget)				\
+{										\
+	struct type *parent = NULL, *elm;					\
+										\
+	for (; budget > 0 && head->npending > 0; budget--) {			\
+		--head->npending;						\
+		elm = _RB_LOAD_SLOT(head->pending[head->npending]);		\
+		elm = _RB_REMOVE_FIND##lay(name, head, elm);			\
+		_RB_STACK_POP##lay(head, elm);					\
+		_RB_STACK_POP##lay(head, parent);				\
+		_RB_GET_PARENT##lay(elm, parent, field);			\
+		name##_RB_SETTLE(head, parent, elm);				\
+	}									\
+	return (head->npending);						\
+}										\
+										\
+attr size_t									\
+name##_RB_REBALANCE(struct name *head, size_t budget)				\
+{										\
+	return (name##_RB_RESUME(head, budget));				\
+}
+
+/* the most nodes a subtree of rank r has under any rule, 2^(r + 1) - 1 */
+#define _RB_BIAS_MAX(r)								\
+((r) < 0 ? (size_t)0 : (r) >= (int)sizeof(size_t) * 8 - 1 ? SIZE_MAX :		\
+    ((size_t)2 << (r)) - 1)
+
+/* RB_REBIAS, lo[r + 1] is the fewest nodes a subtree of rank r has */
+#define _RB_GENERATE_EXT_BIASED(name, type, field, cmp, attr, lay, aug, ext)	\
+										\
+/* whether the rule lets a node of rank have children of lrank and rrank */	\
+static inline int								\
+name##_RB_BIAS_RANKS(int rank, int lrank, int rrank)				\
+{										\
+	if (lrank < -1 || rrank < -1)						\
+		return (0);							\
+	if (name##_RB_RULE == RB_RULE_RB && rank % 2 == 0)			\
+		return (lrank == rank - 1 && rrank == rank - 1);		\
+	if (lrank == rank - 2 && rrank == rank - 2)				\
+		return (name##_RB_RULE == RB_RULE_RB ||				\
+		    (name##_RB_RULE == RB_RULE_WAVL && rank >= 2));		\
+	return (1);								\
+}										\
+										\
+/*										\
+ * links the next n nodes of the list at *next, which weigh total, into a	\
+ * subtree of the given rank, splitting it at the middle of the weight		\
+ */										\
+static struct type *								\
+name##_RB_BIAS_BUILD(struct type **next, size_t n, uint64_t total, int rank,	\
+    const size_t *lo)								\
+{										\
+	struct type *elm, *left, *right;					\
+	uint64_t lsum;								\
+	size_t i, k, kmin, kmax, dist, best;					\
+	int lrank, rrank, l, r;							\
+										\
+	if (n == 0)								\
+		return (NULL);							\
+	lsum = 0;								\
+	for (i = 0, elm = *next; i < n - 1; i++, elm = RB_RIGHT(elm, field)) {	\
+		if (lsum + RB_WEIGHT(elm, field) + 1 > total / 2)		\
+			break;							\
+		lsum += RB_WEIGHT(elm, field) + 1;				\
+	}									\
+	/* the root moves as little as the ranks of the children allow */	\
+	best = SIZE_MAX;							\
+	k = i;									\
+	lrank = rrank = rank - 1;						\
+	for (l = rank - 2; l < rank; l++)					\
+		for (r = rank - 2; r < rank; r++) {				\
+			if (!name##_RB_BIAS_RANKS(rank, l, r) || lo[r + 1] > n - 1)	\
+				continue;					\
+			kmin = n - 1 > _RB_BIAS_MAX(r) ? n - 1 - _RB_BIAS_MAX(r) : 0;	\
+			if (kmin < lo[l + 1])					\
+				kmin = lo[l + 1];				\
+			kmax = n - 1 - lo[r + 1];				\
+			if (kmax > _RB_BIAS_MAX(l))				\
+				kmax = _RB_BIAS_MAX(l);				\
+			if (kmin > kmax)					\
+				continue;					\
+			dist = i < kmin ? kmin - i : i > kmax ? i - kmax : 0;	\
+			if (dist < best) {					\
+				best = dist;					\
+				k = i < kmin ? kmin : i > kmax ? kmax : i;	\
+				lrank = l;					\
+				rrank = r;					\
+			}							\
+		}								\
+	_RB_ASSERT(best != SIZE_MAX);						\
+	if (k != i)								\
+		for (lsum = 0, i = 0, elm = *next; i < k; i++, elm = RB_RIGHT(elm, field))	\
+			lsum += RB_WEIGHT(elm, field) + 1;			\
+	left = name##_RB_BIAS_BUILD(next, k, lsum, lrank, lo);			\
+	elm = *next;								\
+	*next = RB_RIGHT(elm, field);						\
+	right = name##_RB_BIAS_BUILD(next, n - 1 - k,				\
+	    total - lsum - RB_WEIGHT(elm, field) - 1, rrank, lo);		\
+	_RB_SET_CHILD(elm, _RB_LDIR, left, field);				\
+	_RB_SET_CHILD(elm, _RB_RDIR, right, field);				\
+	if (left != NULL)							\
+		_RB_SET_PARENT##lay(left, elm, field);				\
+	if (right != NULL)							\
+		_RB_SET_PARENT##lay(right, elm, field);				\
+	if (rank - lrank == 2)							\
+		_RB_SET_RDIFF1(elm, _RB_LDIR, field);				\
+	if (rank - rrank == 2)							\
+		_RB_SET_RDIFF1(elm, _RB_RDIR, field);				\
+	(void)aug(elm);								\
+	return (elm);								\
+}										\
+										\
+/* rotates the tree into a list through the right links, then builds it back */	\
+attr void									\
+name##_RB_REBIAS(struct name *head)						\
+{										\
+	struct type *elm, *list;						\
+	size_t lo[RB_MAX_HEIGHT + 1], n;					\
+	uint64_t total = 0;							\
+	int rank;								\
+										\
+	_RB_EXT(FLUSH, ext, name, head);					\
+	list = name##_RB_VINE(RB_ROOT(head), &n);				\
+	if (n == 0)								\
+		return;								\
+	for (elm = list; elm != NULL; elm = RB_RIGHT(elm, field))		\
+		total += RB_WEIGHT(elm, field) + 1;				\
+	lo[0] = 0;								\
+	lo[1] = 1;								\
+	for (rank = 1; rank < RB_MAX_HEIGHT; rank++) {				\
+		if (lo[rank] > SIZE_MAX / 4)					\
+			lo[rank + 1] = SIZE_MAX;				\
+		else if (name##_RB_RULE == RB_RULE_AVL)				\
+			lo[rank + 1] = lo[rank] + lo[rank - 1] + 1;		\
+		else if (name##_RB_RULE == RB_RULE_RB && rank % 2 == 0)		\
+			lo[rank + 1] = 2 * lo[rank] + 1;			\
+		else if (name##_RB_RULE == RB_RULE_WAVL && rank == 1)		\
+			lo[rank + 1] = 2;					\
+		else								\
+			lo[rank + 1] = 2 * lo[rank - 1] + 1;			\
+	}									\
+	/* n sits about as far from either end of the sizes of the rank */	\
+	for (rank = 0; rank + 1 < RB_MAX_HEIGHT && lo[rank + 2] <= n &&		\
+	    _RB_BIAS_MAX(rank) / n < n / lo[rank + 1]; rank++)			\
+		;								\
+	elm = name##_RB_BIAS_BUILD(&list, n, total, rank, lo);			\
+	_RB_SET_PARENT##lay(elm, NULL, field);					\
+	_RB_SET_ROOT(head, elm);						\
+	_RB_RETHREAD##lay(name, head, field);					\
+}
+
+/*
+ * The k probes are derived from one hash by double hashing, and mapped
+ * onto the cells with a multiply and shift instead of a modulo.
+ */
+#define _RB_GENERATE_BLOOMHASH(name, type, hashfn)				\
+static inline void								\
+name##_RB_BLOOM_HASH(const struct type *elm, uint32_t *h1, uint32_t *h2)	\
+{										\
+	uint64_t h = (uint64_t)hashfn(elm) * 0x9e3779b97f4a7c15ULL;		\
+	*h1 = (uint32_t)(h >> 32);						\
+	*h2 = (uint32_t)h | 1U;							\
+}										\
+										\
+static inline void								\
+name##_RB_BLOOM_UPDATE(struct name *head, const struct type *elm, int delta)	\
+{										\
+	uint32_t h1, h2;							\
+	unsigned int i;								\
+	uint8_t *cells = _RB_LOAD_SLOT(head->bloom), *cell;			\
+										\
+	if (cells == NULL)							\
+		return;								\
+	name##_RB_BLOOM_HASH(elm, &h1, &h2);					\
+	for (i = 0; i < head->bloom_k; i++, h1 += h2) {				\
+		cell = &cells[((uint64_t)h1 * head->bloom_size) >> 32];		\
+		if (*cell != UINT8_MAX)						\
+			*cell += delta;						\
+	}									\
+}										\
+										\
+static inline int								\
+name##_RB_BLOOM_MAYBE(struct name *head, const struct type *elm)		\
+{										\
+	uint32_t h1, h2;							\
+	unsigned int i;								\
+	uint8_t *cells = _RB_LOAD_SLOT(head->bloom);				\
+										\
+	if (cells == NULL)							\
+		return (1);							\
+	name##_RB_BLOOM_HASH(elm, &h1, &h2);					\
+	for (i = 0; i < head->bloom_k; i++, h1 += h2)				\
+		if (cells[((uint64_t)h1 * head->bloom_size) >> 32] == 0)	\
+			return (0);						\
+	return (1);								\
+}
+
+/* equal prefixes say nothing about the order, only then is cmp needed */
+#define _RB_GENERATE_PREFIXCMP(name, type, field, cmp, prefixfn)		\
+static inline void								\
+name##_RB_PREFIX_KEY(struct type *elm)						\
+{										\
+	(elm)->field.prefix = prefixfn(elm);					\
+}										\
+										\
+static inline int								\
+name##_RB_PREFIX_CMP(struct type *a, struct type *b)				\
+{										\
+	if ((a)->field.prefix != (b)->field.prefix)				\
+		return ((a)->field.prefix < (b)->field.prefix ? -1 : 1);	\
+	return (cmp(a, b));							\
+}
+
+#define _RB_GENERATE_HOTHASH(name, type, hashfn)				\
+static inline unsigned long							\
+name##_RB_HOTHASH(const struct type *elm)					\
+{										\
+	return ((unsigned long)hashfn(elm));					\
+}
+
+/* these are called by the generated insert and remove, ahead of the rest */
+#define _RB_GENERATE_RELAXEDFN(name, type)				\
+static int name##_RB_DEFER(struct name *, struct type *, uintptr_t,	\
+    struct type *);							\
+static void name##_RB_UNQUEUE(struct name *, struct type *);		\
+static void name##_RB_REQUEUE(struct name *, struct type *);		\
+static size_t name##_RB_RESUME(struct name *, size_t);
+
+#define _RB_GENERATE_LOGFN(name, type, logfn)				\
+static inline int							\
+name##_RB_LOG(struct name *head, int op, struct type *elm)		\
+{									\
+	if (head->log == NULL)						\
+		return (0);						\
+	return (logfn(head->log, op, elm));				\
+}
+
+
+#define RB_PROTOTYPE_SMALL(name, type, field, cmp)				\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, , _SMALL, )
+
+#define RB_PROTOTYPE_SMALL_STATIC(name, type, field, cmp)			\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static, _SMALL, )
+
+#define RB_PROTOTYPE_SMALL_EXT(name, type, field, cmp, ...)			\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, , _SMALL, __VA_ARGS__)
+
+#define RB_PROTOTYPE_SMALL_EXT_STATIC(name, type, field, cmp, ...)		\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static, _SMALL, __VA_ARGS__)
+
+#define RB_PROTOTYPE_LARGE(name, type, field, cmp)				\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, , _LARGE, )
+
+#define RB_PROTOTYPE_LARGE_STATIC(name, type, field, cmp)			\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static, _LARGE, )
+
+#define RB_PROTOTYPE_LARGE_EXT(name, type, field, cmp, ...)			\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, , _LARGE, __VA_ARGS__)
+
+#define RB_PROTOTYPE_LARGE_EXT_STATIC(name, type, field, cmp, ...)		\
+	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static, _LARGE, __VA_ARGS__)
+
+#ifdef RB_SMALL
+#define RB_PROTOTYPE(name, type, field, cmp)					\
+	RB_PROTOTYPE_SMALL(name, type, field, cmp)
+
+#define RB_PROTOTYPE_STATIC(name, type, field, cmp)				\
+	RB_PROTOTYPE_SMALL_STATIC(name, type, field, cmp)
+
+#define RB_PROTOTYPE_EXT(name, type, field, cmp, ...)				\
+	RB_PROTOTYPE_SMALL_EXT(name, type, field, cmp, __VA_ARGS__)
+
+#define RB_PROTOTYPE_EXT_STATIC(name, type, field, cmp, ...)			\
+	RB_PROTOTYPE_SMALL_EXT_STATIC(name, type, field, cmp, __VA_ARGS__)
+#else
 #define RB_PROTOTYPE(name, type, field, cmp)					\
-	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp,)
+	RB_PROTOTYPE_LARGE(name, type, field, cmp)
 
 #define RB_PROTOTYPE_STATIC(name, type, field, cmp)				\
-	_RB_PROTOTYPE_INTERNAL(name, type, field, cmp, __attribute__((__unused__)) static)
+	RB_PROTOTYPE_LARGE_STATIC(name, type, field, cmp)
+
+#define RB_PROTOTYPE_EXT(name, type, field, cmp, ...)				\
+	RB_PROTOTYPE_LARGE_EXT(name, type, field, cmp, __VA_ARGS__)
 
-#define _RB_PROTOTYPE_INTERNAL(name, type, field, cmp, attr)			\
+#define RB_PROTOTYPE_EXT_STATIC(name, type, field, cmp, ...)			\
+	RB_PROTOTYPE_LARGE_EXT_STATIC(name, type, field, cmp, __VA_ARGS__)
+#endif
+
+#define _RB_PROTOTYPE_INTERNAL(name, type, field, cmp, attr, lay, ...)	\
 	_RB_PROTOTYPE_INTERNAL_COMMON(name, type, field, cmp, attr)		\
-	_RB_PROTOTYPE_INTERNAL_ITERATE(name, type, field, cmp, attr)		\
-	_RB_PROTOTYPE_INTERNAL_CACHE(name, type, field, cmp, attr)
+	_RB_PROTOTYPE_INTERNAL_ITERATE##lay(name, type, field, cmp, attr)	\
+	_RB_PROTOTYPE_INTERNAL_CACHE(name, type, field, cmp, attr)		\
+	_RB_EACH(_RB_PROTOTYPE_FEATURE, (name, type, field, cmp, attr), __VA_ARGS__)
+
+#define _RB_PROTOTYPE_FEATURE(x, f)					\
+	_RB_CAT(_RB_PROTOTYPE_INTERNAL_EXT, _RB_SUFFIX(_RB_FEATURE(f))) x
 
 #define _RB_PROTOTYPE_INTERNAL_COMMON(name, type, field, cmp, attr)		\
 attr int			 name##_RB_RANK(const struct type *);			\
@@ -991,28 +3644,63 @@ attr struct type	*name##_RB_FIND(struct name *, struct type *);		\
 attr struct type	*name##_RB_NFIND(struct name *, struct type *);		\
 attr struct type	*name##_RB_PFIND(struct name *, struct type *);		\
 attr struct type	*name##_RB_INSERT(struct name *, struct type *);	\
+attr struct type	*name##_RB_INSERT_ALLOC(struct name *, struct type *,		\
+    struct type *(*)(struct type *, struct type *, void *), void *);		\
 attr struct type	*name##_RB_REMOVE(struct name *, struct type *);	\
+attr struct type	*name##_RB_INSERT_TOPDOWN(struct name *, struct type *);	\
+attr struct type	*name##_RB_REMOVE_TOPDOWN(struct name *, struct type *);	\
 attr struct type	*name##_RB_MINMAX(struct name *, int);			\
-
-#ifdef RB_SMALL
-#define _RB_PROTOTYPE_INTERNAL_ITERATE(name, type, field, cmp, attr)
+attr int			 name##_RB_SERIALIZE(struct name *, int (*)(struct type *, void *), void *);	\
+attr int			 name##_RB_DESERIALIZE(struct name *, size_t, struct type *(*)(void *), void *);	\
+attr int			 name##_RB_COMPACT(struct name *, struct type *, size_t, void (*)(struct type *, struct type *, void *), void *);	\
+attr void		 name##_RB_REBUILD_PERFECT(struct name *);		\
+attr int			 name##_RB_DESTROY(struct name *, void (*)(struct type *, void *), void *);	\
+attr int			 name##_RB_CLONE(struct name *, struct name *, struct type *(*)(struct type *, void *), void *);	\
+attr int			 name##_RB_FREEZE(struct name *, struct rb_frozen *);		\
+attr struct type	*name##_RB_FROZEN_FIND(const struct rb_frozen *, struct type *);	\
+attr struct type	*name##_RB_FROZEN_NFIND(const struct rb_frozen *, struct type *);	\
+attr struct type	*name##_RB_FROZEN_PFIND(const struct rb_frozen *, struct type *);	\
+
+#ifndef RB_THREADED
+#define _RB_PROTOTYPE_INTERNAL_ITERATE_SMALL(name, type, field, cmp, attr)
 #else
-#define _RB_PROTOTYPE_INTERNAL_ITERATE(name, type, field, cmp, attr)		\
+#define _RB_PROTOTYPE_INTERNAL_ITERATE_SMALL(name, type, field, cmp, attr)	\
+	_RB_PROTOTYPE_INTERNAL_ITERATE_LARGE(name, type, field, cmp, attr)
+#endif
+
+#define _RB_PROTOTYPE_INTERNAL_ITERATE_LARGE(name, type, field, cmp, attr)	\
 attr struct type	*name##_RB_NEXT(struct type *);				\
 attr struct type	*name##_RB_PREV(struct type *);				\
 attr struct type	*name##_RB_INSERT_NEXT(struct name *, struct type *, struct type *);	\
 attr struct type	*name##_RB_INSERT_PREV(struct name *, struct type *, struct type *);
-#endif
 
-#ifdef RB_SMALL
 #define _RB_PROTOTYPE_INTERNAL_CACHE(name, type, field, cmp, attr)		\
 attr struct type	*name##_RB_FINDC(struct name *, struct type *);		\
 attr struct type	*name##_RB_NFINDC(struct name *, struct type *);	\
 attr struct type	*name##_RB_PFINDC(struct name *, struct type *);	\
 attr struct type	*name##_RB_REMOVEC(struct name *, struct type *);
-#else
-#define _RB_PROTOTYPE_INTERNAL_CACHE(name, type, field, cmp, attr)
-#endif
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_NONE(name, type, field, cmp, attr)
+#define _RB_PROTOTYPE_INTERNAL_EXT_HOT(name, type, field, cmp, attr)
+#define _RB_PROTOTYPE_INTERNAL_EXT_PREFIX(name, type, field, cmp, attr)
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_INDEX(name, type, field, cmp, attr)	\
+attr void		 name##_RB_RELOCATE(struct name *, struct type *);
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_BLOOM(name, type, field, cmp, attr)	\
+attr void		 name##_RB_BLOOM_INIT(struct name *, uint8_t *, size_t, unsigned int);
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_LOG(name, type, field, cmp, attr)	\
+attr struct type	*name##_RB_REPLAY(struct name *, int, struct type *);
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_RELAXED(name, type, field, cmp, attr)	\
+attr size_t		 name##_RB_REBALANCE(struct name *, size_t);
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_BIASED(name, type, field, cmp, attr)	\
+attr void		 name##_RB_REBIAS(struct name *);
+
+#define _RB_PROTOTYPE_INTERNAL_EXT_MINMAX(name, type, field, cmp, attr)	\
+attr struct type	*name##_RB_POP(struct name *, int);
 
 
 #define RB_RANK(name, head)			name##_RB_RANK(head)
@@ -1020,26 +3708,51 @@ attr struct type	*name##_RB_REMOVEC(struct name *, struct type *);
 #define RB_NFIND(name, head, elm)		name##_RB_NFIND(head, elm)
 #define RB_PFIND(name, head, elm)		name##_RB_PFIND(head, elm)
 #define RB_INSERT(name, head, elm)		name##_RB_INSERT(head, elm)
+#define RB_INSERT_ALLOC(name, head, elm, allocfn, arg)	name##_RB_INSERT_ALLOC(head, elm, allocfn, arg)
 #define RB_REMOVE(name, head, elm)		name##_RB_REMOVE(head, elm)
+#define RB_INSERT_TOPDOWN(name, head, elm)	name##_RB_INSERT_TOPDOWN(head, elm)
+#define RB_REMOVE_TOPDOWN(name, head, elm)	name##_RB_REMOVE_TOPDOWN(head, elm)
 #define RB_MIN(name, head)			name##_RB_MINMAX(head, _RB_LDIR)
 #define RB_MAX(name, head)			name##_RB_MINMAX(head, _RB_RDIR)
+#define RB_SERIALIZE(name, head, enc, arg)	name##_RB_SERIALIZE(head, enc, arg)
+#define RB_DESERIALIZE(name, head, n, dec, arg)	name##_RB_DESERIALIZE(head, n, dec, arg)
+#define RB_COMPACT(name, head, dst, n, reloc, arg)	name##_RB_COMPACT(head, dst, n, reloc, arg)
+#define RB_REBUILD_PERFECT(name, head)		name##_RB_REBUILD_PERFECT(head)
+#define RB_DESTROY(name, head, freefn, arg)	name##_RB_DESTROY(head, freefn, arg)
+#define RB_CLONE(name, src, dst, allocfn, arg)	name##_RB_CLONE(src, dst, allocfn, arg)
+#define RB_FREEZE(name, head, fz)		name##_RB_FREEZE(head, fz)
+#define RB_FROZEN_FIND(name, fz, elm)		name##_RB_FROZEN_FIND(fz, elm)
+#define RB_FROZEN_NFIND(name, fz, elm)		name##_RB_FROZEN_NFIND(fz, elm)
+#define RB_FROZEN_PFIND(name, fz, elm)		name##_RB_FROZEN_PFIND(fz, elm)
 
-#ifdef RB_SMALL
 #define RB_FINDC(name, head, elm)		name##_RB_FINDC(head, elm)
 #define RB_NFINDC(name, head, elm)		name##_RB_NFINDC(head, elm)
 #define RB_PFINDC(name, head, elm)		name##_RB_PFINDC(head, elm)
 #define RB_REMOVEC(name, head, elm)		name##_RB_REMOVEC(head, elm)
-#endif
 
-#ifndef RB_SMALL
+/* only available for trees with RB_BLOOM */
+#define RB_BLOOM_INIT(name, head, cells, nkeys, bits_per_key)	name##_RB_BLOOM_INIT(head, cells, nkeys, bits_per_key)
+
+/* only available for trees with RB_LOG */
+#define RB_REPLAY(name, head, op, elm)		name##_RB_REPLAY(head, op, elm)
+
+/* only available for trees with RB_RELAXED */
+#define RB_REBALANCE(name, head, budget)	name##_RB_REBALANCE(head, budget)
+
+/* only available for trees with RB_BIASED */
+#define RB_REBIAS(name, head)			name##_RB_REBIAS(head)
+
+/* only available for trees with RB_MINMAX */
+#define RB_POP_MIN(name, head)			name##_RB_POP(head, _RB_LDIR)
+#define RB_POP_MAX(name, head)			name##_RB_POP(head, _RB_RDIR)
+
+/* only available for trees using the large layout */
 #define RB_NEXT(name, head, elm)		name##_RB_NEXT(elm)
 #define RB_PREV(name, head, elm)		name##_RB_PREV(elm)
 #define RB_INSERT_NEXT(name, head, elm, next)	name##_RB_INSERT_NEXT(head, elm, next)
 #define RB_INSERT_PREV(name, head, elm, prev)	name##_RB_INSERT_PREV(head, elm, prev)
-#endif
 
 
-#ifndef RB_SMALL
 #define RB_FOREACH(x, name, head)					\
 	for ((x) = RB_MIN(name, head);					\
 	     (x) != NULL;						\
@@ -1069,6 +3782,92 @@ attr struct type	*name##_RB_REMOVEC(struct name *, struct type *);
 	for ((x) = RB_MAX(name, head);					\
 	    ((x) != NULL) && ((y) = name##_RB_PREV(x), (x) != NULL);	\
 	     (x) = (y))
-#endif
+
+/*
+ * Index linked trees, for nodes that all live in one array given by the
+ * caller. The left, right and parent links of RB_ENTRY_INDEX are 32 bit
+ * distances in nodes from the entry to the target, which halves the size
+ * of the entry compared to the large layout, and as nothing but the root
+ * refers to an address the array can be moved or mapped elsewhere and
+ * handed back with RB_INDEX_RELOCATE. The nodes have to be within
+ * RB_INDEX_MAX of the base of the array given to the head, inserting any
+ * other node returns it without linking it.
+ *
+ * These are large trees with the RB_INDEX feature, so the usual macros, the
+ * rank rule, augmentation and the other features all work with them, but
+ * RB_COMPACT does not, see there.
+ */
+#define RB_ENTRY_INDEX(type)				\
+struct {						\
+	/* left, right, parent */			\
+	uint32_t	 child[3];			\
+}
+
+#define RB_ENTRY_INDEX_EXT(type, ...)			\
+struct {						\
+	/* left, right, parent */			\
+	uint32_t	 child[3];			\
+	_RB_EACH(_RB_ENTRY_FEATURE, type, __VA_ARGS__)	\
+}
+
+/* the base is in front of the root, so RB_INIT keeps it */
+#define RB_HEAD_INDEX(name, type)			\
+struct name {						\
+	struct type	*base;				\
+	struct type	*root;				\
+}
+
+#define RB_HEAD_INDEX_EXT(name, type, ...)		\
+struct name {						\
+	struct type	*base;				\
+	struct type	*root;				\
+	_RB_EACH(_RB_HEAD_FEATURE, type, __VA_ARGS__)	\
+}
+
+#define RB_INDEX_INITIALIZER(nbase)			\
+{ .base = (nbase), .root = NULL }
+
+#define RB_INDEX_INIT(head, nbase)	do {		\
+RB_INIT(head);						\
+_RB_STORE_SLOT((head)->base, nbase);			\
+} while (0)
+
+#define RB_INDEX_RELOCATE(name, head, nbase)		name##_RB_RELOCATE(head, nbase)
+
+#define RB_GENERATE_INDEX(name, type, field, cmp)				\
+	RB_GENERATE_LARGE_EXT(name, type, field, cmp, RB_INDEX)
+
+#define RB_GENERATE_INDEX_STATIC(name, type, field, cmp)			\
+	RB_GENERATE_LARGE_EXT_STATIC(name, type, field, cmp, RB_INDEX)
+
+#define RB_GENERATE_INDEX_AUGMENT(name, type, field, cmp, augfn)		\
+	RB_GENERATE_LARGE_EXT_AUGMENT(name, type, field, cmp, augfn, RB_INDEX)
+
+#define RB_GENERATE_INDEX_AUGMENT_STATIC(name, type, field, cmp, augfn)		\
+	RB_GENERATE_LARGE_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, RB_INDEX)
+
+#define RB_GENERATE_INDEX_EXT(name, type, field, cmp, ...)			\
+	RB_GENERATE_LARGE_EXT(name, type, field, cmp, RB_INDEX, __VA_ARGS__)
+
+#define RB_GENERATE_INDEX_EXT_STATIC(name, type, field, cmp, ...)		\
+	RB_GENERATE_LARGE_EXT_STATIC(name, type, field, cmp, RB_INDEX, __VA_ARGS__)
+
+#define RB_GENERATE_INDEX_EXT_AUGMENT(name, type, field, cmp, augfn, ...)	\
+	RB_GENERATE_LARGE_EXT_AUGMENT(name, type, field, cmp, augfn, RB_INDEX, __VA_ARGS__)
+
+#define RB_GENERATE_INDEX_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, ...)	\
+	RB_GENERATE_LARGE_EXT_AUGMENT_STATIC(name, type, field, cmp, augfn, RB_INDEX, __VA_ARGS__)
+
+#define RB_PROTOTYPE_INDEX(name, type, field, cmp)				\
+	RB_PROTOTYPE_LARGE_EXT(name, type, field, cmp, RB_INDEX)
+
+#define RB_PROTOTYPE_INDEX_STATIC(name, type, field, cmp)			\
+	RB_PROTOTYPE_LARGE_EXT_STATIC(name, type, field, cmp, RB_INDEX)
+
+#define RB_PROTOTYPE_INDEX_EXT(name, type, field, cmp, ...)			\
+	RB_PROTOTYPE_LARGE_EXT(name, type, field, cmp, RB_INDEX, __VA_ARGS__)
+
+#define RB_PROTOTYPE_INDEX_EXT_STATIC(name, type, field, cmp, ...)		\
+	RB_PROTOTYPE_LARGE_EXT_STATIC(name, type, field, cmp, RB_INDEX, __VA_ARGS__)
 
 #endif /* _SYS_TREE_H_ */
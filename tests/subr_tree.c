@@ -102,6 +102,15 @@ _RBT_STACK_PUSH(head, NULL);			\
 (head)->stack[i] = elm;				\
 } while (0)
 
+#define _RBT_SPINE_PATH(head, elm, dir) do {	\
+struct rb_entry *tmp_pp = _RBT_ROOT(head);	\
+_RBT_STACK_CLEAR(head);				\
+while (tmp_pp != (elm)) {			\
+	_RBT_STACK_PUSH(head, tmp_pp);		\
+	tmp_pp = _RBT_PTR(_RBT_GET_CHILD(tmp_pp, dir));	\
+}						\
+} while (0)
+
 #else
 
 #define _RBT_PDIR				((uintptr_t)2U)
@@ -121,6 +130,7 @@ _RBT_SET_CHILD(elm, _RBT_PDIR, pelm);		\
 #define _RBT_STACK_TOP(head, elm)		do {} while (0)
 #define _RBT_STACK_CLEAR(head)			do {} while (0)
 #define _RBT_STACK_SET(head, i, elm)		do {} while (0)
+#define _RBT_SPINE_PATH(head, elm, dir)		do {} while (0)
 
 #endif
 
@@ -128,7 +138,11 @@ _RBT_SET_CHILD(elm, _RBT_PDIR, pelm);		\
 
 /*
  * element macros
+ *
+ * With RBT_RELATIVE the links, the root and the min/max cache hold offsets
+ * from the field they are stored in, see rbtree.h.
  */
+#ifndef RBT_RELATIVE
 #define _RBT_GET_CHILD(elm, dir)				(elm)->child[dir]
 #define _RBT_SET_CHILD(elm, dir, celm) do {			\
 _RBT_GET_CHILD(elm, dir) = (celm);				\
@@ -138,7 +152,7 @@ _RBT_GET_CHILD(elm, dir) = (struct rb_tree *)(((uintptr_t)_RBT_GET_CHILD(elm, di
 } while (0)
 #define _RBT_SWAP_CHILD_OR_ROOT(rbt, elm, oelm, nelm) do {	\
 if (elm == NULL)						\
-	_RBT_ROOT(rbt) = nelm;					\
+	_RBT_SET_ROOT(rbt, nelm);				\
 else								\
 	_RBT_REPLACE_CHILD(elm, (_RBT_LEFT(elm) == (oelm) ? _RBT_LDIR : _RBT_RDIR), oelm, nelm);	\
 } while (0)
@@ -154,8 +168,71 @@ _RBT_GET_CHILD(elm, dir) = (struct rb_tree *)(((uintptr_t)_RBT_GET_CHILD(elm, di
 _RBT_GET_CHILD(elm, dir) = (struct rb_tree *)(((uintptr_t)_RBT_GET_CHILD(elm, dir)) | 1U);			\
 } while (0)
 
-
 #define _RBT_ROOT(rbt)		(rbt)->root
+#define _RBT_SET_ROOT(rbt, elm) do {				\
+_RBT_ROOT(rbt) = (elm);						\
+} while (0)
+#ifdef RBT_MINMAX
+#define _RBT_MINMAX(rbt, dir)	(rbt)->minmax[dir]
+#define _RBT_SET_MINMAX(rbt, dir, elm) do {			\
+_RBT_MINMAX(rbt, dir) = (elm);					\
+} while (0)
+#endif
+#else
+#define _RBT_REL_DECODE(base, link)				\
+(((uintptr_t)(link) & ~_RBT_LOWMASK) == 0 ? (uintptr_t)(link) :	\
+    (uintptr_t)(link) + (uintptr_t)(base))
+#define _RBT_REL_ENCODE(base, ptr)				\
+(((uintptr_t)(ptr) & ~_RBT_LOWMASK) == 0 ? (uintptr_t)(ptr) :	\
+    (uintptr_t)(ptr) - (uintptr_t)(base))
+#define _RBT_REL_LOAD(slot)					\
+((struct rb_entry *)_RBT_REL_DECODE(&(slot), (slot)))
+#define _RBT_REL_STORE(slot, elm) do {				\
+(slot) = (struct rb_entry *)_RBT_REL_ENCODE(&(slot), (elm));	\
+} while (0)
+
+#define _RBT_GET_CHILD(elm, dir)	_RBT_REL_LOAD((elm)->child[dir])
+#define _RBT_SET_CHILD(elm, dir, celm) do {			\
+_RBT_REL_STORE((elm)->child[dir], celm);			\
+} while (0)
+#define _RBT_REPLACE_CHILD(elm, dir, oelm, nelm) do {		\
+_RBT_SET_CHILD(elm, dir, (struct rb_entry *)(((uintptr_t)_RBT_GET_CHILD(elm, dir)) ^ ((uintptr_t)oelm) ^ ((uintptr_t)nelm)));	\
+} while (0)
+#define _RBT_SWAP_CHILD_OR_ROOT(rbt, elm, oelm, nelm) do {	\
+if (elm == NULL)						\
+	_RBT_SET_ROOT(rbt, nelm);				\
+else								\
+	_RBT_REPLACE_CHILD(elm, (_RBT_LEFT(elm) == (oelm) ? _RBT_LDIR : _RBT_RDIR), oelm, nelm);	\
+} while (0)
+
+/* the tag bits are stored as they are, so these work on the raw link */
+#define _RBT_GET_RDIFF(elm, dir)				(((uintptr_t)(elm)->child[dir]) & 1U)
+#define _RBT_FLIP_RDIFF(elm, dir) do {				\
+(elm)->child[dir] = (struct rb_entry *)(((uintptr_t)(elm)->child[dir]) ^ 1U);	\
+} while (0)
+#define _RBT_SET_RDIFF0(elm, dir) do {				\
+(elm)->child[dir] = (struct rb_entry *)(((uintptr_t)(elm)->child[dir]) &~_RBT_LOWMASK);	\
+} while (0)
+#define _RBT_SET_RDIFF1(elm, dir) do {				\
+(elm)->child[dir] = (struct rb_entry *)(((uintptr_t)(elm)->child[dir]) | 1U);	\
+} while (0)
+
+#define _RBT_ROOT(rbt)		_RBT_REL_LOAD((rbt)->root)
+#define _RBT_SET_ROOT(rbt, elm) do {				\
+_RBT_REL_STORE((rbt)->root, elm);				\
+} while (0)
+#ifdef RBT_MINMAX
+#define _RBT_MINMAX(rbt, dir)	_RBT_REL_LOAD((rbt)->minmax[dir])
+#define _RBT_SET_MINMAX(rbt, dir, elm) do {			\
+_RBT_REL_STORE((rbt)->minmax[dir], elm);			\
+} while (0)
+#endif
+#endif
+
+#ifndef RBT_MINMAX
+#define _RBT_SET_MINMAX(rbt, dir, elm) do {} while (0)
+#endif
+
 #define _RBT_EMPTY(rbt)		(_RBT_ROOT(rbt) == NULL)
 #define _RBT_LEFT(elm)		_RBT_PTR(_RBT_GET_CHILD(elm, _RBT_LDIR))
 #define _RBT_RIGHT(elm)		_RBT_PTR(_RBT_GET_CHILD(elm, _RBT_RDIR))
@@ -213,16 +290,89 @@ _rb_e2n(const struct rb_type *t, struct rb_entry *rbe)
 	return ((void *)(addr - t->t_offset));
 }
 
+/* with RBT_PREFIX the stored prefixes decide unless they are equal */
 static inline int
 _rb_cmp(const struct rb_tree *rbt, struct rb_entry *a, struct rb_entry *b)
 {
+#ifdef RBT_PREFIX
+	if (a->prefix != b->prefix)
+		return (a->prefix < b->prefix ? -1 : 1);
+#endif
 	return ((*(rbt->options->t_compare))(a, b));
 }
 
+/* stores the prefix of a key in its entry before a descent */
+static inline void
+_rb_key(const struct rb_tree *rbt, struct rb_entry *elm)
+{
+#ifdef RBT_PREFIX
+	elm->prefix = (*(rbt->options->t_prefix))(_rb_e2n(rbt->options, elm));
+#endif
+}
+
+#ifdef RBT_BLOOM
+/*
+ * counting Bloom filter of the keys, the k probes come from one hash by
+ * double hashing and are mapped onto the cells with a multiply and shift
+ */
+static inline void
+_rb_bloom_hash(const struct rb_tree *rbt, struct rb_entry *elm, uint32_t *h1, uint32_t *h2)
+{
+	uint64_t h = (uint64_t)(*(rbt->options->t_hash))(_rb_e2n(rbt->options, elm)) * 0x9e3779b97f4a7c15ULL;
+	*h1 = (uint32_t)(h >> 32);
+	*h2 = (uint32_t)h | 1U;
+}
+
+static inline void
+_rb_bloom_update(struct rb_tree *rbt, struct rb_entry *elm, int delta)
+{
+	uint32_t h1, h2;
+	unsigned int i;
+	uint8_t *cell;
+
+	if (rbt->bloom == NULL)
+		return;
+	_rb_bloom_hash(rbt, elm, &h1, &h2);
+	for (i = 0; i < rbt->bloom_k; i++, h1 += h2) {
+		cell = &rbt->bloom[((uint64_t)h1 * rbt->bloom_size) >> 32];
+		/* a saturated counter stays saturated */
+		if (*cell != UINT8_MAX)
+			*cell += delta;
+	}
+}
+
+static inline int
+_rb_bloom_maybe(const struct rb_tree *rbt, struct rb_entry *elm)
+{
+	uint32_t h1, h2;
+	unsigned int i;
+
+	if (rbt->bloom == NULL)
+		return (1);
+	_rb_bloom_hash(rbt, elm, &h1, &h2);
+	for (i = 0; i < rbt->bloom_k; i++, h1 += h2)
+		if (rbt->bloom[((uint64_t)h1 * rbt->bloom_size) >> 32] == 0)
+			return (0);
+	return (1);
+}
+#else
+#define _rb_bloom_update(rbt, elm, delta)	do {} while (0)
+#define _rb_bloom_maybe(rbt, elm)		(1)
+#endif
+
 void
 rb_init(struct rb_tree *rbt)
 {
 	(rbt)->root = NULL;
+#ifdef RBT_MINMAX
+	(rbt)->minmax[_RBT_LDIR] = NULL;
+	(rbt)->minmax[_RBT_RDIR] = NULL;
+#endif
+#ifdef RBT_BLOOM
+	(rbt)->bloom = NULL;
+	(rbt)->bloom_size = 0;
+	(rbt)->bloom_k = 0;
+#endif
 	_RBT_STACK_CLEAR(rbt);
 }
 
@@ -233,38 +383,46 @@ rb_empty(struct rb_tree *rbt)
 }
 
 /*
- * returns -2 if the subtree is not rank balanced else returns
- * the rank of the node.
+ * returns -2 if the subtree is not rank balanced under the rule
+ * else returns the rank of the node.
  */
 static inline int
-_rb_rank(struct rb_entry *elm)
+_rb_rank(int rule, struct rb_entry *elm)
 {
 	int lrank, rrank;
 	if (elm == NULL)
 		return (-1);
-	lrank =  _rb_rank(_RBT_LEFT(elm));
+	lrank =  _rb_rank(rule, _RBT_LEFT(elm));
 	if (lrank < -2)
 		return (-4);
-	rrank =  _rb_rank(_RBT_RIGHT(elm));
+	rrank =  _rb_rank(rule, _RBT_RIGHT(elm));
 	if (rrank < -2)
 		return (-8);
 	lrank += (_RBT_GET_RDIFF(elm, _RBT_LDIR) == 1U) ? 2 : 1;
 	rrank += (_RBT_GET_RDIFF(elm, _RBT_RDIR) == 1U) ? 2 : 1;
 	if (lrank != rrank)
 		return (-2);
+	/* no AVL node is 2,2, a WAVL node only when it is no leaf */
+	if (_RBT_GET_RDIFF(elm, _RBT_LDIR) && _RBT_GET_RDIFF(elm, _RBT_RDIR) &&
+	    (rule == RBT_RULE_AVL || (rule == RBT_RULE_WAVL && lrank == 1)))
+		return (-2);
+	/* red nodes are 1,1 */
+	if (rule == RBT_RULE_RB && lrank % 2 == 0 &&
+	    (_RBT_GET_RDIFF(elm, _RBT_LDIR) || _RBT_GET_RDIFF(elm, _RBT_RDIR)))
+		return (-2);
 	return (lrank);
 }
 
 int
 rb_rank(struct rb_tree *rbt)
 {
-	return (_rb_rank(_RBT_ROOT(rbt)));
+	return (_rb_rank(rbt->options->t_rule, _RBT_ROOT(rbt)));
 }
 
 int rb_rank_node(struct rb_tree *rbt, void *node)
 {
 	struct rb_entry *elm = _rb_n2e(rbt->options, node);
-	return (_rb_rank(elm));
+	return (_rb_rank(rbt->options->t_rule, elm));
 }
 
 int
@@ -283,9 +441,8 @@ rb_root(struct rb_tree *rbt)
 }
 
 static inline struct rb_entry *
-_rb_minmax(struct rb_tree *rbt, int dir)
+_rb_minmax_walk(struct rb_entry *tmp, int dir)
 {
-	struct rb_entry *tmp = _RBT_ROOT(rbt);
 	struct rb_entry *parent = NULL;
 	while (tmp) {
 		parent = tmp;
@@ -294,6 +451,23 @@ _rb_minmax(struct rb_tree *rbt, int dir)
 	return (parent);
 }
 
+#ifdef RBT_MINMAX
+/* the leftmost and rightmost nodes are kept up to date by insert and remove */
+static inline struct rb_entry *
+_rb_minmax(struct rb_tree *rbt, int dir)
+{
+	if (_RBT_EMPTY(rbt))
+		return (NULL);
+	return (_RBT_MINMAX(rbt, dir));
+}
+#else
+static inline struct rb_entry *
+_rb_minmax(struct rb_tree *rbt, int dir)
+{
+	return (_rb_minmax_walk(_RBT_ROOT(rbt), dir));
+}
+#endif
+
 static inline struct rb_entry *
 _rb_min(struct rb_tree *rbt)
 {
@@ -339,7 +513,11 @@ void *
 rb_find(struct rb_tree *rbt, void *node)
 {
 	struct rb_entry *elm = _rb_n2e(rbt->options, node);
-	struct rb_entry *res = _rb_find(rbt, elm);
+	struct rb_entry *res;
+	_rb_key(rbt, elm);
+	if (!_rb_bloom_maybe(rbt, elm))
+		return (NULL);
+	res = _rb_find(rbt, elm);
 	if (res == NULL)
 		return (NULL);
 	return (_rb_e2n(rbt->options, res));
@@ -369,7 +547,9 @@ void *
 rb_nfind(struct rb_tree *rbt, void *node)
 {
 	struct rb_entry *elm = _rb_n2e(rbt->options, node);
-	struct rb_entry *res = _rb_nfind(rbt, elm);
+	struct rb_entry *res;
+	_rb_key(rbt, elm);
+	res = _rb_nfind(rbt, elm);
 	if (res == NULL)
 		return (NULL);
 	return (_rb_e2n(rbt->options, res));
@@ -399,7 +579,9 @@ void *
 rb_pfind(struct rb_tree *rbt, void *node)
 {
 	struct rb_entry *elm = _rb_n2e(rbt->options, node);
-	struct rb_entry *res = _rb_pfind(rbt, elm);
+	struct rb_entry *res;
+	_rb_key(rbt, elm);
+	res = _rb_pfind(rbt, elm);
 	if (res == NULL)
 		return (NULL);
 	return (_rb_e2n(rbt->options, res));
@@ -501,9 +683,12 @@ _rb_insert_balance(struct rb_tree *rbt, struct rb_entry *parent,
 {
 	struct rb_entry *child, *gpar;
 	uintptr_t elmdir, sibdir;
+	int rank;
 
 	child = NULL;
 	gpar = NULL;
+	/* the rank elm is promoted to, only the red-black rule needs it */
+	rank = 0;
 	do {
 		/* elm has not been promoted yet */
 		elmdir = _RBT_LEFT(parent) == elm ? _RBT_LDIR : _RBT_RDIR;
@@ -520,6 +705,14 @@ _rb_insert_balance(struct rb_tree *rbt, struct rb_entry *parent,
 		_RBT_FLIP_RDIFF(parent, sibdir);
 		if (_RBT_GET_RDIFF(parent, sibdir)) {
 			/* case (2.1) */
+			if (++rank % 2 == 0 &&
+			    rbt->options->t_rule == RBT_RULE_RB) {
+				/* parent turns red, its sibling black */
+				_RBT_FLIP_RDIFF(parent, sibdir);
+				child = _RBT_PTR(_RBT_GET_CHILD(parent, sibdir));
+				_RBT_SET_RDIFF1(child, _RBT_LDIR);
+				_RBT_SET_RDIFF1(child, _RBT_RDIR);
+			}
 			_rb_augment_try(rbt, elm);
 			elm = parent;
 			continue;
@@ -557,6 +750,12 @@ _rb_insert_finish(struct rb_tree *rbt, struct rb_entry *parent,
 {
 	struct rb_entry *tmp = elm;
 	_RBT_SET_PARENT(elm, parent);
+#ifdef RBT_MINMAX
+	/* only a new child of an extreme node can replace it */
+	if (_RBT_MINMAX(rbt, insdir) == parent)
+		_RBT_SET_MINMAX(rbt, insdir, elm);
+#endif
+	_rb_bloom_update(rbt, elm, 1);
 	if (_RBT_GET_CHILD(parent, insdir))
 		_RBT_SET_CHILD(parent, insdir, elm);
 	else {
@@ -577,6 +776,9 @@ static inline struct rb_entry *
 _rb_insert(struct rb_tree *rbt, struct rb_entry *elm)
 {
 	struct rb_entry *parent, *tmp;
+#ifdef RBT_MINMAX
+	struct rb_entry *edge;
+#endif
 	int comp;
 	uintptr_t insdir;
 
@@ -585,10 +787,36 @@ _rb_insert(struct rb_tree *rbt, struct rb_entry *elm)
 	_RBT_SET_CHILD(elm, _RBT_RDIR, NULL);
 	tmp = _RBT_ROOT(rbt);
 	if (tmp == NULL) {
-		_RBT_ROOT(rbt) = elm;
+		_RBT_SET_ROOT(rbt, elm);
 		_RBT_SET_PARENT(elm, NULL);
+		_RBT_SET_MINMAX(rbt, _RBT_LDIR, elm);
+		_RBT_SET_MINMAX(rbt, _RBT_RDIR, elm);
+		_rb_bloom_update(rbt, elm, 1);
 		return (NULL);
 	}
+	parent = tmp;
+	comp = _rb_cmp(rbt, elm, tmp);
+	if (comp == 0)
+		return (parent);
+	insdir = (comp < 0) ? _RBT_LDIR : _RBT_RDIR;
+#ifdef RBT_MINMAX
+	/*
+	 * keys beyond the min or max on the same side of the root are
+	 * appended there directly, this costs one comparison otherwise
+	 */
+	edge = _RBT_MINMAX(rbt, insdir);
+	if (edge != parent) {
+		comp = _rb_cmp(rbt, elm, edge);
+		if (comp == 0)
+			return (edge);
+		if ((comp < 0) == (insdir == _RBT_LDIR)) {
+			_RBT_SPINE_PATH(rbt, edge, insdir);
+			return _rb_insert_finish(rbt, edge, insdir, elm);
+		}
+	}
+#endif
+	tmp = _RBT_PTR(_RBT_GET_CHILD(parent, insdir));
+	_RBT_STACK_PUSH(rbt, parent);
 	while (tmp) {
 		parent = tmp;
 		comp = _rb_cmp(rbt, elm, tmp);
@@ -612,7 +840,9 @@ void *
 rb_insert(struct rb_tree *rbt, void *node)
 {
 	struct rb_entry *elm = _rb_n2e(rbt->options, node);
-	struct rb_entry *res = _rb_insert(rbt, elm);
+	struct rb_entry *res;
+	_rb_key(rbt, elm);
+	res = _rb_insert(rbt, elm);
 	if (res == NULL)
 		return (NULL);
 	return (_rb_e2n(rbt->options, res));
@@ -625,6 +855,7 @@ _rb_insert_next(struct rb_tree *rbt, struct rb_entry *elm,
 {
 	struct rb_entry *tmp;
 	uintptr_t insdir = _RBT_RDIR;
+	_rb_key(rbt, next);
 	_RBT_SET_CHILD(next, _RBT_LDIR, NULL);
 	_RBT_SET_CHILD(next, _RBT_RDIR, NULL);
 
@@ -643,6 +874,7 @@ _rb_insert_prev(struct rb_tree *rbt, struct rb_entry *elm,
 {
 	struct rb_entry *tmp;
 	uintptr_t insdir = _RBT_LDIR;
+	_rb_key(rbt, prev);
 	_RBT_SET_CHILD(prev, _RBT_LDIR, NULL);
 	_RBT_SET_CHILD(prev, _RBT_RDIR, NULL);
 
@@ -786,8 +1018,16 @@ _rb_remove_balance(struct rb_tree *rbt,
 		if (_RBT_GET_RDIFF(parent, elmdir) == 0) {
 			/* case (1) */
 			_RBT_FLIP_RDIFF(parent, elmdir);
-			_RBT_STACK_PUSH(rbt, gpar);
-			return (parent);
+			if (rbt->options->t_rule != RBT_RULE_AVL ||
+			    !_RBT_GET_RDIFF(parent, _RBT_ODIR(elmdir))) {
+				_RBT_STACK_PUSH(rbt, gpar);
+				return (parent);
+			}
+			/* an AVL parent left 2,2 is demoted */
+			_RBT_SET_RDIFF0(parent, _RBT_LDIR);
+			_RBT_SET_RDIFF0(parent, _RBT_RDIR);
+			_rb_augment_try(rbt, parent);
+			continue;
 		}
 		/* case 2 */
 		sibdir = _RBT_ODIR(elmdir);
@@ -840,6 +1080,16 @@ _rb_remove_balance(struct rb_tree *rbt,
 			if (elm != sibling)
 				(void)(*(rbt->options->t_augment))(rbt, sibling);
 		}
+		/* an AVL top left 2,2 is demoted */
+		if (rbt->options->t_rule == RBT_RULE_AVL &&
+		    _RBT_GET_RDIFF(elm, _RBT_LDIR) &&
+		    _RBT_GET_RDIFF(elm, _RBT_RDIR)) {
+			_RBT_SET_RDIFF0(elm, _RBT_LDIR);
+			_RBT_SET_RDIFF0(elm, _RBT_RDIR);
+			_rb_augment_try(rbt, elm);
+			parent = elm;
+			continue;
+		}
 		_RBT_STACK_PUSH(rbt, gpar);
 		return (elm);
 	} while ((elm = parent, (parent = gpar) != NULL));
@@ -847,23 +1097,138 @@ _rb_remove_balance(struct rb_tree *rbt,
 	return (elm);
 }
 
+/*
+ * the red-black removal, rank is that of the unlinked node. once it is
+ * black and had no red child to take its colour, elm is a black too short
+ * and its rank stays that of the node it should be
+ */
+static inline struct rb_entry *
+_rb_remove_black(struct rb_tree *rbt, struct rb_entry *parent,
+    struct rb_entry *elm, int rank)
+{
+	struct rb_entry *gpar, *sibling, *tmp;
+	uintptr_t elmdir, sibdir;
+	int prank;
+
+	_RBT_ASSERT(parent != NULL);
+	gpar = NULL;
+	if (elm != NULL) {
+		/* a red leaf takes the place of its black parent */
+		_RBT_SET_RDIFF1(elm, _RBT_LDIR);
+		_RBT_SET_RDIFF1(elm, _RBT_RDIR);
+		return (parent);
+	}
+	if (rank == 0) {
+		/* a red leaf is gone, the parent is black */
+		if (_RBT_LEFT(parent) == NULL)
+			_RBT_SET_RDIFF1(parent, _RBT_LDIR);
+		if (_RBT_RIGHT(parent) == NULL)
+			_RBT_SET_RDIFF1(parent, _RBT_RDIR);
+		return (parent);
+	}
+	for (;;) {
+		_RBT_STACK_POP(rbt, gpar);
+		_RBT_GET_PARENT(parent, gpar);
+		elmdir = _RBT_LEFT(parent) == elm ? _RBT_LDIR : _RBT_RDIR;
+		sibdir = _RBT_ODIR(elmdir);
+		prank = rank + 1 + (int)_RBT_GET_RDIFF(parent, elmdir);
+		sibling = _RBT_PTR(_RBT_GET_CHILD(parent, sibdir));
+		_RBT_ASSERT(sibling != NULL);
+		if (prank % 2 == 1 && !_RBT_GET_RDIFF(parent, sibdir)) {
+			/* case (1), the sibling is red */
+			_RBT_ROTATE(parent, sibling, elmdir);
+			_RBT_SET_PARENT(sibling, gpar);
+			_RBT_SWAP_CHILD_OR_ROOT(rbt, gpar, parent, sibling);
+			_RBT_SET_RDIFF1(sibling, sibdir);
+			_RBT_SET_RDIFF0(parent, elmdir);
+			_RBT_STACK_PUSH(rbt, gpar);
+			_RBT_STACK_PUSH(rbt, sibling);
+			continue;
+		}
+		if (_RBT_GET_RDIFF(sibling, _RBT_LDIR) &&
+		    _RBT_GET_RDIFF(sibling, _RBT_RDIR)) {
+			/* case (2), the sibling turns red */
+			_RBT_SET_RDIFF0(sibling, _RBT_LDIR);
+			_RBT_SET_RDIFF0(sibling, _RBT_RDIR);
+			if (prank % 2 == 0) {
+				/* and the red parent black */
+				_RBT_SET_RDIFF1(parent, elmdir);
+				if (gpar != NULL)
+					_RBT_SET_RDIFF1(gpar,
+					    _RBT_LEFT(gpar) == parent ?
+					    _RBT_LDIR : _RBT_RDIR);
+				_RBT_STACK_PUSH(rbt, gpar);
+				return (parent);
+			}
+			_RBT_SET_RDIFF0(parent, sibdir);
+			_rb_augment_try(rbt, parent);
+			rank = prank;
+			elm = parent;
+			if ((parent = gpar) == NULL) {
+				_RBT_STACK_PUSH(rbt, NULL);
+				return (elm);
+			}
+			continue;
+		}
+		if (_RBT_GET_RDIFF(sibling, sibdir)) {
+			/* case (3), the near child of the sibling is red */
+			tmp = _RBT_PTR(_RBT_GET_CHILD(sibling, elmdir));
+			_RBT_ROTATE(sibling, tmp, sibdir);
+			_RBT_SET_PARENT(tmp, parent);
+			_RBT_REPLACE_CHILD(parent, sibdir, sibling, tmp);
+			_RBT_SET_RDIFF0(sibling, sibdir);
+			_RBT_SET_RDIFF1(tmp, elmdir);
+			_rb_augment_try(rbt, sibling);
+			sibling = tmp;
+		}
+		/* case (4), the far child of the sibling is red */
+		tmp = _RBT_PTR(_RBT_GET_CHILD(sibling, sibdir));
+		_RBT_ROTATE(parent, sibling, elmdir);
+		_RBT_SET_PARENT(sibling, gpar);
+		_RBT_SWAP_CHILD_OR_ROOT(rbt, gpar, parent, sibling);
+		_RBT_SET_RDIFF1(parent, elmdir);
+		_RBT_SET_RDIFF1(tmp, _RBT_LDIR);
+		_RBT_SET_RDIFF1(tmp, _RBT_RDIR);
+		if (prank % 2 == 1) {
+			_RBT_SET_RDIFF1(sibling, _RBT_LDIR);
+			_RBT_SET_RDIFF1(sibling, _RBT_RDIR);
+		}
+		_rb_augment_try(rbt, parent);
+		_RBT_STACK_PUSH(rbt, gpar);
+		return (sibling);
+	}
+}
+
 static inline struct rb_entry *
 _rb_remove_start(struct rb_tree *rbt, struct rb_entry *elm)
 {
 	struct rb_entry *parent, *opar, *child, *rmin, *cptr;
 	size_t sz;
+	int black;
 
 	parent = NULL;
 	opar = NULL;
 	_RBT_STACK_TOP(rbt, opar);
 	_RBT_GET_PARENT(elm, opar);
 
+#ifdef RBT_MINMAX
+	/* the neighbour of an extreme node is in its inner subtree, or it is the parent */
+	if (_RBT_MINMAX(rbt, _RBT_LDIR) == elm)
+		_RBT_SET_MINMAX(rbt, _RBT_LDIR, (_RBT_RIGHT(elm) == NULL) ? opar : _rb_minmax_walk(_RBT_RIGHT(elm), _RBT_LDIR));
+	if (_RBT_MINMAX(rbt, _RBT_RDIR) == elm)
+		_RBT_SET_MINMAX(rbt, _RBT_RDIR, (_RBT_LEFT(elm) == NULL) ? opar : _rb_minmax_walk(_RBT_LEFT(elm), _RBT_RDIR));
+#endif
+	_rb_bloom_update(rbt, elm, -1);
+
 	/* first find the element to swap with oelm */
 	child = _RBT_GET_CHILD(elm, _RBT_LDIR);
 	cptr = _RBT_PTR(child);
 	rmin = _RBT_RIGHT(elm);
 	if (rmin == NULL || cptr == NULL) {
 		rmin = child = (rmin == NULL ? cptr : rmin);
+		/* the rank of a node with a null link, one for a black one */
+		black = (int)_RBT_GET_RDIFF(elm, _RBT_LEFT(elm) == NULL ?
+		    _RBT_LDIR : _RBT_RDIR);
 		parent = opar;	
 		_RBT_STACK_DROP(rbt);
 	}
@@ -875,8 +1240,12 @@ _rb_remove_start(struct rb_tree *rbt, struct rb_entry *elm)
 			_RBT_STACK_PUSH(rbt, rmin);
 			rmin = _RBT_LEFT(rmin);
 		}
+		black = (int)_RBT_GET_RDIFF(rmin, _RBT_LDIR);
 		_RBT_SET_CHILD(rmin, _RBT_LDIR, child);
 		_RBT_SET_PARENT(cptr, rmin);
+		/* the right link of a black leaf has the bit set too */
+		if (rbt->options->t_rule == RBT_RULE_RB)
+			_RBT_SET_RDIFF0(rmin, _RBT_RDIR);
 		child = _RBT_GET_CHILD(rmin, _RBT_RDIR);
 		if (parent != rmin) {
 			_RBT_SET_PARENT(parent, rmin);
@@ -898,7 +1267,9 @@ _rb_remove_start(struct rb_tree *rbt, struct rb_entry *elm)
 		_RBT_SET_PARENT(child, parent);
 	}
 	if (parent != NULL) {
-		parent = _rb_remove_balance(rbt, parent, child);
+		parent = rbt->options->t_rule == RBT_RULE_RB ?
+		    _rb_remove_black(rbt, parent, child, black) :
+		    _rb_remove_balance(rbt, parent, child);
 		if ((rbt->options->t_augment) != NULL)
 			_rb_augment_walk(rbt, parent);
 	}
@@ -1076,3 +1447,249 @@ rb_check(const struct rb_tree *rbt, void *node, unsigned long poison)
 	return (_RBT_LEFT(elm) == (struct rb_entry *)poison &&
 		_RBT_RIGHT(elm) == (struct rb_entry *)poison);
 }
+
+#ifdef RBT_BLOOM
+static void
+_rb_bloom_fill(struct rb_tree *rbt, struct rb_entry *elm)
+{
+	if (elm == NULL)
+		return;
+	_rb_bloom_update(rbt, elm, 1);
+	_rb_bloom_fill(rbt, _RBT_LEFT(elm));
+	_rb_bloom_fill(rbt, _RBT_RIGHT(elm));
+}
+
+/* k = bits_per_key * ln(2) hash functions minimize the false positives */
+void
+rb_bloom_init(struct rb_tree *rbt, uint8_t *cells, size_t nkeys, unsigned int bits_per_key)
+{
+	size_t i;
+
+	rbt->bloom = cells;
+	rbt->bloom_size = RBT_BLOOM_SIZE(nkeys, bits_per_key);
+	rbt->bloom_k = (bits_per_key * 7 + 5) / 10;
+	if (rbt->bloom_k < 1)
+		rbt->bloom_k = 1;
+	for (i = 0; i < rbt->bloom_size; i++)
+		cells[i] = 0;
+	_rb_bloom_fill(rbt, _RBT_ROOT(rbt));
+}
+#endif
+
+/* rotates the subtree into a list through the right links, counting it */
+static struct rb_entry *
+_rb_vine(struct rb_entry *elm, size_t *n)
+{
+	struct rb_entry *left, *list = NULL, *tail = NULL;
+
+	*n = 0;
+	while (elm != NULL) {
+		left = _RBT_LEFT(elm);
+		if (left != NULL) {
+			_RBT_SET_CHILD(elm, _RBT_LDIR, _RBT_RIGHT(left));
+			_RBT_SET_CHILD(left, _RBT_RDIR, elm);
+			elm = left;
+			continue;
+		}
+		if (tail == NULL)
+			list = elm;
+		else
+			_RBT_SET_CHILD(tail, _RBT_RDIR, elm);
+		tail = elm;
+		(*n)++;
+		elm = _RBT_RIGHT(elm);
+	}
+	return (list);
+}
+
+/* rotates every other node of the first 2 * count down the list left */
+static struct rb_entry *
+_rb_compress(struct rb_entry *list, size_t count)
+{
+	struct rb_entry *scan = NULL, *child, *grand;
+
+	for (; count > 0; count--) {
+		child = scan == NULL ? list : _RBT_RIGHT(scan);
+		grand = _RBT_RIGHT(child);
+		_RBT_SET_CHILD(child, _RBT_RDIR, _RBT_LEFT(grand));
+		_RBT_SET_CHILD(grand, _RBT_LDIR, child);
+		if (scan == NULL)
+			list = grand;
+		else
+			_RBT_SET_CHILD(scan, _RBT_RDIR, grand);
+		scan = grand;
+	}
+	return (list);
+}
+
+/*
+ * sets the links below elm, depth levels down a tree whose last level is
+ * h, and returns its rank. under the red-black rule only the nodes of a
+ * last level that is not full are red
+ */
+static int
+_rb_perfect(struct rb_tree *rbt, struct rb_entry *elm, int depth, int h,
+    int full)
+{
+	struct rb_entry *left, *right;
+	int lrank, rrank, rank;
+
+	if (elm == NULL)
+		return (-1);
+	left = _RBT_LEFT(elm);
+	right = _RBT_RIGHT(elm);
+	lrank = _rb_perfect(rbt, left, depth + 1, h, full);
+	rrank = _rb_perfect(rbt, right, depth + 1, h, full);
+	_RBT_SET_CHILD(elm, _RBT_LDIR, left);
+	_RBT_SET_CHILD(elm, _RBT_RDIR, right);
+	if (left != NULL)
+		_RBT_SET_PARENT(left, elm);
+	if (right != NULL)
+		_RBT_SET_PARENT(right, elm);
+	if (rbt->options->t_rule != RBT_RULE_RB)
+		rank = (lrank > rrank ? lrank : rrank) + 1;
+	else if (full)
+		rank = 2 * (h - depth) + 1;
+	else
+		rank = depth == h ? 0 : 2 * (h - depth) - 1;
+	if (rank - lrank == 2)
+		_RBT_SET_RDIFF1(elm, _RBT_LDIR);
+	if (rank - rrank == 2)
+		_RBT_SET_RDIFF1(elm, _RBT_RDIR);
+	_rb_augment_try(rbt, elm);
+	return (rank);
+}
+
+/*
+ * relinks the tree into the least height its nodes fit in, every level
+ * full but the last, in O(n) and without moving a node. the list the tree
+ * is rotated into is folded back by the compressions of Day, Stout and
+ * Warren and one pass down the new tree sets the ranks and augments.
+ */
+void
+rb_rebuild_perfect(struct rb_tree *rbt)
+{
+	struct rb_entry *list;
+	size_t n, m;
+	int h;
+
+	list = _rb_vine(_RBT_ROOT(rbt), &n);
+	if (n == 0)
+		return;
+	/* m is the largest 2^k - 1 not above n, the full levels */
+	for (m = 1, h = 0; m <= (n - 1) / 2; m = 2 * m + 1, h++)
+		;
+	list = _rb_compress(list, n - m);
+	for (; m > 1; m /= 2)
+		list = _rb_compress(list, m / 2);
+	(void)_rb_perfect(rbt, list, 0, n == m ? h : h + 1, n == m);
+	_RBT_SET_PARENT(list, NULL);
+	_RBT_SET_ROOT(rbt, list);
+	_RBT_STACK_CLEAR(rbt);
+}
+
+/*
+ * hands every node to freefn(node, arg) once, in post-order, without a
+ * stack, parent pointers or comparisons: on the way down the link taken is
+ * turned to point back up and the first rank bit of the right link tells
+ * which one it was. the tree is left as rb_init leaves it.
+ */
+void
+rb_destroy(struct rb_tree *rbt, void (*freefn)(void *, void *), void *arg)
+{
+	struct rb_entry *elm, *parent = NULL, *child;
+
+	elm = _RBT_ROOT(rbt);
+	while (elm != NULL) {
+		child = _RBT_LEFT(elm);
+		if (child != NULL) {
+			_RBT_SET_RDIFF0(elm, _RBT_RDIR);
+			_RBT_SET_CHILD(elm, _RBT_LDIR, parent);
+			parent = elm;
+			elm = child;
+			continue;
+		}
+		child = _RBT_RIGHT(elm);
+		if (child != NULL) {
+			_RBT_SET_CHILD(elm, _RBT_RDIR, parent);
+			_RBT_SET_RDIFF1(elm, _RBT_RDIR);
+			parent = elm;
+			elm = child;
+			continue;
+		}
+		(*freefn)(_rb_e2n(rbt->options, elm), arg);
+		/* back up, cutting the link that was followed */
+		elm = parent;
+		if (elm == NULL)
+			break;
+		if (_RBT_GET_RDIFF(elm, _RBT_RDIR)) {
+			parent = _RBT_RIGHT(elm);
+			_RBT_SET_CHILD(elm, _RBT_RDIR, NULL);
+		} else {
+			parent = _RBT_LEFT(elm);
+			_RBT_SET_CHILD(elm, _RBT_LDIR, NULL);
+		}
+	}
+	rb_init(rbt);
+}
+
+/*
+ * copies the tree of src into the empty dst in one walk and in the same
+ * shape and ranks, without comparing or rebalancing. allocfn(node, arg)
+ * returns a copy of the node with its data and augment fields, the links
+ * of the copy are set here. dst->options has to be set. returns -1 if dst
+ * is not empty or allocfn returns NULL, dst then only fits rb_destroy.
+ */
+int
+rb_clone(struct rb_tree *src, struct rb_tree *dst,
+    void *(*allocfn)(void *, void *), void *arg)
+{
+	struct rb_entry *stack[RB_MAX_HEIGHT], *copies[RB_MAX_HEIGHT];
+	struct rb_entry *elm, *copy, *parent = NULL, *prev = NULL;
+	void *node;
+	size_t top = 0;
+	uintptr_t dir = _RBT_LDIR;
+
+	if (!_RBT_EMPTY(dst))
+		return (-1);
+	elm = _RBT_ROOT(src);
+	for (;;) {
+		/* copies elm and the left spine below it */
+		for (; elm != NULL; elm = _RBT_LEFT(elm), dir = _RBT_LDIR) {
+			node = (*allocfn)(_rb_e2n(src->options, elm), arg);
+			if (node == NULL)
+				return (-1);
+			copy = _rb_n2e(dst->options, node);
+			_RBT_SET_CHILD(copy, _RBT_LDIR, NULL);
+			_RBT_SET_CHILD(copy, _RBT_RDIR, NULL);
+			if (_RBT_GET_RDIFF(elm, _RBT_LDIR))
+				_RBT_SET_RDIFF1(copy, _RBT_LDIR);
+			if (_RBT_GET_RDIFF(elm, _RBT_RDIR))
+				_RBT_SET_RDIFF1(copy, _RBT_RDIR);
+			if (parent == NULL)
+				_RBT_SET_ROOT(dst, copy);
+			else
+				_RBT_REPLACE_CHILD(parent, dir, NULL, copy);
+			_RBT_SET_PARENT(copy, parent);
+			_RBT_ASSERT(top < RB_MAX_HEIGHT);
+			stack[top] = elm;
+			copies[top++] = copy;
+			parent = copy;
+		}
+		if (top == 0)
+			break;
+		elm = stack[--top];
+		copy = copies[top];
+		_rb_key(dst, copy);
+		if (prev == NULL)
+			_RBT_SET_MINMAX(dst, _RBT_LDIR, copy);
+		_RBT_SET_MINMAX(dst, _RBT_RDIR, copy);
+		_rb_bloom_update(dst, copy, 1);
+		prev = copy;
+		parent = copy;
+		dir = _RBT_RDIR;
+		elm = _RBT_RIGHT(elm);
+	}
+	_RBT_STACK_CLEAR(dst);
+	return (0);
+}
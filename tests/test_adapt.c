@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+#include "rbadapt.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+#define NSETS	(ITER / 16)
+#define SETSZ	12
+#define NKEYS	64
+
+struct timespec start, end, diff;
+
+/*
+ * many small sets are filled and searched once as plain trees and once
+ * as adaptive sets, timing both. then one set is grown and shrunk across
+ * the switch between array and tree many times, checking it against a
+ * table of the keys that should be in it.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	RB_ENTRY(node)		 adapt_link;
+	int			 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static void check(struct node *, int *);
+
+RB_HEAD(tree, node);
+RB_ADAPT_HEAD(adapt, node);
+
+RB_PROTOTYPE(tree, node, node_link, compare)
+RB_GENERATE(tree, node, node_link, compare)
+RB_ADAPT_PROTOTYPE(adapt, node)
+RB_ADAPT_GENERATE(adapt, node, adapt_link, compare)
+
+struct adapt one;
+
+#define TIMED(what, stmt)	do {					\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);			\
+	stmt;								\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);			\
+	timespecsub(&end, &start, &diff);				\
+	TDEBUGF("%s in: %lld.%09ld s", what, (long long)diff.tv_sec, diff.tv_nsec);	\
+} while (0)
+
+int
+main()
+{
+	struct node *nodes, key;
+	struct tree *trees;
+	struct adapt *sets;
+	int i, j, r, n, *present, *probe;
+	long found;
+
+	nodes = calloc(NSETS * SETSZ, sizeof(struct node));
+	trees = calloc(NSETS, sizeof(struct tree));
+	sets = calloc(NSETS, sizeof(struct adapt));
+	probe = calloc(ITER, sizeof(int));
+	present = calloc(NKEYS, sizeof(int));
+
+	SEED_RANDOM(4201);
+	for (i = 0; i < NSETS; i++) {
+		RB_INIT(&trees[i]);
+		RB_ADAPT_INIT(&sets[i]);
+		for (j = 0; j < SETSZ; j++)
+			nodes[i * SETSZ + j].key = j * 1000 + random() % 1000;
+	}
+	for (i = 0; i < ITER; i++)
+		probe[i] = random() % (SETSZ * 1000);
+
+	TDEBUGF("filling %d sets of %d", NSETS, SETSZ);
+	TIMED("tree inserts", for (i = 0; i < NSETS * SETSZ; i++)
+		if (RB_INSERT(tree, &trees[i / SETSZ], &nodes[i]) != NULL)
+			errx(1, "RB_INSERT failed"));
+	TIMED("adaptive inserts", for (i = 0; i < NSETS * SETSZ; i++)
+		if (RB_ADAPT_INSERT(adapt, &sets[i / SETSZ], &nodes[i]) != NULL)
+			errx(1, "RB_ADAPT_INSERT failed"));
+
+	TDEBUGF("looking up random keys");
+	found = 0;
+	TIMED("tree lookups", for (r = 0; r < 8; r++)
+		for (i = 0; i < ITER; i++) {
+			key.key = probe[i];
+			found += RB_FIND(tree, &trees[(i * 7 + r) % NSETS], &key) != NULL;
+		});
+	TIMED("adaptive lookups", for (r = 0; r < 8; r++)
+		for (i = 0; i < ITER; i++) {
+			key.key = probe[i];
+			found -= RB_ADAPT_FIND(adapt, &sets[(i * 7 + r) % NSETS], &key) != NULL;
+		});
+	assert(found == 0);
+
+	TDEBUGF("growing and shrinking one set");
+	free(nodes);
+	nodes = calloc(NKEYS, sizeof(struct node));
+	RB_ADAPT_INIT(&one);
+	n = 0;
+	for (i = 0; i < NKEYS; i++)
+		nodes[i].key = i;
+	for (i = 0; i < ITER; i++) {
+		/* phases that mostly add and mostly take away keys */
+		r = random() % NKEYS;
+		if (present[r] == (i / 512) % 2 && random() % 4 != 0)
+			continue;
+		key.key = r;
+		if (present[r]) {
+			if (RB_ADAPT_REMOVE(adapt, &one, &nodes[r]) != &nodes[r])
+				errx(1, "RB_ADAPT_REMOVE failed: %d", r);
+			present[r] = 0;
+			n--;
+		} else {
+			if (RB_ADAPT_FIND(adapt, &one, &key) != NULL)
+				errx(1, "RB_ADAPT_FIND found a removed key: %d", r);
+			if (RB_ADAPT_INSERT(adapt, &one, &nodes[r]) != NULL)
+				errx(1, "RB_ADAPT_INSERT failed: %d", r);
+			present[r] = 1;
+			n++;
+		}
+		if (present[r] && RB_ADAPT_INSERT(adapt, &one, &key) != &nodes[r])
+			errx(1, "RB_ADAPT_INSERT took a duplicate: %d", r);
+		if (RB_ADAPT_COUNT(&one) != (size_t)n)
+			errx(1, "RB_ADAPT_COUNT is %zu, not %d", RB_ADAPT_COUNT(&one), n);
+		if (n > RB_ADAPT_SIZE && !RB_ADAPT_ISTREE(&one))
+			errx(1, "a set of %d is not a tree", n);
+		if (n <= RB_ADAPT_SIZE / 2 && RB_ADAPT_ISTREE(&one))
+			errx(1, "a set of %d is still a tree", n);
+		if (i % 64 == 0)
+			check(nodes, present);
+	}
+
+	free(present);
+	free(probe);
+	free(sets);
+	free(trees);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+/* the set holds the keys marked present, in order, and NFIND agrees */
+static void
+check(struct node *nodes, int *present)
+{
+	struct node *tmp, key;
+	int i;
+
+	if (RB_ADAPT_ISTREE(&one) && RB_RANK(adapt_tree, RB_ROOT(&one.tree)) < 0)
+		errx(1, "rank error");
+	i = 0;
+	RB_ADAPT_FOREACH(tmp, adapt, &one) {
+		while (i < NKEYS && !present[i])
+			i++;
+		if (tmp != &nodes[i])
+			errx(1, "RB_ADAPT_FOREACH out of order at %d", tmp->key);
+		i++;
+	}
+	while (i < NKEYS && !present[i])
+		i++;
+	if (i != NKEYS)
+		errx(1, "RB_ADAPT_FOREACH stopped before %d", i);
+	for (i = 0; i < NKEYS; i++) {
+		key.key = i;
+		tmp = RB_ADAPT_NFIND(adapt, &one, &key);
+		if (tmp != NULL && (tmp->key < i || !present[tmp->key]))
+			errx(1, "RB_ADAPT_NFIND is wrong for %d", i);
+		if (present[i] && tmp != &nodes[i])
+			errx(1, "RB_ADAPT_NFIND missed %d", i);
+	}
+}
@@ -0,0 +1,206 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+#include "rbarena.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * the same random inserts, lookups and churn are run with nodes from
+ * malloc, from an arena without hints and from an arena that places
+ * every node next to its parent through RB_INSERT_ALLOC.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+	char			 payload[20];
+};
+
+static int compare(const struct node *, const struct node *);
+
+RB_HEAD(tree, node);
+
+RB_PROTOTYPE(tree, node, node_link, compare)
+RB_GENERATE(tree, node, node_link, compare)
+
+enum { MALLOC, ARENA, HINTED };
+static const char *names[] = { "malloc", "arena", "hinted arena" };
+
+static struct node *
+node_place(struct node *key, struct node *parent, void *a)
+{
+	struct node *elm;
+
+	if ((elm = rb_arena_alloc(a, parent)) != NULL)
+		elm->key = key->key;
+	return (elm);
+}
+
+static struct node *
+node_none(struct node *key, struct node *parent, void *a)
+{
+	return (NULL);
+}
+
+/* inserts a new node with the key of key, returns -1 if none was made */
+static int
+node_insert(int how, struct rb_arena *a, struct tree *t, struct node *key)
+{
+	struct node *elm;
+
+	switch (how) {
+	case MALLOC:
+		elm = malloc(sizeof(struct node));
+		break;
+	case ARENA:
+		elm = rb_arena_alloc(a, NULL);
+		break;
+	default:
+		return (RB_INSERT_ALLOC(tree, t, key, node_place, a) == NULL ? 0 : -1);
+	}
+	if (elm == NULL)
+		return (-1);
+	elm->key = key->key;
+	if (RB_INSERT(tree, t, elm) != NULL)
+		errx(1, "RB_INSERT failed");
+	return (0);
+}
+
+static void
+node_free(int how, struct rb_arena *a, struct node *elm)
+{
+	if (how == MALLOC)
+		free(elm);
+	else
+		rb_arena_free(a, elm);
+}
+
+static void
+run(int how, int *perm, int *stream)
+{
+	struct tree root = RB_INITIALIZER(&root);
+	struct rb_arena a;
+	struct node *tmp, key;
+	unsigned long found;
+	int i;
+
+	if (rb_arena_init(&a, sizeof(struct node), RB_ARENA_HUGE) == -1)
+		errx(1, "rb_arena_init failed");
+
+	TDEBUGF("%s: inserting", names[how]);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		key.key = perm[i];
+		if (node_insert(how, &a, &root, &key) == -1)
+			errx(1, "node_insert failed");
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("%s: done inserts in: %lld.%09ld s", names[how], (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("%s: removing and reinserting half of the keys", names[how]);
+	for (i = 0; i < ITER; i += 2) {
+		key.key = perm[i];
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp == NULL || RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", perm[i]);
+		node_free(how, &a, tmp);
+	}
+	for (i = 0; i < ITER; i += 2) {
+		key.key = perm[i];
+		if (node_insert(how, &a, &root, &key) == -1)
+			errx(1, "node_insert failed");
+	}
+	if (RB_RANK(tree, RB_ROOT(&root)) < 0)
+		errx(1, "rank error");
+	key.key = perm[0];
+	if (RB_INSERT_ALLOC(tree, &root, &key, node_place, &a) !=
+	    RB_FIND(tree, &root, &key))
+		errx(1, "RB_INSERT_ALLOC did not find the equal node");
+	key.key = ITER;
+	if (RB_INSERT_ALLOC(tree, &root, &key, node_none, &a) != &key ||
+	    RB_FIND(tree, &root, &key) != NULL)
+		errx(1, "RB_INSERT_ALLOC went on without a node");
+
+	TDEBUGF("%s: doing random lookups", names[how]);
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		key.key = stream[i];
+		tmp = RB_FIND(tree, &root, &key);
+		found += (tmp != NULL && tmp->key == stream[i]);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("%s: done lookups in: %lld.%09ld s", names[how], (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)ITER);
+
+	for (i = 0; i < ITER; i++) {
+		key.key = i;
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp == NULL || RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", i);
+		node_free(how, &a, tmp);
+	}
+	assert(RB_EMPTY(&root));
+	rb_arena_destroy(&a);
+}
+
+int
+main()
+{
+	int i, r, *perm, *stream;
+
+	perm = calloc(ITER, sizeof(int));
+	stream = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < ITER; i++)
+		stream[i] = random() % ITER;
+
+	run(MALLOC, perm, stream);
+	run(ARENA, perm, stream);
+	run(HINTED, perm, stream);
+
+	free(stream);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
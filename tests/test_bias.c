@@ -0,0 +1,269 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+int LOOKUPS=4000000;
+
+struct timespec start, end, diff;
+
+/*
+ * every node is linked into a plain tree and a _BIASED one, and both are
+ * searched with the same Zipf distributed trace, hot keys spread over the
+ * key range. the first half of the trace touches the nodes it finds, then
+ * RB_REBIAS relinks the biased tree and the second half is timed on both.
+ * the average depth of the touching lookups is reported for both trees,
+ * RB_RANK has to hold and updates have to keep working on the new tree.
+ * a tree that is RB_RELAXED as well has to finish its queued inserts
+ * before RB_REBIAS relinks them.
+ */
+struct node {
+	RB_ENTRY(node)			 plain_link;
+	RB_ENTRY_EXT(node, RB_BIASED)	 bias_link;
+	RB_ENTRY_EXT(node, RB_RELAXED, RB_BIASED)	 relax_link;
+	int				 key;
+	size_t				 size;
+};
+
+static int compare(const struct node *, const struct node *);
+static int augment(struct node *);
+static size_t sizes(struct node *);
+static double plain_depths(struct node *, double);
+static double bias_depths(struct node *, double);
+
+RB_HEAD(ptree, node);
+RB_HEAD(btree, node);
+RB_HEAD_EXT(rtree, node, RB_RELAXED, RB_BIASED);
+struct ptree a = RB_INITIALIZER(&a);
+struct btree b = RB_INITIALIZER(&b);
+struct rtree c = RB_INITIALIZER(&c);
+
+RB_PROTOTYPE(ptree, node, plain_link, compare)
+RB_GENERATE(ptree, node, plain_link, compare)
+RB_PROTOTYPE_EXT(btree, node, bias_link, compare, RB_BIASED)
+RB_GENERATE_EXT_AUGMENT(btree, node, bias_link, compare, augment, RB_BIASED)
+RB_PROTOTYPE_EXT(rtree, node, relax_link, compare, RB_RELAXED, RB_BIASED)
+RB_GENERATE_EXT(rtree, node, relax_link, compare, RB_RELAXED, RB_BIASED)
+
+static void
+check(int n)
+{
+	if (RB_RANK(btree, RB_ROOT(&b)) == -2)
+		errx(1, "rank error");
+	if (sizes(RB_ROOT(&b)) != (size_t)n)
+		errx(1, "augmented tree has the wrong sizes");
+}
+
+#define TIMED(what, stmt)	do {					\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);			\
+	stmt;								\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);			\
+	timespecsub(&end, &start, &diff);				\
+	TDEBUGF("%s in: %lld.%09ld s", what, (long long)diff.tv_sec, diff.tv_nsec);	\
+} while (0)
+
+int
+main()
+{
+	struct node *nodes, *tmp;
+	int i, j, r, n, lo, hi, *perm, *trace;
+	double *cdf, u, pdepth, bdepth;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	trace = calloc(LOOKUPS, sizeof(int));
+	cdf = calloc(ITER, sizeof(double));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < ITER; i++) {
+		nodes[i].key = i;
+		nodes[i].size = 1;
+	}
+
+	/* the i-th most popular key is perm[i], with probability 1/(i + 1) */
+	for (i = 0; i < ITER; i++)
+		cdf[i] = (i > 0 ? cdf[i - 1] : 0) + 1.0 / (i + 1);
+	for (i = 0; i < LOOKUPS; i++) {
+		u = (double)random() / 2147483648.0 * cdf[ITER - 1];
+		for (lo = 0, hi = ITER - 1; lo < hi; ) {
+			j = lo + (hi - lo) / 2;
+			if (cdf[j] <= u)
+				lo = j + 1;
+			else
+				hi = j;
+		}
+		trace[i] = perm[lo];
+	}
+
+	/* in key order, popular keys first would put them near the root */
+	TDEBUGF("inserting keys in order");
+	for (i = 0; i < ITER; i++) {
+		if (RB_INSERT(ptree, &a, &nodes[i]) != NULL)
+			errx(1, "RB_INSERT failed");
+		if (RB_INSERT(btree, &b, &nodes[i]) != NULL)
+			errx(1, "RB_INSERT failed");
+	}
+	n = ITER;
+	check(n);
+
+	TDEBUGF("touching the nodes found by the first half of the trace");
+	for (i = 0; i < LOOKUPS / 2; i++) {
+		tmp = RB_FIND(btree, &b, &nodes[trace[i]]);
+		if (tmp != &nodes[trace[i]])
+			errx(1, "RB_FIND failed");
+		RB_TOUCH(tmp, bias_link);
+	}
+	TIMED("rebias", RB_REBIAS(btree, &b));
+	check(n);
+	pdepth = plain_depths(RB_ROOT(&a), 1) / (LOOKUPS / 2);
+	bdepth = bias_depths(RB_ROOT(&b), 1) / (LOOKUPS / 2);
+	TDEBUGF("average lookup depth: plain %.3f, biased %.3f", pdepth, bdepth);
+	if (bdepth >= pdepth)
+		errx(1, "the biased tree is not shallower for the trace");
+
+	TDEBUGF("looking up the second half of the trace");
+	TIMED("plain lookups", for (i = LOOKUPS / 2; i < LOOKUPS; i++)
+		if (RB_FIND(ptree, &a, &nodes[trace[i]]) != &nodes[trace[i]])
+			errx(1, "RB_FIND failed"));
+	TIMED("biased lookups", for (i = LOOKUPS / 2; i < LOOKUPS; i++)
+		if (RB_FIND(btree, &b, &nodes[trace[i]]) != &nodes[trace[i]])
+			errx(1, "RB_FIND failed"));
+
+	TDEBUGF("removing and reinserting random keys");
+	for (i = 0; i < ITER / 4; i++) {
+		r = random() % ITER;
+		if (RB_FIND(btree, &b, &nodes[r]) == NULL) {
+			nodes[r].size = 1;
+			RB_INSERT(btree, &b, &nodes[r]);
+			n++;
+		} else {
+			if (RB_REMOVE(btree, &b, &nodes[r]) != &nodes[r])
+				errx(1, "RB_REMOVE failed");
+			n--;
+		}
+	}
+	check(n);
+	RB_REBIAS(btree, &b);
+	check(n);
+
+	TDEBUGF("emptying the tree");
+	while (!RB_EMPTY(&b)) {
+		RB_REMOVE(btree, &b, RB_ROOT(&b));
+		if (--n % (ITER / 8) == 0) {
+			check(n);
+			RB_REBIAS(btree, &b);
+			check(n);
+		}
+	}
+	assert(n == 0);
+
+	TDEBUGF("rebiasing a relaxed tree with inserts queued");
+	for (i = 0; i < ITER / 8; i++) {
+		if (RB_INSERT(rtree, &c, &nodes[i]) != NULL)
+			errx(1, "RB_INSERT failed");
+		if (i % 64 != 63)
+			continue;
+		RB_TOUCH(&nodes[trace[i] % (i + 1)], relax_link);
+		RB_REBIAS(rtree, &c);
+		if (RB_PENDING(&c) != 0)
+			errx(1, "RB_REBIAS left inserts queued");
+		if (RB_RANK(rtree, RB_ROOT(&c)) == -2)
+			errx(1, "rank error in the relaxed tree");
+	}
+	RB_REBALANCE(rtree, &c, RB_PENDING(&c));
+	if (RB_RANK(rtree, RB_ROOT(&c)) == -2)
+		errx(1, "rank error in the relaxed tree");
+
+	free(cdf);
+	free(trace);
+	free(perm);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static int
+augment(struct node *elm)
+{
+	size_t size = 1;
+
+	if (RB_LEFT(elm, bias_link) != NULL)
+		size += (RB_LEFT(elm, bias_link))->size;
+	if (RB_RIGHT(elm, bias_link) != NULL)
+		size += (RB_RIGHT(elm, bias_link))->size;
+	if (elm->size == size)
+		return (0);
+	elm->size = size;
+	return (1);
+}
+
+static size_t
+sizes(struct node *elm)
+{
+	size_t size;
+
+	if (elm == NULL)
+		return (0);
+	size = 1 + sizes(RB_LEFT(elm, bias_link)) +
+	    sizes(RB_RIGHT(elm, bias_link));
+	if (elm->size != size)
+		errx(1, "node %d has size %zu, not %zu", elm->key, elm->size,
+		    size);
+	return (size);
+}
+
+/* the depths of the nodes below elm, times the number of times they were touched */
+static double
+plain_depths(struct node *elm, double depth)
+{
+	if (elm == NULL)
+		return (0);
+	return (RB_WEIGHT(elm, bias_link) * depth +
+	    plain_depths(RB_LEFT(elm, plain_link), depth + 1) +
+	    plain_depths(RB_RIGHT(elm, plain_link), depth + 1));
+}
+
+static double
+bias_depths(struct node *elm, double depth)
+{
+	if (elm == NULL)
+		return (0);
+	return (RB_WEIGHT(elm, bias_link) * depth +
+	    bias_depths(RB_LEFT(elm, bias_link), depth + 1) +
+	    bias_depths(RB_RIGHT(elm, bias_link), depth + 1));
+}
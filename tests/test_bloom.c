@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=150000;
+int LOOKUPS=2000000;
+int BITS_PER_KEY=10;
+
+struct timespec start, end, diff;
+
+/*
+ * every node is linked into a plain tree and a tree with a bloom filter,
+ * the same lookup stream, where 90% of the keys are absent, is run
+ * against both.
+ */
+struct node {
+	RB_ENTRY(node)		 plain_link;
+	RB_ENTRY(node)		 bloom_link;
+	int			 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static unsigned int hash(const struct node *);
+
+RB_HEAD(ptree, node);
+RB_HEAD_EXT(btree, node, RB_BLOOM(hash));
+struct ptree proot = RB_INITIALIZER(&proot);
+struct btree broot = RB_INITIALIZER(&broot);
+
+RB_PROTOTYPE(ptree, node, plain_link, compare)
+RB_PROTOTYPE_EXT(btree, node, bloom_link, compare, RB_BLOOM(hash))
+
+RB_GENERATE(ptree, node, plain_link, compare)
+RB_GENERATE_EXT(btree, node, bloom_link, compare, RB_BLOOM(hash))
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	uint8_t *cells;
+	int i, r, *perm, *stream;
+	unsigned long found;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	stream = calloc(LOOKUPS, sizeof(int));
+	cells = calloc(RB_BLOOM_SIZE(ITER, BITS_PER_KEY), sizeof(uint8_t));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	/* only even keys are inserted, so odd keys always miss */
+	TDEBUGF("generating a miss-heavy lookup stream");
+	for (i = 0; i < LOOKUPS; i++) {
+		r = random() % (2 * ITER);
+		if (random() % 10 != 0)
+			r |= 1;
+		else
+			r &= ~1;
+		stream[i] = r;
+	}
+
+	RB_INIT(&proot);
+	RB_INIT(&broot);
+	/* the first half is inserted before the filter is set up, the rest after */
+	for (i = 0; i < ITER; i++) {
+		if (i == ITER / 2)
+			RB_BLOOM_INIT(btree, &broot, cells, ITER, BITS_PER_KEY);
+		tmp = &nodes[i];
+		tmp->key = 2 * perm[i];
+		if (RB_INSERT(ptree, &proot, tmp) != NULL)
+			errx(1, "RB_INSERT plain failed");
+		if (RB_INSERT(btree, &broot, tmp) != NULL)
+			errx(1, "RB_INSERT bloom failed");
+	}
+
+	TDEBUGF("doing lookups in the plain tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		found += (RB_FIND(ptree, &proot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	TDEBUGF("hits: %lu misses: %lu", found, LOOKUPS - found);
+
+	TDEBUGF("doing lookups in the bloom tree");
+	r = found;
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		found += (RB_FIND(btree, &broot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)r);
+
+	TDEBUGF("removing half of the keys from the bloom tree");
+	for (i = 0; i < ITER / 2; i++) {
+		key.key = 2 * perm[i];
+		tmp = RB_FIND(btree, &broot, &key);
+		if (tmp == NULL || tmp->key != 2 * perm[i])
+			errx(1, "RB_FIND bloom failed: %d", 2 * perm[i]);
+		if (RB_REMOVE(btree, &broot, tmp) != tmp)
+			errx(1, "RB_REMOVE bloom failed: %d", 2 * perm[i]);
+	}
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		/* nodes[i] holds 2 * perm[i], so the first half has been removed */
+		tmp = RB_FIND(ptree, &proot, &key);
+		if (tmp != NULL && tmp - nodes < ITER / 2)
+			tmp = NULL;
+		if (RB_FIND(btree, &broot, &key) != tmp)
+			errx(1, "RB_FIND bloom failed after removals: %d", stream[i]);
+	}
+
+	free(cells);
+	free(stream);
+	free(nodes);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static unsigned int
+hash(const struct node *elm)
+{
+	return ((unsigned int)elm->key * 2654435761U);
+}
@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * a tree of malloc'd nodes is churned so that its nodes are scattered over
+ * the heap, then moved into one array with RB_COMPACT. refs is an outside
+ * table of the nodes by key that the relocation callback keeps up to date.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+	size_t			 size;
+	char			 payload[20];
+};
+
+static int compare(const struct node *, const struct node *);
+static int augment(struct node *);
+static void reloc(struct node *, struct node *, void *);
+static void lookups(int *, const char *);
+
+RB_HEAD_EXT(tree, node, RB_MINMAX);
+struct tree root = RB_INITIALIZER(&root);
+struct node **refs;
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_MINMAX)
+RB_GENERATE_EXT_AUGMENT(tree, node, node_link, compare, augment, RB_MINMAX)
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	int i, r, *perm, *stream;
+	size_t moved = 0;
+
+	refs = calloc(ITER, sizeof(struct node *));
+	perm = calloc(ITER, sizeof(int));
+	stream = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < ITER; i++)
+		stream[i] = random() % ITER;
+
+	RB_INIT(&root);
+	for (i = 0; i < ITER; i++) {
+		if ((tmp = malloc(sizeof(struct node))) == NULL)
+			err(1, "malloc");
+		tmp->key = perm[i];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+		refs[perm[i]] = tmp;
+	}
+	/* free and reallocate half of the nodes to scatter them */
+	for (i = 0; i < ITER; i += 2) {
+		tmp = refs[perm[i]];
+		if (RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", perm[i]);
+		free(tmp);
+	}
+	for (i = 0; i < ITER; i += 2) {
+		if ((tmp = malloc(sizeof(struct node))) == NULL)
+			err(1, "malloc");
+		tmp->key = perm[i];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+		refs[perm[i]] = tmp;
+	}
+
+	lookups(stream, "scattered");
+
+	if ((nodes = calloc(ITER, sizeof(struct node))) == NULL)
+		err(1, "calloc");
+	if (RB_COMPACT(tree, &root, nodes, ITER - 1, reloc, &moved) != -1)
+		errx(1, "RB_COMPACT into a short array succeeded");
+	assert(moved == 0);
+
+	TDEBUGF("compacting");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	if (RB_COMPACT(tree, &root, nodes, ITER, reloc, &moved) != 0)
+		errx(1, "RB_COMPACT failed");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done compacting in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(moved == (size_t)ITER);
+	assert(RB_ROOT(&root) == &nodes[0]);
+
+	if (RB_RANK(tree, RB_ROOT(&root)) < 0)
+		errx(1, "rank error");
+	if (RB_ROOT(&root)->size != (size_t)ITER)
+		errx(1, "augment error");
+	if (RB_MIN(tree, &root) != refs[0] || RB_MAX(tree, &root) != refs[ITER - 1])
+		errx(1, "minmax error");
+	for (i = 0; i < ITER; i++) {
+		key.key = i;
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp == NULL || tmp != refs[i] || tmp < nodes || tmp >= nodes + ITER)
+			errx(1, "RB_FIND failed: %d", i);
+	}
+
+	lookups(stream, "compacted");
+
+	TDEBUGF("removing from the compacted tree");
+	for (i = 0; i < ITER; i++) {
+		tmp = refs[perm[i]];
+		if (RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", perm[i]);
+		if (!RB_EMPTY(&root) && RB_ROOT(&root)->size != (size_t)(ITER - 1 - i))
+			errx(1, "augment error");
+		if (i % 100000 == 0 && RB_RANK(tree, RB_ROOT(&root)) == -2)
+			errx(1, "rank error");
+	}
+	assert(RB_EMPTY(&root));
+
+	free(nodes);
+	free(stream);
+	free(perm);
+	free(refs);
+	exit(0);
+}
+
+static void
+lookups(int *stream, const char *what)
+{
+	struct node *tmp, key;
+	int i;
+
+	TDEBUGF("doing random lookups in the %s tree", what);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		key.key = stream[i];
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp != refs[stream[i]])
+			errx(1, "RB_FIND failed: %d", stream[i]);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static int
+augment(struct node *elm)
+{
+	size_t newsize = 1;
+	if (RB_LEFT(elm, node_link))
+		newsize += (RB_LEFT(elm, node_link))->size;
+	if (RB_RIGHT(elm, node_link))
+		newsize += (RB_RIGHT(elm, node_link))->size;
+	if (elm->size != newsize) {
+		elm->size = newsize;
+		return 1;
+	}
+	return 0;
+}
+
+/* the old node is not used by RB_COMPACT once it was copied */
+static void
+reloc(struct node *old, struct node *new, void *arg)
+{
+	refs[new->key] = new;
+	(*(size_t *)arg)++;
+	free(old);
+}
@@ -0,0 +1,251 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+
+int ITER=150000;
+int LOOKUPS=2000000;
+int KEYLEN=24;
+
+struct timespec start, end, diff;
+
+/*
+ * every node is linked into a plain tree and a tree keeping key prefixes,
+ * both are frozen and every search of the snapshots is checked against
+ * the same search of the live tree. the lookup keys miss half the time.
+ */
+struct node {
+	RB_ENTRY(node)				 plain_link;
+	RB_ENTRY_EXT(node, RB_PREFIX(prefix))	 prefix_link;
+	char					*key;
+};
+
+static int compare(const struct node *, const struct node *);
+static uint64_t prefix(const struct node *);
+
+RB_HEAD(ptree, node);
+RB_HEAD(xtree, node);
+struct ptree proot = RB_INITIALIZER(&proot);
+struct xtree xroot = RB_INITIALIZER(&xroot);
+
+RB_PROTOTYPE(ptree, node, plain_link, compare)
+RB_PROTOTYPE_EXT(xtree, node, prefix_link, compare, RB_PREFIX(prefix))
+
+RB_GENERATE(ptree, node, plain_link, compare)
+RB_GENERATE_EXT(xtree, node, prefix_link, compare, RB_PREFIX(prefix))
+
+static char *
+random_key(void)
+{
+	char buf[64];
+	int j;
+
+	for (j = 0; j < KEYLEN; j++)
+		buf[j] = 'a' + random() % 26;
+	buf[KEYLEN] = '\0';
+	return (strdup(buf));
+}
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	struct rb_frozen pfz, xfz;
+	struct node **pbuf, **xbuf;
+	uint64_t *prefixes;
+	char **keys, **probes;
+	int i, m, r, *perm, *stream;
+	unsigned long found;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	keys = calloc(ITER, sizeof(char *));
+	probes = calloc(ITER, sizeof(char *));
+	stream = calloc(LOOKUPS, sizeof(int));
+	pbuf = calloc(ITER, sizeof(struct node *));
+	xbuf = calloc(ITER, sizeof(struct node *));
+	prefixes = calloc(ITER, sizeof(uint64_t));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	/* some keys share their first 8 bytes, so ties go through compare */
+	for (i = 0; i < ITER; i++) {
+		keys[i] = random_key();
+		if (i > 0 && i % 16 == 0)
+			memcpy(keys[i], keys[i - 1], 8);
+		probes[i] = (i % 2 == 0) ? strdup(keys[i]) : random_key();
+		if (i % 4 == 1)
+			memcpy(probes[i], keys[i - 1], 8);
+	}
+	for (i = 0; i < LOOKUPS; i++)
+		stream[i] = random() % ITER;
+
+	TDEBUGF("checking small snapshots");
+	RB_INIT(&proot);
+	for (m = 0; m < 70; m++) {
+		RB_FROZEN_INIT(&pfz, pbuf, NULL, m);
+		if (RB_FREEZE(ptree, &proot, &pfz) != 0)
+			errx(1, "RB_FREEZE failed");
+		for (i = 0; i < 200; i++) {
+			key.key = probes[i];
+			if (RB_FROZEN_FIND(ptree, &pfz, &key) != RB_FIND(ptree, &proot, &key) ||
+			    RB_FROZEN_NFIND(ptree, &pfz, &key) != RB_NFIND(ptree, &proot, &key) ||
+			    RB_FROZEN_PFIND(ptree, &pfz, &key) != RB_PFIND(ptree, &proot, &key))
+				errx(1, "frozen search of %d nodes failed: %s", m, probes[i]);
+		}
+		tmp = &nodes[m];
+		tmp->key = keys[2 * m];
+		if (RB_INSERT(ptree, &proot, tmp) != NULL)
+			errx(1, "RB_INSERT plain failed");
+	}
+
+	RB_INIT(&proot);
+	RB_INIT(&xroot);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = keys[perm[i]];
+		if (RB_INSERT(ptree, &proot, tmp) != NULL)
+			errx(1, "RB_INSERT plain failed");
+		if (RB_INSERT(xtree, &xroot, tmp) != NULL)
+			errx(1, "RB_INSERT prefix failed");
+	}
+
+	RB_FROZEN_INIT(&pfz, pbuf, NULL, ITER - 1);
+	if (RB_FREEZE(ptree, &proot, &pfz) != -1)
+		errx(1, "RB_FREEZE into a short array succeeded");
+	TDEBUGF("freezing");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	RB_FROZEN_INIT(&pfz, pbuf, NULL, ITER);
+	RB_FROZEN_INIT(&xfz, xbuf, prefixes, ITER);
+	if (RB_FREEZE(ptree, &proot, &pfz) != 0 || RB_FREEZE(xtree, &xroot, &xfz) != 0)
+		errx(1, "RB_FREEZE failed");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done freezing in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("checking the snapshots against the trees");
+	for (i = 0; i < ITER; i++) {
+		key.key = probes[i];
+		tmp = RB_FIND(ptree, &proot, &key);
+		if (RB_FROZEN_FIND(ptree, &pfz, &key) != tmp ||
+		    RB_FROZEN_FIND(xtree, &xfz, &key) != tmp)
+			errx(1, "RB_FROZEN_FIND failed: %s", probes[i]);
+		tmp = RB_NFIND(ptree, &proot, &key);
+		if (RB_FROZEN_NFIND(ptree, &pfz, &key) != tmp ||
+		    RB_FROZEN_NFIND(xtree, &xfz, &key) != tmp)
+			errx(1, "RB_FROZEN_NFIND failed: %s", probes[i]);
+		tmp = RB_PFIND(ptree, &proot, &key);
+		if (RB_FROZEN_PFIND(ptree, &pfz, &key) != tmp ||
+		    RB_FROZEN_PFIND(xtree, &xfz, &key) != tmp)
+			errx(1, "RB_FROZEN_PFIND failed: %s", probes[i]);
+	}
+
+	TDEBUGF("doing lookups in the plain tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = probes[stream[i]];
+		found += (RB_FIND(ptree, &proot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("doing lookups in the plain snapshot");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = probes[stream[i]];
+		found -= (RB_FROZEN_FIND(ptree, &pfz, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == 0);
+
+	TDEBUGF("doing lookups in the prefix tree");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = probes[stream[i]];
+		found += (RB_FIND(xtree, &xroot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("doing lookups in the prefix snapshot");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = probes[stream[i]];
+		found -= (RB_FROZEN_FIND(xtree, &xfz, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == 0);
+
+	for (i = 0; i < ITER; i++) {
+		free(probes[i]);
+		free(keys[i]);
+	}
+	free(prefixes);
+	free(xbuf);
+	free(pbuf);
+	free(probes);
+	free(keys);
+	free(stream);
+	free(nodes);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return strcmp(a->key, b->key);
+}
+
+/* the first 8 bytes, big endian and zero padded, order like strcmp */
+static uint64_t
+prefix(const struct node *elm)
+{
+	const unsigned char *p = (const unsigned char *)elm->key;
+	uint64_t res = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		res <<= 8;
+		if (*p != '\0')
+			res |= *p++;
+	}
+	return (res);
+}
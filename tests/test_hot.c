@@ -0,0 +1,211 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=150000;
+int LOOKUPS=2000000;
+
+struct timespec start, end, diff;
+
+/*
+ * every node is linked into a plain tree and a tree with a hot-key cache,
+ * the same zipfian stream of lookups is run against both. a third tree
+ * also keeps its extremes and a Bloom filter, to check the features
+ * work together.
+ */
+struct node {
+	RB_ENTRY(node)		 plain_link;
+	RB_ENTRY(node)		 hot_link;
+	RB_ENTRY(node)		 mixed_link;
+	int			 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static unsigned int hash(const struct node *);
+
+RB_HEAD(ptree, node);
+RB_HEAD_EXT(htree, node, RB_HOT(hash));
+RB_HEAD_EXT(mtree, node, RB_MINMAX, RB_HOT(hash), RB_BLOOM(hash));
+struct ptree proot = RB_INITIALIZER(&proot);
+struct htree hroot = RB_INITIALIZER(&hroot);
+struct mtree mroot = RB_INITIALIZER(&mroot);
+
+RB_PROTOTYPE(ptree, node, plain_link, compare)
+RB_PROTOTYPE_EXT(htree, node, hot_link, compare, RB_HOT(hash))
+RB_PROTOTYPE_EXT(mtree, node, mixed_link, compare, RB_MINMAX, RB_HOT(hash), RB_BLOOM(hash))
+
+RB_GENERATE(ptree, node, plain_link, compare)
+RB_GENERATE_EXT(htree, node, hot_link, compare, RB_HOT(hash))
+RB_GENERATE_EXT(mtree, node, mixed_link, compare, RB_MINMAX, RB_HOT(hash), RB_BLOOM(hash))
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	double *cdf, u;
+	int i, r, lo, hi, *perm, *stream;
+	unsigned long found;
+	uint8_t *cells;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	cdf = calloc(ITER, sizeof(double));
+	stream = calloc(LOOKUPS, sizeof(int));
+	cells = calloc(RB_BLOOM_SIZE(ITER, 10), sizeof(uint8_t));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	/* zipfian with exponent 2, a handful of keys take most of the lookups */
+	TDEBUGF("generating a zipfian lookup stream");
+	cdf[0] = 1.0;
+	for (i = 1; i < ITER; i++)
+		cdf[i] = cdf[i - 1] + 1.0 / ((double)(i + 1) * (i + 1));
+	for (i = 0; i < LOOKUPS; i++) {
+		u = cdf[ITER - 1] * random() / RAND_MAX;
+		lo = 0;
+		hi = ITER - 1;
+		while (lo < hi) {
+			r = (lo + hi) / 2;
+			if (cdf[r] < u)
+				lo = r + 1;
+			else
+				hi = r;
+		}
+		/* the popular ranks are scattered over the key space */
+		stream[i] = perm[lo];
+	}
+
+	RB_INIT(&proot);
+	RB_INIT(&hroot);
+	RB_INIT(&mroot);
+	RB_BLOOM_INIT(mtree, &mroot, cells, ITER, 10);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = perm[i];
+		if (RB_INSERT(ptree, &proot, tmp) != NULL)
+			errx(1, "RB_INSERT plain failed");
+		if (RB_INSERT(htree, &hroot, tmp) != NULL)
+			errx(1, "RB_INSERT hot failed");
+		if (RB_INSERT(mtree, &mroot, tmp) != NULL)
+			errx(1, "RB_INSERT mixed failed");
+	}
+
+	TDEBUGF("doing zipfian lookups in the plain tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		found += (RB_FIND(ptree, &proot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)LOOKUPS);
+
+	TDEBUGF("doing zipfian lookups in the hot tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		found += (RB_FIND(htree, &hroot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)LOOKUPS);
+	TDEBUGF("hits: %lu misses: %lu hit rate: %.1f%%", RB_HOT_HITS(&hroot), RB_HOT_MISSES(&hroot),
+	    100.0 * RB_HOT_HITS(&hroot) / (RB_HOT_HITS(&hroot) + RB_HOT_MISSES(&hroot)));
+	assert(RB_HOT_HITS(&hroot) + RB_HOT_MISSES(&hroot) == (unsigned long)LOOKUPS);
+
+	TDEBUGF("removing the popular keys from the hot tree");
+	for (i = 0; i < ITER / 2; i++) {
+		key.key = perm[i];
+		tmp = RB_FIND(htree, &hroot, &key);
+		if (tmp == NULL || tmp->key != perm[i])
+			errx(1, "RB_FIND hot failed: %d", perm[i]);
+		if (RB_REMOVE(htree, &hroot, tmp) != tmp)
+			errx(1, "RB_REMOVE hot failed: %d", perm[i]);
+	}
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		/* nodes[i] holds perm[i], so the first half has been removed */
+		tmp = RB_FIND(ptree, &proot, &key);
+		if (tmp - nodes < ITER / 2)
+			tmp = NULL;
+		if (RB_FIND(htree, &hroot, &key) != tmp)
+			errx(1, "RB_FIND hot returned a stale node: %d", stream[i]);
+	}
+
+	TDEBUGF("removing the popular keys from the mixed tree");
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		if (RB_FIND(mtree, &mroot, &key) == NULL)
+			errx(1, "RB_FIND mixed failed: %d", stream[i]);
+	}
+	for (i = 0; i < ITER / 2; i++)
+		if (RB_REMOVE(mtree, &mroot, &nodes[i]) != &nodes[i])
+			errx(1, "RB_REMOVE mixed failed: %d", perm[i]);
+	if (RB_MIN(mtree, &mroot) != RB_MIN(htree, &hroot) ||
+	    RB_MAX(mtree, &mroot) != RB_MAX(htree, &hroot))
+		errx(1, "RB_MIN/RB_MAX mixed are stale");
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = stream[i];
+		if (RB_FIND(mtree, &mroot, &key) != RB_FIND(htree, &hroot, &key))
+			errx(1, "RB_FIND mixed returned a stale node: %d", stream[i]);
+	}
+	TDEBUGF("hits: %lu misses: %lu", RB_HOT_HITS(&mroot), RB_HOT_MISSES(&mroot));
+	assert(RB_HOT_HITS(&mroot) + RB_HOT_MISSES(&mroot) >= 2 * (unsigned long)LOOKUPS);
+	while ((tmp = RB_POP_MIN(mtree, &mroot)) != NULL)
+		if (tmp != RB_MIN(htree, &hroot) || RB_REMOVE(htree, &hroot, tmp) != tmp)
+			errx(1, "RB_POP_MIN mixed failed: %d", tmp->key);
+	assert(RB_EMPTY(&hroot));
+
+	free(cells);
+	free(stream);
+	free(cdf);
+	free(nodes);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static unsigned int
+hash(const struct node *elm)
+{
+	return ((unsigned int)elm->key * 2654435761U) >> 16;
+}
@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=150000;
+int RANK_TEST_ITERATIONS=10000;
+
+struct timespec start, end, diff;
+
+/* the nodes of the index tree live in one array, linked by position */
+struct node {
+	RB_ENTRY_INDEX(node)	 node_link;
+	int			 key;
+};
+
+struct pnode {
+	RB_ENTRY_LARGE(pnode)	 node_link;
+	int			 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static int pcompare(const struct pnode *, const struct pnode *);
+
+RB_HEAD_INDEX(itree, node);
+RB_HEAD_LARGE(ptree, pnode);
+struct itree iroot, oroot;
+struct ptree proot = RB_INITIALIZER(&proot);
+
+RB_PROTOTYPE_INDEX(itree, node, node_link, compare)
+RB_PROTOTYPE_LARGE(ptree, pnode, node_link, pcompare)
+
+RB_GENERATE_INDEX(itree, node, node_link, compare)
+RB_GENERATE_LARGE(ptree, pnode, node_link, pcompare)
+
+int
+main()
+{
+	struct node *nodes, *moved, *tmp, key;
+	struct pnode *pnodes, pkey;
+	int i, r, *perm;
+	unsigned long found;
+
+	assert(sizeof(((struct node *)NULL)->node_link) * 2 ==
+	    sizeof(((struct pnode *)NULL)->node_link));
+
+	nodes = calloc(ITER, sizeof(struct node));
+	moved = calloc(ITER, sizeof(struct node));
+	pnodes = calloc(ITER, sizeof(struct pnode));
+	perm = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	/* a node below the base is out of reach of the links */
+	RB_INDEX_INIT(&oroot, &nodes[1]);
+	nodes[0].key = 0;
+	if (RB_INSERT(itree, &oroot, &nodes[0]) != &nodes[0] ||
+	    !RB_EMPTY(&oroot))
+		errx(1, "RB_INSERT index linked a node out of range");
+
+	RB_INDEX_INIT(&iroot, nodes);
+	RB_INIT(&proot);
+	TDEBUGF("inserting into both trees");
+	for (i = 0; i < ITER; i++) {
+		nodes[i].key = perm[i];
+		pnodes[i].key = perm[i];
+		if (RB_INSERT(itree, &iroot, &nodes[i]) != NULL)
+			errx(1, "RB_INSERT index failed");
+		if (RB_INSERT(ptree, &proot, &pnodes[i]) != NULL)
+			errx(1, "RB_INSERT large failed");
+		if (i % RANK_TEST_ITERATIONS == 0 && RB_RANK(itree, RB_ROOT(&iroot)) < 0)
+			errx(1, "index rank error");
+	}
+	key.key = perm[0];
+	if (RB_INSERT(itree, &iroot, &key) != &nodes[0])
+		errx(1, "RB_INSERT index allowed a duplicate");
+
+	TDEBUGF("doing lookups in the large tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		pkey.key = perm[(i * 7919) % ITER];
+		found += (RB_FIND(ptree, &proot, &pkey) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)ITER);
+
+	TDEBUGF("doing lookups in the index tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		key.key = perm[(i * 7919) % ITER];
+		found += (RB_FIND(itree, &iroot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)ITER);
+
+	TDEBUGF("moving the array and iterating");
+	memcpy(moved, nodes, ITER * sizeof(struct node));
+	memset(nodes, 0, ITER * sizeof(struct node));
+	RB_INDEX_RELOCATE(itree, &iroot, moved);
+	i = 0;
+	RB_FOREACH(tmp, itree, &iroot) {
+		if (tmp->key != i)
+			errx(1, "RB_FOREACH index failed: %d", i);
+		i++;
+	}
+	assert(i == ITER);
+	RB_FOREACH_REVERSE(tmp, itree, &iroot) {
+		i--;
+		if (tmp->key != i)
+			errx(1, "RB_FOREACH_REVERSE index failed: %d", i);
+	}
+	key.key = -1;
+	if (RB_NFIND(itree, &iroot, &key) != RB_MIN(itree, &iroot))
+		errx(1, "RB_NFIND index failed");
+	key.key = ITER;
+	if (RB_PFIND(itree, &iroot, &key) != RB_MAX(itree, &iroot))
+		errx(1, "RB_PFIND index failed");
+
+	TDEBUGF("removing from the index tree");
+	for (i = 0; i < ITER; i++) {
+		key.key = perm[(i * 7919) % ITER];
+		tmp = RB_FIND(itree, &iroot, &key);
+		if (tmp == NULL || tmp->key != key.key)
+			errx(1, "RB_FIND index failed: %d", key.key);
+		if (RB_REMOVE(itree, &iroot, tmp) != tmp)
+			errx(1, "RB_REMOVE index failed: %d", key.key);
+		if (RB_FIND(itree, &iroot, &key) != NULL)
+			errx(1, "RB_REMOVE index left the node: %d", key.key);
+		if (i % RANK_TEST_ITERATIONS == 0 && RB_RANK(itree, RB_ROOT(&iroot)) < -1)
+			errx(1, "index rank error");
+	}
+	assert(RB_EMPTY(&iroot));
+
+	free(perm);
+	free(pnodes);
+	free(moved);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static int
+pcompare(const struct pnode *a, const struct pnode *b)
+{
+	return a->key - b->key;
+}
@@ -0,0 +1,148 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=150000;
+
+/*
+ * every node is linked into two trees at once, an augmented 2-pointer one
+ * used for lookups and a plain 3-pointer one used for ordered scans.
+ */
+struct node {
+	RB_ENTRY_SMALL(node)	 small_link;
+	RB_ENTRY_LARGE(node)	 large_link;
+	int			 key;
+	size_t			 size;
+};
+
+static int compare(const struct node *, const struct node *);
+static int small_augment(struct node *);
+
+RB_HEAD_SMALL(stree, node);
+RB_HEAD_LARGE(ltree, node);
+struct stree sroot = RB_INITIALIZER(&sroot);
+struct ltree lroot = RB_INITIALIZER(&lroot);
+
+RB_PROTOTYPE_SMALL(stree, node, small_link, compare)
+RB_PROTOTYPE_LARGE(ltree, node, large_link, compare)
+
+RB_GENERATE_SMALL_AUGMENT(stree, node, small_link, compare, small_augment)
+RB_GENERATE_LARGE(ltree, node, large_link, compare)
+
+int
+main()
+{
+	struct node *tmp, *ins, *nodes, key;
+	int i, r, *perm;
+
+	assert(sizeof(((struct node *)NULL)->small_link) == 2 * sizeof(void *));
+	assert(sizeof(((struct node *)NULL)->large_link) == 3 * sizeof(void *));
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	RB_INIT(&sroot);
+	RB_INIT(&lroot);
+
+	TDEBUGF("inserting into both layouts");
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = perm[i];
+		tmp->size = 1;
+		if (RB_INSERT(stree, &sroot, tmp) != NULL)
+			errx(1, "RB_INSERT small failed");
+		if (RB_ROOT(&sroot)->size != i + 1)
+			errx(1, "small augment error");
+		if (RB_INSERT(ltree, &lroot, tmp) != NULL)
+			errx(1, "RB_INSERT large failed");
+	}
+	if (RB_RANK(stree, RB_ROOT(&sroot)) < 0)
+		errx(1, "small rank error");
+	if (RB_RANK(ltree, RB_ROOT(&lroot)) < 0)
+		errx(1, "large rank error");
+
+	TDEBUGF("looking up in the small layout");
+	for (i = 0; i < ITER; i++) {
+		key.key = i;
+		ins = RB_FIND(stree, &sroot, &key);
+		if (ins == NULL || ins->key != i)
+			errx(1, "RB_FIND small failed: %d", i);
+		if (RB_FIND(ltree, &lroot, &key) != ins)
+			errx(1, "RB_FIND large failed: %d", i);
+	}
+
+	TDEBUGF("iterating the large layout");
+	i = 0;
+	RB_FOREACH(tmp, ltree, &lroot) {
+		if (tmp->key != i)
+			errx(1, "RB_FOREACH large failed: %d", i);
+		i++;
+	}
+	assert(i == ITER);
+
+	TDEBUGF("removing from both layouts");
+	for (i = 0; i < ITER; i++) {
+		key.key = perm[i];
+		ins = RB_FINDC(stree, &sroot, &key);
+		if (ins == NULL)
+			errx(1, "RB_FINDC small failed: %d", perm[i]);
+		if (RB_REMOVEC(stree, &sroot, ins) != ins)
+			errx(1, "RB_REMOVEC small failed: %d", perm[i]);
+		if (RB_REMOVE(ltree, &lroot, ins) != ins)
+			errx(1, "RB_REMOVE large failed: %d", perm[i]);
+		if (!RB_EMPTY(&sroot) && RB_ROOT(&sroot)->size != ITER - 1 - i)
+			errx(1, "small augment error");
+		if (i % 10000 == 0) {
+			if (RB_RANK(stree, RB_ROOT(&sroot)) == -2)
+				errx(1, "small rank error");
+			if (RB_RANK(ltree, RB_ROOT(&lroot)) == -2)
+				errx(1, "large rank error");
+		}
+	}
+	assert(RB_EMPTY(&sroot));
+	assert(RB_EMPTY(&lroot));
+
+	free(nodes);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static int
+small_augment(struct node *elm)
+{
+	size_t newsize = 1;
+	if (RB_LEFT(elm, small_link))
+		newsize += (RB_LEFT(elm, small_link))->size;
+	if (RB_RIGHT(elm, small_link))
+		newsize += (RB_RIGHT(elm, small_link))->size;
+	if (elm->size != newsize) {
+		elm->size = newsize;
+		return 1;
+	}
+	return 0;
+}
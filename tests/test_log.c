@@ -0,0 +1,326 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "rblog.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=100000;
+
+struct timespec start, end, diff;
+
+/* set to make every log write fail */
+int failing;
+
+/*
+ * a tree is checkpointed halfway through a run of inserts and removes
+ * that all go to a log, then rebuilt from the checkpoint and the log into
+ * a second set of nodes and compared with the original.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+};
+
+/* nodes of the recovered tree, handed out in order */
+struct pool {
+	struct node		*nodes;
+	int			 next;
+};
+
+struct keys {
+	int			*keys;
+	int			 n;
+};
+
+static int compare(const struct node *, const struct node *);
+static int logop(void *, int, struct node *);
+static int save(void *, FILE *);
+static int load(void *, FILE *);
+static int apply(void *, int, const void *, size_t);
+static int collect(struct node *, void *);
+static void drop(struct node *, void *);
+
+RB_HEAD_EXT(tree, node, RB_LOG(logop));
+struct tree root = RB_INITIALIZER(&root);
+struct tree rroot = RB_INITIALIZER(&rroot);
+struct pool pool;
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_LOG(logop))
+RB_GENERATE_EXT(tree, node, node_link, compare, RB_LOG(logop))
+
+int
+main()
+{
+	struct node *nodes, *tmp;
+	struct rb_log lg;
+	struct keys a, b;
+	struct rb_log_rec hdr;
+	struct stat st;
+	char dir[] = "/tmp/test_log.XXXXXX", ckpt[64], log[64];
+	long n;
+	off_t size;
+	int i, r, *perm;
+	FILE *fp;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	pool.nodes = calloc(2 * ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	a.keys = calloc(ITER, sizeof(int));
+	b.keys = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(ckpt, sizeof(ckpt), "%s/tree", dir);
+	snprintf(log, sizeof(log), "%s/log", dir);
+	if (rb_log_open(&lg, log, 4096, 256) == -1)
+		err(1, "rb_log_open");
+
+	RB_INIT(&root);
+	RB_SET_LOG(&root, &lg);
+	TDEBUGF("inserting with a checkpoint halfway");
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = perm[i];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+		if (i == ITER / 2 && rb_log_checkpoint(&lg, ckpt, save, &root) == -1)
+			err(1, "rb_log_checkpoint");
+	}
+	TDEBUGF("removing every third key");
+	for (i = 0; i < ITER; i += 3)
+		if (RB_REMOVE(tree, &root, &nodes[i]) != &nodes[i])
+			errx(1, "RB_REMOVE failed");
+	/* a removed key that comes back must stay after replay */
+	if (RB_INSERT(tree, &root, &nodes[0]) != NULL)
+		errx(1, "RB_INSERT failed");
+	TDEBUGF("failing the log");
+	failing = 1;
+	if (RB_INSERT(tree, &root, &nodes[3]) != &nodes[3] ||
+	    RB_FIND(tree, &root, &nodes[3]) != NULL)
+		errx(1, "RB_INSERT went on without its record");
+	if (RB_REMOVE(tree, &root, &nodes[1]) != NULL ||
+	    RB_FIND(tree, &root, &nodes[1]) != &nodes[1])
+		errx(1, "RB_REMOVE went on without its record");
+	failing = 0;
+	if (rb_log_commit(&lg) == -1)
+		err(1, "rb_log_commit");
+
+	/* lose the process without closing the log, leaving a torn record */
+	close(lg.fd);
+	free(lg.buf);
+	if ((fp = fopen(log, "a")) == NULL)
+		err(1, "fopen");
+	fwrite("torn", 4, 1, fp);
+	fclose(fp);
+
+	TDEBUGF("recovering");
+	RB_INIT(&rroot);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	n = rb_log_recover(ckpt, log, load, apply, &rroot);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	if (n == -1)
+		errx(1, "rb_log_recover failed");
+	TDEBUGF("replayed %ld records in: %lld.%09ld s", n, (long long)diff.tv_sec, diff.tv_nsec);
+	assert(n == ITER - ITER / 2 - 1 + (ITER + 2) / 3 + 1);
+	if (RB_RANK(tree, RB_ROOT(&rroot)) < 0)
+		errx(1, "rank error");
+
+	a.n = b.n = 0;
+	RB_SERIALIZE(tree, &root, collect, &a);
+	RB_SERIALIZE(tree, &rroot, collect, &b);
+	if (a.n != b.n || memcmp(a.keys, b.keys, a.n * sizeof(int)) != 0)
+		errx(1, "recovered tree differs");
+
+	TDEBUGF("appending after the torn record");
+	if (rb_log_open(&lg, log, 4096, 0) == -1)
+		err(1, "rb_log_open");
+	RB_SET_LOG(&rroot, &lg);
+	tmp = &pool.nodes[pool.next++];
+	tmp->key = ITER;
+	if (RB_INSERT(tree, &rroot, tmp) != NULL)
+		errx(1, "RB_INSERT failed");
+	if (rb_log_close(&lg) == -1)
+		err(1, "rb_log_close");
+	RB_INIT(&rroot);
+	pool.next = 0;
+	if (rb_log_recover(ckpt, log, load, apply, &rroot) != n + 1)
+		errx(1, "record after the torn one was lost");
+	b.n = 0;
+	RB_SERIALIZE(tree, &rroot, collect, &b);
+	if (b.n != a.n + 1 || b.keys[a.n] != ITER)
+		errx(1, "recovered tree differs");
+
+	TDEBUGF("cutting a header torn in its length");
+	if (stat(log, &st) == -1)
+		err(1, "stat");
+	size = st.st_size;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.len = 0x7fffffff;
+	hdr.op = RB_LOG_INSERT;
+	if ((fp = fopen(log, "a")) == NULL)
+		err(1, "fopen");
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fclose(fp);
+	RB_INIT(&rroot);
+	pool.next = 0;
+	if (rb_log_recover(ckpt, log, load, apply, &rroot) != n + 1)
+		errx(1, "record before the torn header was lost");
+	if (stat(log, &st) == -1)
+		err(1, "stat");
+	if (st.st_size != size)
+		errx(1, "torn header was not cut off");
+
+	TDEBUGF("destroying a logged tree");
+	if (rb_log_open(&lg, log, 4096, 0) == -1)
+		err(1, "rb_log_open");
+	RB_SET_LOG(&rroot, &lg);
+	failing = 1;
+	if (RB_DESTROY(tree, &rroot, drop, NULL) != -1 || RB_EMPTY(&rroot))
+		errx(1, "RB_DESTROY went on without its record");
+	failing = 0;
+	if (RB_DESTROY(tree, &rroot, drop, NULL) != 0 || !RB_EMPTY(&rroot))
+		errx(1, "RB_DESTROY failed");
+	if (rb_log_close(&lg) == -1)
+		err(1, "rb_log_close");
+	pool.next = 0;
+	if (rb_log_recover(ckpt, log, load, apply, &rroot) != n + 2 ||
+	    !RB_EMPTY(&rroot))
+		errx(1, "RB_DESTROY was not replayed");
+
+	unlink(ckpt);
+	unlink(log);
+	rmdir(dir);
+	free(b.keys);
+	free(a.keys);
+	free(perm);
+	free(pool.nodes);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static int
+logop(void *lg, int op, struct node *elm)
+{
+	if (failing)
+		return (-1);
+	if (op == RB_LOG_CLEAR)
+		return (rb_log_append(lg, op, "", 0));
+	return (rb_log_append(lg, op, &elm->key, sizeof(elm->key)));
+}
+
+static int
+encode(struct node *elm, void *fp)
+{
+	return (fwrite(&elm->key, sizeof(elm->key), 1, fp) != 1);
+}
+
+static struct node *
+decode(void *fp)
+{
+	struct node *elm = &pool.nodes[pool.next];
+
+	if (fread(&elm->key, sizeof(elm->key), 1, fp) != 1)
+		return (NULL);
+	pool.next++;
+	return (elm);
+}
+
+static int
+count(struct node *elm, void *arg)
+{
+	(*(size_t *)arg)++;
+	return (0);
+}
+
+static int
+save(void *head, FILE *fp)
+{
+	size_t n = 0;
+
+	RB_SERIALIZE(tree, head, count, &n);
+	if (fwrite(&n, sizeof(n), 1, fp) != 1)
+		return (-1);
+	return (RB_SERIALIZE(tree, head, encode, fp));
+}
+
+static int
+load(void *head, FILE *fp)
+{
+	size_t n;
+
+	if (fread(&n, sizeof(n), 1, fp) != 1)
+		return (-1);
+	return (RB_DESERIALIZE(tree, head, n, decode, fp));
+}
+
+static int
+apply(void *head, int op, const void *rec, size_t len)
+{
+	struct node *elm = &pool.nodes[pool.next];
+
+	if (op == RB_LOG_CLEAR)
+		return (RB_DESTROY(tree, head, drop, NULL));
+	if (len != sizeof(elm->key))
+		return (-1);
+	memcpy(&elm->key, rec, len);
+	/* a fresh node is only used up when it was inserted */
+	if (RB_REPLAY(tree, head, op, elm) == NULL && op == RB_LOG_INSERT)
+		pool.next++;
+	return (0);
+}
+
+static int
+collect(struct node *elm, void *arg)
+{
+	struct keys *k = arg;
+
+	k->keys[k->n++] = elm->key;
+	return (0);
+}
+
+/* the nodes come from arrays freed at the end */
+static void
+drop(struct node *elm, void *arg)
+{
+}
@@ -0,0 +1,178 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+#include "rbpack.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * the keys of a tree are packed with RB_SERIALIZE and rb_pack_add, then
+ * every search of the pack is checked against the tree, with keys that
+ * are spread out so that the deltas take more than one byte now and then.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	uint64_t		 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static int add(struct node *, void *);
+
+RB_HEAD(tree, node);
+struct tree root = RB_INITIALIZER(&root);
+
+RB_PROTOTYPE(tree, node, node_link, compare)
+RB_GENERATE(tree, node, node_link, compare)
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	struct rb_pack pack;
+	struct rb_pack_iter it;
+	uint64_t *sorted, *stream, res, max;
+	size_t idx;
+	int i, r, *perm;
+	unsigned long found;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	sorted = calloc(ITER, sizeof(uint64_t));
+	stream = calloc(ITER, sizeof(uint64_t));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	/* mostly small gaps, with a large one every thousand keys */
+	sorted[0] = random() % 16;
+	for (i = 1; i < ITER; i++)
+		sorted[i] = sorted[i - 1] + 1 + random() % 16 +
+		    (i % 1000 == 0 ? (uint64_t)random() * 1000 : 0);
+	max = sorted[ITER - 1] + 16;
+	for (i = 0; i < ITER; i++)
+		stream[i] = (uint64_t)random() * random() % max;
+
+	RB_INIT(&root);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = sorted[perm[i]];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+	}
+
+	TDEBUGF("packing");
+	rb_pack_init(&pack);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	if (RB_SERIALIZE(tree, &root, add, &pack) != 0)
+		err(1, "rb_pack_add");
+	rb_pack_trim(&pack);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done packing in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	TDEBUGF("%.2f bytes per key packed, %zu in the tree",
+	    (double)rb_pack_bytes(&pack) / ITER, sizeof(struct node));
+	assert(pack.n == (size_t)ITER);
+	if (rb_pack_add(&pack, sorted[0]) != -1)
+		errx(1, "rb_pack_add out of order succeeded");
+
+	TDEBUGF("checking the order");
+	i = 0;
+	RB_PACK_FOREACH(&it, &pack) {
+		if (it.key != sorted[i] || it.idx != (size_t)i)
+			errx(1, "RB_PACK_FOREACH failed: %d", i);
+		i++;
+	}
+	assert(i == ITER);
+
+	TDEBUGF("checking the searches against the tree");
+	for (i = 0; i < ITER; i++) {
+		key.key = sorted[i];
+		if (rb_pack_find(&pack, key.key, &idx) != 0 || idx != (size_t)i)
+			errx(1, "rb_pack_find failed: %llu", (unsigned long long)key.key);
+		key.key = stream[i];
+		tmp = RB_FIND(tree, &root, &key);
+		if ((rb_pack_find(&pack, key.key, &idx) == 0) != (tmp != NULL) ||
+		    (tmp != NULL && sorted[idx] != key.key))
+			errx(1, "rb_pack_find failed: %llu", (unsigned long long)key.key);
+		tmp = RB_NFIND(tree, &root, &key);
+		if ((rb_pack_nfind(&pack, key.key, &res, &idx) == 0) != (tmp != NULL) ||
+		    (tmp != NULL && (res != tmp->key || sorted[idx] != res)))
+			errx(1, "rb_pack_nfind failed: %llu", (unsigned long long)key.key);
+		tmp = RB_PFIND(tree, &root, &key);
+		if ((rb_pack_pfind(&pack, key.key, &res, &idx) == 0) != (tmp != NULL) ||
+		    (tmp != NULL && (res != tmp->key || sorted[idx] != res)))
+			errx(1, "rb_pack_pfind failed: %llu", (unsigned long long)key.key);
+	}
+	if (rb_pack_pfind(&pack, 0, &res, NULL) != (sorted[0] == 0 ? 0 : -1) ||
+	    rb_pack_nfind(&pack, max, &res, NULL) != -1)
+		errx(1, "search past the ends failed");
+
+	TDEBUGF("doing random lookups in the tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		key.key = stream[i];
+		found += (RB_FIND(tree, &root, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("doing random lookups in the pack");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++)
+		found -= (rb_pack_find(&pack, stream[i], NULL) == 0);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == 0);
+
+	rb_pack_free(&pack);
+	free(stream);
+	free(sorted);
+	free(perm);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static int
+add(struct node *elm, void *pack)
+{
+	return (rb_pack_add(pack, elm->key));
+}
@@ -0,0 +1,173 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=150000;
+int LOOKUPS=2000000;
+int KEYLEN=24;
+
+struct timespec start, end, diff;
+
+/*
+ * every node is linked into a plain tree and a tree keeping key prefixes
+ * in the entries, the keys are strings allocated away from the nodes.
+ */
+struct node {
+	RB_ENTRY(node)				 plain_link;
+	RB_ENTRY_EXT(node, RB_PREFIX(prefix))	 prefix_link;
+	char					*key;
+};
+
+static int compare(const struct node *, const struct node *);
+static uint64_t prefix(const struct node *);
+
+RB_HEAD(ptree, node);
+RB_HEAD(xtree, node);
+struct ptree proot = RB_INITIALIZER(&proot);
+struct xtree xroot = RB_INITIALIZER(&xroot);
+
+RB_PROTOTYPE(ptree, node, plain_link, compare)
+RB_PROTOTYPE_EXT(xtree, node, prefix_link, compare, RB_PREFIX(prefix))
+
+RB_GENERATE(ptree, node, plain_link, compare)
+RB_GENERATE_EXT(xtree, node, prefix_link, compare, RB_PREFIX(prefix))
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	char **keys, buf[64];
+	int i, j, r, *perm, *stream;
+	unsigned long found;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	keys = calloc(ITER, sizeof(char *));
+	stream = calloc(LOOKUPS, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	/* some keys share their first 8 bytes, so ties go through compare */
+	TDEBUGF("generating string keys");
+	for (i = 0; i < ITER; i++) {
+		for (j = 0; j < KEYLEN; j++)
+			buf[j] = 'a' + random() % 26;
+		if (i > 0 && i % 16 == 0)
+			memcpy(buf, keys[i - 1], 8);
+		buf[KEYLEN] = '\0';
+		keys[i] = strdup(buf);
+	}
+	for (i = 0; i < LOOKUPS; i++)
+		stream[i] = random() % ITER;
+
+	RB_INIT(&proot);
+	RB_INIT(&xroot);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = keys[perm[i]];
+		if (RB_INSERT(ptree, &proot, tmp) != NULL)
+			errx(1, "RB_INSERT plain failed");
+		if (RB_INSERT(xtree, &xroot, tmp) != NULL)
+			errx(1, "RB_INSERT prefix failed");
+	}
+
+	TDEBUGF("doing lookups in the plain tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = keys[stream[i]];
+		found += (RB_FIND(ptree, &proot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)LOOKUPS);
+
+	TDEBUGF("doing lookups in the prefix tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < LOOKUPS; i++) {
+		key.key = keys[stream[i]];
+		found += (RB_FIND(xtree, &xroot, &key) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == (unsigned long)LOOKUPS);
+
+	TDEBUGF("checking the order and removing from the prefix tree");
+	tmp = RB_MIN(ptree, &proot);
+	key.key = "";
+	if (RB_NFIND(xtree, &xroot, &key) != tmp)
+		errx(1, "RB_NFIND prefix failed");
+	for (i = 0; i < ITER; i++) {
+		key.key = keys[perm[i]];
+		tmp = RB_FIND(xtree, &xroot, &key);
+		if (tmp == NULL || tmp->key != keys[perm[i]])
+			errx(1, "RB_FIND prefix failed: %s", keys[perm[i]]);
+		if (RB_REMOVE(xtree, &xroot, tmp) != tmp)
+			errx(1, "RB_REMOVE prefix failed: %s", keys[perm[i]]);
+	}
+	assert(RB_EMPTY(&xroot));
+
+	for (i = 0; i < ITER; i++)
+		free(keys[i]);
+	free(keys);
+	free(stream);
+	free(nodes);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return strcmp(a->key, b->key);
+}
+
+/* the first 8 bytes, big endian and zero padded, order like strcmp */
+static uint64_t
+prefix(const struct node *elm)
+{
+	const unsigned char *p = (const unsigned char *)elm->key;
+	uint64_t res = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		res <<= 8;
+		if (*p != '\0')
+			res |= *p++;
+	}
+	return (res);
+}
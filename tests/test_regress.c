@@ -60,6 +60,13 @@ struct node;
 struct tree;
 static int compare(const struct node *, const struct node *);
 static void mix_operations(int *, int, struct node *, int, int, int, int);
+#ifdef RB_DESTROY
+static void destroy(struct node *, void *);
+#endif
+#ifdef RB_CLONE
+static struct node *clone(struct node *, void *);
+static int same(struct node *, struct node *, struct node **);
+#endif
 
 #ifdef DOAUGMENT
 static int tree_augment(struct node *);
@@ -83,12 +90,29 @@ struct node {
 	size_t		 size;
 };
 
+#ifdef DOMINMAX
+RB_HEAD_EXT(tree, node, RB_MINMAX);
+struct tree root = RB_INITIALIZER(&root);
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_MINMAX)
+
+#ifdef DOAUGMENT
+RB_GENERATE_EXT_AUGMENT(tree, node, node_link, compare, tree_augment, RB_MINMAX)
+#else
+RB_GENERATE_EXT(tree, node, node_link, compare, RB_MINMAX)
+#endif
+#else
 RB_HEAD(tree, node);
 struct tree root = RB_INITIALIZER(&root);
 
 RB_PROTOTYPE(tree, node, node_link, compare)
 
+#if defined(DOAUGMENT) && defined(RB_GENERATE_AUGMENT)
+RB_GENERATE_AUGMENT(tree, node, node_link, compare, tree_augment)
+#else
 RB_GENERATE(tree, node, node_link, compare)
+#endif
+#endif
 
 #ifndef RB_RANK
 #define RB_RANK(x, y)   0
@@ -102,6 +126,13 @@ main()
 {
 	struct node *tmp, *ins, *nodes;
 	int i, r, rank, *perm, *nums;
+#ifdef RB_DESTROY
+	int destroyed;
+#endif
+#ifdef RB_CLONE
+	struct tree copy = RB_INITIALIZER(&copy);
+	struct node *clones, *bases[2];
+#endif
 
 	nodes = calloc((ITER + 5), sizeof(struct node));
 	perm = calloc(ITER, sizeof(int));
@@ -180,12 +211,23 @@ main()
 	assert(ITER == (RB_ROOT(&root))->size);
 #endif
 
+#ifdef DOMINMAX
+	TDEBUGF("doing min and max removals");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		tmp = (i & 1) ? RB_MAX(tree, &root) : RB_MIN(tree, &root);
+		assert(NULL != tmp);
+		ins = (i & 1) ? RB_POP_MAX(tree, &root) : RB_POP_MIN(tree, &root);
+		assert(ins == tmp);
+		assert(RB_EMPTY(&root) || ((i & 1) ? tmp->key > RB_MAX(tree, &root)->key : tmp->key < RB_MIN(tree, &root)->key));
+#else
 	TDEBUGF("doing root removals");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	for (i = 0; i < ITER; i++) {
 		tmp = RB_ROOT(&root);
 		assert(NULL != tmp);
 		assert(RB_REMOVE(tree, &root, tmp) == tmp);
+#endif
 #ifdef RB_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
 			rank = RB_RANK(tree, RB_ROOT(&root));
@@ -211,12 +253,21 @@ main()
 	timespecsub(&end, &start, &diff);
 	TDEBUGF("done sequential insertions in: %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 
+#ifdef DOMINMAX
+	TDEBUGF("doing min removals");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER + 1; i++) {
+		tmp = RB_POP_MIN(tree, &root);
+		assert(NULL != tmp);
+		assert(RB_EMPTY(&root) || tmp->key < RB_MIN(tree, &root)->key);
+#else
 	TDEBUGF("doing root removals");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	for (i = 0; i < ITER + 1; i++) {
 		tmp = RB_ROOT(&root);
 		assert(NULL != tmp);
 		assert(RB_REMOVE(tree, &root, tmp) == tmp);
+#endif
 #ifdef RB_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
 			rank = RB_RANK(tree, RB_ROOT(&root));
@@ -331,7 +382,7 @@ main()
 	timespecsub(&end, &start, &diff);
 	TDEBUGF("done removals in: %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 
-#ifdef RB_NEXT
+#if defined(RB_NEXT) && (!defined(RB_SMALL) || defined(RB_THREADED))
 	TDEBUGF("starting sequential insertions");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	mix_operations(nums, ITER, nodes, ITER, ITER, 0, 0);
@@ -527,7 +578,7 @@ main()
 	timespecsub(&end, &start, &diff);
 	TDEBUGF("done sequential insertions in: %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 
-#ifdef RB_FOREACH
+#if defined(RB_FOREACH) && (!defined(RB_SMALL) || defined(RB_THREADED))
         TDEBUGF("iterating over tree with RB_FOREACH");
         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
         i = 0;
@@ -543,7 +594,7 @@ main()
         TDEBUGF("done iterations in %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 #endif
 
-#ifdef RB_FOREACH_REVERSE
+#if defined(RB_FOREACH_REVERSE) && (!defined(RB_SMALL) || defined(RB_THREADED))
         TDEBUGF("iterating over tree with RB_FOREACH_REVERSE");
         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
         i = ITER + 5;
@@ -577,7 +628,7 @@ main()
 	timespecsub(&end, &start, &diff);
 	TDEBUGF("done root removals in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 
-#ifdef RB_FOREACH_SAFE
+#if defined(RB_FOREACH_SAFE) && (!defined(RB_SMALL) || defined(RB_THREADED))
 	TDEBUGF("starting sequential insertions");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	mix_operations(nums, ITER, nodes, ITER, ITER, 0, 0);
@@ -601,7 +652,7 @@ main()
         TDEBUGF("done iterations in %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 #endif
 
-#ifdef RB_FOREACH_REVERSE_SAFE
+#if defined(RB_FOREACH_REVERSE_SAFE) && (!defined(RB_SMALL) || defined(RB_THREADED))
 	TDEBUGF("starting sequential insertions");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	mix_operations(nums, ITER, nodes, ITER, ITER, 0, 0);
@@ -625,7 +676,7 @@ main()
         TDEBUGF("done iterations in %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 #endif
 
-#ifdef RB_INSERT_NEXT
+#if defined(RB_INSERT_NEXT) && (!defined(RB_SMALL) || defined(RB_THREADED))
         TDEBUGF("starting sequential insertions using INSERT_NEXT");
         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
         tmp = &(nodes[0]);
@@ -665,7 +716,7 @@ main()
         TDEBUGF("done iterations in %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 #endif
 
-#ifdef RB_INSERT_PREV
+#if defined(RB_INSERT_PREV) && (!defined(RB_SMALL) || defined(RB_THREADED))
         TDEBUGF("starting sequential insertions using INSERT_PREV");
         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
         tmp = &(nodes[ITER]);
@@ -805,12 +856,88 @@ main()
 	timespecsub(&end, &start, &diff);
 	TDEBUGF("done root removals in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 
+#ifdef RB_DESTROY
+	TDEBUGF("starting random insertions");
+	mix_operations(perm, ITER, nodes, ITER, ITER, 0, 0);
+
+#ifdef RB_CLONE
+	TDEBUGF("cloning the tree");
+	clones = calloc((ITER + 5), sizeof(struct node));
+	bases[0] = nodes;
+	bases[1] = clones;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	if (RB_CLONE(tree, &root, &copy, clone, bases) != 0)
+		errx(1, "RB_CLONE error");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done cloning in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
+	if (!same(RB_ROOT(&root), RB_ROOT(&copy), bases))
+		errx(1, "RB_CLONE made a different tree");
+	if (RB_RANK(tree, RB_ROOT(&copy)) == -2)
+		errx(1, "rank error");
+	destroyed = 0;
+	RB_DESTROY(tree, &copy, destroy, &destroyed);
+	if (destroyed != ITER + 1)
+		errx(1, "RB_DESTROY error");
+	free(clones);
+#endif
+
+	TDEBUGF("destroying the tree");
+	destroyed = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	RB_DESTROY(tree, &root, destroy, &destroyed);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done destroying in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
+	if (destroyed != ITER + 1 || !RB_EMPTY(&root))
+		errx(1, "RB_DESTROY error");
+#endif
+
 	free(nodes);
 	free(perm);
 	free(nums);
 	exit(0);
 }
 
+#ifdef RB_DESTROY
+/* RB_DESTROY must give each node back exactly once */
+static void
+destroy(struct node *elm, void *arg)
+{
+	if (elm->size == 0)
+		errx(1, "RB_DESTROY visited a node twice");
+	elm->size = 0;
+	(*(int *)arg)++;
+}
+#endif
+
+#ifdef RB_CLONE
+/* nodes[i] is copied into clones[i], so that same can pair them up */
+static struct node *
+clone(struct node *elm, void *arg)
+{
+	struct node **bases = arg;
+	struct node *copy = &bases[1][elm - bases[0]];
+
+	*copy = *elm;
+	return (copy);
+}
+
+/* a clone keeps the shape, the sizes and the rank difference bits */
+static int
+same(struct node *elm, struct node *copy, struct node **bases)
+{
+	if (elm == NULL || copy == NULL)
+		return (elm == copy);
+	if (copy != &bases[1][elm - bases[0]] || copy->size != elm->size ||
+	    _RB_GET_RDIFF(copy, _RB_LDIR, node_link) != _RB_GET_RDIFF(elm, _RB_LDIR, node_link) ||
+	    _RB_GET_RDIFF(copy, _RB_RDIR, node_link) != _RB_GET_RDIFF(elm, _RB_RDIR, node_link))
+		return (0);
+	return (same(RB_LEFT(elm, node_link), RB_LEFT(copy, node_link), bases) &&
+	    same(RB_RIGHT(elm, node_link), RB_RIGHT(copy, node_link), bases));
+}
+#endif
+
 
 static int
 compare(const struct node *a, const struct node *b)
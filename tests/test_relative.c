@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define RB_RELATIVE
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=150000;
+
+/*
+ * the head, all nodes and the cells of the filter live in one block, which
+ * is built at one address, copied to another one and used there without
+ * touching any link. the features keep their pointers in the head too.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static unsigned int hash(const struct node *);
+
+RB_HEAD_EXT(tree, node, RB_MINMAX, RB_HOT(hash), RB_BLOOM(hash), RB_RELAXED);
+
+struct block {
+	struct tree		 head;
+	struct node		 nodes[];
+};
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_MINMAX, RB_HOT(hash), RB_BLOOM(hash), RB_RELAXED)
+RB_GENERATE_EXT(tree, node, node_link, compare, RB_MINMAX, RB_HOT(hash), RB_BLOOM(hash), RB_RELAXED)
+
+int
+main()
+{
+	struct block *b, *c;
+	struct node *tmp, key;
+	size_t sz;
+	int i, r, *perm;
+
+	sz = sizeof(struct block) + ITER * sizeof(struct node) +
+	    RB_BLOOM_SIZE(ITER, 8);
+	b = calloc(1, sz);
+	c = calloc(1, sz);
+	perm = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	TDEBUGF("building the tree in the first block");
+	RB_INIT(&b->head);
+	RB_BLOOM_INIT(tree, &b->head, (uint8_t *)&b->nodes[ITER], ITER, 8);
+	for (i = 0; i < ITER; i++) {
+		tmp = &b->nodes[i];
+		tmp->key = perm[i];
+		if (RB_INSERT(tree, &b->head, tmp) != NULL)
+			errx(1, "RB_INSERT failed: %d", perm[i]);
+	}
+	/* leaves inserts queued for after the move */
+	if (RB_PENDING(&b->head) == 0)
+		errx(1, "no inserts pending");
+	key.key = perm[0];
+	if (RB_FIND(tree, &b->head, &key) != &b->nodes[0])
+		errx(1, "RB_FIND failed: %d", perm[0]);
+
+	TDEBUGF("moving the block");
+	memcpy(c, b, sz);
+	memset(b, 0xa5, sz);
+	free(b);
+
+	if (RB_REBALANCE(tree, &c->head, RB_RELAXED_SIZE) != 0)
+		errx(1, "RB_REBALANCE failed after the move");
+	if (RB_RANK(tree, RB_ROOT(&c->head)) < 0)
+		errx(1, "rank error after the move");
+	if (RB_MIN(tree, &c->head)->key != 0 ||
+	    RB_MAX(tree, &c->head)->key != ITER - 1)
+		errx(1, "RB_MIN or RB_MAX failed after the move");
+	key.key = perm[0];
+	if (RB_FIND(tree, &c->head, &key) != &c->nodes[0])
+		errx(1, "RB_FIND of a cached node failed after the move");
+	key.key = ITER;
+	if (RB_FIND(tree, &c->head, &key) != NULL)
+		errx(1, "RB_FIND found a missing key after the move");
+	for (i = 0; i < ITER; i++) {
+		key.key = perm[i];
+		tmp = RB_FIND(tree, &c->head, &key);
+		if (tmp != &c->nodes[i])
+			errx(1, "RB_FIND failed after the move: %d", perm[i]);
+	}
+#ifndef RB_SMALL
+	i = 0;
+	RB_FOREACH(tmp, tree, &c->head) {
+		if (tmp->key != i)
+			errx(1, "RB_FOREACH failed after the move: %d", i);
+		i++;
+	}
+	assert(i == ITER);
+	RB_FOREACH_REVERSE(tmp, tree, &c->head) {
+		i--;
+		if (tmp->key != i)
+			errx(1, "RB_FOREACH_REVERSE failed after the move: %d", i);
+	}
+	assert(i == 0);
+#endif
+
+	TDEBUGF("removing from the moved block");
+	for (i = 0; i < ITER; i++) {
+		tmp = &c->nodes[i];
+		if (RB_REMOVE(tree, &c->head, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", perm[i]);
+		if (i % 10000 == 0 && RB_RANK(tree, RB_ROOT(&c->head)) == -2)
+			errx(1, "rank error");
+	}
+	assert(RB_EMPTY(&c->head));
+
+	free(c);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static unsigned int
+hash(const struct node *a)
+{
+	return a->key * 2654435761U;
+}
@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * random inserts go into an augmented plain tree and into a _RELAXED one,
+ * timing both, and the relaxed tree is rebalanced in small slices between
+ * the bursts. every key has to be found at any point, RB_RANK has to hold
+ * once nothing is pending and an augmented relaxed tree checks the sizes.
+ * removals are mixed in, some of them of nodes still waiting.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+	size_t			 size;
+};
+
+static int compare(const struct node *, const struct node *);
+static int augment(struct node *);
+static size_t sizes(struct node *);
+
+RB_HEAD(tree, node);
+RB_HEAD_EXT(rtree, node, RB_RELAXED);
+struct tree a = RB_INITIALIZER(&a);
+struct rtree b = RB_INITIALIZER(&b);
+
+RB_PROTOTYPE(tree, node, node_link, compare)
+RB_GENERATE_AUGMENT(tree, node, node_link, compare, augment)
+RB_PROTOTYPE_EXT(rtree, node, node_link, compare, RB_RELAXED)
+RB_GENERATE_EXT_AUGMENT(rtree, node, node_link, compare, augment, RB_RELAXED)
+
+static void
+check(int n)
+{
+	if (RB_REBALANCE(rtree, &b, RB_RELAXED_SIZE) != 0)
+		errx(1, "RB_REBALANCE left inserts pending");
+	if (RB_RANK(rtree, RB_ROOT(&b)) == -2)
+		errx(1, "rank error");
+	if (sizes(RB_ROOT(&b)) != (size_t)n)
+		errx(1, "augmented tree has the wrong sizes");
+}
+
+#define TIMED(what, stmt)	do {					\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);			\
+	stmt;								\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);			\
+	timespecsub(&end, &start, &diff);				\
+	TDEBUGF("%s in: %lld.%09ld s", what, (long long)diff.tv_sec, diff.tv_nsec);	\
+} while (0)
+
+int
+main()
+{
+	struct node *na, *nb;
+	int i, j, r, n, *perm;
+	size_t deferred;
+
+	na = calloc(ITER, sizeof(struct node));
+	nb = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < ITER; i++) {
+		na[i].key = nb[i].key = perm[i];
+		na[i].size = nb[i].size = 1;
+	}
+
+	TDEBUGF("inserting random keys");
+	TIMED("eager inserts", for (i = 0; i < ITER; i++)
+		if (RB_INSERT(tree, &a, &na[i]) != NULL)
+			errx(1, "RB_INSERT failed"));
+	deferred = 0;
+	TIMED("relaxed inserts and rebalancing", for (i = 0; i < ITER; i++) {
+		if (RB_INSERT(rtree, &b, &nb[i]) != NULL)
+			errx(1, "RB_INSERT failed");
+		if (RB_PENDING(&b) == RB_RELAXED_SIZE) {
+			deferred += RB_PENDING(&b);
+			RB_REBALANCE(rtree, &b, RB_RELAXED_SIZE);
+		}
+	});
+	TDEBUGF("%zu inserts were deferred", deferred);
+	n = ITER;
+	check(n);
+
+	TDEBUGF("looking up every key between slices of rebalancing");
+	RB_INIT(&b);
+	for (i = 0; i < ITER / 8; i++) {
+		nb[i].size = 1;
+		RB_INSERT(rtree, &b, &nb[i]);
+		if (i % 256 != 255)
+			continue;
+		for (j = i - 255; j <= i; j++)
+			if (RB_FIND(rtree, &b, &nb[j]) != &nb[j])
+				errx(1, "RB_FIND failed while inserts are pending");
+		if (RB_REBALANCE(rtree, &b, 8) != RB_PENDING(&b))
+			errx(1, "RB_REBALANCE miscounted");
+	}
+	n = ITER / 8;
+	check(n);
+
+	TDEBUGF("removing and reinserting random keys");
+	TIMED("removals and inserts", for (i = 0; i < ITER; i++) {
+		r = random() % ITER;
+		if (RB_FIND(rtree, &b, &nb[r]) == NULL) {
+			nb[r].size = 1;
+			RB_INSERT(rtree, &b, &nb[r]);
+			n++;
+		} else {
+			if (RB_REMOVE(rtree, &b, &nb[r]) != &nb[r])
+				errx(1, "RB_REMOVE failed");
+			n--;
+		}
+		if (i % 1024 == 0)
+			RB_REBALANCE(rtree, &b, 16);
+	});
+	check(n);
+
+	TDEBUGF("emptying the tree");
+	while (!RB_EMPTY(&b)) {
+		RB_REMOVE(rtree, &b, RB_ROOT(&b));
+		if (--n % (ITER / 8) == 0)
+			check(n);
+	}
+	assert(n == 0 && RB_PENDING(&b) == 0);
+
+	free(perm);
+	free(nb);
+	free(na);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static int
+augment(struct node *elm)
+{
+	size_t size = 1;
+
+	if (RB_LEFT(elm, node_link) != NULL)
+		size += (RB_LEFT(elm, node_link))->size;
+	if (RB_RIGHT(elm, node_link) != NULL)
+		size += (RB_RIGHT(elm, node_link))->size;
+	if (elm->size == size)
+		return (0);
+	elm->size = size;
+	return (1);
+}
+
+static size_t
+sizes(struct node *elm)
+{
+	size_t size;
+
+	if (elm == NULL)
+		return (0);
+	size = 1 + sizes(RB_LEFT(elm, node_link)) +
+	    sizes(RB_RIGHT(elm, node_link));
+	if (elm->size != size)
+		errx(1, "node %d has size %zu, not %zu", elm->key, elm->size,
+		    size);
+	return (size);
+}
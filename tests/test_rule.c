@@ -0,0 +1,355 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+#if RB_RULE == RB_RULE_AVL
+#define RULE	"avl"
+#elif RB_RULE == RB_RULE_RB
+#define RULE	"red-black"
+#else
+#define RULE	"wavl"
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * built once for every RB_RULE. the same random inserts, lookups and
+ * removals are timed and the height and average depth of the tree are
+ * reported, for comparing the rules, while RB_RANK checks that the rule
+ * holds. an augmented tree checks the subtree sizes and trees loaded with
+ * RB_DESERIALIZE or relinked by RB_REBUILD_PERFECT have to keep the rule
+ * as well. whatever RB_RULE is, the pair are linked into an AVL and a
+ * red-black tree of the same nodes, which pick their rules with RB_AVL and
+ * RB_REDBLACK.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+	size_t			 size;
+};
+
+static int compare(const struct node *, const struct node *);
+static int augment(struct node *);
+static size_t sizes(struct node *);
+static void shape(struct node *, int, int *, double *);
+static int encode(struct node *, void *);
+static struct node *decode(void *);
+
+struct pair {
+	RB_ENTRY(pair)		 avl_link;
+	RB_ENTRY(pair)		 rb_link;
+	int			 key;
+};
+
+static int pcompare(const struct pair *, const struct pair *);
+static void pcheck(int);
+static int pcount(struct pair *);
+static int rbcount(struct pair *);
+
+RB_HEAD(tree, node);
+struct tree root = RB_INITIALIZER(&root);
+
+RB_PROTOTYPE(tree, node, node_link, compare)
+RB_GENERATE_AUGMENT(tree, node, node_link, compare, augment)
+
+RB_HEAD(avltree, pair);
+struct avltree avlroot = RB_INITIALIZER(&avlroot);
+RB_HEAD(rbtree, pair);
+struct rbtree rbroot = RB_INITIALIZER(&rbroot);
+
+RB_PROTOTYPE_EXT(avltree, pair, avl_link, pcompare, RB_AVL)
+RB_GENERATE_EXT(avltree, pair, avl_link, pcompare, RB_AVL)
+RB_PROTOTYPE_EXT(rbtree, pair, rb_link, pcompare, RB_REDBLACK)
+RB_GENERATE_EXT(rbtree, pair, rb_link, pcompare, RB_REDBLACK)
+
+static void
+check(int n)
+{
+	int height = 0;
+	double depth = 0;
+
+	if (RB_RANK(tree, RB_ROOT(&root)) == -2)
+		errx(1, "rank error");
+	if (sizes(RB_ROOT(&root)) != (size_t)n)
+		errx(1, "augmented tree has the wrong sizes");
+	shape(RB_ROOT(&root), 1, &height, &depth);
+	TDEBUGF("%s: %d nodes, height %d, average depth %.3f", RULE, n,
+	    height, n > 0 ? depth / n : 0);
+}
+
+#define TIMED(what, stmt)	do {					\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);			\
+	stmt;								\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);			\
+	timespecsub(&end, &start, &diff);				\
+	TDEBUGF("%s %s in: %lld.%09ld s", RULE, what, (long long)diff.tv_sec, diff.tv_nsec);	\
+} while (0)
+
+int
+main()
+{
+	struct node *nodes, *tmp, **stream, **next;
+	struct pair *pairs;
+	int i, r, n, height, *perm;
+	double depth;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	stream = calloc(ITER, sizeof(struct node *));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < ITER; i++) {
+		nodes[i].key = perm[i];
+		nodes[i].size = 1;
+	}
+
+	TDEBUGF("inserting random keys");
+	TIMED("inserts", for (i = 0; i < ITER; i++)
+		if (RB_INSERT(tree, &root, &nodes[i]) != NULL)
+			errx(1, "RB_INSERT failed"));
+	n = ITER;
+	check(n);
+	TIMED("lookups", for (i = 0; i < ITER; i++)
+		if (RB_FIND(tree, &root, &nodes[perm[i]]) != &nodes[perm[i]])
+			errx(1, "RB_FIND failed"));
+
+	TDEBUGF("removing and reinserting random keys");
+	TIMED("removals and inserts", for (i = 0; i < ITER; i++) {
+		r = random() % ITER;
+		if (RB_FIND(tree, &root, &nodes[r]) == NULL) {
+			nodes[r].size = 1;
+			RB_INSERT(tree, &root, &nodes[r]);
+			n++;
+		} else {
+			RB_REMOVE(tree, &root, &nodes[r]);
+			n--;
+		}
+	});
+	check(n);
+	TIMED("lookups", for (i = 0; i < ITER; i++)
+		(void)RB_FIND(tree, &root, &nodes[perm[i]]));
+
+	TDEBUGF("removing every other node");
+	for (i = 0; i < ITER; i += 2) {
+		tmp = RB_FIND(tree, &root, &nodes[i]);
+		if (tmp != NULL && RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed");
+		if (tmp != NULL)
+			n--;
+	}
+	check(n);
+
+	TDEBUGF("rebuilding into a complete tree");
+	TIMED("rebuild", RB_REBUILD_PERFECT(tree, &root));
+	check(n);
+	height = 0;
+	depth = 0;
+	shape(RB_ROOT(&root), 1, &height, &depth);
+	for (i = 0, r = n; r > 0; r /= 2)
+		i++;
+	if (height != i)
+		errx(1, "rebuilt tree of %d has height %d", n, height);
+	TIMED("lookups", for (i = 0; i < ITER; i++)
+		(void)RB_FIND(tree, &root, &nodes[perm[i]]));
+
+	TDEBUGF("loading trees of every size up to 1024");
+	for (r = 0; r <= 1024; r++) {
+		RB_INIT(&root);
+		for (i = 0; i < r; i++) {
+			nodes[i].key = i;
+			stream[i] = &nodes[i];
+		}
+		next = stream;
+		if (RB_DESERIALIZE(tree, &root, r, decode, &next) != 0)
+			errx(1, "RB_DESERIALIZE failed");
+		if (RB_RANK(tree, RB_ROOT(&root)) == -2)
+			errx(1, "rank error in a loaded tree of %d", r);
+		if (sizes(RB_ROOT(&root)) != (size_t)r)
+			errx(1, "loaded tree has the wrong sizes");
+		i = 0;
+		if (RB_SERIALIZE(tree, &root, encode, &i) != 0 || i != r)
+			errx(1, "loaded tree is out of order");
+	}
+	n = r - 1;
+
+	TDEBUGF("emptying the tree");
+	TIMED("removals", while (!RB_EMPTY(&root)) {
+		RB_REMOVE(tree, &root, RB_ROOT(&root));
+		if (--n % 256 == 0)
+			check(n);
+	});
+	assert(n == 0);
+
+	TDEBUGF("churning an AVL and a red-black tree of the same nodes");
+	if (avltree_RB_RULE != RB_RULE_AVL || rbtree_RB_RULE != RB_RULE_RB)
+		errx(1, "trees have the wrong rules");
+	pairs = calloc(ITER, sizeof(struct pair));
+	n = ITER;
+	for (i = 0; i < ITER; i++) {
+		pairs[i].key = perm[i];
+		if (RB_INSERT(avltree, &avlroot, &pairs[i]) != NULL ||
+		    RB_INSERT(rbtree, &rbroot, &pairs[i]) != NULL)
+			errx(1, "RB_INSERT failed");
+	}
+	pcheck(n);
+	for (i = 0; i < ITER; i++) {
+		r = random() % ITER;
+		if (RB_FIND(avltree, &avlroot, &pairs[r]) == NULL) {
+			RB_INSERT(avltree, &avlroot, &pairs[r]);
+			RB_INSERT_TOPDOWN(rbtree, &rbroot, &pairs[r]);
+			n++;
+		} else {
+			RB_REMOVE_TOPDOWN(avltree, &avlroot, &pairs[r]);
+			RB_REMOVE(rbtree, &rbroot, &pairs[r]);
+			n--;
+		}
+	}
+	pcheck(n);
+	free(pairs);
+
+	free(stream);
+	free(perm);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static int
+pcompare(const struct pair *a, const struct pair *b)
+{
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+/* both trees hold the same nodes and keep their own rules */
+static void
+pcheck(int n)
+{
+	if (RB_RANK(avltree, RB_ROOT(&avlroot)) == -2)
+		errx(1, "rank error in the AVL tree");
+	if (RB_RANK(rbtree, RB_ROOT(&rbroot)) == -2)
+		errx(1, "rank error in the red-black tree");
+	if (pcount(RB_ROOT(&avlroot)) != n || rbcount(RB_ROOT(&rbroot)) != n)
+		errx(1, "the trees hold different nodes");
+}
+
+/* the nodes below elm in the AVL tree, each of which the other tree has */
+static int
+pcount(struct pair *elm)
+{
+	int n = 0;
+
+	while (elm != NULL) {
+		if (RB_FIND(rbtree, &rbroot, elm) != elm)
+			errx(1, "node %d is only in the AVL tree", elm->key);
+		n += 1 + pcount(RB_LEFT(elm, avl_link));
+		elm = RB_RIGHT(elm, avl_link);
+	}
+	return (n);
+}
+
+static int
+rbcount(struct pair *elm)
+{
+	if (elm == NULL)
+		return (0);
+	return (1 + rbcount(RB_LEFT(elm, rb_link)) +
+	    rbcount(RB_RIGHT(elm, rb_link)));
+}
+
+static int
+augment(struct node *elm)
+{
+	size_t size = 1;
+
+	if (RB_LEFT(elm, node_link) != NULL)
+		size += (RB_LEFT(elm, node_link))->size;
+	if (RB_RIGHT(elm, node_link) != NULL)
+		size += (RB_RIGHT(elm, node_link))->size;
+	if (elm->size == size)
+		return (0);
+	elm->size = size;
+	return (1);
+}
+
+static size_t
+sizes(struct node *elm)
+{
+	size_t size;
+
+	if (elm == NULL)
+		return (0);
+	size = 1 + sizes(RB_LEFT(elm, node_link)) +
+	    sizes(RB_RIGHT(elm, node_link));
+	if (elm->size != size)
+		errx(1, "node %d has size %zu, not %zu", elm->key, elm->size,
+		    size);
+	return (size);
+}
+
+/* the largest depth and the sum of the depths of the nodes below elm */
+static void
+shape(struct node *elm, int depth, int *height, double *sum)
+{
+	while (elm != NULL) {
+		if (depth > *height)
+			*height = depth;
+		*sum += depth;
+		shape(RB_LEFT(elm, node_link), depth + 1, height, sum);
+		elm = RB_RIGHT(elm, node_link);
+		depth++;
+	}
+}
+
+/* the keys have to come back as 0, 1, 2, ... */
+static int
+encode(struct node *elm, void *arg)
+{
+	int *next = arg;
+
+	return (elm->key != (*next)++);
+}
+
+static struct node *
+decode(void *arg)
+{
+	struct node ***next = arg;
+
+	return (*(*next)++);
+}
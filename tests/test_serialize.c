@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * a tree is dumped to a file as a count followed by its keys, then loaded
+ * back once by inserting every key and once with RB_DESERIALIZE. a load that
+ * fails must leave the filter as empty as the tree.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+	size_t			 size;
+};
+
+struct stream {
+	FILE			*fp;
+	struct node		*nodes;
+	int			 next;
+};
+
+static int compare(const struct node *, const struct node *);
+static int augment(struct node *);
+static int encode(struct node *, void *);
+static struct node *decode(void *);
+static unsigned int hash(const struct node *);
+
+RB_HEAD_EXT(tree, node, RB_MINMAX, RB_BLOOM(hash));
+struct tree root = RB_INITIALIZER(&root);
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_MINMAX, RB_BLOOM(hash))
+RB_GENERATE_EXT_AUGMENT(tree, node, node_link, compare, augment, RB_MINMAX, RB_BLOOM(hash))
+
+int
+main()
+{
+	struct node *nodes, *tmp, key;
+	struct stream st;
+	uint8_t *cells;
+	size_t n, c;
+	int i, r, *perm;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	cells = calloc(RB_BLOOM_SIZE(ITER, 8), 1);
+	perm = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	RB_INIT(&root);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = perm[i];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+	}
+
+	TDEBUGF("dumping the tree");
+	if ((st.fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	n = ITER;
+	if (fwrite(&n, sizeof(n), 1, st.fp) != 1)
+		err(1, "fwrite");
+	if (RB_SERIALIZE(tree, &root, encode, &st) != 0)
+		errx(1, "RB_SERIALIZE failed");
+	if (fflush(st.fp) != 0)
+		err(1, "fflush");
+	st.nodes = nodes;
+
+	TDEBUGF("reloading by insertion");
+	rewind(st.fp);
+	RB_INIT(&root);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	if (fread(&n, sizeof(n), 1, st.fp) != 1)
+		err(1, "fread");
+	for (st.next = 0; st.next < (int)n; ) {
+		tmp = decode(&st);
+		if (tmp == NULL || RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "reinsertion failed");
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done reinsertion in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("loading into a non-empty tree and from a short stream");
+	rewind(st.fp);
+	st.next = 0;
+	if (RB_DESERIALIZE(tree, &root, n, decode, &st) != -1)
+		errx(1, "RB_DESERIALIZE into a non-empty tree succeeded");
+	RB_INIT(&root);
+	RB_BLOOM_INIT(tree, &root, cells, ITER, 8);
+	rewind(st.fp);
+	if (fread(&n, sizeof(n), 1, st.fp) != 1)
+		err(1, "fread");
+	st.next = 0;
+	if (RB_DESERIALIZE(tree, &root, n + 1, decode, &st) != -1)
+		errx(1, "RB_DESERIALIZE past the end succeeded");
+	assert(RB_EMPTY(&root));
+	for (c = 0; c < RB_BLOOM_SIZE(ITER, 8); c++)
+		if (cells[c] != 0)
+			errx(1, "RB_DESERIALIZE left keys in the filter");
+
+	TDEBUGF("reloading with RB_DESERIALIZE");
+	rewind(st.fp);
+	RB_INIT(&root);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	if (fread(&n, sizeof(n), 1, st.fp) != 1)
+		err(1, "fread");
+	st.next = 0;
+	if (RB_DESERIALIZE(tree, &root, n, decode, &st) != 0)
+		errx(1, "RB_DESERIALIZE failed");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done deserialize in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	if (RB_RANK(tree, RB_ROOT(&root)) < 0)
+		errx(1, "rank error");
+	if (RB_ROOT(&root)->size != (size_t)ITER)
+		errx(1, "augment error");
+	if (RB_MIN(tree, &root)->key != 0 || RB_MAX(tree, &root)->key != ITER - 1)
+		errx(1, "minmax error");
+	for (i = 0; i < ITER; i++) {
+		key.key = i;
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp == NULL || tmp->key != i)
+			errx(1, "RB_FIND failed: %d", i);
+	}
+
+	TDEBUGF("removing from the loaded tree");
+	for (i = 0; i < ITER; i++) {
+		key.key = perm[i];
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp == NULL)
+			errx(1, "RB_FIND failed: %d", perm[i]);
+		if (RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", perm[i]);
+		if (!RB_EMPTY(&root) && RB_ROOT(&root)->size != (size_t)(ITER - 1 - i))
+			errx(1, "augment error");
+		if (i % 100000 == 0 && RB_RANK(tree, RB_ROOT(&root)) == -2)
+			errx(1, "rank error");
+	}
+	assert(RB_EMPTY(&root));
+
+	fclose(st.fp);
+	free(cells);
+	free(nodes);
+	free(perm);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+static int
+augment(struct node *elm)
+{
+	size_t newsize = 1;
+	if (RB_LEFT(elm, node_link))
+		newsize += (RB_LEFT(elm, node_link))->size;
+	if (RB_RIGHT(elm, node_link))
+		newsize += (RB_RIGHT(elm, node_link))->size;
+	if (elm->size != newsize) {
+		elm->size = newsize;
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned int
+hash(const struct node *elm)
+{
+	return elm->key * 2654435761U;
+}
+
+static int
+encode(struct node *elm, void *arg)
+{
+	struct stream *st = arg;
+
+	return (fwrite(&elm->key, sizeof(elm->key), 1, st->fp) != 1);
+}
+
+/* the nodes are handed out in stream order from the array */
+static struct node *
+decode(void *arg)
+{
+	struct stream *st = arg;
+	struct node *elm;
+
+	if (st->next == ITER)
+		return (NULL);
+	elm = &st->nodes[st->next];
+	if (fread(&elm->key, sizeof(elm->key), 1, st->fp) != 1)
+		return (NULL);
+	elm->size = 1;
+	st->next++;
+	return (elm);
+}
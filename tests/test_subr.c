@@ -56,8 +56,13 @@ int RANK_TEST_ITERATIONS=10000;
 struct node;
 static int compare(const void *, const void *);
 static void mix_operations(int *, int, struct node *, int, int, int, int);
+static void destroy(void *, void *);
+static void *clone(void *, void *);
+static int same(struct node *, struct node *, struct node **);
 
 static int tree_augment(struct rb_tree *, void *);
+static unsigned long hash(const void *);
+static uint64_t prefix(const void *);
 
 //static void print_helper(const struct node *, int);
 static void print_tree(const struct node *);
@@ -82,7 +87,12 @@ int
 main()
 {
 	struct node *tmp, *ins, *nodes;
-	int i, r, rank, *perm, *nums;
+	int i, r, rank, destroyed, *perm, *nums;
+	struct rb_tree copy;
+	struct node *clones, *bases[2];
+#ifdef RBT_BLOOM
+	uint8_t *bloom;
+#endif
 
 	nodes = calloc((ITER + 5), sizeof(struct node));
 	perm = calloc(ITER, sizeof(int));
@@ -127,6 +137,11 @@ main()
 	options.t_compare = &compare;
 	options.t_augment = &tree_augment;
 	options.t_offset = offsetof(struct node, node_link);
+	options.t_hash = &hash;
+	options.t_prefix = &prefix;
+#ifdef RBT_TEST_RULE
+	options.t_rule = RBT_TEST_RULE;
+#endif
 	root.options = &options;
 
 	TDEBUGF("starting random insertions");
@@ -139,6 +154,20 @@ main()
 	ins = rb_root(&root);
 	assert(ITER + 1 == ins->size);
 
+	TDEBUGF("rebuilding into a complete tree");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	rb_rebuild_perfect(&root);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done rebuilding in: %lld.%09ld s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
+	assert(-2 != rb_rank(&root));
+	ins = rb_root(&root);
+	assert(ITER + 1 == ins->size);
+	for (i = 0, r = ITER + 1; r > 0; r /= 2)
+		i++;
+	if (ins->height != (size_t)i)
+		errx(1, "rb_rebuild_perfect height error");
+
 	TDEBUGF("getting min");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	ins = rb_min(&root);
@@ -169,7 +198,7 @@ main()
 		assert(rb_remove(&root, tmp) == tmp);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			assert(-2 != rank);
                         print_tree(&root);
 		}
@@ -198,7 +227,7 @@ main()
 		assert(rb_remove(&root, tmp) == tmp);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -225,7 +254,7 @@ main()
 		assert(rb_remove(&root, ins) == ins);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -254,9 +283,18 @@ main()
 
 	//print_tree(&root);
 
+#ifdef RBT_BLOOM
+	/* the remaining phases run with a bloom filter in front of rb_find */
+	bloom = calloc(RBT_BLOOM_SIZE(ITER, 10), sizeof(uint8_t));
+	rb_bloom_init(&root, bloom, ITER, 10);
+#endif
+
 	TDEBUGF("doing find and remove in random order");
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	tmp = malloc(sizeof(struct node));
+	tmp->key = -1;
+	if (rb_find(&root, tmp) != NULL)
+		errx(1, "rb_find found a missing key");
 	for(i = 0; i < ITER; i++) {
 //		if (i % RANK_TEST_ITERATIONS == 0)
 //			TDEBUGF("removal %d: %d", i, perm[i]);
@@ -308,7 +346,7 @@ main()
 			errx(1, "rb_remove failed: %d", i);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -363,7 +401,7 @@ main()
 		assert(rb_remove(&root, tmp) == tmp);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -394,7 +432,7 @@ main()
 			errx(1, "rb_remove failed: %d", i);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -426,7 +464,7 @@ main()
 			errx(1, "rb_removec failed: %d", i);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -464,7 +502,7 @@ main()
 			errx(1, "rb_removec failed: %d", i);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -496,7 +534,7 @@ main()
 			errx(1, "rb_removec failed: %d", i);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -555,7 +593,7 @@ main()
 		assert(rb_remove(&root, tmp) == tmp);
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -633,7 +671,7 @@ main()
                 ins = tmp;
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -673,7 +711,7 @@ main()
                 ins = tmp;
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -793,12 +831,91 @@ main()
 	timespecsub(&end, &start, &diff);
 	TDEBUGF("done root removals in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
 
+	TDEBUGF("starting random insertions");
+	mix_operations(perm, ITER, nodes, ITER, ITER, 0, 0);
+
+	TDEBUGF("cloning the tree");
+	rb_init(&copy);
+	copy.options = &options;
+	clones = calloc((ITER + 5), sizeof(struct node));
+	bases[0] = nodes;
+	bases[1] = clones;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	if (rb_clone(&root, &copy, clone, bases) != 0)
+		errx(1, "rb_clone error");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done cloning in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
+	if (!same(rb_root(&root), rb_root(&copy), bases))
+		errx(1, "rb_clone made a different tree");
+	if (rb_rank(&copy) == -2)
+		errx(1, "rank error");
+	if (rb_min(&copy) != &clones[(struct node *)rb_min(&root) - nodes] ||
+	    rb_max(&copy) != &clones[(struct node *)rb_max(&root) - nodes])
+		errx(1, "rb_clone min/max error");
+	destroyed = 0;
+	rb_destroy(&copy, destroy, &destroyed);
+	if (destroyed != ITER + 1)
+		errx(1, "rb_destroy error");
+	free(clones);
+
+	TDEBUGF("destroying the tree");
+	destroyed = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	rb_destroy(&root, destroy, &destroyed);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done destroying in: %llu.%09llu s", (unsigned long long)diff.tv_sec, (unsigned long long)diff.tv_nsec);
+	if (destroyed != ITER + 1 || !rb_empty(&root))
+		errx(1, "rb_destroy error");
+
+#ifdef RBT_BLOOM
+	free(bloom);
+#endif
 	free(nodes);
 	free(perm);
 	free(nums);
 	exit(0);
 }
 
+/* rb_destroy hands over the node, not its entry; a zero size marks it seen */
+static void
+destroy(void *node, void *arg)
+{
+	struct node *elm = node;
+	int *count = arg;
+
+	if (elm->size == 0)
+		errx(1, "rb_destroy visited a node twice");
+	elm->size = 0;
+	(*count)++;
+}
+
+/* the copy goes in the slot of bases[1] with the index of node in bases[0] */
+static void *
+clone(void *node, void *arg)
+{
+	struct node **bases = arg;
+	size_t i = (struct node *)node - bases[0];
+
+	bases[1][i] = *(struct node *)node;
+	return (&bases[1][i]);
+}
+
+/* walks both trees through rb_left and rb_right, comparing the rank bits */
+static int
+same(struct node *elm, struct node *copy, struct node **bases)
+{
+	if (elm == NULL || copy == NULL)
+		return (elm == copy);
+	if (copy != &bases[1][elm - bases[0]] || copy->size != elm->size ||
+	    rb_rank_diff(&root, elm, 0) != rb_rank_diff(&root, copy, 0) ||
+	    rb_rank_diff(&root, elm, 1) != rb_rank_diff(&root, copy, 1))
+		return (0);
+	return (same(rb_left(&root, elm), rb_left(&root, copy), bases) &&
+	    same(rb_right(&root, elm), rb_right(&root, copy), bases));
+}
+
 
 static int
 compare(const void *a, const void *b)
@@ -824,6 +941,19 @@ print_tree(const struct node *t)
 	//if (rb_root(t)) print_helper(rb_root(t), 0);
 }
 
+static unsigned long
+hash(const void *node)
+{
+	return ((unsigned int)((const struct node *)node)->key * 2654435761U);
+}
+
+/* flipping the sign bit keeps the order of negative keys */
+static uint64_t
+prefix(const void *node)
+{
+	return ((uint64_t)(int64_t)((const struct node *)node)->key ^ ((uint64_t)1 << 63));
+}
+
 static int
 tree_augment(struct rb_tree *rbt, void *velm)
 {
@@ -873,7 +1003,7 @@ mix_operations(int *perm, int psize, struct node *nodes, int nsize, int insertio
 
 #ifdef RBT_TEST_RANK
 		if (i % RANK_TEST_ITERATIONS == 0) {
-			rank = rb_rank(tree, rb_root(&root));
+			rank = rb_rank(&root);
 			if (rank == -2)
 				errx(1, "rank error");
 		}
@@ -0,0 +1,244 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * built with RB_SMALL and RB_THREADED this walks and empties a tree of two
+ * pointer nodes by pointer, built without it the same runs on parent
+ * pointers, to compare the two. the order seen by RB_NEXT and RB_PREV is
+ * checked after inserts, removals, RB_COMPACT and RB_DESERIALIZE.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	int			 key;
+};
+
+static int compare(const struct node *, const struct node *);
+static void check(int *, int);
+static int encode(struct node *, void *);
+static struct node *decode(void *);
+
+RB_HEAD_EXT(tree, node, RB_MINMAX);
+struct tree root = RB_INITIALIZER(&root);
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_MINMAX)
+RB_GENERATE_EXT(tree, node, node_link, compare, RB_MINMAX)
+
+struct stream {
+	struct node		*nodes;
+	int			 next;
+};
+
+int
+main()
+{
+	struct node *nodes, *copy, *tmp, *nxt, key;
+	struct stream st;
+	int i, r, n, *perm, *present;
+	long long sum;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	copy = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	present = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+
+	TDEBUGF("inserting");
+	RB_INIT(&root);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[perm[i]];
+		tmp->key = perm[i];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+		present[perm[i]] = 1;
+	}
+	check(present, ITER);
+
+	TDEBUGF("walking the tree");
+	sum = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (r = 0; r < 10; r++)
+		RB_FOREACH(tmp, tree, &root)
+			sum += tmp->key;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done 10 walks in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(sum == 10LL * ITER * (ITER - 1) / 2);
+
+	TDEBUGF("removing every third node by pointer");
+	n = ITER;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i += 3) {
+		tmp = &nodes[perm[i]];
+		if (RB_REMOVEC(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVEC failed: %d", perm[i]);
+		present[perm[i]] = 0;
+		n--;
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done removals in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	check(present, n);
+
+	TDEBUGF("removing the extremes and the nodes next to a walk");
+	for (i = 0; i < 1000; i++) {
+		tmp = RB_POP_MIN(tree, &root);
+		present[tmp->key] = 0;
+		tmp = RB_POP_MAX(tree, &root);
+		present[tmp->key] = 0;
+		n -= 2;
+	}
+	tmp = RB_MIN(tree, &root);
+	while (tmp != NULL && (nxt = RB_NEXT(tree, &root, tmp)) != NULL) {
+		if (RB_REMOVEC(tree, &root, nxt) != nxt)
+			errx(1, "RB_REMOVEC failed: %d", nxt->key);
+		present[nxt->key] = 0;
+		n--;
+		tmp = RB_NEXT(tree, &root, tmp);
+		if (tmp != NULL)
+			tmp = RB_NEXT(tree, &root, tmp);
+	}
+	check(present, n);
+
+	TDEBUGF("moving the tree with RB_COMPACT");
+	if (RB_COMPACT(tree, &root, copy, ITER, NULL, NULL) != 0)
+		errx(1, "RB_COMPACT failed");
+	check(present, n);
+
+	TDEBUGF("reloading the tree with RB_DESERIALIZE");
+	st.nodes = nodes;
+	st.next = 0;
+	if (RB_SERIALIZE(tree, &root, encode, &st) != 0)
+		errx(1, "RB_SERIALIZE failed");
+	RB_INIT(&root);
+	st.next = 0;
+	if (RB_DESERIALIZE(tree, &root, n, decode, &st) != 0)
+		errx(1, "RB_DESERIALIZE failed");
+	check(present, n);
+
+	TDEBUGF("reinserting and removing what RB_FIND returns");
+	for (i = 0; i < ITER; i++) {
+		if (present[i])
+			continue;
+		tmp = &copy[i];
+		tmp->key = i;
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+		present[i] = 1;
+		n++;
+	}
+	for (i = 0; i < ITER; i += 7) {
+		key.key = i;
+		tmp = RB_FIND(tree, &root, &key);
+		if (tmp == NULL || RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed: %d", i);
+		present[i] = 0;
+		n--;
+	}
+	check(present, n);
+
+	TDEBUGF("emptying the tree while walking it");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	RB_FOREACH_SAFE(tmp, tree, &root, nxt)
+		if (RB_REMOVEC(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVEC failed: %d", tmp->key);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(RB_EMPTY(&root));
+
+	free(present);
+	free(perm);
+	free(copy);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key - b->key;
+}
+
+/* both directions have to visit exactly the n keys marked present */
+static void
+check(int *present, int n)
+{
+	struct node *tmp;
+	int i, last;
+
+	if (RB_RANK(tree, RB_ROOT(&root)) < 0)
+		errx(1, "rank error");
+	i = 0;
+	last = -1;
+	RB_FOREACH(tmp, tree, &root) {
+		if (tmp->key <= last || !present[tmp->key])
+			errx(1, "RB_NEXT out of order at %d", tmp->key);
+		last = tmp->key;
+		i++;
+	}
+	if (i != n)
+		errx(1, "RB_NEXT visited %d of %d", i, n);
+	i = 0;
+	last = ITER;
+	RB_FOREACH_REVERSE(tmp, tree, &root) {
+		if (tmp->key >= last || !present[tmp->key])
+			errx(1, "RB_PREV out of order at %d", tmp->key);
+		last = tmp->key;
+		i++;
+	}
+	if (i != n)
+		errx(1, "RB_PREV visited %d of %d", i, n);
+}
+
+static int
+encode(struct node *elm, void *arg)
+{
+	struct stream *st = arg;
+
+	st->nodes[st->next++].key = elm->key;
+	return (0);
+}
+
+static struct node *
+decode(void *arg)
+{
+	struct stream *st = arg;
+
+	return (&st->nodes[st->next++]);
+}
@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * the same inserts and removals are done with RB_INSERT/RB_REMOVE on one
+ * set of nodes and with RB_INSERT_TOPDOWN/RB_REMOVE_TOPDOWN on another,
+ * timing both. the two ways have to build the very same tree. a third,
+ * augmented, tree checks that the subtree sizes stay right.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	RB_ENTRY(node)		 size_link;
+	int			 key;
+	size_t			 size;
+};
+
+static int compare(const struct node *, const struct node *);
+static int augment(struct node *);
+static int same(struct node *, struct node *);
+static size_t sizes(struct node *);
+
+RB_HEAD_EXT(tree, node, RB_MINMAX);
+RB_HEAD_EXT(stree, node, RB_MINMAX);
+struct tree a = RB_INITIALIZER(&a);
+struct tree b = RB_INITIALIZER(&b);
+struct stree s = RB_INITIALIZER(&s);
+
+RB_PROTOTYPE_EXT(tree, node, node_link, compare, RB_MINMAX)
+RB_GENERATE_EXT(tree, node, node_link, compare, RB_MINMAX)
+RB_PROTOTYPE_EXT(stree, node, size_link, compare, RB_MINMAX)
+RB_GENERATE_EXT_AUGMENT(stree, node, size_link, compare, augment, RB_MINMAX)
+
+static void
+check(int n)
+{
+	if (RB_RANK(tree, RB_ROOT(&b)) == -2)
+		errx(1, "rank error");
+	if (!same(RB_ROOT(&a), RB_ROOT(&b)))
+		errx(1, "the top-down tree differs");
+	if (RB_RANK(stree, RB_ROOT(&s)) == -2)
+		errx(1, "rank error");
+	if (sizes(RB_ROOT(&s)) != (size_t)n)
+		errx(1, "augmented tree has the wrong sizes");
+}
+
+#define TIMED(what, stmt)	do {					\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);			\
+	stmt;								\
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);			\
+	timespecsub(&end, &start, &diff);				\
+	TDEBUGF("%s in: %lld.%09ld s", what, (long long)diff.tv_sec, diff.tv_nsec);	\
+} while (0)
+
+int
+main()
+{
+	struct node *na, *nb, *nc;
+	int i, r, n, *perm;
+
+	na = calloc(2 * ITER, sizeof(struct node));
+	nb = calloc(2 * ITER, sizeof(struct node));
+	nc = calloc(2 * ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < 2 * ITER; i++) {
+		na[i].key = nb[i].key = nc[i].key = (i < ITER) ? perm[i] : i;
+		nc[i].size = 1;
+	}
+
+	TDEBUGF("inserting random keys");
+	TIMED("stack inserts", for (i = 0; i < ITER; i++)
+		if (RB_INSERT(tree, &a, &na[i]) != NULL)
+			errx(1, "RB_INSERT failed"));
+	TIMED("top-down inserts", for (i = 0; i < ITER; i++)
+		if (RB_INSERT_TOPDOWN(tree, &b, &nb[i]) != NULL)
+			errx(1, "RB_INSERT_TOPDOWN failed"));
+	for (i = 0; i < ITER; i++)
+		if (RB_INSERT_TOPDOWN(stree, &s, &nc[i]) != NULL)
+			errx(1, "RB_INSERT_TOPDOWN failed");
+	if (RB_INSERT_TOPDOWN(tree, &b, &nc[0]) != &nb[0])
+		errx(1, "RB_INSERT_TOPDOWN took a duplicate");
+	n = ITER;
+	check(n);
+
+	TDEBUGF("removing every third key");
+	TIMED("stack removals", for (i = 0; i < ITER; i += 3)
+		if (RB_REMOVE(tree, &a, &na[i]) != &na[i])
+			errx(1, "RB_REMOVE failed"));
+	TIMED("top-down removals", for (i = 0; i < ITER; i += 3)
+		if (RB_REMOVE_TOPDOWN(tree, &b, &nb[i]) != &nb[i])
+			errx(1, "RB_REMOVE_TOPDOWN failed"));
+	for (i = 0; i < ITER; i += 3) {
+		if (RB_REMOVE_TOPDOWN(stree, &s, &nc[i]) != &nc[i])
+			errx(1, "RB_REMOVE_TOPDOWN failed");
+		n--;
+	}
+#ifdef RB_SMALL
+	/* in the small layout the node given is only a key */
+	if (RB_REMOVE_TOPDOWN(tree, &b, &nc[0]) != NULL)
+		errx(1, "RB_REMOVE_TOPDOWN found a removed key");
+#endif
+	check(n);
+
+	TDEBUGF("appending past the max and taking the min");
+	for (i = ITER; i < 2 * ITER; i += 2) {
+		RB_INSERT(tree, &a, &na[i]);
+		RB_INSERT_TOPDOWN(tree, &b, &nb[i]);
+		RB_INSERT_TOPDOWN(stree, &s, &nc[i]);
+		RB_REMOVE(tree, &a, RB_MIN(tree, &a));
+		RB_REMOVE_TOPDOWN(tree, &b, RB_MIN(tree, &b));
+		RB_REMOVE_TOPDOWN(stree, &s, RB_MIN(stree, &s));
+	}
+	check(n);
+
+	TDEBUGF("removing and reinserting random keys");
+	for (i = 0; i < ITER; i++) {
+		r = random() % (2 * ITER);
+		if (RB_FIND(tree, &a, &na[r]) == NULL) {
+			RB_INSERT(tree, &a, &na[r]);
+			RB_INSERT_TOPDOWN(tree, &b, &nb[r]);
+			RB_INSERT_TOPDOWN(stree, &s, &nc[r]);
+			n++;
+		} else {
+			RB_REMOVE(tree, &a, &na[r]);
+			RB_REMOVE_TOPDOWN(tree, &b, &nb[r]);
+			RB_REMOVE_TOPDOWN(stree, &s, &nc[r]);
+			n--;
+		}
+	}
+	check(n);
+
+	TDEBUGF("emptying the trees");
+	TIMED("stack removals", while (!RB_EMPTY(&a))
+		RB_REMOVE(tree, &a, RB_ROOT(&a)));
+	TIMED("top-down removals", while (!RB_EMPTY(&b))
+		RB_REMOVE_TOPDOWN(tree, &b, RB_ROOT(&b)));
+	while (!RB_EMPTY(&s)) {
+		RB_REMOVE_TOPDOWN(stree, &s, RB_ROOT(&s));
+		if (--n % (ITER / 8) == 0)
+			check(n);
+	}
+	assert(n == 0);
+
+	free(perm);
+	free(nc);
+	free(nb);
+	free(na);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static int
+augment(struct node *elm)
+{
+	size_t size = 1;
+
+	if (RB_LEFT(elm, size_link) != NULL)
+		size += (RB_LEFT(elm, size_link))->size;
+	if (RB_RIGHT(elm, size_link) != NULL)
+		size += (RB_RIGHT(elm, size_link))->size;
+	if (elm->size == size)
+		return (0);
+	elm->size = size;
+	return (1);
+}
+
+/* both trees have the same keys in the same places */
+static int
+same(struct node *x, struct node *y)
+{
+	if (x == NULL || y == NULL)
+		return (x == y);
+	return (x->key == y->key &&
+	    same(RB_LEFT(x, node_link), RB_LEFT(y, node_link)) &&
+	    same(RB_RIGHT(x, node_link), RB_RIGHT(y, node_link)));
+}
+
+/* the size of the subtree, or 0 if a size in it is wrong */
+static size_t
+sizes(struct node *elm)
+{
+	size_t l, r;
+
+	if (elm == NULL)
+		return (0);
+	l = sizes(RB_LEFT(elm, size_link));
+	r = sizes(RB_RIGHT(elm, size_link));
+	if ((l == 0 && RB_LEFT(elm, size_link) != NULL) ||
+	    (r == 0 && RB_RIGHT(elm, size_link) != NULL) ||
+	    elm->size != l + r + 1)
+		return (0);
+	return (l + r + 1);
+}
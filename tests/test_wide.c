@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tree.h"
+#include "rbwide.h"
+
+#define TDEBUGF(fmt, ...)	fprintf(stderr, "%s:%d:%s(): " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+
+#ifndef timespecsub
+#define	timespecsub(tsp, usp, vsp)					\
+	do {								\
+		(vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;		\
+		(vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;	\
+		if ((vsp)->tv_nsec < 0) {				\
+			(vsp)->tv_sec--;				\
+			(vsp)->tv_nsec += 1000000000L;			\
+		}							\
+	} while (0)
+#endif
+
+#ifdef __OpenBSD__
+#define SEED_RANDOM srandom_deterministic
+#else
+#define SEED_RANDOM srandom
+#endif
+
+int ITER=1000000;
+
+struct timespec start, end, diff;
+
+/*
+ * the same keys go into a plain tree and into a set of wide buckets, the
+ * set is checked against the tree and both are timed on random lookups.
+ */
+struct node {
+	RB_ENTRY(node)		 node_link;
+	uint64_t		 key;
+	char			 payload[16];
+};
+
+static int compare(const struct node *, const struct node *);
+static uint64_t key(const struct node *);
+
+RB_HEAD(tree, node);
+struct tree root = RB_INITIALIZER(&root);
+
+RB_WIDE_HEAD(wide, node);
+struct wide wroot = RB_WIDE_INITIALIZER(&wroot);
+struct node top[2 * RB_WIDE_SIZE];
+
+RB_PROTOTYPE(tree, node, node_link, compare)
+RB_GENERATE(tree, node, node_link, compare)
+RB_WIDE_GENERATE_STATIC(wide, node, key)
+
+int
+main()
+{
+	struct node *nodes, *tmp, probe;
+	int i, r, *perm, *stream;
+	unsigned long found;
+	uint64_t last = 0;
+
+	nodes = calloc(ITER, sizeof(struct node));
+	perm = calloc(ITER, sizeof(int));
+	stream = calloc(ITER, sizeof(int));
+
+	SEED_RANDOM(4201);
+	perm[0] = 0;
+	for (i = 1; i < ITER; i++) {
+		r = random() % i;
+		perm[i] = perm[r];
+		perm[r] = i;
+	}
+	for (i = 0; i < ITER; i++)
+		stream[i] = random() % (2 * ITER);
+
+	RB_INIT(&root);
+	RB_WIDE_INIT(&wroot);
+	TDEBUGF("inserting");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		tmp = &nodes[i];
+		tmp->key = 2 * perm[i];
+		if (RB_INSERT(tree, &root, tmp) != NULL)
+			errx(1, "RB_INSERT failed");
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done tree inserts in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++)
+		if (RB_WIDE_INSERT(wide, &wroot, &nodes[i]) != NULL)
+			errx(1, "RB_WIDE_INSERT failed");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done wide inserts in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	if (RB_WIDE_INSERT(wide, &wroot, &nodes[0]) != &nodes[0])
+		errx(1, "RB_WIDE_INSERT of a present key succeeded");
+	assert(RB_WIDE_COUNT(&wroot) == (size_t)ITER);
+	if (RB_RANK(wide_buckets, RB_ROOT(&wroot.buckets)) < 0)
+		errx(1, "rank error");
+
+	TDEBUGF("doing random lookups in the tree");
+	found = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		probe.key = stream[i];
+		found += (RB_FIND(tree, &root, &probe) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+
+	TDEBUGF("doing random lookups in the wide set");
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (i = 0; i < ITER; i++) {
+		probe.key = stream[i];
+		found -= (RB_WIDE_FIND(wide, &wroot, &probe) != NULL);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	timespecsub(&end, &start, &diff);
+	TDEBUGF("done lookups in: %lld.%09ld s", (long long)diff.tv_sec, diff.tv_nsec);
+	assert(found == 0);
+
+	TDEBUGF("removing every other key and checking the order");
+	for (i = 0; i < ITER; i += 2) {
+		tmp = &nodes[i];
+		if (RB_WIDE_REMOVE(wide, &wroot, tmp) != tmp)
+			errx(1, "RB_WIDE_REMOVE failed: %llu", (unsigned long long)tmp->key);
+		if (RB_REMOVE(tree, &root, tmp) != tmp)
+			errx(1, "RB_REMOVE failed");
+	}
+	probe.key = 1;
+	if (RB_WIDE_REMOVE(wide, &wroot, &probe) != NULL)
+		errx(1, "RB_WIDE_REMOVE of a missing key succeeded");
+	assert(RB_WIDE_COUNT(&wroot) == (size_t)(ITER / 2));
+	tmp = RB_MIN(tree, &root);
+	found = 0;
+	RB_WIDE_FOREACH(tmp, wide, &wroot) {
+		if (found > 0 && tmp->key <= last)
+			errx(1, "RB_WIDE_FOREACH out of order");
+		last = tmp->key;
+		found++;
+	}
+	assert(found == (unsigned long)(ITER / 2));
+	for (i = 0; i < ITER; i++) {
+		probe.key = stream[i];
+		if (RB_WIDE_FIND(wide, &wroot, &probe) != RB_FIND(tree, &root, &probe) ||
+		    RB_WIDE_NFIND(wide, &wroot, &probe) != RB_NFIND(tree, &root, &probe))
+			errx(1, "RB_WIDE_FIND failed: %d", stream[i]);
+	}
+	if (RB_RANK(wide_buckets, RB_ROOT(&wroot.buckets)) < 0)
+		errx(1, "rank error");
+
+	for (i = 1; i < ITER; i += 2)
+		if (RB_WIDE_REMOVE(wide, &wroot, &nodes[i]) != &nodes[i])
+			errx(1, "RB_WIDE_REMOVE failed");
+	assert(RB_WIDE_COUNT(&wroot) == 0);
+	assert(RB_EMPTY(&wroot.buckets));
+
+	TDEBUGF("walking the keys at the top of the range");
+	for (i = 0; i < 2 * RB_WIDE_SIZE; i++) {
+		top[i].key = UINT64_MAX - i;
+		if (RB_WIDE_INSERT(wide, &wroot, &top[i]) != NULL)
+			errx(1, "RB_WIDE_INSERT failed");
+	}
+	found = 0;
+	RB_WIDE_FOREACH(tmp, wide, &wroot)
+		if (tmp != &top[2 * RB_WIDE_SIZE - 1 - found++])
+			errx(1, "RB_WIDE_FOREACH out of order");
+	assert(found == 2 * RB_WIDE_SIZE);
+	if (RB_WIDE_NEXT(wide, &wroot, &top[0]) != NULL)
+		errx(1, "RB_WIDE_NEXT went past the largest key");
+	probe.key = UINT64_MAX - RB_WIDE_SIZE / 2;
+	if (RB_WIDE_NEXT(wide, &wroot, &probe) != &top[RB_WIDE_SIZE / 2 - 1])
+		errx(1, "RB_WIDE_NEXT failed");
+	for (i = 0; i < 2 * RB_WIDE_SIZE; i++)
+		if (RB_WIDE_REMOVE(wide, &wroot, &top[i]) != &top[i])
+			errx(1, "RB_WIDE_REMOVE failed");
+	assert(RB_EMPTY(&wroot.buckets));
+	RB_WIDE_FREE(wide, &wroot);
+
+	free(stream);
+	free(perm);
+	free(nodes);
+	exit(0);
+}
+
+static int
+compare(const struct node *a, const struct node *b)
+{
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static uint64_t
+key(const struct node *elm)
+{
+	return (elm->key);
+}